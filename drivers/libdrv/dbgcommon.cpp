@@ -250,6 +250,13 @@ const char *device_control_name(ULONG ioctl_code)
 	case vhci::ioctl::GET_IMPORTED_DEVICES: return "vhci_get_imported_devices";
 	case vhci::ioctl::GET_PERSISTENT: return "vhci_get_persistent";
 	case vhci::ioctl::SET_PERSISTENT: return "vhci_set_persistent";
+	case vhci::ioctl::SET_SOCKET_BUFFERS: return "vhci_set_socket_buffers";
+	case vhci::ioctl::PLUGIN_HARDWARE_BATCH: return "vhci_plugin_hardware_batch";
+	case vhci::ioctl::GET_IMPORTED_DEVICES_DELTA: return "vhci_get_imported_devices_delta";
+	case vhci::ioctl::GET_DEVICE_STATS: return "vhci_get_device_stats";
+	case vhci::ioctl::GET_TRACE: return "vhci_get_trace";
+	case vhci::ioctl::GET_POOL_STATS: return "vhci_get_pool_stats";
+	case vhci::ioctl::SET_RECV_THREAD_OPTIONS: return "vhci_set_recv_thread_options";
 
 	case IOCTL_USB_DIAG_IGNORE_HUBS_ON: return "USB_DIAG_IGNORE_HUBS_ON";
 	case IOCTL_USB_DIAG_IGNORE_HUBS_OFF: return "USB_DIAG_IGNORE_HUBS_OFF";
@@ -463,6 +470,16 @@ const char *dbg_usbip_hdr(char *buf, size_t len, const usbip_header *hdr, bool s
 	case USBIP_RET_UNLINK:
 		RtlStringCbPrintfA(buf, len, "ret_unlink: status %d", hdr->u.ret_unlink.status);
 		break;
+	case USBIP_CMD_IMPORT:
+		RtlStringCbPrintfA(buf, len, "cmd_import: length %u", hdr->u.cmd_import.length);
+		break;
+	case USBIP_RET_IMPORT:
+		RtlStringCbPrintfA(buf, len, "ret_import: status %d, length %u", 
+				   hdr->u.ret_import.status, hdr->u.ret_import.length);
+		break;
+	case USBIP_CMD_RELEASE:
+		RtlStringCbPrintfA(buf, len, "cmd_release");
+		break;
 	default:
 		RtlStringCbPrintfA(buf, len, "command %u", base->command);
 	}
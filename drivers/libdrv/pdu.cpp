@@ -56,6 +56,19 @@ inline void byteswap(usbip_header_ret_unlink &r)
 	r.status = RtlUlongByteSwap(r.status);
 }
 
+inline void byteswap(usbip_header_cmd_import &r) 
+{
+	static_assert(sizeof(r.length) == sizeof(unsigned long));
+	r.length = RtlUlongByteSwap(r.length);
+}
+
+inline void byteswap(usbip_header_ret_import &r) 
+{
+	static_assert(sizeof(r.status) == sizeof(unsigned long));
+	r.status = RtlUlongByteSwap(r.status);
+	r.length = RtlUlongByteSwap(r.length);
+}
+
 } // namespace
 
 
@@ -78,6 +91,12 @@ void byteswap_header(usbip_header &hdr, swap_dir dir)
 	case USBIP_RET_UNLINK:
 		byteswap(hdr.u.ret_unlink);
 		break;
+	case USBIP_CMD_IMPORT:
+		byteswap(hdr.u.cmd_import);
+		break;
+	case USBIP_RET_IMPORT:
+		byteswap(hdr.u.ret_import);
+		break;
 	}
 
 	if (dir == swap_dir::host2net) {
@@ -129,6 +148,13 @@ size_t get_isoc_descr(usbip_iso_packet_descriptor* &isoc, usbip_header &hdr)
 		break;
 	case USBIP_CMD_UNLINK:
 	case USBIP_RET_UNLINK:
+	case USBIP_CMD_RELEASE:
+		break;
+	case USBIP_CMD_IMPORT:
+		buf_end += hdr.u.cmd_import.length;
+		break;
+	case USBIP_RET_IMPORT:
+		buf_end += hdr.u.ret_import.length;
 		break;
 	default:
 		NT_ASSERT(!"Invalid command, wrong endianness?");
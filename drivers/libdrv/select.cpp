@@ -127,32 +127,3 @@ const char* libdrv::select_interface_str(char *buf, size_t len, const _URB_SELEC
 
 	return result && *result ? result : "select_interface_str error";
 }
-
-/*
- * Use ExFreePoolWithTag to free the allocated memory.
- * Do not deallocate _URB_SELECT_CONFIGURATION.ConfigurationDescriptor
- */
-_IRQL_requires_same_
-_IRQL_requires_max_(DISPATCH_LEVEL)
-_URB_SELECT_CONFIGURATION* libdrv::clone(
-	_Out_ ULONG &size, _In_ const _URB_SELECT_CONFIGURATION &src, _In_ POOL_TYPE pool_type, _In_ ULONG pooltag)
-{
-	auto cd_len = src.ConfigurationDescriptor ? src.ConfigurationDescriptor->wTotalLength : 0;
-	size = src.Hdr.Length + cd_len;
-
-	auto dst = (_URB_SELECT_CONFIGURATION*)ExAllocatePoolUninitialized(pool_type, size, pooltag);
-	if (!dst) {
-		return dst;
-	}
-
-	RtlCopyMemory(dst, &src, src.Hdr.Length);
-
-	if (cd_len) {
-		dst->ConfigurationDescriptor = 
-			reinterpret_cast<USB_CONFIGURATION_DESCRIPTOR*>((char*)dst + src.Hdr.Length);
-
-		RtlCopyMemory(dst->ConfigurationDescriptor, src.ConfigurationDescriptor, cd_len);
-	}
-
-	return dst;
-}
@@ -25,9 +25,4 @@ _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
 const char *select_interface_str(char *buf, size_t len, const _URB_SELECT_INTERFACE &iface);
 
-_IRQL_requires_same_
-_IRQL_requires_max_(DISPATCH_LEVEL)
-_URB_SELECT_CONFIGURATION *clone(
-	_Out_ ULONG &size, _In_ const _URB_SELECT_CONFIGURATION &src, _In_ POOL_TYPE pool_type, _In_ ULONG pooltag);
-
 } // namespace libdrv
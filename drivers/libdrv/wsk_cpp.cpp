@@ -773,6 +773,49 @@ PAGED NTSTATUS wsk::get_keepalive_opts(_In_ SOCKET *sock, int *idle, int *cnt, i
         return STATUS_SUCCESS;
 }
 
+_IRQL_requires_max_(APC_LEVEL)
+PAGED NTSTATUS wsk::get_buffers(_In_ SOCKET *sock, int *sndbuf, int *rcvbuf)
+{
+        PAGED_CODE();
+
+        if (sndbuf) {
+                if (auto err = getsockopt(sock, SOL_SOCKET, SO_SNDBUF, sndbuf, sizeof(*sndbuf))) {
+                        return err;
+                }
+        }
+
+        if (rcvbuf) {
+                if (auto err = getsockopt(sock, SOL_SOCKET, SO_RCVBUF, rcvbuf, sizeof(*rcvbuf))) {
+                        return err;
+                }
+        }
+
+        return STATUS_SUCCESS;
+}
+
+/*
+ * Values that are less or equal to zero are not set.
+ */
+_IRQL_requires_max_(APC_LEVEL)
+PAGED NTSTATUS wsk::set_buffers(_In_ SOCKET *sock, int sndbuf, int rcvbuf)
+{
+        PAGED_CODE();
+
+        if (sndbuf > 0) {
+                if (auto err = setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf))) {
+                        return err;
+                }
+        }
+
+        if (rcvbuf > 0) {
+                if (auto err = setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf))) {
+                        return err;
+                }
+        }
+
+        return STATUS_SUCCESS;
+}
+
 _IRQL_requires_(PASSIVE_LEVEL)
 PAGED NTSTATUS wsk::initialize()
 {
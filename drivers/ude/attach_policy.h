@@ -0,0 +1,60 @@
+/*
+ * Copyright (C) 2024 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include <wdm.h>
+
+/*
+ * Scheduling of persistent devices, see persistent.cpp.
+ */
+namespace usbip::attach
+{
+
+enum { UNIT_DELAY = 10, MAX_DELAY = 30*60 }; // seconds
+
+/*
+ * pending -> completing -> completed are set by attach_complete, others by the thread of persistent devices.
+ * unused is a removed entry, its slot is free.
+ */
+enum state_t : LONG { idle, pending, completing, completed, done, unused };
+
+/*
+ * Exponential backoff with equal jitter, first two attempts without a delay.
+ * @param random any value, see RtlRandomEx
+ * @return seconds
+ */
+constexpr ULONG get_delay(_In_ ULONG attempt, _In_ ULONG random)
+{
+        if (attempt < 2) {
+                return 0;
+        }
+
+        auto shift = min(attempt - 2, ULONG(10));
+        auto delay = min(ULONG(UNIT_DELAY) << shift, ULONG(MAX_DELAY));
+
+        auto half = delay/2;
+        return half + random % (half + 1);
+}
+
+/*
+ * @param removed from the list of persistent devices
+ * @param retry the error is transient, see can_retry
+ * @return the state of an entry after its request is completed, idle means the next attempt
+ */
+constexpr auto on_completed(_In_ NTSTATUS status, _In_ bool removed, _In_ bool retry)
+{
+        return NT_SUCCESS(status) || removed || !retry ? done : idle;
+}
+
+/*
+ * Entries are never moved or reused while the request of an entry can refer to it,
+ * see attach_complete and WdfMemoryCreatePreallocated.
+ */
+constexpr auto can_remove(_In_ LONG state)
+{
+        return state == idle || state == done;
+}
+
+} // namespace usbip::attach
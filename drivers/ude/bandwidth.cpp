@@ -0,0 +1,134 @@
+/*
+ * Copyright (C) 2024 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "bandwidth.h"
+
+namespace
+{
+
+using namespace usbip;
+
+enum : ULONG {
+        FRAMES_PER_SECOND = 1000,
+        MICROFRAMES_PER_SECOND = 8*FRAMES_PER_SECOND, // bus intervals for SuperSpeed
+};
+
+/*
+ * @return 2^(bInterval - 1), bInterval is 1..16
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+constexpr ULONG exp_interval(_In_ UCHAR bInterval)
+{
+        return 1UL << (min(max(bInterval, 1), 16) - 1);
+}
+
+/*
+ * @return bytes per service interval of SuperSpeed endpoint
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+UINT64 bytes_per_interval(
+        _In_ UINT64 maxp, _In_opt_ const USB_SUPERSPEED_ENDPOINT_COMPANION_DESCRIPTOR *companion, _In_ bool isoch)
+{
+        if (!(companion && companion->bLength)) {
+                return maxp;
+        }
+
+        if (auto n = companion->wBytesPerInterval) {
+                return n;
+        }
+
+        auto burst = companion->bMaxBurst + 1ULL;
+        auto mult = isoch ? (companion->bmAttributes.Isochronous.Mult & 3) + 1ULL : 1;
+
+        return maxp*burst*mult;
+}
+
+} // namespace
+
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+UINT64 usbip::bus_bandwidth(_In_ usb_device_speed speed)
+{
+        switch (speed) {
+        case USB_SPEED_LOW:
+        case USB_SPEED_FULL:
+                return 1350ULL*FRAMES_PER_SECOND; // 1500 bytes per frame
+        case USB_SPEED_HIGH:
+        case USB_SPEED_WIRELESS:
+                return 6000ULL*MICROFRAMES_PER_SECOND; // 7500 bytes per microframe
+        case USB_SPEED_SUPER:
+                return 450'000'000; // 5 Gbps, 8b/10b
+        case USB_SPEED_SUPER_PLUS:
+                return 1'090'000'000; // 10 Gbps, 128b/132b
+        case USB_SPEED_UNKNOWN:
+                break;
+        }
+
+        return 0;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+UINT64 usbip::periodic_bandwidth(
+        _In_ const USB_ENDPOINT_DESCRIPTOR &d,
+        _In_opt_ const USB_SUPERSPEED_ENDPOINT_COMPANION_DESCRIPTOR *companion,
+        _In_ usb_device_speed speed)
+{
+        auto type = usb_endpoint_type(d);
+        bool isoch = type == UsbdPipeTypeIsochronous;
+
+        if (!(isoch || type == UsbdPipeTypeInterrupt)) {
+                return 0;
+        }
+
+        UINT64 maxp = d.wMaxPacketSize & 0x7FF;
+
+        switch (speed) {
+        case USB_SPEED_LOW:
+        case USB_SPEED_FULL:
+                if (isoch) {
+                        return maxp*FRAMES_PER_SECOND/exp_interval(d.bInterval);
+                }
+                return maxp*FRAMES_PER_SECOND/max(d.bInterval, 1); // interrupt, 1..255 frames
+        case USB_SPEED_HIGH:
+        case USB_SPEED_WIRELESS:
+                if (auto mult = 1 + ((d.wMaxPacketSize >> 11) & 3); mult <= 3) { // additional transactions per microframe
+                        return maxp*mult*MICROFRAMES_PER_SECOND/exp_interval(d.bInterval);
+                }
+                break;
+        case USB_SPEED_SUPER:
+        case USB_SPEED_SUPER_PLUS:
+                return bytes_per_interval(maxp, companion, isoch)*MICROFRAMES_PER_SECOND/exp_interval(d.bInterval);
+        case USB_SPEED_UNKNOWN:
+                break;
+        }
+
+        return 0;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+bool usbip::admit(
+        _Inout_ bandwidth_reservation &r, _In_ const bandwidth_budget &b, _In_ bandwidth_policy policy,
+        _In_ UCHAR intf, _In_ UINT64 demand, _Out_ bool &exceeded)
+{
+        NT_ASSERT(intf < ARRAYSIZE(r.intf));
+
+        auto &cur = r.intf[intf];
+        auto own = r.total - cur + demand; // of this device if admitted
+
+        exceeded = demand && policy != bandwidth_policy::allow &&
+                   (b.bus_used + own > b.bus || (b.link && b.link_used + own > b.link));
+
+        bool admitted = !(exceeded && policy == bandwidth_policy::reject);
+        auto val = admitted ? demand : 0;
+
+        r.total = r.total - cur + val;
+        cur = val;
+
+        return admitted;
+}
@@ -0,0 +1,89 @@
+/*
+ * Copyright (C) 2024 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include <libdrv/ch9.h>
+#include <usbip/ch9.h>
+
+namespace usbip
+{
+
+/*
+ * What to do if periodic bandwidth of an alternate setting exceeds the budget of the bus or of the network link.
+ * Is read from the driver's Parameters key, value BandwidthPolicy.
+ */
+enum class bandwidth_policy : UCHAR { allow, warn, reject };
+
+/*
+ * Periodic bandwidth that a device has reserved, bytes per second.
+ * Reservations of all devices are changed under vhci_ctx::devices_lock, see vhci::reserve_bandwidth.
+ */
+struct bandwidth_reservation
+{
+        UINT64 intf[32]; // of selected alternate settings, index is bInterfaceNumber
+        UINT64 total; // SUM(intf)
+};
+
+/*
+ * Bandwidth of the bus and of the network link, bytes per second.
+ */
+struct bandwidth_budget
+{
+        UINT64 bus; // see bus_bandwidth
+        UINT64 bus_used; // by other devices on the same bus
+        UINT64 link; // zero if unlimited
+        UINT64 link_used; // by other devices of the same server
+};
+
+/*
+ * Root hubs of USB 2.0 and USB 3 are different buses.
+ */
+constexpr auto same_bus(_In_ usb_device_speed a, _In_ usb_device_speed b)
+{
+        return (a >= USB_SPEED_SUPER) == (b >= USB_SPEED_SUPER);
+}
+
+/*
+ * @return bytes per second that the bus can reserve for periodic transfers of a device,
+ *         90% of a frame for full/low speed, 80% of a microframe for high speed, 90% for SuperSpeed
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+UINT64 bus_bandwidth(_In_ usb_device_speed speed);
+
+/*
+ * USB 2.0, 5.6.4, 5.7.4, 9.6.6; USB 3.2, 9.6.7.
+ * @param companion is used for SuperSpeed, can be null or zeroed if absent
+ * @return bytes per second that isoch or interrupt endpoint reserves, zero for control and bulk
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+UINT64 periodic_bandwidth(
+        _In_ const USB_ENDPOINT_DESCRIPTOR &d,
+        _In_opt_ const USB_SUPERSPEED_ENDPOINT_COMPANION_DESCRIPTOR *companion,
+        _In_ usb_device_speed speed);
+
+/*
+ * Replaces the reservation of an interface by the demand of its new alternate setting.
+ * The previous reservation of the interface is not counted against the budget.
+ *
+ * @param intf bInterfaceNumber, must be less than ARRAYSIZE(r.intf)
+ * @param exceeded is set if the demand does not fit the budget, it is not checked if the policy is allow
+ * @return false if the alternate setting is rejected by the policy, nothing is reserved for the interface
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+bool admit(
+        _Inout_ bandwidth_reservation &r, _In_ const bandwidth_budget &b, _In_ bandwidth_policy policy,
+        _In_ UCHAR intf, _In_ UINT64 demand, _Out_ bool &exceeded);
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+inline void release(_Out_ bandwidth_reservation &r)
+{
+        r = {};
+}
+
+} // namespace usbip
@@ -0,0 +1,259 @@
+/*
+ * Copyright (C) 2024 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include <ntifs.h>
+
+#include "compression.h"
+#include "trace.h"
+#include "compression.tmh"
+
+#include "context.h"
+#include "wsk_context.h"
+#include "persistent.h"
+#include "pool.h"
+
+#include <libdrv\ch9.h>
+
+namespace
+{
+
+using namespace usbip;
+
+enum : ULONG { CHUNK_SIZE = 4096 }; // is ignored by XPRESS
+
+enum : USHORT {
+        FORMAT = COMPRESSION_FORMAT_XPRESS,
+        FORMAT_AND_ENGINE = COMPRESSION_FORMAT_XPRESS | COMPRESSION_ENGINE_STANDARD,
+};
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto get_workspace_size(_Out_ ULONG &compress, _Out_ ULONG &decompress)
+{
+        compress = 0;
+        decompress = 0;
+
+        auto err = RtlGetCompressionWorkSpaceSize(FORMAT_AND_ENGINE, &compress, &decompress);
+        if (err) {
+                Trace(TRACE_LEVEL_ERROR, "RtlGetCompressionWorkSpaceSize %!STATUS!", err);
+        }
+
+        compress = ALIGN_UP_BY(compress, MEMORY_ALLOCATION_ALIGNMENT);
+        return err;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto get_compression_threshold()
+{
+        PAGED_CODE();
+
+        Registry key;
+        if (auto err = open_parameters_key(key, KEY_QUERY_VALUE)) {
+                return 0UL;
+        }
+
+        UNICODE_STRING name;
+        RtlUnicodeStringInit(&name, L"CompressBulkTransfers");
+
+        ULONG val{};
+        if (auto err = WdfRegistryQueryULong(key.get(), &name, &val)) {
+                if (err != STATUS_OBJECT_NAME_NOT_FOUND) {
+                        Trace(TRACE_LEVEL_ERROR, "WdfRegistryQueryULong('%!USTR!') %!STATUS!", &name, err);
+                }
+                return 0UL;
+        }
+
+        return val ? max(val, ULONG(COMPRESS_MIN_THRESHOLD)) : 0;
+}
+
+/*
+ * Races between queues of the same endpoint are harmless, backoff is a hint.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void incompressible(_Inout_ device_ctx &dev, _Inout_ endpoint_ctx &endp)
+{
+        endp.compress_skip = endp.compress_backoff = next_backoff(endp.compress_backoff);
+        InterlockedIncrement64(reinterpret_cast<LONG64*>(&dev.compress_skipped));
+}
+
+} // namespace
+
+
+/*
+ * A buffer is a workspace of RtlCompressBuffer followed by the output buffer for COMPRESS_MAX_LENGTH.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void usbip::init_compression(_Inout_ device_ctx_ext &ext)
+{
+        PAGED_CODE();
+
+        NT_ASSERT(!ext.compress_buffers);
+        ext.compress_threshold = get_compression_threshold();
+
+        if (!ext.compress_threshold) {
+                return;
+        }
+
+        ULONG workspace_size;
+        ULONG fragment_workspace_size;
+
+        if (get_workspace_size(workspace_size, fragment_workspace_size)) {
+                ext.compress_threshold = 0;
+                return;
+        }
+
+        auto size = workspace_size + ALIGN_UP_BY(get_compression_limit(COMPRESS_MAX_LENGTH), MEMORY_ALLOCATION_ALIGNMENT);
+
+        ext.compress_buffers = pool_alloc(pool_consumer::compression, NonPagedPoolNx, COMPRESS_BUFFERS*size, false);
+        if (!ext.compress_buffers) {
+                Trace(TRACE_LEVEL_ERROR, "Can't allocate %d*%lu bytes, compression is disabled", COMPRESS_BUFFERS, size);
+                ext.compress_threshold = 0;
+                return;
+        }
+
+        ext.compress_buffer_size = size;
+        ext.compress_workspace_size = workspace_size;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void usbip::free_compress_buffers(_Inout_ device_ctx_ext &ext)
+{
+        PAGED_CODE();
+
+        if (auto ptr = ext.compress_buffers) {
+                NT_ASSERT(!ext.compress_busy);
+                pool_free(pool_consumer::compression, ptr, COMPRESS_BUFFERS*ext.compress_buffer_size);
+                ext.compress_buffers = nullptr;
+        }
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+ULONG usbip::compress(_Inout_ device_ctx &dev, _Inout_ endpoint_ctx &endp, _Inout_ wsk_context &ctx)
+{
+        auto &ext = *dev.ext;
+
+        if (!(ext.features & USBIP_FEATURE_COMPRESS) || usb_endpoint_type(endp.descriptor) != UsbdPipeTypeBulk) {
+                return 0;
+        }
+
+        auto mdl = ctx.mdl_buf.get();
+        auto len = ctx.mdl_buf.size();
+
+        if (!mdl || mdl->Next || !is_compressible(len, ext.compress_threshold)) {
+                return 0;
+        }
+
+        if (endp.compress_skip) {
+                --endp.compress_skip;
+                InterlockedIncrement64(reinterpret_cast<LONG64*>(&dev.compress_skipped));
+                return 0;
+        }
+
+        auto src = ctx.mdl_buf.sysaddr(NormalPagePriority | MdlMappingNoExecute | MdlMappingNoWrite);
+        if (!src) {
+                return 0;
+        }
+
+        NT_ASSERT(!ctx.compress_buffer);
+        ctx.compress_buffer = acquire_compress_buffer(ext.compress_busy);
+        if (!ctx.compress_buffer) {
+                return 0; // is not counted as skipped, the payload may be compressible
+        }
+
+        auto workspace = static_cast<UCHAR*>(ext.compress_buffers) + 
+                         get_compress_buffer_index(ctx.compress_buffer)*ext.compress_buffer_size;
+
+        auto dst = workspace + ext.compress_workspace_size;
+        ULONG dst_len{};
+
+        if (auto st = RtlCompressBuffer(FORMAT_AND_ENGINE, static_cast<UCHAR*>(src), len, 
+                                        dst, get_compression_limit(len), CHUNK_SIZE, &dst_len, workspace);
+            !NT_SUCCESS(st) || !dst_len) {
+                if (st != STATUS_BUFFER_TOO_SMALL) {
+                        Trace(TRACE_LEVEL_ERROR, "RtlCompressBuffer(%lu) %!STATUS!", len, st);
+                }
+                free_compressed(ctx);
+                incompressible(dev, endp);
+                return 0;
+        }
+
+        Mdl mdl_dst(dst, dst_len);
+        if (auto err = mdl_dst.prepare_nonpaged()) {
+                Trace(TRACE_LEVEL_ERROR, "prepare_nonpaged %!STATUS!", err);
+                free_compressed(ctx);
+                return 0;
+        }
+
+        ctx.mdl_buf = static_cast<Mdl&&>(mdl_dst); // std::move is not available
+        set_compressed_size(ctx.hdr, dst_len);
+
+        endp.compress_backoff = 0;
+
+        InterlockedAdd64(reinterpret_cast<LONG64*>(&dev.compressed_out), len);
+        InterlockedAdd64(reinterpret_cast<LONG64*>(&dev.compressed_out_wire), dst_len);
+
+        return dst_len;
+}
+
+/*
+ * ctx.mdl_buf that describes the buffer is released before, see free(wsk_context*).
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::free_compressed(_Inout_ wsk_context &ctx)
+{
+        if (auto &bit = ctx.compress_buffer) {
+                release_compress_buffer(ctx.dev->ext->compress_busy, bit);
+                bit = 0;
+        }
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS usbip::decompress(
+        _Inout_ device_ctx &dev, _In_ MDL *dst, _In_ ULONG length, _In_ const void *src, _In_ ULONG src_len)
+{
+        PAGED_CODE();
+
+        auto buf = static_cast<UCHAR*>(MmGetSystemAddressForMdlSafe(dst, NormalPagePriority | MdlMappingNoExecute));
+        if (!buf) {
+                return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        ULONG compress_workspace_size;
+        ULONG workspace_size; // fragment workspace is used by RtlDecompressBufferEx
+
+        if (auto err = get_workspace_size(compress_workspace_size, workspace_size)) {
+                return err;
+        }
+
+        pool_ptr workspace(pool_consumer::compression, NonPagedPoolNx, max(workspace_size, 1UL), false);
+        if (!workspace) {
+                Trace(TRACE_LEVEL_ERROR, "Can't allocate %lu bytes", workspace_size);
+                return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        ULONG actual{};
+
+        if (auto err = RtlDecompressBufferEx(FORMAT, buf, length, static_cast<UCHAR*>(const_cast<void*>(src)), src_len,
+                                             &actual, workspace.get())) {
+                Trace(TRACE_LEVEL_ERROR, "RtlDecompressBufferEx(%lu -> %lu) %!STATUS!", src_len, length, err);
+                return err;
+        }
+
+        if (actual != length) {
+                Trace(TRACE_LEVEL_ERROR, "Decompressed %lu bytes, actual_length %lu", actual, length);
+                return STATUS_BAD_COMPRESSION_BUFFER;
+        }
+
+        dev.compressed_in += length;
+        dev.compressed_in_wire += src_len;
+
+        return STATUS_SUCCESS;
+}
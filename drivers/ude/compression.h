@@ -0,0 +1,75 @@
+/*
+ * Copyright (C) 2024 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include "compression_policy.h"
+#include <libdrv\codeseg.h>
+
+#include <wdm.h>
+
+namespace usbip
+{
+
+struct device_ctx;
+struct device_ctx_ext;
+struct endpoint_ctx;
+struct wsk_context;
+
+/*
+ * usbip-win extension USBIP_FEATURE_COMPRESS, see <usbip\proto_op.h>.
+ * Payloads of bulk transfers are compressed by RtlCompressBuffer, COMPRESSION_FORMAT_XPRESS.
+ * It pays off on slow links for printers, scanners and mass storage, their data is compressible.
+ *
+ * It is disabled by default, the driver's Parameters key, value CompressBulkTransfers (DWORD)
+ * is the minimal length of a payload to compress, in bytes.
+ *
+ * Reads the threshold and preallocates the buffers of compress(), compression is disabled
+ * if they can't be allocated.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void init_compression(_Inout_ device_ctx_ext &ext);
+
+/*
+ * Is called by free(device_ctx_ext*).
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void free_compress_buffers(_Inout_ device_ctx_ext &ext);
+
+/*
+ * Is called by prepare_wsk_buf for USBIP_CMD_SUBMIT, ctx.mdl_buf describes OUT transfer buffer.
+ * If compressed data is shorter than the original at least by 1/8, ctx.mdl_buf is replaced by it
+ * and its length is set by set_compressed_size.
+ *
+ * Does not allocate memory, a payload is sent as is if all preallocated buffers are in use
+ * or it is longer than COMPRESS_MAX_LENGTH, that bounds the time spent at DISPATCH_LEVEL.
+ *
+ * An endpoint that has sent incompressible data skips next payloads, their number doubles
+ * on every failure and is reset by successful compression.
+ *
+ * @return length of compressed payload, zero if the payload is sent as is
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+ULONG compress(_Inout_ device_ctx &dev, _Inout_ endpoint_ctx &endp, _Inout_ wsk_context &ctx);
+
+/*
+ * Releases the buffer of compress(), is called by free(wsk_context*).
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void free_compressed(_Inout_ wsk_context &ctx);
+
+/*
+ * Is called by the receive thread.
+ * @param dst transfer buffer, length is usbip_header_ret_submit::actual_length
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS decompress(
+        _Inout_ device_ctx &dev, _In_ MDL *dst, _In_ ULONG length, _In_ const void *src, _In_ ULONG src_len);
+
+} // namespace usbip
@@ -0,0 +1,132 @@
+/*
+ * Copyright (C) 2024 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include <usbip/proto.h>
+#include <usbip/proto_op.h>
+
+#include <wdm.h>
+
+namespace usbip
+{
+
+/*
+ * Framing and size decisions of USBIP_FEATURE_COMPRESS, see compression.h.
+ */
+enum : ULONG {
+        COMPRESS_MIN_THRESHOLD = 512, // shorter payloads are not worth the effort
+        COMPRESS_MAX_LENGTH = 64*1024, // larger transfer buffers are sent as is
+};
+
+enum : UCHAR { COMPRESS_MAX_BACKOFF = 64 }; // payloads
+
+enum { COMPRESS_BUFFERS = 4 }; // preallocated per device, a payload is sent as is if all of them are in use
+
+/*
+ * A compressed payload must be shorter than the original at least by 1/8.
+ * @return the size of the output buffer for a payload of the given length
+ */
+constexpr ULONG get_compression_limit(_In_ ULONG length)
+{
+        return length - length/8;
+}
+
+/*
+ * @param threshold see device_ctx_ext::compress_threshold, zero if compression is disabled
+ */
+constexpr bool is_compressible(_In_ ULONG length, _In_ ULONG threshold)
+{
+        return threshold && length >= threshold && length <= COMPRESS_MAX_LENGTH;
+}
+
+/*
+ * Isochronous transfers are never compressed, the fields that carry the length are not used
+ * by the other transfers: start_frame of USBIP_CMD_SUBMIT, error_count of USBIP_RET_SUBMIT.
+ * The receiver does not need to know the type of the endpoint.
+ *
+ * @param features see device_ctx_ext::features
+ * @param hdr in host byte order, number_of_packets of USBIP_RET_SUBMIT is normalized, see validate_header
+ * @return length of compressed payload, zero if the payload is not compressed
+ */
+constexpr ULONG get_compressed_size(_In_ const usbip_header &hdr, _In_ UINT32 features)
+{
+        if (!(features & USBIP_FEATURE_COMPRESS)) {
+                return 0;
+        }
+
+        switch (hdr.base.command) {
+        case USBIP_CMD_SUBMIT:
+                if (auto &r = hdr.u.cmd_submit; r.number_of_packets == number_of_packets_non_isoch && r.start_frame > 0) {
+                        return r.start_frame;
+                }
+                break;
+        case USBIP_RET_SUBMIT:
+                if (auto &r = hdr.u.ret_submit; !r.number_of_packets && r.error_count > 0) {
+                        return r.error_count;
+                }
+                break;
+        }
+
+        return 0;
+}
+
+/*
+ * @param hdr USBIP_CMD_SUBMIT of a non-isochronous transfer in host byte order
+ */
+inline void set_compressed_size(_Inout_ usbip_header &hdr, _In_ ULONG length)
+{
+        NT_ASSERT(hdr.base.command == USBIP_CMD_SUBMIT);
+        NT_ASSERT(hdr.u.cmd_submit.number_of_packets == number_of_packets_non_isoch);
+
+        hdr.u.cmd_submit.start_frame = length;
+}
+
+/*
+ * @param backoff payloads to skip after the current incompressible one, see endpoint_ctx::compress_backoff
+ * @return the next value of backoff, it doubles on every failure
+ */
+constexpr UCHAR next_backoff(_In_ UCHAR backoff)
+{
+        return backoff ? static_cast<UCHAR>(min(2*backoff, COMPRESS_MAX_BACKOFF)) : 1;
+}
+
+/*
+ * @param busy bitmask of the buffers in use, see device_ctx_ext::compress_busy
+ * @return bit of the acquired buffer, zero if all of them are in use
+ */
+inline LONG acquire_compress_buffer(_Inout_ volatile LONG &busy)
+{
+        for (auto val = ReadNoFence(&busy); ; ) {
+                auto bit = ~val & (val + 1); // lowest clear bit
+                if (bit >= (1 << COMPRESS_BUFFERS)) {
+                        return 0;
+                }
+                if (auto prev = InterlockedCompareExchange(&busy, val | bit, val); prev == val) {
+                        return bit;
+                } else {
+                        val = prev;
+                }
+        }
+}
+
+inline void release_compress_buffer(_Inout_ volatile LONG &busy, _In_ LONG bit)
+{
+        NT_ASSERT(bit && !(bit & (bit - 1)));
+        NT_ASSERT(ReadNoFence(&busy) & bit);
+
+        InterlockedAnd(&busy, ~bit);
+}
+
+/*
+ * @return index of the buffer that is acquired by acquire_compress_buffer
+ */
+constexpr int get_compress_buffer_index(_In_ LONG bit)
+{
+        int i = 0;
+        for ( ; !(bit & 1); bit >>= 1, ++i);
+        return i;
+}
+
+} // namespace usbip
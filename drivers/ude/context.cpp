@@ -7,29 +7,19 @@
 #include "context.tmh"
 
 #include "driver.h"
+#include "descriptor_cache.h"
+#include "compression.h"
+#include "mux.h"
 
 #include <libdrv\strconv.h>
 #include <libdrv\wsk_cpp.h>
 
- /*
-  * First bit is reserved for direction of transfer (USBIP_DIR_OUT|USBIP_DIR_IN).
-  * @see is_valid_seqnum
-  */
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
 seqnum_t usbip::next_seqnum(_Inout_ device_ctx &dev, _In_ bool dir_in)
 {
-	static_assert(!USBIP_DIR_OUT);
-	static_assert(USBIP_DIR_IN);
-
-	auto &seqnum = dev.seqnum;
-	static_assert(sizeof(seqnum) == sizeof(LONG));
-
-	while (true) {
-		if (seqnum_t num = InterlockedIncrement(reinterpret_cast<LONG*>(&seqnum)) << 1) {
-			return num |= seqnum_t(dir_in);
-		}
-	}
+	auto s = dev.ext->session; // is not changed while device_ctx_ext is alive
+	return next_seqnum(s ? s->seqnum : dev.seqnum, dir_in);
 }
 
 _IRQL_requires_same_
@@ -39,7 +29,7 @@ PAGED NTSTATUS usbip::create_device_ctx_ext(
 {
         PAGED_CODE();
 
-        ext = (device_ctx_ext*)ExAllocatePoolZero(NonPagedPoolNx, sizeof(*ext), pooltag);
+        ext = (device_ctx_ext*)pool_alloc(pool_consumer::device, NonPagedPoolNx, sizeof(*ext));
         if (!ext) {
                 Trace(TRACE_LEVEL_ERROR, "Can't allocate device_ctx_ext");
                 return STATUS_INSUFFICIENT_RESOURCES;
@@ -74,13 +64,22 @@ PAGED void usbip::free(_In_ device_ctx_ext *ext)
         PAGED_CODE();
 
         NT_ASSERT(ext);
+
+        if (auto s = ext->session) {
+                leave_session(*ext); // the device was not created or not detached
+                WdfObjectDereference(get_handle(s));
+        }
+
         free(ext->sock);
+        free(ext->prev_sock);
+        free(ext->descriptors);
+        free_compress_buffers(*ext);
 
         libdrv::FreeUnicodeString(ext->node_name, pooltag); // @see RtlFreeUnicodeString
         libdrv::FreeUnicodeString(ext->service_name, pooltag);
         libdrv::FreeUnicodeString(ext->busid, pooltag);
 
-        ExFreePoolWithTag(ext, pooltag);
+        pool_free(pool_consumer::device, ext, sizeof(*ext));
 }
 
 _IRQL_requires_same_
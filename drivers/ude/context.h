@@ -4,6 +4,13 @@
 
 #pragma once
 
+#include "pool.h"
+#include "timer_wheel.h"
+#include "frame_clock.h"
+#include "bandwidth.h"
+#include "seqnum.h"
+#include "milestone.h"
+
 #include <libdrv\codeseg.h>
 #include <libdrv\ch9.h>
 #include <libdrv\wdf_cpp.h>
@@ -29,6 +36,8 @@ namespace wsk
 namespace usbip
 {
 
+struct event_ring;
+
 enum { 
         USB2_PORTS = 30,
         USB3_PORTS = USB2_PORTS,
@@ -47,15 +56,27 @@ constexpr auto is_valid_port(int port)
 struct vhci_ctx
 {
         UDECXUSBDEVICE devices[TOTAL_PORTS]; // do not access directly, functions must be used
+        UINT64 changed[TOTAL_PORTS]; // generation of the last change of devices[i]
+        UINT64 generation; // is incremented when devices[i] is changed
+        UINT64 epoch; // identifies this instance for generation, see vhci::ioctl::get_imported_devices_delta
         WDFSPINLOCK devices_lock;
 
         LIST_ENTRY fileobjects; // @see fileobject_ctx::entry
         WDFQUEUE reads; // IRP_MJ_READ
         int events_subscribers; // SUM(fileobject_ctx::process_events)
         WDFWAITLOCK events_lock;
+        event_ring *events; // for IRP_MJ_READ, see fileobject_ctx::seqnum
 
         _KTHREAD *attach_thread;
         KEVENT attach_thread_stop;
+
+        volatile bool removing; // UdecxUsbDevicePlugOutAndDelete is not deferred, see device::plugout_deferred
+        volatile LONG undeleted; // UDECXUSBDEVICE-s that are plugged out, but are not destroyed yet
+
+        LIST_ENTRY sessions; // @see mux_session::entry
+        WDFWAITLOCK sessions_lock;
+        ULONG features_unsupported[8]; // hashes of servers that do not support OP_REQ_FEATURES, see mux.h
+        ULONG features_unsupported_next;
 };
 WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(vhci_ctx, get_vhci_ctx)
 
@@ -67,6 +88,42 @@ inline auto get_handle(_In_ vhci_ctx *ctx)
 
 struct wsk_context;
 struct device_ctx;
+struct descriptor_cache;
+
+/*
+ * Context space for WDFOBJECT, a connection that is shared by several devices of the same server.
+ * The parent is WDFDEVICE of VHCI. device_ctx_ext::session holds a reference, see mux.h.
+ */
+struct mux_session
+{
+        LIST_ENTRY entry; // head is vhci_ctx::sessions
+        WDFDEVICE vhci;
+
+        USHORT node_len; // bytes
+        USHORT service_len;
+        wchar_t node[sizeof(vhci::imported_device_location::host)]; // device_ctx_ext::node_name
+        wchar_t service[sizeof(vhci::imported_device_location::service)];
+
+        wsk::SOCKET *sock;
+        WDFSPINLOCK send_lock; // is device_ctx::send_lock of all devices
+        UINT32 features; // accepted by the server, are inherited by device_ctx_ext::features
+
+        WDFSPINLOCK lock; // for the members below
+        LONG attached; // device_ctx_ext-s that use the connection, it is closed with the last one
+        bool closed; // the connection is lost or closed
+        device_ctx *devices[TOTAL_PORTS]; // to dispatch responses of the server
+        LIST_ENTRY imports; // USBIP_CMD_IMPORT-s that wait for USBIP_RET_IMPORT
+
+        seqnum_t seqnum; // of all commands of the session and its devices, see next_seqnum
+        _KTHREAD *recv_thread;
+};
+WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(mux_session, get_mux_session)
+
+inline auto get_handle(_In_ mux_session *ctx)
+{
+        NT_ASSERT(ctx);
+        return static_cast<WDFOBJECT>(WdfObjectContextGetObject(ctx));
+}
 
 /*
  * Context extention for device_ctx. 
@@ -84,6 +141,18 @@ struct device_ctx_ext
 {
         device_ctx *ctx;
         wsk::SOCKET *sock;
+        wsk::SOCKET *prev_sock; // closed, replaced by reconnect, can still be in use by concurrent close_socket
+
+        mux_session *session; // the connection is shared with other devices, sock is not used
+        bool mux_attached; // is counted by mux_session::attached
+        EX_RUNDOWN_REF mux_rundown; // mux_session's receive thread uses device_ctx
+
+        UINT32 features; // USBIP_FEATURE_XXX that are accepted by the server, see negotiate_features
+        ULONG compress_threshold; // bytes, zero if USBIP_FEATURE_COMPRESS is not requested, see compression.h
+        void *compress_buffers; // COMPRESS_BUFFERS of compress_buffer_size, see init_compression
+        ULONG compress_buffer_size; // workspace and output buffer
+        ULONG compress_workspace_size;
+        volatile LONG compress_busy; // bitmask of compress_buffers in use, see acquire_compress_buffer
 
         // from ioctl::plugin_hardware
         // .Buffer-s are allocated in PagedPool, see create_device_ctx_ext
@@ -93,8 +162,24 @@ struct device_ctx_ext
         //
         
         vhci::imported_device_properties dev; // for ioctl::get_imported_devices
+        vhci::socket_buffers buffers; // requested, are applied to every new socket, see socket_buffers.h
+        vhci::recv_thread_options recv_options; // see recv_priority.h
+
+        ULONGLONG attach_start; // KeQueryInterruptTime when PLUGIN_HARDWARE is received
+        vhci::attach_timings timings; // see set_milestone
+        descriptor_cache *descriptors; // persistent devices only, see load_descriptor_cache; is reallocated, not reset
 };
 
+/*
+ * @param milestone member of ext.timings, is set once
+ */
+inline void set_milestone(_Inout_ UINT32 &milestone, _In_ const device_ctx_ext &ext)
+{
+        if (!milestone) {
+                set_milestone(milestone, ext.attach_start, KeQueryInterruptTime());
+        }
+}
+
 /*
  * Context space for UDECXUSBDEVICE - emulated USB device.
  */
@@ -102,7 +187,7 @@ struct device_ctx
 {
         device_ctx_ext *ext; // must be free-d
 
-        auto sock() const { return ext->sock; }
+        auto sock() const { return ext->session ? ext->session->sock : ext->sock; }
         auto speed() const { return ext->dev.speed; }
         auto devid() const { return ext->dev.devid; }
 
@@ -112,13 +197,23 @@ struct device_ctx
         WDFSPINLOCK endpoint_list_lock; // for endpoint_ctx::entry
 
         WDFSPINLOCK send_lock; // for WskSend on sock()
+        WDFSPINLOCK descriptors_lock; // for device_ctx_ext::descriptors
 
         int port; // vhci_ctx.devices[port - 1]
-        seqnum_t seqnum; // @see next_seqnum
+        seqnum_t seqnum; // is not used if ext->session is set, see next_seqnum
+        LONG seqnum_epoch; // is incremented when seqnum is reset, see reconnect.cpp, replace_socket
 
         volatile bool unplugged; // initiated detach that may still be ongoing
+        KEVENT unplugged_event; // is set with unplugged, wakes up waiters such as reconnect()
+        volatile bool reconnecting; // connection is lost, the device stays plugged, see reconnect()
+        ULONG reconnect_grace_period; // seconds, zero if reconnect mode is disabled
         KEVENT detach_completed;
 
+        bool plugged_out; // UdecxUsbDevicePlugOutAndDelete succeeded, see vhci_ctx::undeleted
+        ULONG delete_delay; // milliseconds, see get_plugout_delay
+        WDFTIMER plugout_timer; // deferred UdecxUsbDevicePlugOutAndDelete, the port is still claimed
+        volatile LONG plugout_pending; // plugout_timer is started, see device::plugout_deferred
+
         WDFWAITLOCK delete_lock; // serialize UdecxUsbDevicePlugOutAndDelete and UDECX_USB_DEVICE_STATE_CHANGE_CALLBACKS
 
         LIST_ENTRY requests; // list head, requests that are waiting for USBIP_RET_SUBMIT from a server
@@ -127,6 +222,48 @@ struct device_ctx
         // statistics
         UINT64 sent_requests; // were sent successfully
         UINT64 cancelable_requests; // marked as
+        UINT64 drained; // see vhci::device_stats
+        UINT64 drained_bytes;
+        ULONG reconnects; // successful
+        LONG64 reconnect_time; // total duration of successful reconnects, 100-nanosecond units
+        LONG64 last_reconnect_time;
+        pool_counter pool; // wsk_context-s and payload buffers that are held by the device
+
+        // USBIP_FEATURE_COMPRESS, see vhci::device_stats
+        UINT64 compressed_out; // are updated concurrently by interlocked operations
+        UINT64 compressed_out_wire;
+        UINT64 compress_skipped;
+        UINT64 compressed_in; // are updated by the receive thread only
+        UINT64 compressed_in_wire;
+
+        // socket buffers autotuning, see autotune_socket_buffers
+        UINT64 inflight_bytes; // SUM(request_ctx::length) of requests list, protected by requests_lock
+        ULONG inflight_requests; // length of requests list, protected by requests_lock
+        UINT64 max_inflight_bytes; // since autotune_time, protected by requests_lock
+        UINT64 completed_bytes; // since autotune_time
+        LONG64 srtt; // smoothed round-trip time of requests, 100-nanosecond units
+        ULONGLONG autotune_time; // KeQueryInterruptTime
+
+        // deadlines of requests, see deadline.h
+        timer_wheel deadlines; // of request_ctx::deadline, protected by requests_lock
+        WDFTIMER deadline_timer;
+        ULONG timeouts[USB_ENDPOINT_TYPE_INTERRUPT + 1]; // milliseconds, zero if disabled, index is USB_ENDPOINT_TYPE_XXX
+
+        frame_clock clock; // bus frame clock of the server, protected by clock_lock
+        WDFSPINLOCK clock_lock;
+
+        // periodic bandwidth admission, bytes per second, see filter_request.cpp
+        bandwidth_reservation bandwidth; // protected by vhci_ctx::devices_lock
+        ULONG link; // hash of node_name, devices of the same server share the network link
+        ULONG link_bandwidth; // kilobytes per second, zero if unlimited
+        bandwidth_policy bw_policy;
+
+        // scheduling of recv_thread, see recv_priority.h
+        UCHAR intf_priority[32]; // KPRIORITY of selected alternate settings, index is bInterfaceNumber
+        volatile LONG recv_options_changed; // boolean, recv_thread must apply the options again
+        KPRIORITY recv_priority; // is changed by recv_thread only
+        int recv_processor; // ideal, is changed by recv_thread only
+        PROCESSOR_NUMBER recv_default_processor; // ideal processor assigned by the system, see recv_processor
 
         _KTHREAD *recv_thread;
 };        
@@ -146,10 +283,17 @@ struct endpoint_ctx
         UDECXUSBDEVICE device; // parent
         WDFQUEUE queue; // child
         USB_ENDPOINT_DESCRIPTOR_AUDIO descriptor;
+        USB_SUPERSPEED_ENDPOINT_COMPANION_DESCRIPTOR companion; // zeroed if absent
+        bool no_bandwidth; // periodic bandwidth of its alternate setting was rejected, see filter_request.cpp
+
+        UCHAR compress_backoff; // payloads to skip after the next incompressible one, see compression.h
+        UCHAR compress_skip; // payloads that will be sent as is
 
         CCHAR priority_boost; 
         static_assert(!IO_NO_INCREMENT);
 
+        vhci::endpoint_stats stats; // see stats.h
+
         // UCHAR interface_number; // interface to which it belongs
         // UCHAR alternate_setting;
 
@@ -158,6 +302,12 @@ struct endpoint_ctx
 };        
 WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(endpoint_ctx, get_endpoint_ctx)
 
+inline auto get_handle(_In_ endpoint_ctx *ctx)
+{
+        NT_ASSERT(ctx);
+        return static_cast<UDECXUSBENDPOINT>(WdfObjectContextGetObject(ctx));
+}
+
 WDF_DECLARE_CONTEXT_TYPE(UDECXUSBENDPOINT); // WdfObjectGet_UDECXUSBENDPOINT
 inline auto& get_endpoint(_In_ WDFQUEUE queue)
 {
@@ -174,6 +324,11 @@ struct request_ctx
         UDECXUSBENDPOINT endpoint;
         seqnum_t seqnum;
         bool cancelable;
+
+        ULONG length; // TransferBufferLength
+        ULONGLONG dispatch_time; // KeQueryInterruptTimePrecise when the URB is received, zero if unknown
+        ULONGLONG send_time; // KeQueryInterruptTimePrecise, the tick of KeQueryInterruptTime is too coarse
+        wheel_timer deadline; // see device_ctx::deadlines
 };
 WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(request_ctx, get_request_ctx)
 
@@ -204,9 +359,7 @@ struct fileobject_ctx
 {
         LIST_ENTRY entry; // head is vhci_ctx::fileobjects
 
-        WDFCOLLECTION events; // WDFMEMORY(device_state) that are waiting for IRP_MJ_READ
-        enum { MAX_EVENTS = 2*TOTAL_PORTS }; // arbitrary
-
+        UINT64 seqnum; // of the next event to read from vhci_ctx::events
         bool process_events; // if IRP_MJ_READ was issued, see vhci_ctx::events_subscribers
 };
 WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(fileobject_ctx, get_fileobject_ctx)
@@ -218,14 +371,13 @@ inline auto get_handle(_In_ fileobject_ctx *ctx)
 }
 
 
+/*
+ * Devices of a mux_session use its counter, the server gets unique seqnums over the shared connection.
+ */
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
 seqnum_t next_seqnum(_Inout_ device_ctx &dev, _In_ bool dir_in);
 
-constexpr auto extract_num(seqnum_t seqnum) { return seqnum >> 1; }
-constexpr auto extract_dir(seqnum_t seqnum) { return usbip_dir(seqnum & 1); }
-constexpr bool is_valid_seqnum(seqnum_t seqnum) { return extract_num(seqnum); }
-
 constexpr UINT32 make_devid(UINT16 busnum, UINT16 devnum)
 {
         return (busnum << 16) | devnum;
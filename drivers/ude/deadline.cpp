@@ -0,0 +1,191 @@
+/*
+ * Copyright (C) 2024 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "deadline.h"
+#include "trace.h"
+#include "deadline.tmh"
+
+#include "context.h"
+#include "persistent.h"
+#include "request_list.h"
+#include "device_ioctl.h"
+
+#include <libdrv\ch9.h>
+#include <libdrv\wait_timeout.h>
+
+namespace
+{
+
+using namespace usbip;
+
+enum { MAX_TIMEOUT = 3600*1000 }; // milliseconds
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+inline auto current_tick()
+{
+        return KeQueryInterruptTime()/(DEADLINE_TICK*ULONGLONG(wdm::msec));
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto query_timeout(_In_ WDFKEY key, _In_ const wchar_t *value_name, _In_ ULONG default_value)
+{
+        PAGED_CODE();
+
+        UNICODE_STRING name;
+        RtlUnicodeStringInit(&name, value_name);
+
+        ULONG val{};
+        if (auto err = WdfRegistryQueryULong(key, &name, &val)) {
+                if (err != STATUS_OBJECT_NAME_NOT_FOUND) {
+                        Trace(TRACE_LEVEL_ERROR, "WdfRegistryQueryULong('%!USTR!') %!STATUS!", &name, err);
+                }
+                val = default_value;
+        }
+
+        return min(val, ULONG(MAX_TIMEOUT));
+}
+
+/*
+ * @param v index is USB_ENDPOINT_TYPE_XXX
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void read_timeouts(_Out_ ULONG (&v)[USB_ENDPOINT_TYPE_INTERRUPT + 1])
+{
+        PAGED_CODE();
+
+        v[USB_ENDPOINT_TYPE_CONTROL] = 0;
+        v[USB_ENDPOINT_TYPE_ISOCHRONOUS] = 1000;
+        v[USB_ENDPOINT_TYPE_BULK] = 0;
+        v[USB_ENDPOINT_TYPE_INTERRUPT] = 0;
+
+        Registry key;
+        if (auto err = open_parameters_key(key, KEY_QUERY_VALUE)) {
+                return;
+        }
+
+        const wchar_t* names[] = { L"ControlTimeout", L"IsochTimeout", L"BulkTimeout", L"InterruptTimeout" };
+        static_assert(ARRAYSIZE(names) == ARRAYSIZE(v));
+
+        for (int i = 0; i < ARRAYSIZE(v); ++i) {
+                v[i] = query_timeout(key.get(), names[i], v[i]);
+        }
+}
+
+_Function_class_(EVT_WDF_TIMER)
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void NTAPI deadline_timer(_In_ WDFTIMER timer)
+{
+        auto device = static_cast<UDECXUSBDEVICE>(WdfTimerGetParentObject(timer));
+        auto &dev = *get_device_ctx(device);
+
+        LIST_ENTRY expired;
+        InitializeListHead(&expired);
+
+        device::remove_expired_requests(dev, current_tick(), expired);
+
+        while (!IsListEmpty(&expired)) {
+                auto entry = RemoveHeadList(&expired);
+                InitializeListHead(entry);
+
+                auto req = CONTAINING_RECORD(entry, request_ctx, deadline.entry);
+                auto request = get_handle(req);
+
+                Trace(TRACE_LEVEL_WARNING, "dev %04x, req %04x, seqnum %u, deadline is exceeded",
+                                            ptr04x(device), ptr04x(request), req->seqnum);
+
+                device::send_cmd_unlink_and_complete(device, request, STATUS_IO_TIMEOUT);
+        }
+}
+
+} // namespace
+
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS usbip::create_deadline_timer(_In_ UDECXUSBDEVICE device, _Inout_ device_ctx &dev)
+{
+        PAGED_CODE();
+
+        init(dev.deadlines, current_tick());
+        read_timeouts(dev.timeouts);
+
+        WDF_TIMER_CONFIG cfg;
+        WDF_TIMER_CONFIG_INIT_PERIODIC(&cfg, deadline_timer, DEADLINE_TICK);
+        cfg.AutomaticSerialization = false;
+        cfg.TolerableDelay = DEADLINE_TICK/2; // coalescing with other timers saves power
+
+        WDF_OBJECT_ATTRIBUTES attr;
+        WDF_OBJECT_ATTRIBUTES_INIT(&attr);
+        attr.ParentObject = device;
+
+        if (auto err = WdfTimerCreate(&cfg, &attr, &dev.deadline_timer)) {
+                Trace(TRACE_LEVEL_ERROR, "WdfTimerCreate %!STATUS!", err);
+                return err;
+        }
+
+        auto &v = dev.timeouts;
+        TraceDbg("dev %04x, timeouts(ms): control %lu, isoch %lu, bulk %lu, interrupt %lu", ptr04x(device),
+                  v[USB_ENDPOINT_TYPE_CONTROL], v[USB_ENDPOINT_TYPE_ISOCHRONOUS],
+                  v[USB_ENDPOINT_TYPE_BULK], v[USB_ENDPOINT_TYPE_INTERRUPT]);
+
+        return STATUS_SUCCESS;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::start_deadline_timer(_Inout_ device_ctx &dev)
+{
+        NT_ASSERT(!dev.deadlines.count);
+
+        LIST_ENTRY expired;
+        InitializeListHead(&expired);
+
+        advance(dev.deadlines, current_tick(), expired); // skips the ticks while the timer was stopped
+        NT_ASSERT(IsListEmpty(&expired));
+
+        if (!dev.unplugged) {
+                WdfTimerStart(dev.deadline_timer, WDF_REL_TIMEOUT_IN_MS(DEADLINE_TICK));
+        }
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void usbip::stop_deadline_timer(_Inout_ device_ctx &dev)
+{
+        PAGED_CODE();
+        NT_ASSERT(dev.unplugged);
+
+        if (auto timer = dev.deadline_timer) {
+                { // start_deadline_timer that has not seen dev.unplugged yet returns
+                        wdf::Lock lck(dev.requests_lock);
+                }
+                WdfTimerStop(timer, true);
+        }
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+UINT64 usbip::get_deadline(_In_ const device_ctx &dev, _In_ UDECXUSBENDPOINT endpoint, _In_ const usbip_header &hdr)
+{
+        if (hdr.base.command != USBIP_CMD_SUBMIT) {
+                return 0;
+        }
+
+        auto type = usb_endpoint_type(get_endpoint_ctx(endpoint)->descriptor);
+
+        ULONGLONG msec = dev.timeouts[type];
+        if (!msec) {
+                return 0;
+        }
+
+        if (auto cnt = hdr.u.cmd_submit.number_of_packets; type == UsbdPipeTypeIsochronous && cnt > 0) {
+                msec += dev.speed() >= USB_SPEED_HIGH ? cnt/8 + 1 : cnt; // microframes of 125 us or frames of 1 ms
+        }
+
+        return current_tick() + (msec + DEADLINE_TICK - 1)/DEADLINE_TICK;
+}
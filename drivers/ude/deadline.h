@@ -0,0 +1,60 @@
+/*
+ * Copyright (C) 2024 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include <libdrv\codeseg.h>
+#include <usbip\proto.h>
+
+#include <wdf.h>
+#include <UdeCx.h>
+
+namespace usbip
+{
+
+struct device_ctx;
+
+/*
+ * A server can stop answering on some endpoint without closing the connection,
+ * TCP keepalive does not detect that. URBs that are not completed in time are unlinked
+ * and completed with STATUS_IO_TIMEOUT.
+ *
+ * Deadlines are kept in device_ctx::deadlines that is advanced by a periodic timer of the device,
+ * it runs only while there are scheduled deadlines.
+ * Timeouts are read from the driver's Parameters key, milliseconds, zero disables the deadline:
+ * ControlTimeout   - disabled by default, 10000 is recommended if the server can hang
+ * BulkTimeout      - disabled by default, bulk IN can legitimately wait for data forever
+ * InterruptTimeout - disabled by default for the same reason
+ * IsochTimeout     - is added to the duration of the frames of a transfer, default is one second
+ */
+enum : ULONG { DEADLINE_TICK = 100 }; // milliseconds, resolution of deadlines
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS create_deadline_timer(_In_ UDECXUSBDEVICE device, _Inout_ device_ctx &dev);
+
+/*
+ * Is called under device_ctx::requests_lock before the first deadline is scheduled.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void start_deadline_timer(_Inout_ device_ctx &dev);
+
+/*
+ * Must be called before UdecxUsbDevicePlugOutAndDelete, UDECXUSBDEVICE may not be deleted for a long time.
+ * device_ctx::unplugged must be set, the timer is not started after that.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void stop_deadline_timer(_Inout_ device_ctx &dev);
+
+/*
+ * @param hdr USBIP_CMD_SUBMIT in host byte order
+ * @return tick of device_ctx::deadlines, zero if the request has no deadline
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+UINT64 get_deadline(_In_ const device_ctx &dev, _In_ UDECXUSBENDPOINT endpoint, _In_ const usbip_header &hdr);
+
+} // namespace usbip
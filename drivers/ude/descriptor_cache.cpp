@@ -0,0 +1,365 @@
+/*
+ * Copyright (C) 2024 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "descriptor_cache.h"
+#include "trace.h"
+#include "descriptor_cache.tmh"
+
+#include "context.h"
+#include "driver.h"
+#include "persistent.h"
+
+#include <usbip\proto_op.h>
+#include <ntstrsafe.h>
+
+namespace
+{
+
+using namespace usbip;
+
+enum { INITIAL_CAPACITY = 1024 }; // enough for most devices
+
+constexpr auto &subkey_name = L"DescriptorCache";
+
+/*
+ * @param capacity of descriptor_cache::data
+ * @param hdr is copied as is
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto alloc_cache(_In_ ULONG capacity, _In_ const descriptor_cache_header &hdr)
+{
+        NT_ASSERT(hdr.length <= capacity);
+        auto size = get_descriptor_cache_size(capacity);
+
+        auto cache = (descriptor_cache*)pool_alloc(pool_consumer::descriptors, NonPagedPoolNx, size, false);
+        if (cache) {
+                cache->dirty = false;
+                cache->capacity = capacity;
+                cache->hdr = hdr;
+        } else {
+                Trace(TRACE_LEVEL_ERROR, "Can't allocate %Iu bytes", size);
+        }
+
+        return cache;
+}
+
+/*
+ * Doubles the capacity, but not above MAX_LENGTH.
+ * @param length that is required
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto grow(_Inout_ descriptor_cache* &cache, _In_ ULONG length)
+{
+        if (length > descriptor_cache::MAX_LENGTH) {
+                return false;
+        }
+
+        auto capacity = min(max(length, 2*cache->capacity), ULONG(descriptor_cache::MAX_LENGTH));
+
+        auto c = alloc_cache(capacity, cache->hdr);
+        if (!c) {
+                return false;
+        }
+
+        c->dirty = cache->dirty;
+        RtlCopyMemory(c->data, cache->data, cache->hdr.length);
+
+        free(cache);
+        cache = c;
+
+        return true;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto open_cache_key(_Out_ Registry &key, _In_ ACCESS_MASK DesiredAccess)
+{
+        PAGED_CODE();
+
+        Registry params;
+        if (auto err = open_parameters_key(params, KEY_CREATE_SUB_KEY)) {
+                return err;
+        }
+
+        UNICODE_STRING name;
+        RtlUnicodeStringInit(&name, subkey_name);
+
+        WDFKEY k{};
+        auto st = WdfRegistryCreateKey(params.get(), &name, DesiredAccess, REG_OPTION_NON_VOLATILE, nullptr,
+                                       WDF_NO_OBJECT_ATTRIBUTES, &k);
+        if (st) {
+                Trace(TRACE_LEVEL_ERROR, "WdfRegistryCreateKey('%!USTR!') %!STATUS!", &name, st);
+        }
+
+        key.reset(k);
+        return st;
+}
+
+/*
+ * "host,busid,VVVV:PPPP:BBBB"
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto make_value_name(
+        _Out_ UNICODE_STRING &name, _Out_ unique_ptr &buf,
+        _In_ const device_ctx_ext &ext, _In_ const descriptor_cache_header &hdr)
+{
+        PAGED_CODE();
+
+        const USHORT ids_len = 32*sizeof(*name.Buffer);
+        const USHORT len = ext.node_name.Length + ext.busid.Length + ids_len;
+
+        buf = unique_ptr(libdrv::uninitialized, PagedPool, len);
+        if (!buf) {
+                Trace(TRACE_LEVEL_ERROR, "Can't allocate %d bytes", len);
+                return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        name.Buffer = buf.get<WCHAR>();
+        name.Length = 0;
+        name.MaximumLength = len;
+
+        auto st = RtlUnicodeStringPrintf(&name, L"%wZ,%wZ,%04x:%04x:%04x", &ext.node_name, &ext.busid,
+                                         hdr.idVendor, hdr.idProduct, hdr.bcdDevice);
+        if (st) {
+                Trace(TRACE_LEVEL_ERROR, "RtlUnicodeStringPrintf %!STATUS!", st);
+        }
+
+        return st;
+}
+
+/*
+ * Sets ext.descriptors if the cached value is valid, removes the value if it is stale.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto read_descriptor_cache(
+        _Inout_ device_ctx_ext &ext, _In_ const descriptor_cache_header &hdr, _In_ const usbip_usb_device &udev)
+{
+        PAGED_CODE();
+
+        Registry key;
+        if (auto err = open_cache_key(key, KEY_QUERY_VALUE | KEY_SET_VALUE)) {
+                return err;
+        }
+
+        UNICODE_STRING name;
+        unique_ptr name_buf;
+
+        if (auto err = make_value_name(name, name_buf, ext, hdr)) {
+                return err;
+        }
+
+        const auto size = get_descriptor_cache_size(descriptor_cache::MAX_LENGTH);
+
+        unique_ptr buf(libdrv::uninitialized, PagedPool, size);
+        if (!buf) {
+                Trace(TRACE_LEVEL_ERROR, "Can't allocate %Iu bytes", size);
+                return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        auto &tmp = *buf.get<descriptor_cache>();
+
+        ULONG actual{};
+        auto type = REG_NONE;
+        const auto length = ULONG(sizeof(tmp.hdr) + descriptor_cache::MAX_LENGTH);
+
+        auto st = WdfRegistryQueryValue(key.get(), &name, length, &tmp.hdr, &actual, &type);
+
+        if (st == STATUS_OBJECT_NAME_NOT_FOUND) {
+                TraceDbg("'%!USTR!' is not cached", &name);
+                return STATUS_SUCCESS;
+        } else if (st) {
+                Trace(TRACE_LEVEL_ERROR, "WdfRegistryQueryValue('%!USTR!') %!STATUS!", &name, st);
+        } else if (type == REG_BINARY && is_valid(tmp.hdr, actual, udev)) {
+                auto cache = alloc_cache(tmp.hdr.length, tmp.hdr);
+                if (!cache) {
+                        return STATUS_INSUFFICIENT_RESOURCES;
+                }
+
+                RtlCopyMemory(cache->data, tmp.data, tmp.hdr.length);
+                ext.descriptors = cache;
+
+                Trace(TRACE_LEVEL_INFORMATION, "'%!USTR!', %d descriptor(s), %lu bytes",
+                                                &name, cache->hdr.count, cache->hdr.length);
+                return STATUS_SUCCESS;
+        } else {
+                Trace(TRACE_LEVEL_INFORMATION, "'%!USTR!' is stale, type %lu, %lu bytes", &name, type, actual);
+                st = STATUS_SUCCESS;
+        }
+
+        if (auto err = WdfRegistryRemoveValue(key.get(), &name)) {
+                Trace(TRACE_LEVEL_ERROR, "WdfRegistryRemoveValue('%!USTR!') %!STATUS!", &name, err);
+        }
+
+        return st;
+}
+
+} // namespace
+
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::free(_In_opt_ descriptor_cache *cache)
+{
+        if (cache) {
+                pool_free(pool_consumer::descriptors, cache, get_descriptor_cache_size(cache->capacity));
+        }
+}
+
+/*
+ * The value is read into a temporary buffer of the maximum size, the cache is allocated for its records.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS usbip::load_descriptor_cache(_Inout_ device_ctx_ext &ext, _In_ const usbip_usb_device &udev)
+{
+        PAGED_CODE();
+        NT_ASSERT(!ext.descriptors);
+
+        if (!is_persistent(ext)) {
+                return STATUS_SUCCESS;
+        }
+
+        descriptor_cache_header hdr;
+        init(hdr, udev);
+
+        auto st = read_descriptor_cache(ext, hdr, udev);
+        if (ext.descriptors) {
+                return st;
+        }
+
+        ext.descriptors = alloc_cache(INITIAL_CAPACITY, hdr);
+        return ext.descriptors ? st : STATUS_INSUFFICIENT_RESOURCES;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void usbip::save_descriptor_cache(_In_ const device_ctx &dev)
+{
+        PAGED_CODE();
+
+        auto &ext = *dev.ext;
+        if (!ext.descriptors) {
+                return;
+        }
+
+        descriptor_cache_header hdr;
+        {
+                wdf::Lock lck(dev.descriptors_lock); // can't allocate PagedPool under the lock
+                auto &cache = *ext.descriptors;
+
+                if (!cache.dirty) {
+                        return;
+                }
+                hdr = cache.hdr;
+        }
+
+        auto length = ULONG(sizeof(hdr) + hdr.length); // records are only appended, see put_cached_descriptor
+
+        unique_ptr buf(libdrv::uninitialized, PagedPool, length);
+        if (!buf) {
+                Trace(TRACE_LEVEL_ERROR, "Can't allocate %lu bytes", length);
+                return;
+        }
+
+        {
+                wdf::Lock lck(dev.descriptors_lock);
+                auto &cache = *ext.descriptors;
+
+                RtlCopyMemory(buf.get(), &hdr, sizeof(hdr));
+                RtlCopyMemory(buf.get<UCHAR>() + sizeof(hdr), cache.data, hdr.length);
+                cache.dirty = cache.hdr.length != hdr.length; // appended after the copy of the header
+        }
+
+        Registry key;
+        if (auto err = open_cache_key(key, KEY_SET_VALUE)) {
+                return;
+        }
+
+        UNICODE_STRING name;
+        unique_ptr name_buf;
+
+        if (auto err = make_value_name(name, name_buf, ext, hdr)) {
+                return;
+        }
+
+        if (auto err = WdfRegistryAssignValue(key.get(), &name, REG_BINARY, length, buf.get())) {
+                Trace(TRACE_LEVEL_ERROR, "WdfRegistryAssignValue('%!USTR!') %!STATUS!, length %lu", &name, err, length);
+        } else {
+                TraceDbg("'%!USTR!', %d descriptor(s), %lu bytes", &name, hdr.count, length);
+        }
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+bool usbip::get_cached_descriptor(
+        _In_ const device_ctx &dev, _In_ const USB_DEFAULT_PIPE_SETUP_PACKET &pkt,
+        _Out_writes_bytes_to_(len, len) void *buf, _Inout_ ULONG &len)
+{
+        if (!(dev.ext->descriptors && is_cacheable(pkt))) {
+                return false;
+        }
+
+        wdf::Lock lck(dev.descriptors_lock);
+
+        auto r = find(dev.ext->descriptors->hdr, dev.ext->descriptors->data, pkt.wValue.W, pkt.wIndex.W);
+        if (!r) {
+                return false;
+        }
+
+        len = min(len, r->wLength); // cached descriptor is complete, a shorter response is valid
+        RtlCopyMemory(buf, r + 1, len);
+
+        return true;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::put_cached_descriptor(
+        _In_ const device_ctx &dev, _In_ const USB_DEFAULT_PIPE_SETUP_PACKET &pkt,
+        _In_reads_bytes_(len) const void *data, _In_ ULONG len)
+{
+        if (!(dev.ext->descriptors && is_cacheable(pkt) && len >= sizeof(USB_COMMON_DESCRIPTOR))) {
+                return;
+        }
+
+        auto &d = *static_cast<const USB_COMMON_DESCRIPTOR*>(data);
+        if (d.bDescriptorType != get_type(pkt)) {
+                return;
+        }
+
+        if (auto full_len = get_full_length(d, len); full_len && full_len <= len) {
+                len = full_len; // only complete descriptors are cached
+        } else {
+                return;
+        }
+
+        wdf::Lock lck(dev.descriptors_lock);
+        auto &cache = dev.ext->descriptors;
+
+        if (find(cache->hdr, cache->data, pkt.wValue.W, pkt.wIndex.W)) {
+                return;
+        }
+
+        descriptor_cache_record r{ pkt.wValue.W, pkt.wIndex.W, static_cast<UINT16>(len) };
+
+        if (auto length = ULONG(cache->hdr.length + sizeof(r) + len);
+            length > cache->capacity && !grow(cache, length)) {
+                Trace(TRACE_LEVEL_WARNING, "No room for %!usb_descriptor_type!, %lu bytes", d.bDescriptorType, len);
+                return;
+        }
+
+        auto &hdr = cache->hdr;
+        auto dst = cache->data + hdr.length;
+        RtlCopyMemory(dst, &r, sizeof(r));
+        RtlCopyMemory(dst + sizeof(r), data, len);
+
+        hdr.length += sizeof(r) + len;
+        ++hdr.count;
+
+        cache->dirty = true;
+}
@@ -0,0 +1,75 @@
+/*
+ * Copyright (C) 2024 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include "descriptor_cache_format.h"
+#include <libdrv\codeseg.h>
+
+namespace usbip
+{
+
+struct device_ctx;
+struct device_ctx_ext;
+
+/*
+ * Descriptors of a persistent device are saved in the registry on detach.
+ * When the device is attached again, GET_DESCRIPTOR requests are completed from the cache
+ * without a round trip to the server, so PnP enumeration does not wait on the network.
+ *
+ * The cache is keyed by host, busid, VID/PID and bcdDevice.
+ * The cache is discarded if it does not match usbip_usb_device from OP_REP_IMPORT, see descriptor_cache_format.h.
+ * String descriptors are not cached, usbip_usb_device does not have a serial number to validate them.
+ *
+ * The allocation is sized to the stored descriptors and is reallocated under device_ctx::descriptors_lock
+ * as they are appended.
+ */
+struct descriptor_cache
+{
+        bool dirty; // must be saved
+        ULONG capacity; // of data, bytes
+        descriptor_cache_header hdr;
+
+        enum { MAX_LENGTH = 16*1024 };
+        UCHAR data[ANYSIZE_ARRAY]; // descriptor_cache_record, descriptor, descriptor_cache_record, ...
+};
+static_assert(offsetof(descriptor_cache, data) == offsetof(descriptor_cache, hdr) + sizeof(descriptor_cache_header));
+
+constexpr auto get_descriptor_cache_size(_In_ ULONG capacity)
+{
+        return offsetof(descriptor_cache, data) + capacity;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS load_descriptor_cache(_Inout_ device_ctx_ext &ext, _In_ const usbip_usb_device &udev);
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void save_descriptor_cache(_In_ const device_ctx &dev);
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void free(_In_opt_ descriptor_cache *cache);
+
+/*
+ * @param len size of the buffer on input, bytes copied on output
+ * @return true if the request is completed from the cache
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+bool get_cached_descriptor(
+        _In_ const device_ctx &dev, _In_ const USB_DEFAULT_PIPE_SETUP_PACKET &pkt,
+        _Out_writes_bytes_to_(len, len) void *buf, _Inout_ ULONG &len);
+
+/*
+ * Store a descriptor received from the server if the request is cacheable.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void put_cached_descriptor(
+        _In_ const device_ctx &dev, _In_ const USB_DEFAULT_PIPE_SETUP_PACKET &pkt,
+        _In_reads_bytes_(len) const void *data, _In_ ULONG len);
+
+} // namespace usbip
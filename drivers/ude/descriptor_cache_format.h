@@ -0,0 +1,199 @@
+/*
+ * Copyright (C) 2024 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include <usbip/proto_op.h>
+
+#include <wdm.h>
+#include <usbspec.h>
+
+namespace usbip
+{
+
+enum : UINT32 { DESCRIPTOR_CACHE_MAGIC = 0x43534455 }; // 'CSDU'
+enum : UINT16 { DESCRIPTOR_CACHE_VERSION = 2 };
+
+/*
+ * Layout of REG_BINARY value, records follow the header.
+ * Fields after "length" are copied from usbip_usb_device and are used for validation.
+ */
+struct descriptor_cache_header
+{
+        UINT32 magic;
+        UINT16 version;
+        UINT16 count; // of descriptor_cache_record
+        UINT32 length; // of all records, bytes
+
+        UINT32 speed;
+        UINT16 idVendor;
+        UINT16 idProduct;
+        UINT16 bcdDevice;
+        UINT8 bDeviceClass;
+        UINT8 bDeviceSubClass;
+        UINT8 bDeviceProtocol;
+        UINT8 bNumConfigurations;
+};
+
+struct descriptor_cache_record
+{
+        UINT16 wValue; // descriptor type and index, as in the setup packet
+        UINT16 wIndex; // language id for string descriptors
+        UINT16 wLength; // of the descriptor that follows the record
+};
+
+constexpr auto get_type(_In_ const USB_DEFAULT_PIPE_SETUP_PACKET &pkt)
+{
+        return pkt.wValue.HiByte;
+}
+
+/*
+ * Standard GET_DESCRIPTOR requests for the device only.
+ * Strings are not cached, a serial number of another device must not be returned.
+ */
+constexpr auto is_cacheable(_In_ const USB_DEFAULT_PIPE_SETUP_PACKET &pkt)
+{
+        if (!(pkt.bmRequestType.B == 0x80 && pkt.bRequest == USB_REQUEST_GET_DESCRIPTOR)) { // IN, standard, device
+                return false;
+        }
+
+        switch (get_type(pkt)) {
+        case USB_DEVICE_DESCRIPTOR_TYPE:
+        case USB_CONFIGURATION_DESCRIPTOR_TYPE:
+        case USB_BOS_DESCRIPTOR_TYPE:
+                return true;
+        }
+
+        return false;
+}
+
+/*
+ * @param len of the buffer that starts with the descriptor
+ * @return zero if the length can't be determined
+ */
+inline ULONG get_full_length(_In_ const USB_COMMON_DESCRIPTOR &d, _In_ ULONG len)
+{
+        switch (d.bDescriptorType) {
+        case USB_CONFIGURATION_DESCRIPTOR_TYPE:
+                static_assert(offsetof(USB_CONFIGURATION_DESCRIPTOR, wTotalLength) == offsetof(USB_BOS_DESCRIPTOR, wTotalLength));
+                [[fallthrough]];
+        case USB_BOS_DESCRIPTOR_TYPE:
+                return len >= sizeof(USB_BOS_DESCRIPTOR) ? reinterpret_cast<const USB_BOS_DESCRIPTOR&>(d).wTotalLength : 0;
+        default:
+                return d.bLength;
+        }
+}
+
+inline auto next(_In_ const descriptor_cache_record *r)
+{
+        auto ptr = reinterpret_cast<const UCHAR*>(r + 1) + r->wLength;
+        return reinterpret_cast<const descriptor_cache_record*>(ptr);
+}
+
+/*
+ * @param records hdr.count of descriptor_cache_record, each is followed by a descriptor
+ */
+inline const descriptor_cache_record *find(
+        _In_ const descriptor_cache_header &hdr, _In_ const void *records, _In_ UINT16 wValue, _In_ UINT16 wIndex)
+{
+        auto r = static_cast<const descriptor_cache_record*>(records);
+
+        for (int i = 0; i < hdr.count; ++i, r = next(r)) {
+                if (r->wValue == wValue && r->wIndex == wIndex) {
+                        return r;
+                }
+        }
+
+        return nullptr;
+}
+
+inline void init(_Out_ descriptor_cache_header &hdr, _In_ const usbip_usb_device &udev)
+{
+        hdr = descriptor_cache_header {
+                .magic = DESCRIPTOR_CACHE_MAGIC,
+                .version = DESCRIPTOR_CACHE_VERSION,
+                .speed = udev.speed,
+                .idVendor = udev.idVendor,
+                .idProduct = udev.idProduct,
+                .bcdDevice = udev.bcdDevice,
+                .bDeviceClass = udev.bDeviceClass,
+                .bDeviceSubClass = udev.bDeviceSubClass,
+                .bDeviceProtocol = udev.bDeviceProtocol,
+                .bNumConfigurations = udev.bNumConfigurations,
+        };
+}
+
+/*
+ * Records must not exceed the length and must contain descriptors of the type from the setup packet.
+ */
+inline auto is_valid(_In_ const descriptor_cache_header &hdr, _In_ const void *records)
+{
+        auto r = static_cast<const descriptor_cache_record*>(records);
+        auto end = static_cast<const UCHAR*>(records) + hdr.length;
+
+        for (int i = 0; i < hdr.count; ++i, r = next(r)) {
+                if (reinterpret_cast<const UCHAR*>(r + 1) > end || reinterpret_cast<const UCHAR*>(next(r)) > end) {
+                        return false;
+                }
+
+                auto &d = *reinterpret_cast<const USB_COMMON_DESCRIPTOR*>(r + 1);
+
+                if (r->wLength < sizeof(d) || d.bDescriptorType != r->wValue >> 8 ||
+                    get_full_length(d, r->wLength) != r->wLength) {
+                        return false;
+                }
+        }
+
+        return reinterpret_cast<const UCHAR*>(r) == end;
+}
+
+/*
+ * Invalidation rules:
+ * 1.Magic or version mismatch.
+ * 2.Any field of usbip_usb_device saved in the header was changed.
+ * 3.Malformed records.
+ * 4.Cached device descriptor does not match usbip_usb_device.
+ *
+ * @param h header of the value that was read from the registry, records follow it
+ * @param actual size of the value, bytes
+ */
+inline auto is_valid(_In_ const descriptor_cache_header &h, _In_ ULONG actual, _In_ const usbip_usb_device &udev)
+{
+        descriptor_cache_header expected;
+        init(expected, udev);
+
+        if (!(actual >= sizeof(h) && h.magic == expected.magic && h.version == expected.version &&
+              h.length == actual - sizeof(h))) {
+                return false;
+        }
+
+        if (!(h.speed == expected.speed &&
+              h.idVendor == expected.idVendor && h.idProduct == expected.idProduct &&
+              h.bcdDevice == expected.bcdDevice &&
+              h.bDeviceClass == expected.bDeviceClass &&
+              h.bDeviceSubClass == expected.bDeviceSubClass &&
+              h.bDeviceProtocol == expected.bDeviceProtocol &&
+              h.bNumConfigurations == expected.bNumConfigurations)) {
+                return false;
+        }
+
+        auto records = &h + 1;
+
+        if (!is_valid(h, records)) {
+                return false;
+        }
+
+        if (auto r = find(h, records, USB_DEVICE_DESCRIPTOR_TYPE << 8, 0)) {
+                auto &d = *reinterpret_cast<const USB_DEVICE_DESCRIPTOR*>(r + 1);
+
+                return  r->wLength == sizeof(d) &&
+                        d.idVendor == h.idVendor && d.idProduct == h.idProduct && d.bcdDevice == h.bcdDevice &&
+                        d.bDeviceClass == h.bDeviceClass && d.bDeviceSubClass == h.bDeviceSubClass &&
+                        d.bDeviceProtocol == h.bDeviceProtocol && d.bNumConfigurations == h.bNumConfigurations;
+        }
+
+        return true;
+}
+
+} // namespace usbip
@@ -14,6 +14,13 @@
 #include "wsk_receive.h"
 #include "ioctl.h"
 #include "vhci.h"
+#include "descriptor_cache.h"
+#include "reconnect.h"
+#include "persistent.h"
+#include "deadline.h"
+#include "recv_priority.h"
+#include "mux.h"
+#include "plugout_policy.h"
 
 #include <libdrv/dbgcommon.h>
 #include <libdrv/wait_timeout.h>
@@ -23,6 +30,15 @@ namespace
 
 using namespace usbip;
 
+enum {
+        DEFAULT_DELETE_DELAY = 3000, // milliseconds
+        MAX_DELETE_DELAY = 30000,
+};
+
+constexpr auto &delete_delay_value_name = L"DeferredDeleteTimeout";
+constexpr auto &bandwidth_policy_value_name = L"BandwidthPolicy";
+constexpr auto &link_bandwidth_value_name = L"LinkBandwidth";
+
 _IRQL_requires_same_
 _IRQL_requires_max_(PASSIVE_LEVEL)
 PAGED auto to_udex_speed(_In_ usb_device_speed speed)
@@ -54,11 +70,16 @@ PAGED void NTAPI device_destroy(_In_ WDFOBJECT object)
         PAGED_CODE();
 
         auto device = static_cast<UDECXUSBDEVICE>(object);
-        auto &ext = get_device_ctx(device)->ext;
+        auto &dev = *get_device_ctx(device);
+        auto &ext = dev.ext;
 
         Trace(TRACE_LEVEL_INFORMATION, "dev %04x, %!USTR!:%!USTR!/%!USTR!", 
                 ptr04x(device), &ext->node_name, &ext->service_name, &ext->busid);
 
+        if (dev.plugged_out) {
+                InterlockedDecrement(&get_vhci_ctx(dev.vhci)->undeleted);
+        }
+
         free(ext);
         ext = nullptr;
 }
@@ -90,9 +111,11 @@ PAGED _KTHREAD *recv_thread_join(_In_ UDECXUSBDEVICE device, _Inout_ device_ctx
         PAGED_CODE();
 
         auto thread = (_KTHREAD*)InterlockedExchangePointer(reinterpret_cast<PVOID*>(&dev.recv_thread), nullptr);
-        NT_ASSERT(thread);
 
-        if (thread == KeGetCurrentThread()) {
+        if (!thread) { // mux_session's receive thread is used
+                NT_ASSERT(dev.ext->session);
+                return nullptr;
+        } else if (thread == KeGetCurrentThread()) {
                 return thread;
         }
 
@@ -370,6 +393,11 @@ PAGED NTSTATUS endpoint_add(_In_ UDECXUSBDEVICE device, _In_ UDECX_USB_ENDPOINT_
                 NT_ASSERT(sizeof(endp.descriptor) >= len);
                 RtlCopyMemory(&endp.descriptor, &epd, len);
                 insert_endpoint_list(endp);
+
+                if (auto d = data->SuperSpeedEndpointCompanionDescriptor;
+                    d && data->SuperSpeedEndpointCompanionDescriptorBufferLength >= sizeof(*d)) {
+                        endp.companion = *d;
+                }
         } else {
                 NT_ASSERT(epd == EP0);
                 static_cast<USB_ENDPOINT_DESCRIPTOR&>(endp.descriptor) = epd;
@@ -416,7 +444,7 @@ PAGED NTSTATUS default_endpoint_add(_In_ UDECXUSBDEVICE dev, _In_ _UDECXUSBENDPO
  * SELECT_INTERFACE URBs and notifies this driver.
  *
  * @see ude_filter/int_dev_ctrl.cpp, int_dev_ctrl
- * @see device_ioctl.cpp, control_transfer
+ * @see filter_request.cpp, add_request_interface
  */
 _Function_class_(EVT_UDECX_USB_DEVICE_ENDPOINTS_CONFIGURE)
 _IRQL_requires_same_
@@ -557,10 +585,17 @@ PAGED auto init_device(_In_ UDECXUSBDEVICE device, _Inout_ device_ctx &dev)
 {
         PAGED_CODE();
 
+        if (auto s = dev.ext->session) {
+                dev.send_lock = s->send_lock; // devices of the session send over the same socket
+        } else if (auto err = create_spin_lock(&dev.send_lock, device)) {
+                return err;
+        }
+
         WDFSPINLOCK *v[] = {
-                &dev.send_lock,
                 &dev.endpoint_list_lock,
                 &dev.requests_lock,
+                &dev.descriptors_lock,
+                &dev.clock_lock,
         };
 
         for (auto i: v) {
@@ -575,14 +610,22 @@ PAGED auto init_device(_In_ UDECXUSBDEVICE device, _Inout_ device_ctx &dev)
 
         InitializeListHead(&dev.requests);
         KeInitializeEvent(&dev.detach_completed, NotificationEvent, false);
+        KeInitializeEvent(&dev.unplugged_event, NotificationEvent, false);
 
-        return STATUS_SUCCESS;
+        init(dev.clock, KeQueryInterruptTime());
+        return create_deadline_timer(device, dev);
 }
 
 inline auto set_unplugged(_Inout_ device_ctx &dev)
 {
         static_assert(sizeof(dev.unplugged) == sizeof(CHAR));
-        return InterlockedExchange8(PCHAR(&dev.unplugged), true);
+        auto was_unplugged = InterlockedExchange8(PCHAR(&dev.unplugged), true);
+
+        if (!was_unplugged) {
+                KeSetEvent(&dev.unplugged_event, IO_NO_INCREMENT, false);
+        }
+
+        return was_unplugged;
 }
 
 _IRQL_requires_same_
@@ -599,6 +642,187 @@ PAGED auto plugout_and_delete(_In_ UDECXUSBDEVICE dev, _In_ WDFWAITLOCK delete_l
         return true;
 }
 
+/*
+ * @see bandwidth_policy
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void read_bandwidth_settings(_Inout_ device_ctx &dev)
+{
+        PAGED_CODE();
+
+        auto &ext = *dev.ext;
+        if (auto err = RtlHashUnicodeString(&ext.node_name, true, HASH_STRING_ALGORITHM_DEFAULT, &dev.link)) {
+                Trace(TRACE_LEVEL_ERROR, "RtlHashUnicodeString %!STATUS!", err);
+        }
+
+        dev.bw_policy = bandwidth_policy::warn;
+
+        Registry key;
+        if (auto err = open_parameters_key(key, KEY_QUERY_VALUE)) {
+                return;
+        }
+
+        UNICODE_STRING name;
+        ULONG val{};
+
+        RtlUnicodeStringInit(&name, bandwidth_policy_value_name);
+        if (auto err = WdfRegistryQueryULong(key.get(), &name, &val)) {
+                if (err != STATUS_OBJECT_NAME_NOT_FOUND) {
+                        Trace(TRACE_LEVEL_ERROR, "WdfRegistryQueryULong('%!USTR!') %!STATUS!", &name, err);
+                }
+        } else if (val <= ULONG(bandwidth_policy::reject)) {
+                dev.bw_policy = static_cast<bandwidth_policy>(val);
+        }
+
+        RtlUnicodeStringInit(&name, link_bandwidth_value_name);
+        if (auto err = WdfRegistryQueryULong(key.get(), &name, &dev.link_bandwidth)) {
+                if (err != STATUS_OBJECT_NAME_NOT_FOUND) {
+                        Trace(TRACE_LEVEL_ERROR, "WdfRegistryQueryULong('%!USTR!') %!STATUS!", &name, err);
+                }
+                dev.link_bandwidth = 0;
+        }
+
+        TraceDbg("dev %04x, link %#lx, bandwidth policy %d, link bandwidth %lu KB/s", 
+                  ptr04x(get_handle(&dev)), dev.link, dev.bw_policy, dev.link_bandwidth);
+}
+
+/*
+ * @return milliseconds, zero disables deferred deletion
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED ULONG get_delete_delay()
+{
+        PAGED_CODE();
+        ULONG val = DEFAULT_DELETE_DELAY;
+
+        Registry key;
+        if (auto err = open_parameters_key(key, KEY_QUERY_VALUE)) {
+                return val;
+        }
+
+        UNICODE_STRING name;
+        RtlUnicodeStringInit(&name, delete_delay_value_name);
+
+        if (auto err = WdfRegistryQueryULong(key.get(), &name, &val)) {
+                if (err != STATUS_OBJECT_NAME_NOT_FOUND) {
+                        Trace(TRACE_LEVEL_ERROR, "WdfRegistryQueryULong('%!USTR!') %!STATUS!", &name, err);
+                }
+                val = DEFAULT_DELETE_DELAY;
+        }
+
+        return min(val, ULONG(MAX_DELETE_DELAY));
+}
+
+/*
+ * The port is released right before UdecxUsbDevicePlugOutAndDelete, see defer_plugout.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void plugout(_In_ UDECXUSBDEVICE device)
+{
+        PAGED_CODE();
+        auto &dev = *get_device_ctx(device);
+
+        auto port = vhci::reclaim_roothub_port(device);
+        if (port) {
+                Trace(TRACE_LEVEL_INFORMATION, "port %d released", port);
+        }
+
+        device_state_changed(dev.vhci, *dev.ext, port, vhci::state::unplugging);
+
+        if (plugout_and_delete(device, dev.delete_lock)) {
+                dev.plugged_out = true;
+                auto cnt = InterlockedIncrement(&get_vhci_ctx(dev.vhci)->undeleted); // see device_destroy
+
+                Trace(TRACE_LEVEL_INFORMATION, "dev %04x, PlugOutAndDelete-d, undeleted %ld", ptr04x(device), cnt);
+                device_state_changed(dev.vhci, *dev.ext, port, vhci::state::unplugged);
+        }
+}
+
+/*
+ * @return true if the caller has cancelled deferred plugout and must call it
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+inline auto cancel_deferred_plugout(_Inout_ device_ctx &dev)
+{
+        return InterlockedExchange(&dev.plugout_pending, false);
+}
+
+_Function_class_(EVT_WDF_TIMER)
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void NTAPI plugout_timer(_In_ WDFTIMER timer)
+{
+        PAGED_CODE();
+
+        auto device = static_cast<UDECXUSBDEVICE>(WdfTimerGetParentObject(timer));
+        TraceDbg("dev %04x", ptr04x(device));
+
+        if (cancel_deferred_plugout(*get_device_ctx(device))) {
+                plugout(device);
+        }
+}
+
+/*
+ * UdecxUsbDevicePlugOutAndDelete does not delete UDECXUSBDEVICE if it is called shortly after
+ * UdecxUsbDevicePlugIn, while PnP enumeration of the device is in progress, see detach.
+ *
+ * The call is deferred by a passive-level timer, detach completes without waiting for it.
+ * The port stays claimed meanwhile, so the number of deferred devices is bounded by the number of ports.
+ * vhci_ctx::removing disables deferral, device::plugout_deferred flushes it.
+ *
+ * @return false if UdecxUsbDevicePlugOutAndDelete must be called now
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto defer_plugout(_In_ UDECXUSBDEVICE device, _Inout_ device_ctx &dev)
+{
+        PAGED_CODE();
+
+        auto &vhci = *get_vhci_ctx(dev.vhci);
+        if (vhci.removing) {
+                return false;
+        }
+
+        auto &ext = *dev.ext;
+        auto &t = ext.timings;
+
+        auto now = (KeQueryInterruptTime() - ext.attach_start)/wdm::usec;
+        auto delay = get_plugout_delay(t.plugged, t.configured, now, dev.delete_delay*1000ULL); // microseconds
+
+        if (!delay) {
+                return false;
+        }
+
+        WDF_TIMER_CONFIG cfg;
+        WDF_TIMER_CONFIG_INIT(&cfg, plugout_timer);
+        cfg.AutomaticSerialization = false;
+
+        WDF_OBJECT_ATTRIBUTES attr;
+        WDF_OBJECT_ATTRIBUTES_INIT(&attr);
+        attr.ParentObject = device;
+        attr.ExecutionLevel = WdfExecutionLevelPassive; // for UdecxUsbDevicePlugOutAndDelete
+
+        if (auto err = WdfTimerCreate(&cfg, &attr, &dev.plugout_timer)) {
+                Trace(TRACE_LEVEL_ERROR, "dev %04x, WdfTimerCreate %!STATUS!", ptr04x(device), err);
+                return false;
+        }
+
+        InterlockedExchange(&dev.plugout_pending, true); // full barrier, see vhci_query_remove
+
+        if (vhci.removing) {
+                return !cancel_deferred_plugout(dev); // false if plugout_deferred has not seen it
+        }
+
+        TraceDbg("dev %04x, UdecxUsbDevicePlugOutAndDelete is deferred for %I64u ms", ptr04x(device), delay/1000);
+        WdfTimerStart(dev.plugout_timer, WDF_REL_TIMEOUT_IN_US(delay));
+
+        return true;
+}
+
 /*
  * Call UdecxUsbDevicePlugOutAndDelete if UdecxUsbDevicePlugIn was successful.
  * After UdecxUsbDevicePlugOutAndDelete the client driver can no longer use UDECXUSBDEVICE.
@@ -614,6 +838,8 @@ PAGED auto plugout_and_delete(_In_ UDECXUSBDEVICE dev, _In_ WDFWAITLOCK delete_l
  *
  * FIXME: inability to delete UDECXUSBDEVICE causes leak of resources, drivers' memory consumption 
  * raises over the time. Driver Verifier cannot detect it because all will be freed on driver unload.
+ * UDE has no means to unplug UDECXUSBDEVICE without deleting it, so it can't be reused for the next device.
+ * To mitigate the leak the deletion is deferred by defer_plugout, remaining ones are counted by vhci_ctx::undeleted.
  */
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
@@ -624,23 +850,17 @@ PAGED auto detach(_In_ UDECXUSBDEVICE device)
         auto &dev = *get_device_ctx(device);
 	NT_ASSERT(dev.unplugged);
 
-        if (close_socket(dev.sock())) {
+        if (auto &ext = *dev.ext; ext.session ? leave_session(ext) : close_socket(dev.sock())) {
                 Trace(TRACE_LEVEL_INFORMATION, "dev %04x, connection closed", ptr04x(device));
                 device_state_changed(dev, vhci::state::disconnected);
         }
 
         auto thread = recv_thread_join(device, dev);
+        stop_deadline_timer(dev);
+        save_descriptor_cache(dev);
 
-        auto port = vhci::reclaim_roothub_port(device);
-        if (port) {
-                Trace(TRACE_LEVEL_INFORMATION, "port %d released", port);
-        }
-
-        device_state_changed(dev.vhci, *dev.ext, port, vhci::state::unplugging);
-
-        if (plugout_and_delete(device, dev.delete_lock)) {
-                Trace(TRACE_LEVEL_INFORMATION, "dev %04x, PlugOutAndDelete-d", ptr04x(device));
-                device_state_changed(dev.vhci, *dev.ext, port, vhci::state::unplugged);
+        if (!defer_plugout(device, dev)) {
+                plugout(device);
         }
 
         NT_VERIFY(!KeSetEvent(&dev.detach_completed, IO_NO_INCREMENT, false)); // once
@@ -747,7 +967,16 @@ PAGED NTSTATUS usbip::device::create(_Out_ UDECXUSBDEVICE &device, _In_ WDFDEVIC
                 return err;
         }
 
-        Trace(TRACE_LEVEL_INFORMATION, "dev %04x", ptr04x(device));
+        ctx.reconnect_grace_period = get_reconnect_grace_period();
+        ctx.delete_delay = get_delete_delay();
+        read_bandwidth_settings(ctx);
+
+        ctx.recv_priority = DEFAULT_RECV_PRIORITY;
+        ctx.recv_processor = -1;
+        ctx.recv_options_changed = true; // apply on start of recv_thread
+
+        Trace(TRACE_LEVEL_INFORMATION, "dev %04x, reconnect grace period %lu sec", 
+                                        ptr04x(device), ctx.reconnect_grace_period);
         return STATUS_SUCCESS;
 }
 
@@ -834,6 +1063,41 @@ PAGED NTSTATUS usbip::device::async_detach_and_wait(_In_ UDECXUSBDEVICE device)
         return st;
 }
 
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED int usbip::device::wait_any_detach_until(
+        _In_reads_(cnt) const UDECXUSBDEVICE *devices, _In_ int cnt, _In_ ULONGLONG deadline)
+{
+        PAGED_CODE();
+
+        void *events[MAX_WAIT_DETACH];
+        NT_ASSERT(cnt > 0 && cnt <= ARRAYSIZE(events));
+
+        for (int i = 0; i < cnt; ++i) {
+                auto &dev = *get_device_ctx(devices[i]);
+                NT_ASSERT(dev.unplugged);
+                events[i] = &dev.detach_completed;
+        }
+
+        LARGE_INTEGER timeout{};
+        if (deadline != NO_DEADLINE) {
+                auto now = KeQueryInterruptTime();
+                timeout = make_timeout(deadline > now ? deadline - now : 0, wdm::period::relative);
+        }
+
+        KWAIT_BLOCK wait_blocks[ARRAYSIZE(events)];
+        auto st = KeWaitForMultipleObjects(cnt, events, WaitAny, Executive, KernelMode, false, 
+                                           deadline == NO_DEADLINE ? nullptr : &timeout, wait_blocks);
+
+        if (auto i = st - STATUS_WAIT_0; i >= 0 && i < cnt) {
+                TraceDbg("dev %04x, completed", ptr04x(devices[i]));
+                return i;
+        }
+
+        Trace(TRACE_LEVEL_ERROR, "%d device(s), KeWaitForMultipleObjects %!STATUS!", cnt, st);
+        return -1;
+}
+
 /*
  * @see plugout_and_delete
  */
@@ -855,3 +1119,19 @@ PAGED NTSTATUS usbip::device::detach(_In_ UDECXUSBDEVICE device)
         auto timeout = wait_detach_timeout();
         return wait_detach(device, &timeout); // concurrent calls wait for the completion
 }
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void usbip::device::plugout_deferred(_In_ UDECXUSBDEVICE device)
+{
+        PAGED_CODE();
+
+        auto &dev = *get_device_ctx(device);
+        NT_ASSERT(get_vhci_ctx(dev.vhci)->removing);
+
+        if (cancel_deferred_plugout(dev)) {
+                WdfTimerStop(dev.plugout_timer, false); // can be not started yet, see defer_plugout
+                TraceDbg("dev %04x", ptr04x(device));
+                plugout(device);
+        }
+}
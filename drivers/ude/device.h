@@ -36,8 +36,29 @@ _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
 PAGED NTSTATUS async_detach_and_wait(_In_ UDECXUSBDEVICE device);
 
+enum { MAX_WAIT_DETACH = 16 }; // KWAIT_BLOCK-s are allocated on the stack
+constexpr auto NO_DEADLINE = ~0ULL;
+
+/*
+ * Wait for the completion of any of async_detach_nowait.
+ * @param cnt at most MAX_WAIT_DETACH
+ * @param deadline value of KeQueryInterruptTime, NO_DEADLINE waits without a time limit
+ * @return index of the device whose detach has completed, -1 if the deadline has passed
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED int wait_any_detach_until(_In_reads_(cnt) const UDECXUSBDEVICE *devices, _In_ int cnt, _In_ ULONGLONG deadline);
+
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
 PAGED NTSTATUS detach(_In_ UDECXUSBDEVICE device);
 
+/*
+ * Calls UdecxUsbDevicePlugOutAndDelete now if detach has deferred it.
+ * Is called when VHCI is being removed, vhci_ctx::removing must be set.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void plugout_deferred(_In_ UDECXUSBDEVICE device);
+
 } // namespace usbip::device
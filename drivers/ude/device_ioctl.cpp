@@ -14,9 +14,10 @@
 #include "proto.h"
 #include "network.h"
 #include "ioctl.h"
-
-#include "filter_request.h"
-#include <ude_filter\request.h>
+#include "descriptor_cache.h"
+#include "reconnect.h"
+#include "trace_ring.h"
+#include "compression.h"
 
 #include <libdrv\irp.h>
 #include <libdrv\pdu.h>
@@ -53,6 +54,9 @@ NTSTATUS send_complete(_In_ DEVICE_OBJECT*, _In_ IRP *wsk_irp, _In_reads_opt_(_I
         TraceWSK("req %04x -> wsk irp %04x, %!STATUS!, Information %Iu", 
                   ptr04x(request), ptr04x(wsk_irp), wsk.Status, wsk.Information);
 
+        trace_urb(vhci::trace_event::send, dev, ctx.seqnum(true), RtlUlongByteSwap(ctx->hdr.base.ep), 
+                  static_cast<UINT32>(wsk.Information), wsk.Status);
+
         if (!request) {
                 // nothing to do
         } else if (NT_SUCCESS(wsk.Status)) {
@@ -62,12 +66,13 @@ NTSTATUS send_complete(_In_ DEVICE_OBJECT*, _In_ IRP *wsk_irp, _In_reads_opt_(_I
                         device::send_cmd_unlink_and_complete(device, request, err);
                 }
         } else if (device::remove_request(dev, request, false)) {
-                complete(request, wsk.Status);
+                auto reconnect = dev.reconnect_grace_period && !dev.unplugged; // the receive thread will reconnect
+                complete(request, reconnect ? RECONNECT_STATUS : wsk.Status);
         } else {
                 TraceDbg("req %04x not found, could not complete", ptr04x(request));
         }
 
-        if (wsk.Status == STATUS_FILE_FORCED_CLOSED && !dev.unplugged) {
+        if (wsk.Status == STATUS_FILE_FORCED_CLOSED && !(dev.unplugged || dev.reconnect_grace_period)) {
                 auto device = get_handle(&dev);
                 TraceDbg("dev %04x, unplugging after %!STATUS!", ptr04x(device), wsk.Status);
                 device::async_detach_nowait(device);
@@ -78,15 +83,21 @@ NTSTATUS send_complete(_In_ DEVICE_OBJECT*, _In_ IRP *wsk_irp, _In_reads_opt_(_I
 
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
-auto prepare_wsk_buf(_Inout_ WSK_BUF &buf, _Inout_ wsk_context &ctx, _Inout_opt_ const URB *transfer_buffer)
+auto prepare_wsk_buf(
+        _Inout_ WSK_BUF &buf, _Inout_ wsk_context &ctx, _In_opt_ UDECXUSBENDPOINT endpoint, 
+        _Inout_opt_ const URB *transfer_buffer)
 {
         NT_ASSERT(!ctx.mdl_buf);
+        ULONG compressed = 0;
 
         if (transfer_buffer && is_transfer_dir_out(ctx.hdr)) { // TransferFlags can have wrong direction
                 if (auto err = make_transfer_buffer_mdl(ctx.mdl_buf, URB_BUF_LEN, IoReadAccess, *transfer_buffer)) {
                         Trace(TRACE_LEVEL_ERROR, "make_transfer_buffer_mdl %!STATUS!", err);
                         return err;
                 }
+                if (endpoint && !ctx.is_isoc) {
+                        compressed = compress(*ctx.dev, *get_endpoint_ctx(endpoint), ctx);
+                }
         }
 
         ctx.mdl_hdr.next(ctx.mdl_buf); // always replace tie from previous call
@@ -100,7 +111,7 @@ auto prepare_wsk_buf(_Inout_ WSK_BUF &buf, _Inout_ wsk_context &ctx, _Inout_opt_
 
         buf.Mdl = ctx.mdl_hdr.get();
         buf.Offset = 0;
-        buf.Length = get_total_size(ctx.hdr);
+        buf.Length = compressed ? sizeof(ctx.hdr) + compressed : get_total_size(ctx.hdr);
 
         NT_ASSERT(verify(buf, ctx.is_isoc));
         return STATUS_SUCCESS;
@@ -123,8 +134,12 @@ auto send(_In_opt_ UDECXUSBENDPOINT endpoint, _In_ wsk_context_ptr &ctx, _Inout_
 {
         auto request = ctx->request; // can be WDF_NO_HANDLE, do not access after send
 
+        auto seqnum = ctx->hdr.base.seqnum;
+        auto ep = ctx->hdr.base.ep;
+        trace_urb(vhci::trace_event::prepare, dev, seqnum, ep, 0, STATUS_SUCCESS);
+
         WSK_BUF buf{};
-        if (auto err = prepare_wsk_buf(buf, *ctx, transfer_buffer)) {
+        if (auto err = prepare_wsk_buf(buf, *ctx, endpoint, transfer_buffer)) {
                 return err;
         } else {
                 char str[DBG_USBIP_HDR_BUFSZ];
@@ -132,26 +147,71 @@ auto send(_In_opt_ UDECXUSBENDPOINT endpoint, _In_ wsk_context_ptr &ctx, _Inout_
                         ptr04x(request), buf.Length, dbg_usbip_hdr(str, sizeof(str), &ctx->hdr, log_setup));
         }
 
-        if (request && endpoint) {
-                device::append_request(dev, *ctx, endpoint);
-        }
-
-        byteswap_header(ctx->hdr, swap_dir::host2net);
-
         auto wsk_irp = ctx->wsk_irp; // do not access ctx or wsk_irp after send
-        IoSetCompletionRoutine(wsk_irp, send_complete, ctx.release(), true, true, true);
+        wsk_context *context{};
 
         NTSTATUS st;
+        bool stale;
         {
                 wdf::Lock lck(dev.send_lock); // EvtUsbEndpointPurge, EvtIoInternalDeviceControl on other queues
-                st = send(dev.sock(), &buf, WSK_FLAG_NODELAY, wsk_irp); // completion handler will be called anyway
+
+                // seqnum was issued for the closed socket or can be reissued after reconnect, see replace_socket
+                stale = dev.reconnecting || ctx->seqnum_epoch != dev.seqnum_epoch;
+
+                if (request && endpoint) { // under the lock, see reconnect.cpp, fail_pending_requests
+                        device::append_request(dev, *ctx, endpoint);
+                }
+
+                byteswap_header(ctx->hdr, swap_dir::host2net);
+
+                context = ctx.release();
+                IoSetCompletionRoutine(wsk_irp, send_complete, context, true, true, true);
+
+                trace_urb(vhci::trace_event::locked, dev, seqnum, ep, ULONG(buf.Length), STATUS_SUCCESS);
+                st = stale ? RECONNECT_STATUS : // completion handler will be called anyway
+                             send(dev.sock(), &buf, WSK_FLAG_NODELAY, wsk_irp);
         }
         TraceWSK("req %04x -> wsk irp %04x, %Iu bytes, %!STATUS!", 
                   ptr04x(request), ptr04x(wsk_irp), buf.Length, st);
 
+        if (stale || st == STATUS_NOT_SUPPORTED) { // WSK was not called and IRP will not be completed
+                wsk_irp->IoStatus.Status = st;
+                wsk_irp->IoStatus.Information = 0;
+                send_complete(nullptr, wsk_irp, context);
+        }
+
         return STATUS_PENDING;
 }
 
+/*
+ * @return true if the request was served from the descriptor cache and must be completed
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto from_descriptor_cache(
+        _In_ const device_ctx &dev, _In_ WDFREQUEST request, 
+        _In_ const USB_DEFAULT_PIPE_SETUP_PACKET &pkt, _In_ ULONG buf_len)
+{
+        UCHAR *buf{};
+        ULONG len{};
+
+        if (UdecxUrbRetrieveBuffer(request, &buf, &len)) {
+                return false;
+        }
+
+        NT_ASSERT(len >= buf_len);
+        len = buf_len;
+
+        if (!get_cached_descriptor(dev, pkt, buf, len)) {
+                return false;
+        }
+
+        TraceUrb("req %04x <- descriptor cache, %lu bytes", ptr04x(request), len);
+        UdecxUrbSetBytesCompleted(request, len);
+
+        return true;
+}
+
 using urb_function_t = NTSTATUS (device_ctx&, UDECXUSBENDPOINT, endpoint_ctx&, WDFREQUEST, URB&);
 
 _IRQL_requires_max_(DISPATCH_LEVEL)
@@ -169,12 +229,6 @@ auto control_transfer(
                 endp.PipeHandle = r.PipeHandle;
         }
 
-        if (!filter::is_request(r)) {
-                //
-        } else if (auto func = filter::get_function(r, true); auto err = filter::unpack_request(dev, r, func)) {
-                return err;
-        }
-
         {
                 char buf_flags[USBD_TRANSFER_FLAGS_BUFBZ];
                 char buf_setup[USB_SETUP_PKT_STR_BUFBZ];
@@ -197,6 +251,10 @@ auto control_transfer(
                 return STATUS_INVALID_PARAMETER;
         }
 
+        if (is_transfer_dir_in(pkt) && from_descriptor_cache(dev, request, pkt, buf_len)) {
+                return STATUS_SUCCESS;
+        }
+
         wsk_context_ptr ctx(&dev, request);
         if (!ctx) {
                 return STATUS_INSUFFICIENT_RESOURCES;
@@ -281,8 +339,38 @@ auto repack(_In_ usbip_iso_packet_descriptor *d, _In_ const _URB_ISOCH_TRANSFER
 }
 
 /*
- * USBD_START_ISO_TRANSFER_ASAP is appended because URB_GET_CURRENT_FRAME_NUMBER is not implemented.
+ * Explicit StartFrame is translated to the server's frame number if the frame clock is locked
+ * and the frame is not in the past, otherwise USBD_START_ISO_TRANSFER_ASAP is appended.
+ * @return true if start_frame is set
  */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto get_start_frame(_Inout_ device_ctx &dev, _In_ const _URB_ISOCH_TRANSFER &r, _Out_ ULONG &start_frame)
+{
+        start_frame = 0;
+
+        if (r.TransferFlags & USBD_START_ISO_TRANSFER_ASAP) {
+                return false;
+        }
+
+        wdf::Lock lck(dev.clock_lock);
+
+        auto m = frames_modulus(dev.clock);
+        if (!m) {
+                return false;
+        }
+
+        auto cur = static_cast<ULONG>(current_frame(dev.clock, KeQueryInterruptTime()));
+
+        if (auto delta = static_cast<LONG>(r.StartFrame - cur); delta < 0 || UINT64(delta) >= m/2) {
+                TraceDbg("StartFrame %lu, current frame %lu, modulus %llu -> ASAP", r.StartFrame, cur, m);
+                return false;
+        }
+
+        start_frame = to_server_frame(dev.clock, r.StartFrame);
+        return true;
+}
+
 _IRQL_requires_max_(DISPATCH_LEVEL)
 _Function_class_(urb_function_t)
 auto isoch_transfer(
@@ -320,8 +408,14 @@ auto isoch_transfer(
                 return STATUS_INSUFFICIENT_RESOURCES;
         }
 
-        if (auto err = set_cmd_submit_usbip_header(ctx->hdr, dev, endp.descriptor, 
-                               r.TransferFlags | USBD_START_ISO_TRANSFER_ASAP, r.TransferBufferLength)) {
+        ULONG start_frame;
+        auto flags = r.TransferFlags;
+
+        if (!get_start_frame(dev, r, start_frame)) {
+                flags |= USBD_START_ISO_TRANSFER_ASAP;
+        }
+
+        if (auto err = set_cmd_submit_usbip_header(ctx->hdr, dev, endp.descriptor, flags, r.TransferBufferLength)) {
                 return err;
         }
 
@@ -330,13 +424,31 @@ auto isoch_transfer(
         }
 
         if (auto cmd = &ctx->hdr.u.cmd_submit) {
-                cmd->start_frame = r.StartFrame;
+                cmd->start_frame = start_frame;
                 cmd->number_of_packets = r.NumberOfPackets;
         }
 
         return send(endpoint, ctx, dev, false, &urb);
 }
 
+/*
+ * The frame number is synthesized by the frame clock of the device.
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_Function_class_(urb_function_t)
+auto get_current_frame_number(
+        _In_ device_ctx &dev, _In_ UDECXUSBENDPOINT, _In_ endpoint_ctx&, _In_ WDFREQUEST request, _In_ URB &urb)
+{
+        auto &r = urb.UrbGetCurrentFrameNumber;
+        {
+                wdf::Lock lck(dev.clock_lock);
+                r.FrameNumber = static_cast<ULONG>(current_frame(dev.clock, KeQueryInterruptTime()));
+        }
+
+        TraceUrb("req %04x -> FrameNumber %lu", ptr04x(request), r.FrameNumber);
+        return STATUS_SUCCESS;
+}
+
 /*
  * @see WdfRequestForwardToParentDeviceIoQueue
  */
@@ -361,12 +473,17 @@ _IRQL_requires_max_(DISPATCH_LEVEL)
 auto usb_submit_urb(
         _In_ device_ctx &dev, _In_ UDECXUSBENDPOINT endpoint, _In_ endpoint_ctx &endp, _In_ WDFREQUEST request)
 {
+        ULONG64 qpc;
+        auto now = KeQueryInterruptTimePrecise(&qpc);
+
         if (get_request_ctx(request)) [[likely]] {
                 // NULL for some devices
         } else if (auto err = allocate_request_ctx(request)) {
                 return err;
         }
 
+        get_request_ctx(request)->dispatch_time = now;
+
         auto &urb = get_urb(request);
         urb_function_t *handler{};
 
@@ -383,6 +500,9 @@ auto usb_submit_urb(
         case URB_FUNCTION_CONTROL_TRANSFER:
                 handler = control_transfer;
                 break;
+        case URB_FUNCTION_GET_CURRENT_FRAME_NUMBER:
+                handler = get_current_frame_number;
+                break;
         default:
                 Trace(TRACE_LEVEL_ERROR, "%s(%#04x), dev %04x, endp %04x", urb_function_str(func), func, 
                                           ptr04x(endp.device), ptr04x(endpoint));
@@ -453,6 +573,11 @@ void usbip::device::send_cmd_unlink_and_complete(_In_ UDECXUSBDEVICE device, _In
 
         TraceDbg("dev %04x, seqnum %u", ptr04x(device), req.seqnum);
 
+        auto &stats = get_endpoint_ctx(req.endpoint)->stats; // can be called concurrently
+        InterlockedIncrement64(reinterpret_cast<LONG64*>(&stats.cancelled));
+
+        trace_urb(vhci::trace_event::unlink, dev, req, 0, status);
+
         if (dev.unplugged) {
                 TraceDbg("Unplugged, do not send unlink");
         } else if (auto ctx = wsk_context_ptr(&dev, WDFREQUEST(WDF_NO_HANDLE))) {
@@ -598,9 +723,21 @@ void NTAPI usbip::device::internal_control(
         auto endpoint = get_endpoint(queue);
         auto &endp = *get_endpoint_ctx(endpoint);
         
-        if (auto dev = get_device_ctx(endp.device); dev->unplugged) {
+        auto &dev = *get_device_ctx(endp.device);
+
+        if (dev.unplugged) {
                 UdecxUrbComplete(request, USBD_STATUS_DEVICE_GONE);
-        } else if (auto st = usb_submit_urb(*dev, endpoint, endp, request); st != STATUS_PENDING) {
+                return;
+        }
+
+        if (endp.no_bandwidth) { // see filter_request.cpp, admit_interface
+                UdecxUrbComplete(request, USBD_STATUS_NO_BANDWIDTH);
+                return;
+        }
+
+        set_milestone(dev.ext->timings.first_urb, *dev.ext);
+
+        if (auto st = usb_submit_urb(dev, endpoint, endp, request); st != STATUS_PENDING) {
                 if (st) {
                         TraceDbg("%!STATUS!", st);
                 }
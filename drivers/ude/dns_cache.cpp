@@ -0,0 +1,451 @@
+/*
+ * Copyright (C) 2024 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "dns_cache.h"
+#include "trace.h"
+#include "dns_cache.tmh"
+
+#include "pool.h"
+#include "persistent.h"
+#include "dns_policy.h"
+
+#include <libdrv\wait_timeout.h>
+
+namespace
+{
+
+using namespace usbip;
+
+enum {
+        MAX_ENTRIES = 32,
+        MAX_ADDRESSES = 8, // per entry
+
+        DEFAULT_TTL = 5*60, // seconds
+        DEFAULT_NEGATIVE_TTL = 30,
+        DEFAULT_STALE_TTL = 24*60*60,
+};
+
+struct address
+{
+        int family;
+        int socktype;
+        int protocol;
+        SOCKADDR_INET addr;
+};
+
+/*
+ * dns_slot::time is KeQueryInterruptTime, dns_slot::status is of WskGetAddressInfo.
+ */
+struct entry : dns_slot
+{
+        ULONG cnt; // of addresses
+        address addresses[MAX_ADDRESSES];
+
+        USHORT node_len; // bytes
+        USHORT service_len;
+        wchar_t node[NI_MAXHOST];
+        wchar_t service[NI_MAXSERV];
+};
+
+struct cache
+{
+        FAST_MUTEX lock;
+        dns_ttl ttl; // 100-nanosecond units
+
+        dns_cache_stats stats;
+        entry entries[MAX_ENTRIES];
+};
+
+cache *g_cache; // NULL if the cache is disabled
+
+class lock_guard
+{
+public:
+        lock_guard(_Inout_ FAST_MUTEX &m) : m_mutex(m) { ExAcquireFastMutex(&m_mutex); }
+        ~lock_guard() { ExReleaseFastMutex(&m_mutex); }
+
+        lock_guard(const lock_guard&) = delete;
+        lock_guard& operator =(const lock_guard&) = delete;
+
+private:
+        FAST_MUTEX &m_mutex;
+};
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto query_seconds(_In_ WDFKEY key, _In_ const wchar_t *value_name, _In_ ULONG default_value)
+{
+        PAGED_CODE();
+
+        UNICODE_STRING name;
+        RtlUnicodeStringInit(&name, value_name);
+
+        ULONG val{};
+        if (auto err = WdfRegistryQueryULong(key, &name, &val)) {
+                if (err != STATUS_OBJECT_NAME_NOT_FOUND) {
+                        Trace(TRACE_LEVEL_ERROR, "WdfRegistryQueryULong('%!USTR!') %!STATUS!", &name, err);
+                }
+                val = default_value;
+        }
+
+        return val*ULONGLONG(wdm::second);
+}
+
+constexpr auto make_unicode_string(_In_ const wchar_t *buf, _In_ USHORT len)
+{
+        return UNICODE_STRING{ .Length = len, .MaximumLength = len, .Buffer = const_cast<wchar_t*>(buf) };
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(APC_LEVEL)
+PAGED auto matches(_In_ const entry &e, _In_ const UNICODE_STRING &node, _In_ const UNICODE_STRING &service)
+{
+        PAGED_CODE();
+
+        auto n = make_unicode_string(e.node, e.node_len);
+        auto s = make_unicode_string(e.service, e.service_len);
+
+        return e.time && RtlEqualUnicodeString(&n, &node, true) && RtlEqualUnicodeString(&s, &service, true);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(APC_LEVEL)
+PAGED auto find(_In_ cache &c, _In_ const UNICODE_STRING &node, _In_ const UNICODE_STRING &service) -> entry*
+{
+        PAGED_CODE();
+
+        for (auto &e: c.entries) {
+                if (matches(e, node, service)) {
+                        return &e;
+                }
+        }
+
+        return nullptr;
+}
+
+/*
+ * ADDRINFOEXW-s and SOCKADDR_INET-s are allocated by a single block.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto make_addrinfo(_In_ const entry &e) -> ADDRINFOEXW*
+{
+        NT_ASSERT(e.cnt);
+        auto sz = e.cnt*(sizeof(ADDRINFOEXW) + sizeof(SOCKADDR_INET));
+
+        auto ai = (ADDRINFOEXW*)pool_alloc(pool_consumer::dns_cache, NonPagedPoolNx, sz);
+        if (!ai) {
+                Trace(TRACE_LEVEL_ERROR, "Can't allocate %Iu bytes", sz);
+                return nullptr;
+        }
+
+        auto sa = reinterpret_cast<SOCKADDR_INET*>(ai + e.cnt);
+
+        for (ULONG i = 0; i < e.cnt; ++i) {
+                auto &a = e.addresses[i];
+                auto &r = ai[i];
+
+                sa[i] = a.addr;
+
+                r.ai_family = a.family;
+                r.ai_socktype = a.socktype;
+                r.ai_protocol = a.protocol;
+                r.ai_addrlen = a.family == AF_INET ? sizeof(sa[i].Ipv4) : sizeof(sa[i].Ipv6);
+                r.ai_addr = reinterpret_cast<SOCKADDR*>(sa + i);
+                r.ai_next = i + 1 < e.cnt ? &ai[i + 1] : nullptr;
+        }
+
+        return ai;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto copy(_Inout_ entry &e, _In_opt_ const ADDRINFOEXW *ai)
+{
+        e.cnt = 0;
+
+        for ( ; ai && e.cnt < ARRAYSIZE(e.addresses); ai = ai->ai_next) {
+
+                auto &sa = *reinterpret_cast<SOCKADDR_INET*>(ai->ai_addr);
+                auto len = sa.si_family == AF_INET ? sizeof(sa.Ipv4) :
+                           sa.si_family == AF_INET6 ? sizeof(sa.Ipv6) : 0;
+
+                if (!len || ai->ai_addrlen < len) {
+                        continue;
+                }
+
+                auto &a = e.addresses[e.cnt++];
+
+                a.family = ai->ai_family;
+                a.socktype = ai->ai_socktype;
+                a.protocol = ai->ai_protocol;
+
+                RtlZeroMemory(&a.addr, sizeof(a.addr));
+                RtlCopyMemory(&a.addr, &sa, len);
+        }
+
+        return e.cnt;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(APC_LEVEL)
+PAGED auto set_key(_Inout_ entry &e, _In_ const UNICODE_STRING &node, _In_ const UNICODE_STRING &service)
+{
+        PAGED_CODE();
+
+        if (node.Length > sizeof(e.node) || service.Length > sizeof(e.service)) {
+                return false;
+        }
+
+        e.node_len = node.Length;
+        RtlCopyMemory(e.node, node.Buffer, node.Length);
+
+        e.service_len = service.Length;
+        RtlCopyMemory(e.service, service.Buffer, service.Length);
+
+        return true;
+}
+
+_Function_class_(IO_COMPLETION_ROUTINE)
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS resolve_complete(_In_ DEVICE_OBJECT*, _In_ IRP*, _In_reads_opt_(_Inexpressible_("varies")) void *context)
+{
+        KeSetEvent(static_cast<KEVENT*>(context), IO_NO_INCREMENT, false);
+        return StopCompletion;
+}
+
+/*
+ * Synchronous WskGetAddressInfo.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto resolve(_Out_ ADDRINFOEXW* &result, _In_ const UNICODE_STRING &node, _In_ const UNICODE_STRING &service)
+{
+        PAGED_CODE();
+        result = nullptr;
+
+        auto irp = IoAllocateIrp(1, false);
+        if (!irp) {
+                return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        KEVENT completed;
+        KeInitializeEvent(&completed, NotificationEvent, false);
+        IoSetCompletionRoutine(irp, resolve_complete, &completed, true, true, true);
+
+        ADDRINFOEXW hints {
+                .ai_flags = AI_NUMERICSERV,
+                .ai_family = AF_UNSPEC,
+                .ai_socktype = SOCK_STREAM,
+                .ai_protocol = IPPROTO_TCP // zero isn't work
+        };
+
+        auto st = wsk::getaddrinfo(result, const_cast<UNICODE_STRING*>(&node), const_cast<UNICODE_STRING*>(&service), 
+                                   &hints, irp);
+
+        if (st == STATUS_PENDING || KeReadStateEvent(&completed)) { // libdrv wrappers can fail without calling WSK
+                NT_VERIFY(!KeWaitForSingleObject(&completed, Executive, KernelMode, false, nullptr));
+                st = irp->IoStatus.Status;
+        }
+
+        IoFreeIrp(irp);
+        return st;
+}
+
+} // namespace
+
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS usbip::init_dns_cache()
+{
+        PAGED_CODE();
+        NT_ASSERT(!g_cache);
+
+        ULONGLONG ttl = DEFAULT_TTL*ULONGLONG(wdm::second);
+        ULONGLONG negative_ttl = DEFAULT_NEGATIVE_TTL*ULONGLONG(wdm::second);
+        ULONGLONG stale_ttl = DEFAULT_STALE_TTL*ULONGLONG(wdm::second);
+
+        if (Registry key; !open_parameters_key(key, KEY_QUERY_VALUE)) {
+                ttl = query_seconds(key.get(), L"DnsCacheTtl", DEFAULT_TTL);
+                negative_ttl = query_seconds(key.get(), L"DnsCacheNegativeTtl", DEFAULT_NEGATIVE_TTL);
+                stale_ttl = query_seconds(key.get(), L"DnsCacheStaleTtl", DEFAULT_STALE_TTL);
+        }
+
+        if (!ttl) {
+                Trace(TRACE_LEVEL_INFORMATION, "disabled");
+                return STATUS_SUCCESS;
+        }
+
+        auto c = (cache*)pool_alloc(pool_consumer::dns_cache, NonPagedPoolNx, sizeof(cache));
+        if (!c) {
+                Trace(TRACE_LEVEL_ERROR, "Can't allocate %Iu bytes", sizeof(*c));
+                return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        ExInitializeFastMutex(&c->lock);
+
+        c->ttl = { .positive = ttl, .negative = negative_ttl, .stale = stale_ttl };
+
+        Trace(TRACE_LEVEL_INFORMATION, "ttl %llu, negative %llu, stale %llu (sec)",
+                ttl/wdm::second, negative_ttl/wdm::second, stale_ttl/wdm::second);
+
+        g_cache = c;
+        return STATUS_SUCCESS;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void usbip::delete_dns_cache()
+{
+        PAGED_CODE();
+
+        if (auto c = (cache*)InterlockedExchangePointer(reinterpret_cast<PVOID*>(&g_cache), nullptr)) {
+                auto &s = c->stats;
+                Trace(TRACE_LEVEL_INFORMATION, "hits %lu, negative %lu, stale %lu, misses %lu, insertions %lu, evictions %lu",
+                        s.hits, s.negative_hits, s.stale_hits, s.misses, s.insertions, s.evictions);
+
+                pool_free(pool_consumer::dns_cache, c, sizeof(*c));
+        }
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED bool usbip::dns_cache_get(
+        _Out_ ADDRINFOEXW* &result, _Out_ NTSTATUS &status, 
+        _In_ const UNICODE_STRING &node, _In_ const UNICODE_STRING &service, _In_ bool stale)
+{
+        PAGED_CODE();
+
+        result = nullptr;
+        status = STATUS_SUCCESS;
+
+        auto c = g_cache;
+        if (!c) {
+                return false;
+        }
+
+        lock_guard lck(c->lock);
+        auto now = KeQueryInterruptTime();
+
+        auto e = find(*c, node, service);
+        auto kind = e ? lookup(*e, c->ttl, now, stale) : dns_lookup::miss;
+
+        switch (kind) {
+        case dns_lookup::miss:
+                ++c->stats.misses;
+                return false;
+        case dns_lookup::negative:
+                ++c->stats.negative_hits;
+                status = e->status;
+                break;
+        case dns_lookup::fresh:
+        case dns_lookup::stale:
+                if (result = make_addrinfo(*e); !result) {
+                        return false; // let the caller resolve it
+                }
+                ++(kind == dns_lookup::fresh ? c->stats.hits : c->stats.stale_hits);
+                TraceDbg("'%!USTR!:%!USTR!', age %llu sec%s", &node, &service, (now - e->time)/wdm::second,
+                          kind == dns_lookup::fresh ? "" : ", stale");
+                break;
+        }
+
+        e->last_used = now;
+        return true;
+}
+
+/*
+ * A negative entry does not replace a positive one to make serve-stale possible.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void usbip::dns_cache_put(
+        _In_ const UNICODE_STRING &node, _In_ const UNICODE_STRING &service,
+        _In_opt_ const ADDRINFOEXW *result, _In_ NTSTATUS status)
+{
+        PAGED_CODE();
+
+        auto c = g_cache;
+        if (!c || status == STATUS_CANCELLED) {
+                return;
+        }
+
+        lock_guard lck(c->lock);
+        auto now = KeQueryInterruptTime();
+
+        auto e = find(*c, node, service);
+
+        if (!e) {
+                bool evicted;
+                e = &evict(c->entries, evicted);
+                c->stats.evictions += evicted;
+
+                if (!set_key(*e, node, service)) {
+                        e->time = 0;
+                        return;
+                }
+                ++c->stats.insertions;
+        } else if (!can_replace(*e, status)) {
+                return;
+        }
+
+        if (!status && !copy(*e, result)) {
+                status = STATUS_NOT_FOUND; // no usable addresses
+        }
+
+        store(*e, status, now);
+
+        TraceDbg("'%!USTR!:%!USTR!', %!STATUS!, %lu address(es)", &node, &service, status, status ? 0 : e->cnt);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS usbip::dns_cache_prefetch(_In_ const UNICODE_STRING &node, _In_ const UNICODE_STRING &service)
+{
+        PAGED_CODE();
+
+        if (!g_cache) {
+                return STATUS_SUCCESS; // nothing to do
+        }
+
+        ADDRINFOEXW *result{};
+
+        if (NTSTATUS st; dns_cache_get(result, st, node, service, false)) {
+                free_cached_addrinfo(result);
+                return st;
+        }
+
+        auto st = resolve(result, node, service);
+        TraceDbg("'%!USTR!:%!USTR!' %!STATUS!", &node, &service, st);
+
+        dns_cache_put(node, service, result, st);
+        wsk::free(result);
+
+        return st;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::free_cached_addrinfo(_In_opt_ ADDRINFOEXW *result)
+{
+        SIZE_T cnt = 0;
+        for (auto ai = result; ai; ai = ai->ai_next, ++cnt); // see make_addrinfo
+
+        pool_free(pool_consumer::dns_cache, result, cnt*(sizeof(*result) + sizeof(SOCKADDR_INET)));
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void usbip::get_dns_cache_stats(_Out_ dns_cache_stats &stats)
+{
+        PAGED_CODE();
+
+        if (auto c = g_cache) {
+                lock_guard lck(c->lock);
+                stats = c->stats;
+        } else {
+                RtlZeroMemory(&stats, sizeof(stats));
+        }
+}
@@ -0,0 +1,78 @@
+/*
+ * Copyright (C) 2024 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include <libdrv\codeseg.h>
+#include <libdrv\wsk_cpp.h>
+
+namespace usbip
+{
+
+/*
+ * Driver-wide cache of WskGetAddressInfo results, it is shared by all attach paths.
+ *
+ * WSK does not return TTL of DNS records, the lifetimes are read from the driver's Parameters key:
+ * DnsCacheTtl - seconds, a positive entry is fresh, default is 300, zero disables the cache;
+ * DnsCacheNegativeTtl - seconds, a failed resolution is remembered, default is 30;
+ * DnsCacheStaleTtl - seconds, an expired positive entry can be served if the resolver fails, default is 86400.
+ */
+struct dns_cache_stats
+{
+        ULONG hits; // fresh positive entry was returned
+        ULONG negative_hits; // fresh negative entry was returned
+        ULONG stale_hits; // expired entry was returned after resolver's error
+        ULONG misses;
+        ULONG insertions;
+        ULONG evictions; // least recently used entry was replaced
+};
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS init_dns_cache();
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void delete_dns_cache();
+
+/*
+ * The decisions are made by dns_policy.h.
+ * @param result a list that must be released by free_cached_addrinfo if status is STATUS_SUCCESS
+ * @param status STATUS_SUCCESS or an error of a fresh negative entry
+ * @param stale return an expired positive entry if there is no fresh one
+ * @return false if there is no usable entry, the name must be resolved
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED bool dns_cache_get(
+        _Out_ ADDRINFOEXW* &result, _Out_ NTSTATUS &status, 
+        _In_ const UNICODE_STRING &node, _In_ const UNICODE_STRING &service, _In_ bool stale);
+
+/*
+ * @param status of WskGetAddressInfo, a negative entry is stored if it is an error
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void dns_cache_put(
+        _In_ const UNICODE_STRING &node, _In_ const UNICODE_STRING &service,
+        _In_opt_ const ADDRINFOEXW *result, _In_ NTSTATUS status);
+
+/*
+ * Resolve the name and store the result if there is no fresh entry.
+ * The calls of dns_cache_get that follow do not wait for the resolver.
+ * @return status of a fresh entry or of WskGetAddressInfo
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS dns_cache_prefetch(_In_ const UNICODE_STRING &node, _In_ const UNICODE_STRING &service);
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void free_cached_addrinfo(_In_opt_ ADDRINFOEXW *result);
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void get_dns_cache_stats(_Out_ dns_cache_stats &stats);
+
+} // namespace usbip
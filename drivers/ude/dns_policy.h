@@ -0,0 +1,91 @@
+/*
+ * Copyright (C) 2024 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include <wdm.h>
+
+namespace usbip
+{
+
+/*
+ * Lifetimes of DNS cache entries, in the units of the clock, see dns_cache.h.
+ */
+struct dns_ttl
+{
+        ULONGLONG positive; // a positive entry is fresh
+        ULONGLONG negative; // a failed resolution is remembered
+        ULONGLONG stale; // an expired positive entry can be served if the resolver fails
+};
+
+/*
+ * Bookkeeping part of a cache entry, the key and the addresses are kept by a derived type.
+ */
+struct dns_slot
+{
+        ULONGLONG time; // of resolution, zero if the slot is unused
+        ULONGLONG last_used; // for LRU eviction
+        NTSTATUS status; // of the resolution, an error for a negative entry
+};
+
+enum class dns_lookup { miss, fresh, negative, stale };
+
+/*
+ * @param serve_stale return an expired positive entry if there is no fresh one, negative entries are ignored
+ */
+constexpr auto lookup(_In_ const dns_slot &s, _In_ const dns_ttl &t, _In_ ULONGLONG now, _In_ bool serve_stale)
+{
+        if (!s.time) {
+                return dns_lookup::miss;
+        }
+
+        auto age = now - s.time;
+
+        if (s.status) {
+                return age < t.negative && !serve_stale ? dns_lookup::negative : dns_lookup::miss;
+        } else if (age < t.positive) {
+                return dns_lookup::fresh;
+        }
+
+        return serve_stale && age < t.stale ? dns_lookup::stale : dns_lookup::miss;
+}
+
+/*
+ * A negative result does not replace a positive entry to make serve-stale possible.
+ */
+constexpr auto can_replace(_In_ const dns_slot &s, _In_ NTSTATUS status)
+{
+        return !(s.time && status && !s.status);
+}
+
+inline void store(_Inout_ dns_slot &s, _In_ NTSTATUS status, _In_ ULONGLONG now)
+{
+        s.status = status;
+        s.time = now;
+        s.last_used = now;
+}
+
+/*
+ * @param evicted is set if the slot is in use
+ * @return unused or least recently used slot
+ */
+template<typename T, size_t N>
+inline auto evict(_Inout_ T (&slots)[N], _Out_ bool &evicted) -> T&
+{
+        dns_slot *victim = slots;
+        evicted = false;
+
+        for (auto &s: slots) {
+                if (!s.time) {
+                        return s;
+                } else if (s.last_used < victim->last_used) {
+                        victim = &s;
+                }
+        }
+
+        evicted = true;
+        return static_cast<T&>(*victim);
+}
+
+} // namespace usbip
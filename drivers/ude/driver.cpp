@@ -9,6 +9,9 @@
 
 #include "context.h"
 #include "wsk_context.h"
+#include "dns_cache.h"
+#include "trace_ring.h"
+#include "pool.h"
 
 #include <libdrv\wsk_cpp.h>
 
@@ -29,6 +32,8 @@ PAGED void driver_cleanup(_In_ WDFOBJECT Object)
 
 	wsk::shutdown();
 	delete_wsk_context_list();
+	delete_dns_cache();
+	delete_trace_ring();
 
 	auto drvobj = WdfDriverWdmGetDriverObject(drv);
 	WPP_CLEANUP(drvobj);
@@ -56,8 +61,9 @@ _IRQL_requires_(PASSIVE_LEVEL)
 CS_INIT auto init()
 {
 	PAGED_CODE();
+	init_pool_stats();
 
-	if (auto err = init_wsk_context_list(pooltag)) {
+	if (auto err = init_wsk_context_list(get_pool_tag(pool_consumer::wsk_context))) {
 		Trace(TRACE_LEVEL_CRITICAL, "ExInitializeLookasideListEx %!STATUS!", err);
 		return err;
 	}
@@ -67,6 +73,16 @@ CS_INIT auto init()
 		return err;
 	}
 
+	if (auto err = init_dns_cache()) {
+		Trace(TRACE_LEVEL_CRITICAL, "init_dns_cache %!STATUS!", err);
+		return err;
+	}
+
+	if (auto err = init_trace_ring()) {
+		Trace(TRACE_LEVEL_CRITICAL, "init_trace_ring %!STATUS!", err);
+		return err;
+	}
+
 	return STATUS_SUCCESS;
 }
 
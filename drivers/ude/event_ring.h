@@ -0,0 +1,21 @@
+/*
+ * Copyright (C) 2024 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include "seq_ring.h"
+#include <usbip\vhci.h>
+
+namespace usbip
+{
+
+/*
+ * Events for IRP_MJ_READ, each consumer has its own cursor, see fileobject_ctx::seqnum.
+ * The gap in vhci::device_state::seqnum tells how many events were lost by a consumer that lags behind.
+ *
+ * vhci_ctx::events_lock must be acquired to call the functions of seq_ring.
+ */
+struct event_ring : seq_ring<vhci::device_state, 512> {};
+
+} // namespace usbip
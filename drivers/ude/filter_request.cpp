@@ -8,6 +8,8 @@
 
 #include "endpoint_list.h"
 #include "device_ioctl.h"
+#include "vhci.h"
+#include "recv_priority.h"
 
 #include <ude_filter/request.h>
 
@@ -65,9 +67,66 @@ constexpr CCHAR get_priority_boost(_In_ int cls, _In_ int subclass, _In_ int pro
         return IO_NO_INCREMENT;
 }
 
+/*
+ * @return bytes per second that periodic endpoints of the interface require
+ */
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
-void update_pipe_properties(_In_ device_ctx &dev, _In_ const USBD_INTERFACE_INFORMATION &intf)
+auto get_periodic_bandwidth(_In_ device_ctx &dev, _In_ const USBD_INTERFACE_INFORMATION &intf)
+{
+        auto speed = static_cast<usb_device_speed>(dev.speed());
+        UINT64 total = 0;
+
+        for (ULONG i = 0; i < intf.NumberOfPipes; ++i) {
+                if (auto endp = find_endpoint(dev, intf.Pipes[i].EndpointAddress)) {
+                        total += periodic_bandwidth(endp->descriptor, &endp->companion, speed);
+                }
+        }
+
+        return total;
+}
+
+/*
+ * A real host controller refuses an alternate setting if its periodic bandwidth exceeds the budget of the bus.
+ * This driver is notified after SELECT_CONFIGURATION/SELECT_INTERFACE is completed, so the URB can't be failed.
+ * If the policy is reject, periodic URBs of the interface are completed with USBD_STATUS_NO_BANDWIDTH
+ * and SET_INTERFACE or SET_CONFIGURATION is not sent to the server.
+ *
+ * @return false if the alternate setting is rejected
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto admit_interface(_Inout_ device_ctx &dev, _In_ const USBD_INTERFACE_INFORMATION &intf)
+{
+        auto num = intf.InterfaceNumber;
+        if (num >= ARRAYSIZE(dev.bandwidth.intf)) {
+                Trace(TRACE_LEVEL_ERROR, "InterfaceNumber %d is out of range", num);
+                return true;
+        }
+
+        auto demand = get_periodic_bandwidth(dev, intf);
+
+        bandwidth_budget b {
+                .bus = bus_bandwidth(static_cast<usb_device_speed>(dev.speed())),
+                .link = dev.link_bandwidth*1024ULL, // zero if unlimited
+        };
+
+        bool exceeded;
+        auto admitted = vhci::reserve_bandwidth(dev.vhci, dev, b, num, demand, exceeded);
+
+        if (exceeded) {
+                Trace(TRACE_LEVEL_WARNING, "dev %04x, interface %d.%d requires %llu bytes/s, "
+                        "bus %llu of %llu, link %llu of %llu are used by other devices -> %s",
+                        ptr04x(get_handle(&dev)), num, intf.AlternateSetting, demand, 
+                        b.bus_used, b.bus, b.link_used, b.link, admitted ? "allowed" : "rejected");
+        }
+
+        return admitted;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void update_pipe_properties(_In_ device_ctx &dev, _In_ const USBD_INTERFACE_INFORMATION &intf, _In_ bool admitted)
 {
         for (ULONG i = 0; i < intf.NumberOfPipes; ++i) {
                 auto &pipe = intf.Pipes[i];
@@ -84,6 +143,9 @@ void update_pipe_properties(_In_ device_ctx &dev, _In_ const USBD_INTERFACE_INFO
 
                 NT_ASSERT(usb_endpoint_type(endp->descriptor) == pipe.PipeType);
 
+                endp->no_bandwidth = !admitted && 
+                        (pipe.PipeType == UsbdPipeTypeIsochronous || pipe.PipeType == UsbdPipeTypeInterrupt);
+
                 if (pipe.PipeType == UsbdPipeTypeControl) {
                         //
                 } else if (auto boost = get_priority_boost(intf.Class, intf.SubClass, intf.Protocol)) {
@@ -103,108 +165,180 @@ void update_pipe_properties(_In_ device_ctx &dev, _In_ const USBD_INTERFACE_INFO
         }
 }
 
+/*
+ * @return referenced UDECXUSBDEVICE which is plugged into the port
+ */
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
-auto clear_endpoint_stall(
-        _In_ device_ctx &dev, _Inout_ USB_DEFAULT_PIPE_SETUP_PACKET &pkt, _Inout_ _URB_PIPE_REQUEST &r)
+auto get_plugged_device(_In_ void *Context, _In_ int port)
 {
-        if (auto endp = find_endpoint(dev, r.PipeHandle)) {
-                auto addr = endp->descriptor.bEndpointAddress;
-                pkt = device::make_clear_endpoint_stall(addr);
-                TraceDbg("PipeHandle %04x, bEndpointAddress %#x", ptr04x(r.PipeHandle), addr);
-                return STATUS_SUCCESS;
+        auto vhci = static_cast<WDFDEVICE>(Context);
+
+        auto dev = vhci::get_device(vhci, port);
+        if (!dev) {
+                Trace(TRACE_LEVEL_ERROR, "vhci %04x, port %d is empty", ptr04x(vhci), port);
         }
 
-        Trace(TRACE_LEVEL_ERROR, "PipeHandle %04x not found", ptr04x(r.PipeHandle));
+        return dev;
+}
+
+_Function_class_(filter::reset_pipe_t)
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS reset_pipe(_In_ void *Context, _In_ int port, _In_ const _URB_PIPE_REQUEST &r)
+{
+        auto ref = get_plugged_device(Context, port);
+        if (!ref) {
+                return STATUS_NO_SUCH_DEVICE;
+        }
+
+        auto &dev = *get_device_ctx(ref.get<UDECXUSBDEVICE>());
+
+        auto endp = find_endpoint(dev, r.PipeHandle);
+        if (!endp) {
+                Trace(TRACE_LEVEL_ERROR, "PipeHandle %04x not found", ptr04x(r.PipeHandle));
+                return STATUS_INVALID_HANDLE;
+        }
 
-        r.Hdr.Status = USBD_STATUS_INVALID_PIPE_HANDLE;
-        return STATUS_INVALID_HANDLE;
+        return device::clear_endpoint_stall(get_handle(endp), WDF_NO_HANDLE);
 }
 
+_Function_class_(filter::select_configuration_t)
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
-auto select_configuration(
-        _In_ device_ctx &dev, _Inout_ USB_DEFAULT_PIPE_SETUP_PACKET &pkt, _In_ const _URB_SELECT_CONFIGURATION &r)
+NTSTATUS select_configuration(_In_ void *Context, _In_ int port, _In_ const _URB_SELECT_CONFIGURATION &r)
 {
+        auto ref = get_plugged_device(Context, port);
+        if (!ref) {
+                return STATUS_NO_SUCH_DEVICE;
+        }
+
+        auto device = ref.get<UDECXUSBDEVICE>();
+        auto &dev = *get_device_ctx(device);
+
         {
                 char buf[libdrv::SELECT_CONFIGURATION_STR_BUFSZ];
-                TraceDbg("%s", libdrv::select_configuration_str(buf, sizeof(buf), &r));
+                TraceDbg("dev %04x, %s", ptr04x(device), libdrv::select_configuration_str(buf, sizeof(buf), &r));
         }
 
         UCHAR cfg{}; // FIXME: can't pass -1 if unconfigured
 
+        vhci::release_bandwidth(dev.vhci, dev);
+        clear_interface_priority(dev);
+
+        bool admitted = true;
+
         if (auto cd = r.ConfigurationDescriptor) { // null if unconfigured
                 cfg = cd->bConfigurationValue;
+                set_milestone(dev.ext->timings.configured, *dev.ext);
 
                 auto intf = &r.Interface;
+                for (int i = 0; admitted && i < cd->bNumInterfaces; ++i, intf = libdrv::next(intf)) {
+                        admitted = admit_interface(dev, *intf);
+                }
+
+                if (!admitted) { // the configuration is rejected as a whole
+                        vhci::release_bandwidth(dev.vhci, dev);
+                }
+
+                intf = &r.Interface;
                 for (int i = 0; i < cd->bNumInterfaces; ++i, intf = libdrv::next(intf)) {
-                        update_pipe_properties(dev, *intf);
+                        update_pipe_properties(dev, *intf, admitted);
+                        set_interface_priority(dev, intf->InterfaceNumber, 
+                                admitted ? get_class_priority(intf->Class, intf->SubClass, intf->Protocol) : 0);
                 }
         }
 
-        pkt = device::make_set_configuration(cfg);
-        return STATUS_SUCCESS;
+        if (!admitted) {
+                Trace(TRACE_LEVEL_ERROR, "dev %04x, configuration %d is rejected", ptr04x(device), cfg);
+                return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        return device::set_configuration(device, WDF_NO_HANDLE, cfg);
 }
 
+_Function_class_(filter::select_interface_t)
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
-auto select_interface(
-        _In_ device_ctx &dev, _Inout_ USB_DEFAULT_PIPE_SETUP_PACKET &pkt, _In_ const _URB_SELECT_INTERFACE &r)
+NTSTATUS select_interface(_In_ void *Context, _In_ int port, _In_ const _URB_SELECT_INTERFACE &r)
 {
+        auto ref = get_plugged_device(Context, port);
+        if (!ref) {
+                return STATUS_NO_SUCH_DEVICE;
+        }
+
+        auto device = ref.get<UDECXUSBDEVICE>();
+        auto &dev = *get_device_ctx(device);
+
         {
                 char buf[libdrv::SELECT_INTERFACE_STR_BUFSZ];
-                TraceDbg("%s", libdrv::select_interface_str(buf, sizeof(buf), r));
+                TraceDbg("dev %04x, %s", ptr04x(device), libdrv::select_interface_str(buf, sizeof(buf), r));
         }
 
         auto &i = r.Interface;
-        update_pipe_properties(dev, i);
-        pkt = device::make_set_interface(i.InterfaceNumber, i.AlternateSetting);
 
-        return STATUS_SUCCESS;
+        auto admitted = admit_interface(dev, i);
+        update_pipe_properties(dev, i, admitted);
+
+        set_interface_priority(dev, i.InterfaceNumber, 
+                admitted ? get_class_priority(i.Class, i.SubClass, i.Protocol) : 0);
+
+        if (!admitted) {
+                return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        return device::set_interface(device, WDF_NO_HANDLE, i.InterfaceNumber, i.AlternateSetting);
+}
+
+/*
+ * The filter calls functions of the interface, so the context of VHCI device must be alive.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void interface_reference(_In_ void *Context)
+{
+        WdfObjectReference(static_cast<WDFDEVICE>(Context));
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void interface_dereference(_In_ void *Context)
+{
+        WdfObjectDereference(static_cast<WDFDEVICE>(Context));
 }
 
 } // namespace
 
 
+/*
+ * WdfDeviceAddQueryInterface copies the interface,
+ * the framework calls InterfaceReference for each copy it returns, the filter calls InterfaceDereference.
+ */
 _IRQL_requires_same_
-_IRQL_requires_max_(DISPATCH_LEVEL)
-NTSTATUS usbip::filter::unpack_request(
-        _In_ device_ctx &dev, _Inout_ _URB_CONTROL_TRANSFER_EX &r, _In_ int function)
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS usbip::filter::add_request_interface(_In_ WDFDEVICE vhci)
 {
-        NT_ASSERT(!r.TransferBufferLength);
+        PAGED_CODE();
 
-        NT_ASSERT((USBD_TRANSFER_DIRECTION_FLAG(r.TransferFlags) == USBD_TRANSFER_DIRECTION_IN));
-        r.TransferFlags ^= USBD_TRANSFER_DIRECTION_IN; // flip direction
+        request_interface r{};
 
-        auto func_name = urb_function_str(function);
-        TraceDbg("%s", func_name);
+        r.Size = static_cast<USHORT>(sizeof(r));
+        r.Version = REQUEST_INTERFACE_VERSION;
+        r.Context = vhci;
+        r.InterfaceReference = interface_reference;
+        r.InterfaceDereference = interface_dereference;
 
-        NTSTATUS st;
+        r.SelectConfiguration = select_configuration;
+        r.SelectInterface = select_interface;
+        r.ResetPipe = reset_pipe;
 
-        switch (auto &pkt = get_setup_packet(r); function) {
-        case URB_FUNCTION_SYNC_RESET_PIPE_AND_CLEAR_STALL:
-        case URB_FUNCTION_SYNC_RESET_PIPE:
-        case URB_FUNCTION_SYNC_CLEAR_STALL:
-                static_assert(is_request_function(URB_FUNCTION_SYNC_RESET_PIPE_AND_CLEAR_STALL));
-                static_assert(is_request_function(URB_FUNCTION_SYNC_RESET_PIPE));
-                static_assert(is_request_function(URB_FUNCTION_SYNC_CLEAR_STALL));
-                st = clear_endpoint_stall(dev, pkt, *reinterpret_cast<_URB_PIPE_REQUEST*>(r.TransferBuffer));
-                break;
-        case URB_FUNCTION_SELECT_INTERFACE:
-                static_assert(is_request_function(URB_FUNCTION_SELECT_INTERFACE));
-                st = select_interface(dev, pkt, *reinterpret_cast<_URB_SELECT_INTERFACE*>(r.TransferBuffer));
-                break;
-        case URB_FUNCTION_SELECT_CONFIGURATION:
-                static_assert(is_request_function(URB_FUNCTION_SELECT_CONFIGURATION));
-                st = select_configuration(dev, pkt, *reinterpret_cast<_URB_SELECT_CONFIGURATION*>(r.TransferBuffer));
-                break;
-        default:
-                st = STATUS_INVALID_PARAMETER;
-                r.Hdr.Status = USBD_STATUS_INVALID_PARAMETER;
-                Trace(TRACE_LEVEL_ERROR, "Unexpected %s", func_name);
-                NT_ASSERT(!"Unexpected URB Function");
+        WDF_QUERY_INTERFACE_CONFIG cfg;
+        WDF_QUERY_INTERFACE_CONFIG_INIT(&cfg, &r, &GUID_REQUEST_INTERFACE, WDF_NO_EVENT_CALLBACK);
 
+        if (auto err = WdfDeviceAddQueryInterface(vhci, &cfg)) {
+                Trace(TRACE_LEVEL_ERROR, "WdfDeviceAddQueryInterface %!STATUS!", err);
+                return err;
         }
 
-        return st;
+        return STATUS_SUCCESS;
 }
@@ -4,19 +4,17 @@
 
 #pragma once
 
-#include <wdm.h>
-struct _URB_CONTROL_TRANSFER_EX;
-
-namespace usbip 
-{
-        struct device_ctx;
-}
+#include <libdrv\codeseg.h>
+#include <libdrv\wdf_cpp.h>
 
 namespace usbip::filter
 {
 
+/*
+ * Exposes filter::request_interface for VHCI device, see <ude_filter\request.h>.
+ */
 _IRQL_requires_same_
-_IRQL_requires_max_(DISPATCH_LEVEL)
-NTSTATUS unpack_request(_In_ device_ctx &dev, _Inout_ _URB_CONTROL_TRANSFER_EX &r, _In_ int function);
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS add_request_interface(_In_ WDFDEVICE vhci);
 
 } // namespace usbip::filter
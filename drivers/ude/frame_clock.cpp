@@ -0,0 +1,256 @@
+/*
+ * Copyright (C) 2024 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "frame_clock.h"
+
+namespace
+{
+
+using namespace usbip;
+
+enum state_t : UCHAR { UNSYNCED, CALIBRATING, TRACKING };
+
+enum : ULONG {
+        LOCK_SAMPLES = 8, // accepted since the last step
+        STEP_THRESHOLD = 8, // frames
+        PHASE_GAIN = 8, // a sample corrects 1/PHASE_GAIN of the phase error
+        FREQ_GAIN = 20, // log2, a phase error of one frame corrects the period by ~1 ppm
+        MAX_DRIFT = 1000, // ppm, USB requires 500 ppm for full-speed
+        CALIBRATION_MIN = 32*frame_clock::NOMINAL_PERIOD,
+        CALIBRATION_MAX = 256*frame_clock::NOMINAL_PERIOD,
+};
+
+constexpr UINT64 ONE = 1ULL << frame_clock::FRAC_BITS; // frame
+constexpr UINT64 NOMINAL = UINT64(frame_clock::NOMINAL_PERIOD) << frame_clock::FRAC_BITS;
+constexpr UINT64 MAX_PERIOD_DELTA = NOMINAL*MAX_DRIFT/1'000'000;
+
+constexpr INT64 MAX_ELAPSED = 1LL << 30; // 100-nanosecond units, "dt << 2*FRAC_BITS" must not overflow
+
+/*
+ * @return frames elapsed since c.base_time, FRAC_BITS fixed point
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+INT64 elapsed(_In_ const frame_clock &c, _In_ UINT64 time)
+{
+        auto dt = static_cast<INT64>(time - c.base_time);
+        NT_ASSERT(dt > -MAX_ELAPSED && dt < MAX_ELAPSED);
+
+        auto frames = static_cast<INT64>((UINT64(dt < 0 ? -dt : dt) << 2*frame_clock::FRAC_BITS)/c.period);
+        return dt < 0 ? -frames : frames;
+}
+
+/*
+ * @return extended frame number at the time, FRAC_BITS fixed point
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+UINT64 predict(_Inout_ frame_clock &c, _In_ UINT64 time)
+{
+        while (static_cast<INT64>(time - c.base_time) >= MAX_ELAPSED) { // the clock was not read for a long time
+                auto t = c.base_time + MAX_ELAPSED/2;
+                c.base_frame += elapsed(c, t);
+                c.base_time = t;
+        }
+
+        if (static_cast<INT64>(time - c.base_time) <= -MAX_ELAPSED) { // stale sample
+                time = c.base_time;
+        }
+
+        return c.base_frame + elapsed(c, time);
+}
+
+/*
+ * Steps the clock forward to the nearest frame number that is congruent to the server's one.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void sync(_Inout_ frame_clock &c, _In_ UINT64 time, _In_ ULONG raw)
+{
+        auto m = c.modulus >> c.shift;
+
+        auto cur = predict(c, time) >> frame_clock::FRAC_BITS;
+        auto frame = (cur & ~(m - 1)) | ((raw & (c.modulus - 1)) >> c.shift);
+
+        if (frame < cur) {
+                frame += m;
+        }
+
+        c.base_time = time;
+        c.base_frame = (frame << frame_clock::FRAC_BITS) | ONE/2; // the sample is in the middle of the frame
+        c.period = NOMINAL;
+
+        c.state = TRACKING;
+        c.samples = 0;
+}
+
+/*
+ * @return true if the rollover of the server's frame numbers was underestimated
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto grow_modulus(_Inout_ frame_clock &c, _In_ ULONG raw)
+{
+        bool grown{};
+
+        for ( ; raw >= c.modulus; c.modulus <<= 1) {
+                grown = true;
+        }
+
+        return grown;
+}
+
+/*
+ * Two samples tell whether the server counts frames or microframes.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void calibrate(_Inout_ frame_clock &c, _In_ UINT64 time, _In_ ULONG raw)
+{
+        auto dt = static_cast<INT64>(time - c.sample_time);
+        if (dt < CALIBRATION_MIN) {
+                return;
+        }
+
+        int shift = -1;
+
+        if (dt <= CALIBRATION_MAX && raw >= c.raw_frame) { // has not rolled over in between
+                auto ms = dt/frame_clock::NOMINAL_PERIOD;
+                INT64 diff = raw - c.raw_frame;
+
+                if (diff >= ms/2 && diff <= 3*ms/2) {
+                        shift = 0;
+                } else if (diff >= 6*ms && diff <= 10*ms) {
+                        shift = 3;
+                }
+        }
+
+        if (shift < 0) { // start over
+                c.sample_time = time;
+                c.raw_frame = raw;
+                return;
+        }
+
+        c.shift = static_cast<UCHAR>(shift);
+        c.modulus = UINT64(frame_clock::MIN_MODULUS) << shift;
+
+        grow_modulus(c, raw);
+        sync(c, time, raw);
+}
+
+/*
+ * Phase-locked loop of the second order.
+ * A negative phase error moves base_frame backward, current_frame does not return such frames.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void track(_Inout_ frame_clock &c, _In_ UINT64 time, _In_ ULONG raw)
+{
+        if (grow_modulus(c, raw)) {
+                sync(c, time, raw);
+                return;
+        }
+
+        auto m = c.modulus >> c.shift;
+        auto pred = predict(c, time);
+
+        auto diff = static_cast<INT64>(((raw >> c.shift) - (pred >> frame_clock::FRAC_BITS)) & (m - 1));
+        if (diff >= INT64(m/2)) {
+                diff -= m;
+        }
+
+        auto err = diff*INT64(ONE) + INT64(ONE/2) - INT64(pred & (ONE - 1)); // positive if the server is ahead
+        if ((err < 0 ? -err : err) > INT64(STEP_THRESHOLD*ONE)) {
+                sync(c, time, raw);
+                return;
+        }
+
+        c.base_time = time;
+        c.base_frame = pred + err/PHASE_GAIN;
+
+        auto period = INT64(c.period) - INT64(c.period)*err/INT64(ONE << FREQ_GAIN); // server's frame is shorter if it is ahead
+        c.period = max(NOMINAL - MAX_PERIOD_DELTA, min(UINT64(period), NOMINAL + MAX_PERIOD_DELTA));
+
+        if (c.samples < LOCK_SAMPLES) {
+                ++c.samples;
+        }
+}
+
+} // namespace
+
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::init(_Out_ frame_clock &c, _In_ UINT64 now)
+{
+        c = {
+                .base_time = now,
+                .base_frame = 0,
+                .period = NOMINAL,
+                .last_frame = 0,
+
+                .sample_time = 0,
+                .modulus = frame_clock::MIN_MODULUS,
+                .raw_frame = 0,
+
+                .shift = 0,
+                .state = UNSYNCED,
+                .samples = 0,
+        };
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+UINT64 usbip::current_frame(_Inout_ frame_clock &c, _In_ UINT64 now)
+{
+        if (auto frame = predict(c, now) >> frame_clock::FRAC_BITS; frame > c.last_frame) {
+                c.last_frame = frame;
+        }
+
+        return c.last_frame; // frame numbers never go backward, class drivers do not expect that
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+bool usbip::is_locked(_In_ const frame_clock &c)
+{
+        return c.state == TRACKING && c.samples >= LOCK_SAMPLES;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::add_sample(_Inout_ frame_clock &c, _In_ UINT64 time, _In_ ULONG start_frame)
+{
+        switch (c.state) {
+        case UNSYNCED:
+                c.sample_time = time;
+                c.raw_frame = start_frame;
+                c.state = CALIBRATING;
+                break;
+        case CALIBRATING:
+                calibrate(c, time, start_frame);
+                break;
+        default:
+                track(c, time, start_frame);
+        }
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+ULONG usbip::to_local_frame(_Inout_ frame_clock &c, _In_ UINT64 now, _In_ ULONG start_frame)
+{
+        auto cur = current_frame(c, now);
+        if (!is_locked(c)) { // start_frame is in the server's numbering
+                return static_cast<ULONG>(cur);
+        }
+
+        auto m = c.modulus >> c.shift;
+
+        auto diff = static_cast<INT64>((((start_frame & (c.modulus - 1)) >> c.shift) - cur) & (m - 1));
+        if (diff >= INT64(m/2)) {
+                diff -= m;
+        }
+
+        return static_cast<ULONG>(cur + diff);
+}
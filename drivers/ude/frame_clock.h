@@ -0,0 +1,103 @@
+/*
+ * Copyright (C) 2024 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include <wdm.h>
+
+namespace usbip
+{
+
+/*
+ * Synthesized USB bus frame clock of a remote device, time is KeQueryInterruptTime.
+ *
+ * The server reports start_frame of isoch transfers in RET_SUBMIT. Its units are frames or microframes
+ * (depends on its HCD), its frame numbers roll over at some power of two, both are learned from samples.
+ * Local frame numbers are extended (never roll over) and are congruent to the server's ones modulo its
+ * rollover, so explicit StartFrame of URB_FUNCTION_ISOCH_TRANSFER can be translated to the server's frame.
+ *
+ * The clock is disciplined by a phase-locked loop: every sample corrects a fraction of the phase error
+ * and slightly adjusts the period of a frame, so the clock keeps the server's rate between samples.
+ * Large errors (server restarted, rollover was mislearned) step the clock.
+ *
+ * The clock does not lock and does not read the time itself, the caller must serialize access.
+ */
+struct frame_clock
+{
+        enum {
+                FRAC_BITS = 16, // fixed point
+                NOMINAL_PERIOD = 10'000, // of a frame, 1 ms in 100-nanosecond units
+                MIN_MODULUS = 1024, // frames, EHCI periodic schedule size
+        };
+
+        UINT64 base_time; // 100-nanosecond units
+        UINT64 base_frame; // extended frame number at base_time, FRAC_BITS fixed point
+        UINT64 period; // of a frame in 100-nanosecond units, FRAC_BITS fixed point
+        UINT64 last_frame; // returned by current_frame, extended frame number
+
+        UINT64 sample_time; // of the first sample of calibration
+        UINT64 modulus; // rollover of the server's frame numbers, in its units, power of two
+        ULONG raw_frame; // the first sample of calibration, in the server's units
+
+        UCHAR shift; // log2 of the server's frame number units per frame: 0 - frames, 3 - microframes
+        UCHAR state;
+        USHORT samples; // accepted since the last step
+};
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void init(_Out_ frame_clock &c, _In_ UINT64 now);
+
+/*
+ * The clock runs at the nominal rate until it is locked.
+ * Frame numbers never go backward, the result is clamped to the last returned one.
+ * @return extended frame number
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+UINT64 current_frame(_Inout_ frame_clock &c, _In_ UINT64 now);
+
+/*
+ * @param time when the transfer began
+ * @param start_frame of the transfer as the server reported it
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void add_sample(_Inout_ frame_clock &c, _In_ UINT64 time, _In_ ULONG start_frame);
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+bool is_locked(_In_ const frame_clock &c);
+
+/*
+ * @return number of frames after which the server's frame numbers roll over, zero if the clock is not locked
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+inline UINT64 frames_modulus(_In_ const frame_clock &c)
+{
+        return is_locked(c) ? c.modulus >> c.shift : 0;
+}
+
+/*
+ * @param frame local frame number, the clock must be locked
+ * @return frame number in the server's units
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+inline ULONG to_server_frame(_In_ const frame_clock &c, _In_ ULONG frame)
+{
+        NT_ASSERT(is_locked(c));
+        return static_cast<ULONG>((UINT64(frame) << c.shift) & (c.modulus - 1));
+}
+
+/*
+ * @param start_frame in the server's units
+ * @return local frame number that is the nearest to the current one, the current one if the clock is not locked
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+ULONG to_local_frame(_Inout_ frame_clock &c, _In_ UINT64 now, _In_ ULONG start_frame);
+
+} // namespace usbip
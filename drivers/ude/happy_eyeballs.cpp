@@ -0,0 +1,254 @@
+/*
+ * Copyright (C) 2024 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "happy_eyeballs.h"
+#include "trace.h"
+#include "happy_eyeballs.tmh"
+
+#include "happy_eyeballs_policy.h"
+#include "network.h"
+
+#include <libdrv\dbgcommon.h>
+#include <libdrv\wait_timeout.h>
+
+namespace
+{
+
+using namespace usbip;
+using namespace usbip::happy_eyeballs;
+
+enum {
+        MAX_ADDRESSES = 16, // are tried
+        MAX_ATTEMPTS = 8, // concurrent
+        CONNECTION_ATTEMPT_DELAY = 250, // milliseconds, recommended by RFC 8305
+};
+
+struct attempt
+{
+        SOCKET *sock;
+        IRP *irp;
+        KEVENT completed; // is set by the completion routine, the last access to attempt
+        const ADDRINFOEXW *ai;
+};
+
+struct race
+{
+        const ADDRINFOEXW *addrs[MAX_ADDRESSES];
+        schedule sched; // of addrs
+
+        attempt attempts[MAX_ATTEMPTS]; // attempt is pending if irp is not NULL
+};
+
+_Function_class_(IO_COMPLETION_ROUTINE)
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS attempt_complete(_In_ DEVICE_OBJECT*, _In_ IRP*, _In_reads_opt_(_Inexpressible_("varies")) void *context)
+{
+        KeSetEvent(static_cast<KEVENT*>(context), IO_NO_INCREMENT, false);
+        return StopCompletion;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void log(_In_ const ADDRINFOEXW &ai)
+{
+        PAGED_CODE();
+
+        if (auto &sa = *reinterpret_cast<SOCKADDR_INET*>(ai.ai_addr); sa.si_family == AF_INET) {
+                auto &v4 = sa.Ipv4;
+                TraceDbg("%!IPADDR!", v4.sin_addr.s_addr);
+        } else {
+                auto &v6 = sa.Ipv6;
+                TraceDbg("%!BIN!", WppBinary(&v6.sin6_addr, sizeof(v6.sin6_addr)));
+        }
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void release(_Inout_ attempt &a)
+{
+        PAGED_CODE();
+
+        if (a.sock) {
+                close_socket(a.sock);
+                free(a.sock);
+        }
+
+        if (auto &irp = a.irp) {
+                IoFreeIrp(irp);
+                irp = nullptr;
+        }
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS start(_Inout_ attempt &a, _In_ const ADDRINFOEXW &ai)
+{
+        PAGED_CODE();
+        NT_ASSERT(!(a.sock || a.irp));
+
+        log(ai);
+        a.ai = &ai;
+
+        if (auto err = create_socket(a.sock, ai)) {
+                release(a);
+                return err;
+        }
+
+        a.irp = IoAllocateIrp(1, false);
+        if (!a.irp) {
+                release(a);
+                return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        KeInitializeEvent(&a.completed, NotificationEvent, false);
+        IoSetCompletionRoutine(a.irp, attempt_complete, &a.completed, true, true, true);
+
+        auto st = connect(a.sock, ai.ai_addr, a.irp); // completion handler will be called anyway
+        TraceDbg("%!STATUS!", st);
+
+        return STATUS_SUCCESS;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto start_next(_Inout_ race &r)
+{
+        PAGED_CODE();
+
+        for (auto &a: r.attempts) {
+                if (!a.irp) {
+                        return start(a, *r.addrs[next_address(r.sched)]);
+                }
+        }
+
+        NT_ASSERT(!"free attempt not found");
+        return STATUS_INTERNAL_ERROR;
+}
+
+/*
+ * @return index of completed attempt, ARRAYSIZE(r.attempts) if cancelled, negative if timed out
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED int wait(_In_ race &r, _In_opt_ KEVENT *cancel, _In_ ULONGLONG deadline)
+{
+        PAGED_CODE();
+
+        void *objects[MAX_ATTEMPTS + 1];
+        int index[ARRAYSIZE(objects)];
+        ULONG cnt = 0;
+
+        for (int i = 0; i < ARRAYSIZE(r.attempts); ++i) {
+                if (auto &a = r.attempts[i]; a.irp) {
+                        index[cnt] = i;
+                        objects[cnt++] = &a.completed;
+                }
+        }
+
+        if (cancel) {
+                index[cnt] = ARRAYSIZE(r.attempts);
+                objects[cnt++] = cancel;
+        }
+
+        KWAIT_BLOCK blocks[ARRAYSIZE(objects)];
+        auto now = KeQueryInterruptTime();
+
+        auto timeout = make_timeout(deadline > now ? deadline - now : 0, wdm::period::relative);
+        bool infinite = deadline == MAXULONGLONG;
+
+        auto st = KeWaitForMultipleObjects(cnt, objects, WaitAny, Executive, KernelMode, false,
+                                           infinite ? nullptr : &timeout, blocks);
+
+        if (st == STATUS_TIMEOUT) {
+                return -1;
+        } else if (st >= STATUS_WAIT_0 && st < STATUS_WAIT_0 + cnt) {
+                return index[st - STATUS_WAIT_0];
+        }
+
+        Trace(TRACE_LEVEL_ERROR, "KeWaitForMultipleObjects %!STATUS!", st);
+        return ARRAYSIZE(r.attempts);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void cancel_pending(_Inout_ race &r)
+{
+        PAGED_CODE();
+
+        for (auto &a: r.attempts) {
+                if (a.irp) {
+                        IoCancelIrp(a.irp);
+                        NT_VERIFY(!KeWaitForSingleObject(&a.completed, Executive, KernelMode, false, nullptr));
+                        release(a);
+                }
+        }
+
+        r.sched.pending = 0;
+}
+
+} // namespace
+
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS usbip::happy_eyeballs_connect(
+        _Out_ SOCKET* &sock, _In_ const ADDRINFOEXW &head, _In_opt_ KEVENT *cancel, _In_ ULONGLONG deadline)
+{
+        PAGED_CODE();
+        sock = nullptr;
+
+        race r{};
+        auto &s = r.sched;
+
+        s.addr_cnt = interleave(r.addrs, head);
+        s.max_pending = ARRAYSIZE(r.attempts);
+
+        NTSTATUS st = STATUS_HOST_UNREACHABLE; // of the last failed attempt
+
+        while (true) {
+                if (auto now = KeQueryInterruptTime(); can_start(s, now)) {
+                        if (auto err = start_next(r)) {
+                                st = err;
+                                continue; // start the next one immediately
+                        }
+                        on_started(s, now, ULONGLONG(CONNECTION_ATTEMPT_DELAY)*wdm::msec);
+                }
+
+                if (!s.pending) {
+                        break; // all attempts have failed
+                }
+
+                auto i = wait(r, cancel, get_wakeup(s, deadline));
+
+                if (i == ARRAYSIZE(r.attempts)) {
+                        st = STATUS_CANCELLED;
+                        break;
+                } else if (i < 0) {
+                        if (KeQueryInterruptTime() >= deadline) {
+                                st = STATUS_IO_TIMEOUT;
+                                break;
+                        }
+                        continue; // time to start the next attempt
+                }
+
+                auto &a = r.attempts[i];
+
+                st = a.irp->IoStatus.Status;
+                on_completed(s, NT_SUCCESS(st));
+
+                if (NT_SUCCESS(st)) {
+                        sock = a.sock;
+                        a.sock = nullptr; // the winner
+                        release(a);
+                        break;
+                }
+
+                TraceDbg("attempt #%d %!STATUS!", i, st);
+                release(a);
+        }
+
+        cancel_pending(r);
+        return st;
+}
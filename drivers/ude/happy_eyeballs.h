@@ -0,0 +1,30 @@
+/*
+ * Copyright (C) 2024 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include <libdrv\codeseg.h>
+#include <libdrv\wsk_cpp.h>
+
+namespace usbip
+{
+
+/*
+ * RFC 8305, Happy Eyeballs Version 2: Better Connectivity Using Concurrency.
+ *
+ * Addresses are interleaved by family starting with the family of the first address.
+ * Next connection attempt is started after CONNECTION_ATTEMPT_DELAY or immediately if the previous one has failed,
+ * pending attempts are not cancelled. The first established connection wins, others are closed.
+ * So a dead address of one family does not cost a full TCP timeout before the other family is tried.
+ *
+ * @param cancel if signaled, all pending attempts are cancelled and STATUS_CANCELLED is returned
+ * @param deadline @see KeQueryInterruptTime, MAXULONGLONG if there is no deadline
+ * @param sock connected socket with options set, see create_socket
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS happy_eyeballs_connect(
+        _Out_ wsk::SOCKET* &sock, _In_ const ADDRINFOEXW &head, _In_opt_ KEVENT *cancel, _In_ ULONGLONG deadline);
+
+} // namespace usbip
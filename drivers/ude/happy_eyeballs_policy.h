@@ -0,0 +1,121 @@
+/*
+ * Copyright (C) 2024 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include <wdm.h>
+
+/*
+ * Ordering and scheduling of connection attempts, see happy_eyeballs.h.
+ */
+namespace usbip::happy_eyeballs
+{
+
+/*
+ * RFC 8305, 4. Sorting Addresses.
+ * Addresses are interleaved by family starting with the family of the first address,
+ * the order of addresses of the same family is preserved.
+ *
+ * @param T ADDRINFOEXW or any type with ai_family and ai_next
+ * @return number of addresses
+ */
+template<typename T, size_t N>
+inline ULONG interleave(_Out_ const T* (&addrs)[N], _In_ const T &head)
+{
+        const T *first[N];
+        const T *second[N];
+
+        ULONG first_cnt = 0;
+        ULONG second_cnt = 0;
+
+        for (auto ai = &head; ai; ai = ai->ai_next) {
+                if (ai->ai_family == head.ai_family) {
+                        if (first_cnt < N) {
+                                first[first_cnt++] = ai;
+                        }
+                } else if (second_cnt < N) {
+                        second[second_cnt++] = ai;
+                }
+        }
+
+        ULONG cnt = 0;
+
+        for (ULONG i = 0; i < max(first_cnt, second_cnt); ++i) {
+                if (i < first_cnt && cnt < N) {
+                        addrs[cnt++] = first[i];
+                }
+                if (i < second_cnt && cnt < N) {
+                        addrs[cnt++] = second[i];
+                }
+        }
+
+        return cnt;
+}
+
+/*
+ * The time is in the units of the clock, see KeQueryInterruptTime.
+ */
+struct schedule
+{
+        ULONG addr_cnt; // to try
+        ULONG next; // index of the address of the next attempt
+        ULONG pending; // attempts
+        ULONG max_pending;
+        ULONGLONG next_time; // of the next attempt
+};
+
+/*
+ * @return true if the next attempt can be started
+ */
+constexpr auto can_start(_In_ const schedule &s)
+{
+        return s.next < s.addr_cnt && s.pending < s.max_pending;
+}
+
+constexpr auto can_start(_In_ const schedule &s, _In_ ULONGLONG now)
+{
+        return can_start(s) && now >= s.next_time;
+}
+
+/*
+ * @return index of the address of the next attempt
+ */
+inline auto next_address(_Inout_ schedule &s)
+{
+        NT_ASSERT(can_start(s));
+        return s.next++;
+}
+
+/*
+ * @param delay CONNECTION_ATTEMPT_DELAY
+ */
+inline void on_started(_Inout_ schedule &s, _In_ ULONGLONG now, _In_ ULONGLONG delay)
+{
+        ++s.pending;
+        s.next_time = now + delay;
+}
+
+/*
+ * RFC 8305, 5. The next attempt is started immediately if the previous one has failed.
+ */
+inline void on_completed(_Inout_ schedule &s, _In_ bool success)
+{
+        NT_ASSERT(s.pending);
+        --s.pending;
+
+        if (!success) {
+                s.next_time = 0;
+        }
+}
+
+/*
+ * @param deadline of the whole race, MAXULONGLONG if there is no deadline
+ * @return when to stop waiting for pending attempts
+ */
+constexpr auto get_wakeup(_In_ const schedule &s, _In_ ULONGLONG deadline)
+{
+        return can_start(s) ? min(s.next_time, deadline) : deadline;
+}
+
+} // namespace usbip::happy_eyeballs
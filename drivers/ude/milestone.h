@@ -0,0 +1,33 @@
+/*
+ * Copyright (C) 2024 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include <wdm.h>
+
+namespace usbip
+{
+
+/*
+ * @param start when PLUGIN_HARDWARE is received, see KeQueryInterruptTime
+ * @param now see KeQueryInterruptTime
+ * @return microseconds for vhci::attach_timings, not zero because it means that the milestone is not reached
+ */
+constexpr UINT32 get_milestone(_In_ ULONGLONG start, _In_ ULONGLONG now)
+{
+        auto usec = (now - start)/10; // 100-nanosecond units
+        return static_cast<UINT32>(min(max(usec, 1ULL), ULONGLONG(MAXUINT32)));
+}
+
+/*
+ * @param milestone member of vhci::attach_timings, is set once
+ */
+inline void set_milestone(_Inout_ UINT32 &milestone, _In_ ULONGLONG start, _In_ ULONGLONG now)
+{
+        if (!milestone) {
+                milestone = get_milestone(start, now);
+        }
+}
+
+} // namespace usbip
@@ -0,0 +1,786 @@
+/*
+ * Copyright (C) 2024 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "mux.h"
+#include "trace.h"
+#include "mux.tmh"
+
+#include "context.h"
+#include "device.h"
+#include "network.h"
+#include "persistent.h"
+#include "wsk_receive.h"
+
+#include <usbip\proto_op.h>
+
+#include <libdrv\pdu.h>
+#include <libdrv\strconv.h>
+#include <libdrv\wait_timeout.h>
+
+#include <libusbip/src/op_common.h>
+
+namespace
+{
+
+using namespace usbip;
+
+/*
+ * USBIP_CMD_IMPORT that waits for USBIP_RET_IMPORT, lives on the stack of import_device.
+ */
+struct import_waiter
+{
+        LIST_ENTRY entry; // head is mux_session::imports, self-linked if removed
+        seqnum_t seqnum;
+
+        KEVENT completed;
+        NTSTATUS status;
+        UINT32 devid;
+        op_import_reply *reply;
+};
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto is_mux_enabled()
+{
+        PAGED_CODE();
+
+        Registry key;
+        if (auto err = open_parameters_key(key, KEY_QUERY_VALUE)) {
+                return false;
+        }
+
+        UNICODE_STRING name;
+        RtlUnicodeStringInit(&name, L"MultiplexConnections");
+
+        ULONG val{};
+        if (auto err = WdfRegistryQueryULong(key.get(), &name, &val)) {
+                if (err != STATUS_OBJECT_NAME_NOT_FOUND) {
+                        Trace(TRACE_LEVEL_ERROR, "WdfRegistryQueryULong('%!USTR!') %!STATUS!", &name, err);
+                }
+                return false;
+        }
+
+        return val != 0;
+}
+
+/*
+ * @return non-zero hash of host and service, a collision only disables the extension for a server
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto get_hash(_In_ const device_ctx_ext &ext)
+{
+        PAGED_CODE();
+
+        ULONG node{};
+        ULONG service{};
+
+        NT_VERIFY(NT_SUCCESS(RtlHashUnicodeString(&ext.node_name, true, HASH_STRING_ALGORITHM_DEFAULT, &node)));
+        NT_VERIFY(NT_SUCCESS(RtlHashUnicodeString(&ext.service_name, true, HASH_STRING_ALGORITHM_DEFAULT, &service)));
+
+        return (31*node + service) | 1;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void set_unsupported(_Inout_ vhci_ctx &v, _In_ const device_ctx_ext &ext)
+{
+        PAGED_CODE();
+        auto hash = get_hash(ext);
+
+        wdf::WaitLock lck(v.sessions_lock);
+
+        auto &next = v.features_unsupported_next;
+        v.features_unsupported[next] = hash;
+
+        next = (next + 1) % ARRAYSIZE(v.features_unsupported);
+}
+
+constexpr auto make_unicode_string(_In_ const wchar_t *buf, _In_ USHORT len)
+{
+        return UNICODE_STRING{ .Length = len, .MaximumLength = len, .Buffer = const_cast<wchar_t*>(buf) };
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto matches(_In_ const mux_session &s, _In_ const device_ctx_ext &ext)
+{
+        PAGED_CODE();
+
+        auto node = make_unicode_string(s.node, s.node_len);
+        auto service = make_unicode_string(s.service, s.service_len);
+
+        return  RtlEqualUnicodeString(&node, &ext.node_name, true) &&
+                RtlEqualUnicodeString(&service, &ext.service_name, true);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto set_names(_Inout_ mux_session &s, _In_ const device_ctx_ext &ext)
+{
+        PAGED_CODE();
+
+        struct {
+                wchar_t *dst;
+                USHORT maxlen; // bytes
+                USHORT &len;
+                const UNICODE_STRING &src;
+        } const v[] = {
+                { s.node, sizeof(s.node), s.node_len, ext.node_name },
+                { s.service, sizeof(s.service), s.service_len, ext.service_name },
+        };
+
+        for (auto &[dst, maxlen, len, src]: v) {
+                if (src.Length > maxlen) {
+                        return STATUS_NAME_TOO_LONG;
+                }
+                RtlCopyMemory(dst, src.Buffer, len = src.Length);
+        }
+
+        return STATUS_SUCCESS;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto attach(_Inout_ mux_session &s, _Inout_ device_ctx_ext &ext)
+{
+        {
+                wdf::Lock lck(s.lock);
+                if (s.closed) {
+                        return false;
+                }
+                ++s.attached;
+        }
+
+        WdfObjectReference(get_handle(&s)); // see free(device_ctx_ext*)
+        ext.session = &s;
+        ext.mux_attached = true;
+        ext.features = s.features;
+
+        return true;
+}
+
+/*
+ * The counter is shared with URBs of the devices, see next_seqnum(device_ctx&).
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto next_seqnum(_Inout_ mux_session &s)
+{
+        return usbip::next_seqnum(s.seqnum, false); // USBIP_DIR_OUT
+}
+
+_Function_class_(IO_COMPLETION_ROUTINE)
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS send_complete(_In_ DEVICE_OBJECT*, _In_ IRP*, _In_reads_opt_(_Inexpressible_("varies")) void *context)
+{
+        KeSetEvent(static_cast<KEVENT*>(context), IO_NO_INCREMENT, false);
+        return StopCompletion;
+}
+
+/*
+ * URBs of other devices are sent concurrently, WskSend must be called under mux_session::send_lock.
+ * @param data must be big-endian
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS send_locked(_Inout_ mux_session &s, _In_ void *data, _In_ ULONG len)
+{
+        PAGED_CODE();
+
+        Mdl mdl(data, len);
+        if (auto err = mdl.prepare_paged(IoReadAccess)) {
+                return err;
+        }
+
+        auto irp = IoAllocateIrp(1, false);
+        if (!irp) {
+                Trace(TRACE_LEVEL_ERROR, "IoAllocateIrp -> NULL");
+                return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        KEVENT completed;
+        KeInitializeEvent(&completed, NotificationEvent, false);
+        IoSetCompletionRoutine(irp, send_complete, &completed, true, true, true);
+
+        WSK_BUF buf{ .Mdl = mdl.get(), .Length = len };
+        NTSTATUS st;
+        {
+                wdf::Lock lck(s.send_lock);
+                st = send(s.sock, &buf, WSK_FLAG_NODELAY, irp);
+        }
+
+        if (st != STATUS_NOT_SUPPORTED) { // the socket is closed, WSK was not called and IRP will not be completed
+                NT_VERIFY(!KeWaitForSingleObject(&completed, Executive, KernelMode, false, nullptr));
+                st = irp->IoStatus.Status;
+        }
+
+        IoFreeIrp(irp);
+        return st;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto send_cmd_import(_Inout_ mux_session &s, _In_ seqnum_t seqnum, _In_ const UNICODE_STRING &busid)
+{
+        PAGED_CODE();
+
+        struct {
+                usbip_header hdr{};
+                op_import_request body{};
+        } req;
+
+        static_assert(sizeof(req) == sizeof(req.hdr) + sizeof(req.body)); // packed
+
+        if (auto &dst = req.body.busid; auto err = libdrv::unicode_to_utf8(dst, sizeof(dst), busid)) {
+                Trace(TRACE_LEVEL_ERROR, "unicode_to_utf8('%!USTR!') %!STATUS!", &busid, err);
+                return err;
+        }
+
+        req.hdr.base.command = USBIP_CMD_IMPORT;
+        req.hdr.base.seqnum = seqnum;
+        req.hdr.u.cmd_import.length = sizeof(req.body);
+
+        byteswap_header(req.hdr, swap_dir::host2net);
+        PACK_OP_IMPORT_REQUEST(false, &req.body);
+
+        return send_locked(s, &req, sizeof(req));
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto send_cmd_release(_Inout_ mux_session &s, _In_ UINT32 devid)
+{
+        PAGED_CODE();
+
+        usbip_header hdr{};
+        hdr.base.command = USBIP_CMD_RELEASE;
+        hdr.base.seqnum = next_seqnum(s);
+        hdr.base.devid = devid;
+
+        byteswap_header(hdr, swap_dir::host2net);
+        return send_locked(s, &hdr, sizeof(hdr));
+}
+
+/*
+ * @return false if the waiter was already removed by ret_import or session_lost
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto remove_waiter(_Inout_ mux_session &s, _Inout_ import_waiter &w)
+{
+        wdf::Lock lck(s.lock);
+
+        if (IsListEmpty(&w.entry)) {
+                return false;
+        }
+
+        RemoveEntryList(&w.entry);
+        InitializeListHead(&w.entry);
+        return true;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void complete(_Inout_ import_waiter &w, _In_ NTSTATUS status)
+{
+        RemoveEntryList(&w.entry);
+        InitializeListHead(&w.entry);
+
+        w.status = status;
+        KeSetEvent(&w.completed, IO_NO_INCREMENT, false);
+}
+
+/*
+ * @return true if the device was registered by add_device
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto remove_device(_Inout_ mux_session &s, _In_ const device_ctx *dev)
+{
+        wdf::Lock lck(s.lock);
+
+        for (auto &d: s.devices) {
+                if (d && d == dev) {
+                        d = nullptr;
+                        return true;
+                }
+        }
+
+        return false;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void recv_thread_join(_Inout_ mux_session &s)
+{
+        PAGED_CODE();
+
+        auto thread = (_KTHREAD*)InterlockedExchangePointer(reinterpret_cast<PVOID*>(&s.recv_thread), nullptr);
+        if (!thread) {
+                return;
+        }
+
+        NT_ASSERT(thread != KeGetCurrentThread());
+
+        TraceDbg("session %04x", ptr04x(get_handle(&s)));
+        NT_VERIFY(!KeWaitForSingleObject(thread, Executive, KernelMode, false, nullptr));
+        TraceDbg("session %04x, joined", ptr04x(get_handle(&s)));
+
+        ObDereferenceObject(thread);
+}
+
+_Function_class_(EVT_WDF_OBJECT_CONTEXT_CLEANUP)
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void session_cleanup(_In_ WDFOBJECT object)
+{
+        PAGED_CODE();
+
+        auto &s = *get_mux_session(object);
+        TraceDbg("session %04x", ptr04x(object));
+
+        NT_ASSERT(!s.attached);
+
+        if (close_socket(s.sock)) {
+                Trace(TRACE_LEVEL_INFORMATION, "session %04x, connection closed", ptr04x(object));
+        }
+
+        recv_thread_join(s);
+}
+
+/*
+ * The socket can be used by devices till their device_ctx_ext-s release references.
+ */
+_Function_class_(EVT_WDF_OBJECT_CONTEXT_DESTROY)
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void session_destroy(_In_ WDFOBJECT object)
+{
+        PAGED_CODE();
+
+        auto &s = *get_mux_session(object);
+        TraceDbg("session %04x", ptr04x(object));
+
+        free(s.sock);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto recv_thread_start(_Inout_ mux_session &s)
+{
+        PAGED_CODE();
+        const auto access = THREAD_ALL_ACCESS;
+
+        HANDLE handle{};
+        if (auto err = PsCreateSystemThread(&handle, access, nullptr, nullptr, nullptr, mux_recv_thread_function, &s)) {
+                Trace(TRACE_LEVEL_ERROR, "PsCreateSystemThread %!STATUS!", err);
+                return err;
+        }
+
+        NT_VERIFY(NT_SUCCESS(ObReferenceObjectByHandle(handle, access, *PsThreadType, KernelMode,
+                                                       reinterpret_cast<PVOID*>(&s.recv_thread), nullptr)));
+
+        NT_VERIFY(NT_SUCCESS(ZwClose(handle)));
+        return STATUS_SUCCESS;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto init_session(_Inout_ mux_session &s, _In_ WDFDEVICE vhci, _In_ const device_ctx_ext &ext)
+{
+        PAGED_CODE();
+
+        s.vhci = vhci;
+        InitializeListHead(&s.entry);
+        InitializeListHead(&s.imports);
+
+        if (auto err = set_names(s, ext)) {
+                return err;
+        }
+
+        WDF_OBJECT_ATTRIBUTES attr;
+        WDF_OBJECT_ATTRIBUTES_INIT(&attr);
+        attr.ParentObject = get_handle(&s);
+
+        WDFSPINLOCK *v[] = { &s.send_lock, &s.lock };
+
+        for (auto lck: v) {
+                if (auto err = WdfSpinLockCreate(&attr, lck)) {
+                        Trace(TRACE_LEVEL_ERROR, "WdfSpinLockCreate %!STATUS!", err);
+                        return err;
+                }
+        }
+
+        return STATUS_SUCCESS;
+}
+
+/*
+ * @param ext.sock is moved into the session
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto new_session(_In_ WDFDEVICE vhci, _Inout_ device_ctx_ext &ext)
+{
+        PAGED_CODE();
+
+        WDF_OBJECT_ATTRIBUTES attr;
+        WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&attr, mux_session);
+        attr.EvtCleanupCallback = session_cleanup;
+        attr.EvtDestroyCallback = session_destroy;
+        attr.ExecutionLevel = WdfExecutionLevelPassive;
+        attr.ParentObject = vhci;
+
+        WDFOBJECT obj{};
+        if (auto err = WdfObjectCreate(&attr, &obj)) {
+                Trace(TRACE_LEVEL_ERROR, "WdfObjectCreate %!STATUS!", err);
+                return err;
+        }
+
+        auto &s = *get_mux_session(obj);
+
+        if (auto err = init_session(s, vhci, ext)) {
+                WdfObjectDelete(obj);
+                return err;
+        }
+
+        s.sock = ext.sock;
+        ext.sock = nullptr;
+        s.features = ext.features;
+
+        if (auto err = recv_thread_start(s)) {
+                WdfObjectDelete(obj); // closes the socket
+                return err;
+        }
+
+        NT_VERIFY(attach(s, ext));
+
+        {
+                auto &v = *get_vhci_ctx(vhci);
+                wdf::WaitLock lck(v.sessions_lock);
+                InsertTailList(&v.sessions, &s.entry);
+        }
+
+        Trace(TRACE_LEVEL_INFORMATION, "session %04x, %!USTR!:%!USTR!",
+                                        ptr04x(obj), &ext.node_name, &ext.service_name);
+        return STATUS_SUCCESS;
+}
+
+} // namespace
+
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED UINT32 usbip::get_requested_features(_In_ WDFDEVICE vhci, _In_ const device_ctx_ext &ext)
+{
+        PAGED_CODE();
+
+        UINT32 features = is_mux_enabled() ? USBIP_FEATURE_MUX : 0;
+
+        if (ext.compress_threshold) {
+                features |= USBIP_FEATURE_COMPRESS;
+        }
+
+        if (!features) {
+                return 0;
+        }
+
+        auto hash = get_hash(ext);
+        auto &v = *get_vhci_ctx(vhci);
+
+        wdf::WaitLock lck(v.sessions_lock);
+
+        for (auto h: v.features_unsupported) {
+                if (h == hash) {
+                        return 0;
+                }
+        }
+
+        return features;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED bool usbip::join_session(_In_ WDFDEVICE vhci, _Inout_ device_ctx_ext &ext)
+{
+        PAGED_CODE();
+        NT_ASSERT(!ext.session);
+
+        auto &v = *get_vhci_ctx(vhci);
+        wdf::WaitLock lck(v.sessions_lock);
+
+        for (auto head = &v.sessions, entry = head->Flink; entry != head; entry = entry->Flink) {
+                auto &s = *CONTAINING_RECORD(entry, mux_session, entry);
+
+                if (matches(s, ext) && attach(s, ext)) {
+                        TraceDbg("session %04x, %!USTR!:%!USTR!",
+                                  ptr04x(get_handle(&s)), &ext.node_name, &ext.service_name);
+                        return true;
+                }
+        }
+
+        return false;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS usbip::negotiate_features(_In_ WDFDEVICE vhci, _Inout_ device_ctx_ext &ext, _In_ UINT32 features)
+{
+        PAGED_CODE();
+
+        auto requested = features;
+        auto st = request_features(ext.sock, features);
+
+        auto &v = *get_vhci_ctx(vhci);
+
+        if (st) { // the state of the connection is unknown
+                Trace(TRACE_LEVEL_INFORMATION, "%!USTR!:%!USTR! does not support OP_REQ_FEATURES, %!STATUS!",
+                                                &ext.node_name, &ext.service_name, st);
+                set_unsupported(v, ext);
+
+                close_socket(ext.sock);
+                free(ext.sock);
+                return st;
+        }
+
+        if (!features) {
+                Trace(TRACE_LEVEL_INFORMATION, "%!USTR!:%!USTR! rejected features %#x",
+                                                &ext.node_name, &ext.service_name, requested);
+                set_unsupported(v, ext);
+                return STATUS_NOT_SUPPORTED;
+        }
+
+        TraceDbg("%!USTR!:%!USTR!, features %#x of %#x", &ext.node_name, &ext.service_name, features, requested);
+        ext.features = features;
+
+        if (!(features & USBIP_FEATURE_MUX)) {
+                return STATUS_SUCCESS;
+        }
+
+        auto err = new_session(vhci, ext);
+        if (err) { // the connection is in USBIP_FEATURE_MUX mode and can't be used as usual
+                ext.features = 0;
+                close_socket(ext.sock);
+                free(ext.sock);
+        }
+
+        return err;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS usbip::import_device(_Inout_ device_ctx_ext &ext, _Out_ op_import_reply &reply)
+{
+        PAGED_CODE();
+
+        RtlZeroMemory(&reply, sizeof(reply));
+        auto &s = *ext.session;
+
+        import_waiter w{ .status = STATUS_PENDING, .reply = &reply };
+        KeInitializeEvent(&w.completed, NotificationEvent, false);
+
+        {
+                wdf::Lock lck(s.lock);
+                if (s.closed) {
+                        return STATUS_CONNECTION_DISCONNECTED;
+                }
+                w.seqnum = next_seqnum(s);
+                InsertTailList(&s.imports, &w.entry);
+        }
+
+        if (auto err = send_cmd_import(s, w.seqnum, ext.busid)) {
+                Trace(TRACE_LEVEL_ERROR, "Send USBIP_CMD_IMPORT %!STATUS!", err);
+                if (remove_waiter(s, w)) {
+                        return err;
+                }
+        }
+
+        auto timeout = make_timeout(30*wdm::second, wdm::period::relative);
+
+        if (KeWaitForSingleObject(&w.completed, Executive, KernelMode, false, &timeout) == STATUS_TIMEOUT &&
+            remove_waiter(s, w)) {
+                Trace(TRACE_LEVEL_ERROR, "USBIP_RET_IMPORT is not received, seqnum %u", w.seqnum);
+                return STATUS_IO_TIMEOUT;
+        }
+
+        if (auto err = w.status) {
+                return err;
+        }
+
+        if (auto err = verify_busid(reply, ext.busid)) {
+                return err;
+        }
+
+        auto &udev = reply.udev;
+
+        if (auto devid = make_devid(static_cast<UINT16>(udev.busnum), static_cast<UINT16>(udev.devnum));
+            devid != w.devid) {
+                Trace(TRACE_LEVEL_ERROR, "USBIP_RET_IMPORT devid %#x != %#x", w.devid, devid);
+                return USBIP_ERROR_PROTOCOL;
+        }
+
+        return STATUS_SUCCESS;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS usbip::add_device(_Inout_ device_ctx &dev)
+{
+        auto &ext = *dev.ext;
+        auto &s = *ext.session;
+
+        ExInitializeRundownProtection(&ext.mux_rundown);
+
+        wdf::Lock lck(s.lock);
+
+        if (s.closed) {
+                return STATUS_CONNECTION_DISCONNECTED;
+        }
+
+        for (auto &d: s.devices) {
+                if (!d) {
+                        d = &dev;
+                        return STATUS_SUCCESS;
+                }
+        }
+
+        return STATUS_INSUFFICIENT_RESOURCES;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED bool usbip::leave_session(_Inout_ device_ctx_ext &ext)
+{
+        PAGED_CODE();
+
+        auto s = ext.session;
+        if (!(s && ext.mux_attached)) {
+                return false;
+        }
+        ext.mux_attached = false;
+
+        if (remove_device(*s, ext.ctx)) {
+                ExWaitForRundownProtectionRelease(&ext.mux_rundown); // the receive thread uses device_ctx
+        }
+
+        bool closed;
+        {
+                wdf::Lock lck(s->lock);
+                closed = s->closed;
+        }
+
+        if (auto devid = ext.dev.devid; devid && !closed) { // was imported, the connection is alive
+                if (auto err = send_cmd_release(*s, devid)) {
+                        TraceDbg("Send USBIP_CMD_RELEASE %!STATUS!", err);
+                }
+        }
+
+        bool last;
+        {
+                wdf::Lock lck(s->lock);
+                last = !--s->attached;
+                if (last) {
+                        s->closed = true; // join_session must not use it
+                }
+        }
+
+        TraceDbg("session %04x, last %d", ptr04x(get_handle(s)), last);
+
+        if (last) {
+                {
+                        auto &v = *get_vhci_ctx(s->vhci);
+                        wdf::WaitLock lck(v.sessions_lock);
+                        RemoveEntryList(&s->entry);
+                        InitializeListHead(&s->entry);
+                }
+                WdfObjectDelete(get_handle(s)); // see session_cleanup
+        }
+
+        return true;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+device_ctx *usbip::acquire_device(_Inout_ mux_session &s, _In_ UINT32 devid)
+{
+        wdf::Lock lck(s.lock);
+
+        for (auto dev: s.devices) {
+                if (dev && dev->devid() == devid) {
+                        return ExAcquireRundownProtection(&dev->ext->mux_rundown) ? dev : nullptr;
+                }
+        }
+
+        return nullptr;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::release_device(_Inout_ device_ctx &dev)
+{
+        ExReleaseRundownProtection(&dev.ext->mux_rundown);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS usbip::ret_import(_Inout_ mux_session &s, _In_ const usbip_header &hdr)
+{
+        PAGED_CODE();
+
+        auto &r = hdr.u.ret_import;
+        auto st = op_status_error(static_cast<op_status_t>(r.status));
+
+        if (r.length != (st ? 0 : sizeof(op_import_reply))) {
+                Trace(TRACE_LEVEL_ERROR, "USBIP_RET_IMPORT status %d, length %u", r.status, r.length);
+                return USBIP_ERROR_PROTOCOL;
+        }
+
+        op_import_reply reply;
+
+        if (st) {
+                Trace(TRACE_LEVEL_ERROR, "USBIP_RET_IMPORT, seqnum %u, %!op_status_t!",
+                                          hdr.base.seqnum, static_cast<op_status_t>(r.status));
+        } else if (auto err = recv(s.sock, memory::stack, &reply, sizeof(reply))) {
+                Trace(TRACE_LEVEL_ERROR, "Receive op_import_reply %!STATUS!", err);
+                return err;
+        } else {
+                PACK_OP_IMPORT_REPLY(false, &reply);
+        }
+
+        wdf::Lock lck(s.lock);
+
+        for (auto head = &s.imports, entry = head->Flink; entry != head; entry = entry->Flink) {
+                auto &w = *CONTAINING_RECORD(entry, import_waiter, entry);
+                if (w.seqnum == hdr.base.seqnum) {
+                        if (!st) {
+                                *w.reply = reply;
+                                w.devid = hdr.base.devid;
+                        }
+                        complete(w, st);
+                        break;
+                }
+        }
+
+        return STATUS_SUCCESS; // a late reply is ignored
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::session_lost(_Inout_ mux_session &s)
+{
+        wdf::Lock lck(s.lock);
+        s.closed = true;
+
+        while (!IsListEmpty(&s.imports)) {
+                auto &w = *CONTAINING_RECORD(s.imports.Flink, import_waiter, entry);
+                complete(w, STATUS_CONNECTION_DISCONNECTED);
+        }
+
+        for (auto dev: s.devices) {
+                if (dev) {
+                        device::async_detach_nowait(get_handle(dev));
+                }
+        }
+}
@@ -0,0 +1,105 @@
+/*
+ * Copyright (C) 2024 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include <libdrv\codeseg.h>
+#include <libdrv\wdf_cpp.h>
+
+struct usbip_header;
+struct op_import_reply;
+
+namespace usbip
+{
+
+struct mux_session;
+struct device_ctx;
+struct device_ctx_ext;
+
+/*
+ * usbip-win extensions, see OP_REQ_FEATURES in <usbip\proto_op.h>.
+ * A server that has rejected them is not asked again, see vhci_ctx::features_unsupported.
+ *
+ * USBIP_FEATURE_MUX: devices that are imported from the same host:service share one TCP connection
+ * and one receive thread. It is disabled by default, it is enabled by the driver's Parameters key,
+ * value MultiplexConnections (DWORD).
+ *
+ * USBIP_FEATURE_COMPRESS: is requested if ext.compress_threshold is set, see compression.h.
+ *
+ * @return USBIP_FEATURE_XXX that should be requested from the server, zero if none
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED UINT32 get_requested_features(_In_ WDFDEVICE vhci, _In_ const device_ctx_ext &ext);
+
+/*
+ * @return true if ext.session is set to the live connection with the same server
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED bool join_session(_In_ WDFDEVICE vhci, _Inout_ device_ctx_ext &ext);
+
+/*
+ * Sends OP_REQ_FEATURES over just connected ext.sock and sets ext.features.
+ * If USBIP_FEATURE_MUX is accepted, the socket is moved into a new session.
+ *
+ * A standard server closes the connection, in that case ext.sock is closed, freed and set to NULL,
+ * the caller must connect again. The same is done if the session can't be created.
+ * Otherwise ext.sock can be used as usual if an error is returned.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS negotiate_features(_In_ WDFDEVICE vhci, _Inout_ device_ctx_ext &ext, _In_ UINT32 features);
+
+/*
+ * USBIP_CMD_IMPORT, replacement of OP_REQ_IMPORT if ext.session is set.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS import_device(_Inout_ device_ctx_ext &ext, _Out_ op_import_reply &reply);
+
+/*
+ * Responses of the server for the device will be dispatched by the receive thread of the session.
+ * Is called instead of device::recv_thread_start.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS add_device(_Inout_ device_ctx &dev);
+
+/*
+ * Sends USBIP_CMD_RELEASE, the connection is closed with the last device.
+ * Can be called several times.
+ * @return true if the device has left the session by this call
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED bool leave_session(_Inout_ device_ctx_ext &ext);
+
+/*
+ * For the receive thread of the session, see wsk_receive.cpp.
+ * @return device that must be released by release_device, NULL if devid is not attached
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+device_ctx *acquire_device(_Inout_ mux_session &s, _In_ UINT32 devid);
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void release_device(_Inout_ device_ctx &dev);
+
+/*
+ * Receives the payload of USBIP_RET_IMPORT and wakes up import_device.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS ret_import(_Inout_ mux_session &s, _In_ const usbip_header &hdr);
+
+/*
+ * The receive thread of the session is exiting, all its devices are detached.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void session_lost(_Inout_ mux_session &s);
+
+} // namespace usbip
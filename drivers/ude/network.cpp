@@ -13,17 +13,66 @@
 
 #include <libdrv\dbgcommon.h>
 #include <libdrv\usbd_helper.h>
+#include <libdrv\strconv.h>
 
 #include <libusbip/src/op_common.h>
 
 namespace {
 
+using namespace usbip;
+
 constexpr auto make_priority( _In_ LOCK_OPERATION operation)
 {
         return NormalPagePriority | MdlMappingNoExecute | 
                 (operation == IoReadAccess ? MdlMappingNoWrite : 0UL);
 }
 
+
+/*
+ * TCP_NODELAY is not supported, see WSK_FLAG_NODELAY.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto set_options(_In_ SOCKET *sock)
+{
+        PAGED_CODE();
+
+        auto keepalive = [] (auto idle, auto cnt, auto intvl) constexpr { return idle + cnt*intvl; };
+
+        int idle = 0;
+        int cnt = 0;
+        int intvl = 0;
+
+        if (auto err = get_keepalive_opts(sock, &idle, &cnt, &intvl)) {
+                Trace(TRACE_LEVEL_ERROR, "get_keepalive_opts %!STATUS!", err);
+                return err;
+        }
+
+        Trace(TRACE_LEVEL_VERBOSE, "get keepalive: idle(%d sec) + cnt(%d)*intvl(%d sec) => %d sec", 
+                idle, cnt, intvl, keepalive(idle, cnt, intvl));
+
+        enum { IDLE = 30, CNT = 9, INTVL = 10 };
+
+        if (auto err = set_keepalive(sock, IDLE, CNT, INTVL)) {
+                Trace(TRACE_LEVEL_ERROR, "set_keepalive %!STATUS!", err);
+                return err;
+        }
+
+        bool optval{};
+        if (auto err = get_keepalive(sock, optval)) {
+                Trace(TRACE_LEVEL_ERROR, "get_keepalive %!STATUS!", err);
+                return err;
+        }
+
+        NT_VERIFY(!get_keepalive_opts(sock, &idle, &cnt, &intvl));
+
+        Trace(TRACE_LEVEL_VERBOSE, "set keepalive: idle(%d sec) + cnt(%d)*intvl(%d sec) => %d sec", 
+                idle, cnt, intvl, keepalive(idle, cnt, intvl));
+
+        bool ok = optval && keepalive(idle, cnt, intvl) == keepalive(IDLE, CNT, INTVL);
+        return ok ? STATUS_SUCCESS : STATUS_UNSUCCESSFUL;
+}
+
 } // namespace
 
 
@@ -183,3 +232,138 @@ PAGED bool usbip::close_socket(_In_ SOCKET *sock)
 
         return true;
 }
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS usbip::create_socket(_Inout_ SOCKET* &sock, _In_ const ADDRINFOEXW &ai)
+{
+        PAGED_CODE();
+        NT_ASSERT(!sock);
+
+        if (auto err = socket(sock, static_cast<ADDRESS_FAMILY>(ai.ai_family), 
+                                static_cast<USHORT>(ai.ai_socktype), ai.ai_protocol, 
+                                WSK_FLAG_CONNECTION_SOCKET, nullptr, nullptr)) {
+                NT_ASSERT(!sock);
+                Trace(TRACE_LEVEL_ERROR, "socket %!STATUS!", err);
+                return err;
+        }
+
+        if (auto err = set_options(sock)) {
+                return err;
+        }
+
+        SOCKADDR_INET any { // see INADDR_ANY, IN6ADDR_ANY_INIT
+                .si_family = static_cast<ADDRESS_FAMILY>(ai.ai_family)
+        };
+
+        if (auto err = bind(sock, reinterpret_cast<SOCKADDR*>(&any))) {
+                Trace(TRACE_LEVEL_ERROR, "bind %!STATUS!", err);
+                return err;
+        }
+
+        return STATUS_SUCCESS;
+}
+
+/*
+ * @see <linux>/tools/usb/usbip/src/usbipd.c, recv_request_import
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS usbip::send_req_import(_In_ SOCKET *sock, _In_ const UNICODE_STRING &busid)
+{
+        PAGED_CODE();
+
+        struct {
+                op_common hdr{ USBIP_VERSION, OP_REQ_IMPORT, ST_OK };
+                op_import_request body{};
+        } req;
+
+        static_assert(sizeof(req) == sizeof(req.hdr) + sizeof(req.body)); // packed
+
+        if (auto &dst = req.body.busid; auto err = libdrv::unicode_to_utf8(dst, sizeof(dst), busid)) {
+                Trace(TRACE_LEVEL_ERROR, "unicode_to_utf8('%!USTR!') %!STATUS!", &busid, err);
+                return err;
+        }
+
+        PACK_OP_COMMON(false, &req.hdr);
+        PACK_OP_IMPORT_REQUEST(false, &req.body);
+
+        return send(sock, memory::stack, &req, sizeof(req));
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS usbip::recv_rep_import(
+        _In_ SOCKET *sock, _In_ const UNICODE_STRING &busid, _In_ memory pool, _Out_ op_import_reply &reply)
+{
+        PAGED_CODE();
+        RtlZeroMemory(&reply, sizeof(reply));
+
+        if (auto err = recv_op_common(sock, OP_REP_IMPORT)) {
+                return err;
+        }
+
+        if (auto err = recv(sock, pool, &reply, sizeof(reply))) {
+                Trace(TRACE_LEVEL_ERROR, "Receive op_import_reply %!STATUS!", err);
+                return err;
+        }
+        PACK_OP_IMPORT_REPLY(false, &reply);
+
+        return verify_busid(reply, busid);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS usbip::verify_busid(_In_ const op_import_reply &reply, _In_ const UNICODE_STRING &busid)
+{
+        PAGED_CODE();
+
+        if (char str[sizeof(reply.udev.busid)];
+            auto err = libdrv::unicode_to_utf8(str, sizeof(str), busid)) {
+                Trace(TRACE_LEVEL_ERROR, "unicode_to_utf8('%!USTR!') %!STATUS!", &busid, err);
+                return err;
+        } else if (strncmp(reply.udev.busid, str, sizeof(str))) {
+                Trace(TRACE_LEVEL_ERROR, "Received busid '%s' != '%s'", reply.udev.busid, str);
+                return USBIP_ERROR_PROTOCOL;
+        }
+
+        return STATUS_SUCCESS;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS usbip::request_features(_In_ SOCKET *sock, _Inout_ UINT32 &features)
+{
+        PAGED_CODE();
+
+        struct {
+                op_common hdr{ USBIP_VERSION, OP_REQ_FEATURES, ST_OK };
+                op_features_request body{};
+        } req;
+
+        static_assert(sizeof(req) == sizeof(req.hdr) + sizeof(req.body)); // packed
+
+        auto requested = features;
+        req.body.features = requested;
+        features = 0;
+
+        PACK_OP_COMMON(false, &req.hdr);
+        PACK_OP_FEATURES_REQUEST(false, &req.body);
+
+        if (auto err = send(sock, memory::stack, &req, sizeof(req))) {
+                return err;
+        }
+
+        if (auto err = recv_op_common(sock, OP_REP_FEATURES)) {
+                return err;
+        }
+
+        op_features_reply reply{};
+        if (auto err = recv(sock, memory::stack, &reply, sizeof(reply))) {
+                return err;
+        }
+        PACK_OP_FEATURES_REPLY(false, &reply);
+
+        features = reply.features & requested; // must be a subset of requested
+        return STATUS_SUCCESS;
+}
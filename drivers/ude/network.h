@@ -13,6 +13,7 @@
 
 struct _URB;
 struct usbip_header;
+struct op_import_reply;
 
 namespace usbip
 {
@@ -34,6 +35,39 @@ _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
 PAGED USBIP_STATUS recv_op_common(_Inout_ SOCKET *sock, _In_ UINT16 expected_code);
 
+/*
+ * OP_REQ_FEATURES, see <usbip\proto_op.h>.
+ * A standard server closes the connection, an error is returned in that case.
+ *
+ * @param features IN: requested USBIP_FEATURE_XXX, OUT: accepted ones
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS request_features(_In_ SOCKET *sock, _Inout_ UINT32 &features);
+
+/*
+ * Create, set options and bind the socket that will be connected to the given address.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS create_socket(_Inout_ SOCKET* &sock, _In_ const ADDRINFOEXW &ai);
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS send_req_import(_In_ SOCKET *sock, _In_ const UNICODE_STRING &busid);
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS recv_rep_import(
+        _In_ SOCKET *sock, _In_ const UNICODE_STRING &busid, _In_ memory pool, _Out_ op_import_reply &reply);
+
+/*
+ * @return USBIP_ERROR_PROTOCOL if the server has imported other device
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS verify_busid(_In_ const op_import_reply &reply, _In_ const UNICODE_STRING &busid);
+
 enum : ULONG { URB_BUF_LEN = MAXULONG }; // set mdl_size to URB.TransferBufferLength
 
 _IRQL_requires_max_(DISPATCH_LEVEL)
@@ -6,7 +6,11 @@
 #include "trace.h"
 #include "persistent.tmh"
 
+#include "attach_policy.h"
 #include "context.h"
+#include "vhci.h"
+
+#include "driver.h"
 
 #include <libdrv\strconv.h>
 #include <libdrv\wait_timeout.h>
@@ -82,186 +86,322 @@ PAGED auto parse_string(_Out_ vhci::ioctl::plugin_hardware &r, _In_ const UNICOD
 }
 
 /*
- * Target is self. 
+ * WskGetAddressInfo() can return STATUS_INTERNAL_ERROR(0xC00000E5), but after some delay it will succeed.
+ * This can happen after reboot if dnscache(?) service is not ready yet.
  */
+constexpr auto can_retry(_In_ NTSTATUS status)
+{
+        switch (as_usbip_status(status)) {
+        case USBIP_ERROR_VERSION:
+        case USBIP_ERROR_PROTOCOL:
+        case USBIP_ERROR_ABI:
+        // @see op_status_t
+        case USBIP_ERROR_ST_NA: 
+        case USBIP_ERROR_ST_DEV_BUSY:
+        case USBIP_ERROR_ST_DEV_ERR:
+        case USBIP_ERROR_ST_NODEV:
+        case USBIP_ERROR_ST_ERROR:
+                return false;
+        default:
+                return true;
+        }
+}
+
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
-PAGED auto make_target(_In_ WDFDEVICE vhci)
+PAGED auto contains(_In_ WDFCOLLECTION col, _In_ const UNICODE_STRING &str)
 {
         PAGED_CODE();
-        ObjectDelete target;
+        
+        for (ULONG i = 0, cnt = WdfCollectionGetCount(col); i < cnt; ++i) {
+                auto item = (WDFSTRING)WdfCollectionGetItem(col, i);
 
-        if (WDFIOTARGET t; auto err = WdfIoTargetCreate(vhci, WDF_NO_OBJECT_ATTRIBUTES, &t)) {
-                Trace(TRACE_LEVEL_ERROR, "WdfIoTargetCreate %!STATUS!", err);
-                return target;
-        } else {
-                target.reset(t);
+                UNICODE_STRING s{};
+                WdfStringGetUnicodeString(item, &s);
+                        
+                if (RtlEqualUnicodeString(&s, &str, true)) {
+                        return true;
+                }
         }
 
-        auto fdo = WdfDeviceWdmGetDeviceObject(vhci);
+        return false;
+}
 
-        WDF_IO_TARGET_OPEN_PARAMS params;
-        WDF_IO_TARGET_OPEN_PARAMS_INIT_EXISTING_DEVICE(&params, fdo);
+enum { 
+        REFRESH_PERIOD = 60, // seconds, how often to re-read persistent_devices_value_name
+        DEFAULT_PARALLELISM = 4, // concurrent attach requests
+};
 
-        if (auto err = WdfIoTargetOpen(target.get<WDFIOTARGET>(), &params)) {
-                Trace(TRACE_LEVEL_ERROR, "WdfIoTargetOpen %!STATUS!", err);
-                target.reset();
-        }
+constexpr auto &parallelism_value_name = L"PersistentAttachParallelism";
 
-        return target;
-}
+struct scheduler;
+
+/*
+ * Attach state of a persistent device.
+ */
+struct attach_entry
+{
+        scheduler *sched;
+
+        WDFSTRING line; // "host,service,busid"
+        UNICODE_STRING str; // of the line
+        ULONG hash; // of str, case-insensitive
+
+        WDFREQUEST request; // reused for each attempt
+        WDFMEMORY input; // children of the request
+        WDFMEMORY output;
+        vhci::ioctl::plugin_hardware req;
+
+        using enum attach::state_t;
+        volatile LONG state;
 
-constexpr auto get_delay(_In_ ULONG attempt, _In_ ULONG cnt)
+        NTSTATUS status; // of the last attempt
+        ULONG attempt;
+        ULONGLONG next_time; // @see KeQueryInterruptTime
+        bool removed; // from persistent_devices_value_name
+};
+
+/*
+ * Each device has its own exponential backoff, so one dead host does not delay others.
+ * Devices are looked up by the hash set to compare them with the registry and attached devices.
+ */
+struct scheduler
+{
+        vhci_ctx *vhci;
+        WDFIOTARGET target;
+        KEVENT completed; // signaled by attach_complete
+        volatile LONG inflight; // attach_complete will access this object
+
+        ULONG parallelism;
+        ULONG pending; // entries in pending state
+        ULONG seed; // for RtlRandomEx
+
+        ULONG cnt; // of entries, including unused
+        attach_entry entries[ARRAYSIZE(vhci_ctx::devices)];
+
+        attach_entry* set[2*ARRAYSIZE(entries)]; // open addressing, linear probing
+
+        WCHAR buf[sizeof(vhci::ioctl::plugin_hardware::host) + 
+                  sizeof(vhci::ioctl::plugin_hardware::service) + 
+                  sizeof(vhci::ioctl::plugin_hardware::busid)]; // to make a line of attached device
+};
+
+/*
+ * @return seconds
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto get_delay(_Inout_ scheduler &s, _In_ ULONG attempt)
 {
-        NT_ASSERT(cnt);
-        enum { UNIT = 10, MAX_DELAY = 30*60 }; // seconds
-        return attempt > 1 ? min(UNIT*attempt/cnt, MAX_DELAY) : 0; // first two attempts without a delay
+        PAGED_CODE();
+        return attach::get_delay(attempt, RtlRandomEx(&s.seed));
 }
 
 _IRQL_requires_same_
-_IRQL_requires_max_(APC_LEVEL)
-PAGED auto sleep(_Inout_ vhci_ctx &ctx, _In_ ULONG seconds)
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto get_parallelism()
 {
         PAGED_CODE();
-        auto timeout = make_timeout(seconds*wdm::second, wdm::period::relative);
+        ULONG val = DEFAULT_PARALLELISM;
 
-        switch (auto st = KeWaitForSingleObject(&ctx.attach_thread_stop, Executive, KernelMode, false, &timeout)) {
-        case STATUS_SUCCESS:
-                TraceDbg("thread stop requested");
-                return false;
-        case STATUS_TIMEOUT:
-                break;
-        default:
-                Trace(TRACE_LEVEL_ERROR, "KeWaitForSingleObject %!STATUS!", st);
+        Registry key;
+        if (auto err = open_parameters_key(key, KEY_QUERY_VALUE)) {
+                return val;
         }
 
-        return true;
+        UNICODE_STRING name;
+        RtlUnicodeStringInit(&name, parallelism_value_name);
+
+        if (auto err = WdfRegistryQueryULong(key.get(), &name, &val)) {
+                if (err != STATUS_OBJECT_NAME_NOT_FOUND) {
+                        Trace(TRACE_LEVEL_ERROR, "WdfRegistryQueryULong('%!USTR!') %!STATUS!", &name, err);
+                }
+                val = DEFAULT_PARALLELISM;
+        }
+
+        return max(1UL, min(val, ULONG(ARRAYSIZE(vhci_ctx::devices))));
 }
 
-/*
- * WskGetAddressInfo() can return STATUS_INTERNAL_ERROR(0xC00000E5), but after some delay it will succeed.
- * This can happen after reboot if dnscache(?) service is not ready yet.
- */
-constexpr auto can_retry(_In_ NTSTATUS status)
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto hash(_In_ const UNICODE_STRING &str)
 {
-        switch (as_usbip_status(status)) {
-        case USBIP_ERROR_VERSION:
-        case USBIP_ERROR_PROTOCOL:
-        case USBIP_ERROR_ABI:
-        // @see op_status_t
-        case USBIP_ERROR_ST_NA: 
-        case USBIP_ERROR_ST_DEV_BUSY:
-        case USBIP_ERROR_ST_DEV_ERR:
-        case USBIP_ERROR_ST_NODEV:
-        case USBIP_ERROR_ST_ERROR:
-                return false;
-        default:
-                return true;
+        PAGED_CODE();
+
+        ULONG val{};
+        NT_VERIFY(NT_SUCCESS(RtlHashUnicodeString(&str, true, HASH_STRING_ALGORITHM_DEFAULT, &val)));
+        return val;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED attach_entry *find(_In_ const scheduler &s, _In_ const UNICODE_STRING &str, _In_ ULONG hash)
+{
+        PAGED_CODE();
+        const auto n = ARRAYSIZE(s.set);
+
+        for (auto i = hash % n; auto e = s.set[i]; i = (i + 1) % n) {
+                if (e->hash == hash && RtlEqualUnicodeString(&e->str, &str, true)) {
+                        return e;
+                }
         }
+
+        return nullptr;
 }
 
-/*
- * @return true - do not try to connect to this device again
- */
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
-PAGED auto plugin_hardware(
-        _In_ const UNICODE_STRING &line, 
-        _In_ WDFIOTARGET target,
-        _Inout_ vhci::ioctl::plugin_hardware &req,
-        _Inout_ WDF_MEMORY_DESCRIPTOR &input,
-        _Inout_ WDF_MEMORY_DESCRIPTOR &output,
-        [[maybe_unused]] _In_ const ULONG outlen)
+PAGED void insert(_Inout_ scheduler &s, _In_ attach_entry &e)
 {
         PAGED_CODE();
+        const auto n = ARRAYSIZE(s.set);
 
-        if (auto err = parse_string(req, line)) {
-                Trace(TRACE_LEVEL_ERROR, "'%!USTR!' parse %!STATUS!", &line, err);
-                return true; // remove malformed string
+        auto i = e.hash % n;
+        while (s.set[i]) {
+                i = (i + 1) % n;
         }
 
-        Trace(TRACE_LEVEL_INFORMATION, "%s:%s/%s", req.host, req.service, req.busid);
-        req.port = 0;
+        s.set[i] = &e;
+}
 
-        if (ULONG_PTR BytesReturned; // send IOCTL to itself
-            auto err = WdfIoTargetSendIoctlSynchronously(target, WDF_NO_HANDLE, vhci::ioctl::PLUGIN_HARDWARE, 
-                                                         &input, &output, nullptr, &BytesReturned)) {
-                Trace(TRACE_LEVEL_ERROR, "WdfIoTargetSendIoctlSynchronously %!STATUS!", err);
-                return !can_retry(err);
-        } else {
-                NT_ASSERT(BytesReturned == outlen);
-                return true;
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void rebuild_set(_Inout_ scheduler &s)
+{
+        PAGED_CODE();
+        RtlZeroMemory(s.set, sizeof(s.set));
+
+        for (ULONG i = 0; i < s.cnt; ++i) {
+                if (auto &e = s.entries[i]; e.state != attach_entry::unused) {
+                        insert(s, e);
+                }
         }
 }
 
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
-PAGED auto contains(_In_ WDFCOLLECTION col, _In_ const UNICODE_STRING &str)
+PAGED auto add_entry(_Inout_ scheduler &s, _In_ const UNICODE_STRING &str, _In_ ULONG hash)
 {
         PAGED_CODE();
-        
-        for (ULONG i = 0, cnt = WdfCollectionGetCount(col); i < cnt; ++i) {
-                auto item = (WDFSTRING)WdfCollectionGetItem(col, i);
 
-                UNICODE_STRING s{};
-                WdfStringGetUnicodeString(item, &s);
-                        
-                if (RtlEqualUnicodeString(&s, &str, true)) {
-                        return true;
+        ULONG idx = 0;
+        while (idx < s.cnt && s.entries[idx].state != attach_entry::unused) {
+                ++idx;
+        }
+
+        if (idx == ARRAYSIZE(s.entries)) {
+                Trace(TRACE_LEVEL_WARNING, "'%!USTR!' ignored, too many devices", &str);
+                return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        auto &e = s.entries[idx];
+        RtlZeroMemory(&e, sizeof(e));
+        e.state = attach_entry::unused; // until success
+
+        e.sched = &s;
+        e.hash = hash;
+        e.req.size = sizeof(e.req);
+
+        WDF_OBJECT_ATTRIBUTES attr;
+        WDF_OBJECT_ATTRIBUTES_INIT(&attr);
+        attr.ParentObject = s.target;
+
+        if (auto err = WdfStringCreate(&str, &attr, &e.line)) {
+                Trace(TRACE_LEVEL_ERROR, "WdfStringCreate %!STATUS!", err);
+                return err;
+        }
+        WdfStringGetUnicodeString(e.line, &e.str);
+
+        if (auto err = WdfRequestCreate(&attr, s.target, &e.request)) {
+                Trace(TRACE_LEVEL_ERROR, "WdfRequestCreate %!STATUS!", err);
+                WdfObjectDelete(e.line);
+                return err;
+        }
+
+        attr.ParentObject = e.request;
+
+        for (auto mem: {&e.input, &e.output}) {
+                if (auto err = WdfMemoryCreatePreallocated(&attr, &e.req, sizeof(e.req), mem)) {
+                        Trace(TRACE_LEVEL_ERROR, "WdfMemoryCreatePreallocated %!STATUS!", err);
+                        WdfObjectDelete(e.request);
+                        WdfObjectDelete(e.line);
+                        return err;
                 }
         }
 
-        return false;
+        TraceDbg("add '%!USTR!'", &e.str);
+
+        e.state = attach_entry::idle;
+        if (idx == s.cnt) {
+                ++s.cnt;
+        }
+
+        insert(s, e);
+
+        return STATUS_SUCCESS;
 }
 
 /*
- * Remove from collection A items absent in collection B.
+ * Do not call for pending or completed entry, see attach::can_remove.
+ * The slot is reused by add_entry.
  */
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
-PAGED void intersection(_In_ WDFCOLLECTION a, _In_ WDFCOLLECTION b)
+PAGED void remove_entry(_Inout_ scheduler &s, _Inout_ attach_entry &e)
 {
         PAGED_CODE();
 
-        for (ULONG i = 0, cnt = WdfCollectionGetCount(a); i < cnt; ) {
-                auto item = (WDFSTRING)WdfCollectionGetItem(a, i);
+        NT_ASSERT(attach::can_remove(e.state));
+        TraceDbg("remove '%!USTR!'", &e.str);
 
-                UNICODE_STRING s{};
-                WdfStringGetUnicodeString(item, &s);
+        WdfObjectDelete(e.request);
+        WdfObjectDelete(e.line);
 
-                if (contains(b, s)) {
-                        ++i;
-                } else {
-                        TraceDbg("exclude %!USTR!", &s);
-                        WdfCollectionRemoveItem(a, i);
-                        --cnt;
-                }
+        RtlZeroMemory(&e, sizeof(e));
+        e.state = attach_entry::unused;
+
+        while (s.cnt && s.entries[s.cnt - 1].state == attach_entry::unused) {
+                --s.cnt;
         }
 }
 
 /*
- * Refreshing allows to remove devices that constantly fail to attach.
+ * Devices that are attached already do not need to be attached.
  */
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
-PAGED ULONG get_count(_In_ WDFCOLLECTION col, _In_ WDFKEY key, _In_ bool refresh)
+PAGED void exclude_attached(_Inout_ scheduler &s)
 {
         PAGED_CODE();
+        auto vhci = get_handle(s.vhci);
 
-        if (!refresh) {
-                //
-        } else if (auto newcol = get_persistent_devices(key)) {
-                intersection(col, newcol.get<WDFCOLLECTION>());
-        } else {
-                return 0;
-        }
+        for (int port = 1; port <= ARRAYSIZE(vhci_ctx::devices); ++port) {
+
+                auto dev = vhci::get_device(vhci, port);
+                if (!dev) {
+                        continue;
+                }
 
-        return min(WdfCollectionGetCount(col), ARRAYSIZE(vhci_ctx::devices));
+                auto &ext = *get_device_ctx(dev.get())->ext;
+                UNICODE_STRING str{ .MaximumLength = sizeof(s.buf), .Buffer = s.buf };
+
+                if (auto err = RtlUnicodeStringPrintf(&str, L"%wZ,%wZ,%wZ", 
+                                                      &ext.node_name, &ext.service_name, &ext.busid)) {
+                        Trace(TRACE_LEVEL_ERROR, "RtlUnicodeStringPrintf %!STATUS!", err);
+                } else if (auto e = find(s, str, hash(str)); e && e->state == attach_entry::idle) {
+                        TraceDbg("'%!USTR!' is attached, port %d", &str, port);
+                        e->state = attach_entry::done;
+                }
+        }
 }
 
+/*
+ * Synchronize the entries with the registry.
+ * Refreshing allows to remove devices that constantly fail to attach.
+ */
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
-PAGED void plugin_persistent_devices(_In_ vhci_ctx &ctx)
+PAGED void refresh(_Inout_ scheduler &s)
 {
         PAGED_CODE();
 
@@ -270,57 +410,283 @@ PAGED void plugin_persistent_devices(_In_ vhci_ctx &ctx)
                 return;
         }
 
-        auto devices = get_persistent_devices(key.get());
-        if (!(devices && WdfCollectionGetCount(devices.get<WDFCOLLECTION>()))) {
+        auto col = get_persistent_devices(key.get()); // absent value means that the list is empty
+
+        for (ULONG i = 0; i < s.cnt; ++i) {
+                s.entries[i].removed = true;
+        }
+
+        for (ULONG i = 0, cnt = col ? WdfCollectionGetCount(col.get<WDFCOLLECTION>()) : 0; i < cnt; ++i) {
+                auto item = (WDFSTRING)WdfCollectionGetItem(col.get<WDFCOLLECTION>(), i);
+
+                UNICODE_STRING str{};
+                WdfStringGetUnicodeString(item, &str);
+
+                if (empty(str)) {
+                        continue;
+                }
+
+                auto h = hash(str);
+
+                if (auto e = find(s, str, h)) {
+                        e->removed = false;
+                } else {
+                        add_entry(s, str, h);
+                }
+        }
+
+        for (ULONG i = 0; i < s.cnt; ++i) {
+                if (auto &e = s.entries[i]; e.removed && attach::can_remove(e.state)) {
+                        remove_entry(s, e);
+                }
+        }
+
+        rebuild_set(s);
+        exclude_attached(s);
+}
+
+_Function_class_(EVT_WDF_REQUEST_COMPLETION_ROUTINE)
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void NTAPI attach_complete(
+        _In_ WDFREQUEST, _In_ WDFIOTARGET, _In_ WDF_REQUEST_COMPLETION_PARAMS *params, _In_ WDFCONTEXT context)
+{
+        auto &e = *static_cast<attach_entry*>(context);
+        auto &s = *e.sched;
+
+        e.status = params->IoStatus.Status;
+        InterlockedExchange(&e.state, attach_entry::completing);
+
+        KeSetEvent(&s.completed, IO_NO_INCREMENT, false);
+        InterlockedDecrement(&s.inflight);
+
+        InterlockedExchange(&e.state, attach_entry::completed); // must be the last access, the request can be reused
+}
+
+/*
+ * Send IOCTL to itself.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void send(_Inout_ scheduler &s, _Inout_ attach_entry &e)
+{
+        PAGED_CODE();
+
+        if (auto err = parse_string(e.req, e.str)) {
+                Trace(TRACE_LEVEL_ERROR, "'%!USTR!' parse %!STATUS!", &e.str, err);
+                e.state = attach_entry::done;
                 return;
         }
 
-        auto vhci = get_handle(&ctx);
+        Trace(TRACE_LEVEL_INFORMATION, "%s:%s/%s, attempt #%lu", e.req.host, e.req.service, e.req.busid, e.attempt);
+        e.req.port = 0;
 
-        auto target = make_target(vhci);
-        if (!target) {
+        WDF_REQUEST_REUSE_PARAMS params;
+        WDF_REQUEST_REUSE_PARAMS_INIT(&params, WDF_REQUEST_REUSE_NO_FLAGS, STATUS_SUCCESS);
+        NT_VERIFY(NT_SUCCESS(WdfRequestReuse(e.request, &params)));
+
+        constexpr auto outlen = offsetof(vhci::ioctl::plugin_hardware, port) + sizeof(e.req.port);
+
+        NT_VERIFY(NT_SUCCESS(WdfMemoryAssignBuffer(e.input, &e.req, sizeof(e.req))));
+        NT_VERIFY(NT_SUCCESS(WdfMemoryAssignBuffer(e.output, &e.req, outlen)));
+
+        e.state = attach_entry::pending;
+        ++s.pending;
+
+        if (auto err = WdfIoTargetFormatRequestForIoctl(s.target, e.request, vhci::ioctl::PLUGIN_HARDWARE, 
+                                                        e.input, nullptr, e.output, nullptr)) {
+                Trace(TRACE_LEVEL_ERROR, "WdfIoTargetFormatRequestForIoctl %!STATUS!", err);
+                e.status = err;
+                e.state = attach_entry::completed;
                 return;
         }
 
-        vhci::ioctl::plugin_hardware req{{ .size = sizeof(req) }};
+        WdfRequestSetCompletionRoutine(e.request, attach_complete, &e);
+        InterlockedIncrement(&s.inflight);
+
+        if (!WdfRequestSend(e.request, s.target, WDF_NO_SEND_OPTIONS)) { // completion routine will not be called
+                InterlockedDecrement(&s.inflight);
+                e.status = WdfRequestGetStatus(e.request);
+                Trace(TRACE_LEVEL_ERROR, "WdfRequestSend %!STATUS!", e.status);
+                e.state = attach_entry::completed;
+        }
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void on_completed(_Inout_ scheduler &s, _Inout_ attach_entry &e, _In_ ULONGLONG now)
+{
+        PAGED_CODE();
 
-        WDF_MEMORY_DESCRIPTOR input;
-        WDF_MEMORY_DESCRIPTOR_INIT_BUFFER(&input, &req, sizeof(req));
+        NT_ASSERT(s.pending);
+        --s.pending;
 
-        constexpr auto outlen = offsetof(vhci::ioctl::plugin_hardware, port) + sizeof(req.port);
+        auto st = e.status;
+        e.state = attach::on_completed(st, e.removed, can_retry(st));
 
-        WDF_MEMORY_DESCRIPTOR output;
-        WDF_MEMORY_DESCRIPTOR_INIT_BUFFER(&output, &req, outlen);
+        if (NT_SUCCESS(st)) {
+                Trace(TRACE_LEVEL_INFORMATION, "'%!USTR!' attached, port %d", &e.str, e.req.port);
+        } else if (e.state == attach_entry::done) {
+                Trace(TRACE_LEVEL_ERROR, "'%!USTR!' %!STATUS!, exclude", &e.str, st);
+        } else {
+                auto secs = get_delay(s, ++e.attempt);
+                TraceDbg("'%!USTR!' %!STATUS!, next attempt #%lu in %lu sec.", &e.str, st, e.attempt, secs);
 
-        for (ULONG attempt = 0; true; ++attempt) {
+                e.next_time = now + ULONGLONG(secs)*wdm::second;
+        }
+}
 
-                auto cnt = get_count(devices.get<WDFCOLLECTION>(), key.get(), attempt);
-                if (!cnt) {
-                        break;
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void process_completed(_Inout_ scheduler &s)
+{
+        PAGED_CODE();
+        auto now = KeQueryInterruptTime();
+
+        for (ULONG i = 0; i < s.cnt; ++i) {
+                auto &e = s.entries[i];
+
+                for (auto delay = make_timeout(wdm::msec, wdm::period::relative); 
+                     ReadAcquire(&e.state) == attach_entry::completing; ) { // attach_complete is exiting
+                        KeDelayExecutionThread(KernelMode, false, &delay);
                 }
 
-                if (auto secs = get_delay(attempt, cnt)) {
-                        TraceDbg("attempt #%lu, %lu device(s), sleep %lu sec.", attempt, cnt, secs);
-                        if (!sleep(ctx, secs)) {
-                                break;
-                        }
+                if (e.state == attach_entry::completed) {
+                        on_completed(s, e, now);
+                }
+        }
+}
+
+/*
+ * @return false if the thread must exit
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(APC_LEVEL)
+PAGED auto wait(_Inout_ scheduler &s, _In_ ULONGLONG timeout)
+{
+        PAGED_CODE();
+
+        void *objects[] { &s.vhci->attach_thread_stop, &s.completed };
+        auto t = make_timeout(timeout, wdm::period::relative);
+
+        switch (auto st = KeWaitForMultipleObjects(ARRAYSIZE(objects), objects, WaitAny, Executive, KernelMode, false, 
+                                                   &t, nullptr)) {
+        case STATUS_WAIT_0:
+                TraceDbg("thread stop requested");
+                return false;
+        case STATUS_WAIT_1:
+        case STATUS_TIMEOUT:
+                break;
+        default:
+                Trace(TRACE_LEVEL_ERROR, "KeWaitForMultipleObjects %!STATUS!", st);
+        }
+
+        return true;
+}
+
+/*
+ * Entries are accessed by completion routines, wait for all pending requests.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void cancel_and_wait(_Inout_ scheduler &s)
+{
+        PAGED_CODE();
+
+        for (ULONG i = 0; i < s.cnt; ++i) {
+                if (auto &e = s.entries[i]; e.state == attach_entry::pending) {
+                        WdfRequestCancelSentRequest(e.request);
+                }
+        }
+
+        for (process_completed(s); s.pending; process_completed(s)) {
+                TraceDbg("wait for %lu pending request(s)", s.pending);
+                NT_VERIFY(!KeWaitForSingleObject(&s.completed, Executive, KernelMode, false, nullptr));
+        }
+
+        for (auto delay = make_timeout(wdm::msec, wdm::period::relative); s.inflight; ) { // attach_complete is exiting
+                KeDelayExecutionThread(KernelMode, false, &delay);
+        }
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void run(_Inout_ scheduler &s)
+{
+        PAGED_CODE();
+
+        for (ULONGLONG refresh_time = 0; true; ) {
+
+                auto now = KeQueryInterruptTime();
+
+                if (now >= refresh_time) {
+                        refresh(s);
+                        refresh_time = now + ULONGLONG(REFRESH_PERIOD)*wdm::second;
                 }
 
-                for (ULONG i = 0; i < cnt && sleep(ctx, 0); ) {
-                        UNICODE_STRING str{};
-                        if (auto s = (WDFSTRING)WdfCollectionGetItem(devices.get<WDFCOLLECTION>(), i)) {
-                                WdfStringGetUnicodeString(s, &str);
+                auto wakeup = refresh_time;
+                bool active = s.pending;
+
+                for (ULONG i = 0; i < s.cnt; ++i) {
+                        auto &e = s.entries[i];
+                        if (e.state != attach_entry::idle) {
+                                continue;
                         }
 
-                        if (plugin_hardware(str, target.get<WDFIOTARGET>(), req, input, output, outlen)) {
-                                TraceDbg("exclude %!USTR!", &str);
-                                WdfCollectionRemoveItem(devices.get<WDFCOLLECTION>(), i);
-                                --cnt;
-                        } else {
-                                ++i;
+                        active = true;
+
+                        if (e.next_time > now) {
+                                wakeup = min(wakeup, e.next_time);
+                        } else if (s.pending < s.parallelism) {
+                                send(s, e);
                         }
                 }
+
+                if (!active) {
+                        TraceDbg("all devices are processed");
+                        break;
+                }
+
+                process_completed(s); // WdfRequestSend failed
+
+                if (!wait(s, wakeup > now ? wakeup - now : 0)) {
+                        break;
+                }
+
+                process_completed(s);
+        }
+
+        cancel_and_wait(s);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void plugin_persistent_devices(_In_ vhci_ctx &ctx)
+{
+        PAGED_CODE();
+
+        auto target = make_target(get_handle(&ctx));
+        if (!target) {
+                return;
         }
+
+        unique_ptr buf(NonPagedPoolNx, sizeof(scheduler)); // entries are accessed by completion routines
+        if (!buf) {
+                Trace(TRACE_LEVEL_ERROR, "Can't allocate scheduler");
+                return;
+        }
+
+        auto &s = *buf.get<scheduler>();
+
+        s.vhci = &ctx;
+        s.target = target.get<WDFIOTARGET>(); // parent of entries' objects
+        KeInitializeEvent(&s.completed, SynchronizationEvent, false);
+
+        s.parallelism = get_parallelism();
+        s.seed = static_cast<ULONG>(KeQueryInterruptTime());
+
+        TraceDbg("parallelism %lu", s.parallelism);
+        run(s);
 }
 
 /*
@@ -349,6 +715,36 @@ PAGED void persistent_devices_thread(_In_ void *ctx)
 } // namespace 
 
 
+/*
+ * Target is self. 
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED ObjectDelete usbip::make_target(_In_ WDFDEVICE vhci)
+{
+        PAGED_CODE();
+        ObjectDelete target;
+
+        if (WDFIOTARGET t; auto err = WdfIoTargetCreate(vhci, WDF_NO_OBJECT_ATTRIBUTES, &t)) {
+                Trace(TRACE_LEVEL_ERROR, "WdfIoTargetCreate %!STATUS!", err);
+                return target;
+        } else {
+                target.reset(t);
+        }
+
+        auto fdo = WdfDeviceWdmGetDeviceObject(vhci);
+
+        WDF_IO_TARGET_OPEN_PARAMS params;
+        WDF_IO_TARGET_OPEN_PARAMS_INIT_EXISTING_DEVICE(&params, fdo);
+
+        if (auto err = WdfIoTargetOpen(target.get<WDFIOTARGET>(), &params)) {
+                Trace(TRACE_LEVEL_ERROR, "WdfIoTargetOpen %!STATUS!", err);
+                target.reset();
+        }
+
+        return target;
+}
+
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
 PAGED void usbip::plugin_persistent_devices(_In_ vhci_ctx *vhci)
@@ -418,3 +814,38 @@ PAGED NTSTATUS usbip::open_parameters_key(_Out_ Registry &key, _In_ ACCESS_MASK
         key.reset(k);
         return st;
 }
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED bool usbip::is_persistent(_In_ const device_ctx_ext &ext)
+{
+        PAGED_CODE();
+
+        Registry key;
+        if (auto err = open_parameters_key(key, KEY_QUERY_VALUE)) {
+                return false;
+        }
+
+        auto devices = get_persistent_devices(key.get());
+        if (!devices) {
+                return false;
+        }
+
+        const USHORT len = ext.node_name.Length + ext.service_name.Length + ext.busid.Length + 
+                           2*sizeof(*ext.busid.Buffer); // separators
+
+        unique_ptr buf(libdrv::uninitialized, PagedPool, len);
+        if (!buf) {
+                Trace(TRACE_LEVEL_ERROR, "Can't allocate %d bytes", len);
+                return false;
+        }
+
+        UNICODE_STRING str{ .MaximumLength = len, .Buffer = buf.get<WCHAR>() };
+
+        if (auto err = RtlUnicodeStringPrintf(&str, L"%wZ,%wZ,%wZ", &ext.node_name, &ext.service_name, &ext.busid)) {
+                Trace(TRACE_LEVEL_ERROR, "RtlUnicodeStringPrintf %!STATUS!", err);
+                return false;
+        }
+
+        return contains(devices.get<WDFCOLLECTION>(), str);
+}
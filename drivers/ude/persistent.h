@@ -12,6 +12,7 @@ namespace usbip
 
 struct vhci_ctx;
 struct device_ctx;
+struct device_ctx_ext;
 
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
@@ -24,8 +25,22 @@ PAGED NTSTATUS copy(
         _Inout_ char *service, _In_ USHORT service_sz, _In_ const UNICODE_STRING &uservice,
         _Inout_ char *busid, _In_ USHORT busid_sz, _In_ const UNICODE_STRING &ubusid);
 
+/*
+ * @return I/O target that sends requests to the given device itself
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED ObjectDelete make_target(_In_ WDFDEVICE vhci);
+
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
 PAGED void plugin_persistent_devices(_In_ vhci_ctx *vhci);
 
+/*
+ * @return true if the device is in the list of persistent devices
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED bool is_persistent(_In_ const device_ctx_ext &ext);
+
 } // namespace usbip
@@ -0,0 +1,360 @@
+/*
+ * Copyright (C) 2024 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "plugin_batch.h"
+#include "trace.h"
+#include "plugin_batch.tmh"
+
+#include "context.h"
+#include "driver.h"
+#include "persistent.h"
+#include "dns_cache.h"
+
+#include <libdrv\strconv.h>
+#include <libdrv\irp.h>
+
+namespace
+{
+
+using namespace usbip;
+
+enum { ARG_WORKITEM }; // of the batch request, see cancel_batch
+
+struct batch_ctx;
+
+struct batch_entry
+{
+        batch_ctx *owner;
+        WDFREQUEST request; // PLUGIN_HARDWARE that is sent to itself
+        vhci::ioctl::plugin_hardware req;
+        NTSTATUS status;
+};
+
+/*
+ * Context space for WDFWORKITEM.
+ */
+struct batch_ctx
+{
+        WDFDEVICE vhci;
+        WDFREQUEST request; // PLUGIN_HARDWARE_BATCH
+        vhci::ioctl::plugin_hardware_batch *r; // its buffer
+
+        KEVENT completed; // all sent requests are completed
+        KEVENT cancel; // the batch request is cancelled
+        volatile LONG inflight;
+};
+WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(batch_ctx, get_batch_ctx)
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void prefetch(_In_ const vhci::imported_device_location &d)
+{
+        PAGED_CODE();
+
+        UNICODE_STRING node{};
+        UNICODE_STRING service{};
+
+        if (auto err = libdrv::utf8_to_unicode(node, d.host, sizeof(d.host), PagedPool, pooltag)) {
+                Trace(TRACE_LEVEL_ERROR, "utf8_to_unicode('%s') %!STATUS!", d.host, err);
+        } else if (auto err = libdrv::utf8_to_unicode(service, d.service, sizeof(d.service), PagedPool, pooltag)) {
+                Trace(TRACE_LEVEL_ERROR, "utf8_to_unicode('%s') %!STATUS!", d.service, err);
+        } else {
+                dns_cache_prefetch(node, service); // PLUGIN_HARDWARE will report the error
+        }
+
+        libdrv::FreeUnicodeString(service, pooltag);
+        libdrv::FreeUnicodeString(node, pooltag);
+}
+
+/*
+ * Concurrent PLUGIN_HARDWARE-s for the same host would resolve it concurrently.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void prefetch(_In_ const vhci::ioctl::plugin_hardware_batch &r)
+{
+        PAGED_CODE();
+
+        for (ULONG i = 0; i < r.count; ++i) {
+                auto &d = r.devices[i];
+                bool seen = false;
+
+                for (ULONG j = 0; j < i && !seen; ++j) {
+                        auto &prev = r.devices[j];
+                        seen = !(strcmp(prev.host, d.host) || strcmp(prev.service, d.service));
+                }
+
+                if (!seen) {
+                        prefetch(d);
+                }
+        }
+}
+
+_Function_class_(EVT_WDF_REQUEST_COMPLETION_ROUTINE)
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void NTAPI plugin_complete(
+        _In_ WDFREQUEST, _In_ WDFIOTARGET, _In_ WDF_REQUEST_COMPLETION_PARAMS *params, _In_ WDFCONTEXT context)
+{
+        auto &e = *static_cast<batch_entry*>(context);
+        auto &ctx = *e.owner;
+
+        e.status = params->IoStatus.Status;
+
+        if (!InterlockedDecrement(&ctx.inflight)) {
+                KeSetEvent(&ctx.completed, IO_NO_INCREMENT, false); // must be the last access
+        }
+}
+
+/*
+ * Send PLUGIN_HARDWARE to itself.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto send(
+        _Inout_ batch_ctx &ctx, _In_ WDFIOTARGET target, _Inout_ batch_entry &e,
+        _In_ const vhci::imported_device_location &loc)
+{
+        PAGED_CODE();
+
+        e.owner = &ctx;
+        static_cast<vhci::imported_device_location&>(e.req) = loc;
+
+        e.req.size = sizeof(e.req);
+        e.req.port = 0;
+
+        WDF_OBJECT_ATTRIBUTES attr;
+        WDF_OBJECT_ATTRIBUTES_INIT(&attr);
+        attr.ParentObject = target;
+
+        if (auto err = WdfRequestCreate(&attr, target, &e.request)) {
+                Trace(TRACE_LEVEL_ERROR, "WdfRequestCreate %!STATUS!", err);
+                return err;
+        }
+
+        ObjectDelete request(e.request); // with its memory objects if this function fails
+        attr.ParentObject = e.request;
+        constexpr auto outlen = offsetof(vhci::ioctl::plugin_hardware, port) + sizeof(e.req.port);
+
+        WDFMEMORY input{};
+        WDFMEMORY output{};
+
+        if (auto err = WdfMemoryCreatePreallocated(&attr, &e.req, sizeof(e.req), &input)) {
+                Trace(TRACE_LEVEL_ERROR, "WdfMemoryCreatePreallocated %!STATUS!", err);
+                return err;
+        }
+
+        if (auto err = WdfMemoryCreatePreallocated(&attr, &e.req, outlen, &output)) {
+                Trace(TRACE_LEVEL_ERROR, "WdfMemoryCreatePreallocated %!STATUS!", err);
+                return err;
+        }
+
+        if (auto err = WdfIoTargetFormatRequestForIoctl(target, e.request, vhci::ioctl::PLUGIN_HARDWARE,
+                                                        input, nullptr, output, nullptr)) {
+                Trace(TRACE_LEVEL_ERROR, "WdfIoTargetFormatRequestForIoctl %!STATUS!", err);
+                return err;
+        }
+
+        e.status = STATUS_PENDING;
+        WdfRequestSetCompletionRoutine(e.request, plugin_complete, &e);
+
+        InterlockedIncrement(&ctx.inflight);
+
+        if (!WdfRequestSend(e.request, target, WDF_NO_SEND_OPTIONS)) { // completion routine will not be called
+                InterlockedDecrement(&ctx.inflight); // never drops to zero here, see run
+                auto err = WdfRequestGetStatus(e.request);
+                Trace(TRACE_LEVEL_ERROR, "WdfRequestSend %!STATUS!", err);
+                return err;
+        }
+
+        request.release(); // is deleted with its parent, see run
+        return STATUS_PENDING;
+}
+
+/*
+ * Entries are accessed by completion routines, wait for all sent requests.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void wait(_Inout_ batch_ctx &ctx, _In_ batch_entry *entries, _In_ ULONG cnt)
+{
+        PAGED_CODE();
+
+        void *objects[] { &ctx.completed, &ctx.cancel };
+
+        if (KeWaitForMultipleObjects(ARRAYSIZE(objects), objects, WaitAny, Executive, KernelMode, false,
+                                     nullptr, nullptr) == STATUS_WAIT_1) {
+
+                TraceDbg("req %04x cancelled", ptr04x(ctx.request));
+
+                for (ULONG i = 0; i < cnt; ++i) {
+                        if (auto &e = entries[i]; e.status == STATUS_PENDING) {
+                                WdfRequestCancelSentRequest(e.request);
+                        }
+                }
+
+                NT_VERIFY(!KeWaitForSingleObject(&ctx.completed, Executive, KernelMode, false, nullptr));
+        }
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS run(_Inout_ batch_ctx &ctx)
+{
+        PAGED_CODE();
+        auto &r = *ctx.r;
+
+        prefetch(r);
+
+        unique_ptr buf(NonPagedPoolNx, r.count*sizeof(batch_entry));
+        if (!buf) {
+                Trace(TRACE_LEVEL_ERROR, "Can't allocate %lu entries", r.count);
+                return STATUS_INSUFFICIENT_RESOURCES;
+        }
+        auto entries = buf.get<batch_entry>();
+
+        auto target = make_target(ctx.vhci); // parent of the requests
+        if (!target) {
+                return STATUS_UNSUCCESSFUL;
+        }
+
+        ctx.inflight = 1; // the bias
+
+        for (ULONG i = 0; i < r.count; ++i) {
+                auto &e = entries[i];
+                if (auto st = send(ctx, target.get<WDFIOTARGET>(), e, r.devices[i]); st != STATUS_PENDING) {
+                        e.status = st;
+                }
+        }
+
+        if (InterlockedDecrement(&ctx.inflight)) {
+                wait(ctx, entries, r.count);
+        }
+
+        for (ULONG i = 0; i < r.count; ++i) {
+                auto &e = entries[i];
+                auto &d = r.devices[i];
+
+                d.status = e.status;
+                d.port = NT_SUCCESS(e.status) ? e.req.port : 0;
+
+                TraceDbg("%s:%s/%s -> port %d, %!STATUS!", d.host, d.service, d.busid, d.port, e.status);
+        }
+
+        return STATUS_SUCCESS;
+}
+
+_Function_class_(EVT_WDF_REQUEST_CANCEL)
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void NTAPI cancel_batch(_In_ WDFREQUEST request)
+{
+        auto irp = WdfRequestWdmGetIrp(request);
+        TraceDbg("req %04x", ptr04x(request));
+
+        auto wi = libdrv::argv<WDFWORKITEM, ARG_WORKITEM>(irp);
+        KeSetEvent(&get_batch_ctx(wi)->cancel, IO_NO_INCREMENT, false);
+}
+
+_Function_class_(EVT_WDF_WORKITEM)
+_IRQL_requires_same_
+_IRQL_requires_max_(PASSIVE_LEVEL)
+PAGED void NTAPI batch_workitem(_In_ WDFWORKITEM wi)
+{
+        PAGED_CODE();
+
+        auto &ctx = *get_batch_ctx(wi);
+        auto request = ctx.request;
+
+        auto st = run(ctx);
+
+        if (WdfRequestUnmarkCancelable(request) == STATUS_CANCELLED) { // cancel_batch has been or will be called
+                NT_VERIFY(!KeWaitForSingleObject(&ctx.cancel, Executive, KernelMode, false, nullptr));
+        }
+
+        if (NT_SUCCESS(st)) {
+                WdfRequestSetInformation(request, vhci::ioctl::plugin_hardware_batch_size(ctx.r->count));
+        }
+
+        TraceDbg("req %04x, %!STATUS!", ptr04x(request), st);
+        WdfRequestComplete(request, st);
+
+        WdfObjectDelete(wi);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto create_workitem(_Out_ WDFWORKITEM &wi, _In_ WDFOBJECT parent)
+{
+        PAGED_CODE();
+
+        WDF_WORKITEM_CONFIG cfg;
+        WDF_WORKITEM_CONFIG_INIT(&cfg, batch_workitem);
+        cfg.AutomaticSerialization = false;
+
+        WDF_OBJECT_ATTRIBUTES attr; // WdfSynchronizationScopeNone is inherited from the driver object
+        WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&attr, batch_ctx);
+        attr.ParentObject = parent;
+
+        return WdfWorkItemCreate(&cfg, &attr, &wi);
+}
+
+} // namespace
+
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS usbip::plugin_hardware_batch(_In_ WDFREQUEST request)
+{
+        PAGED_CODE();
+        WdfRequestSetInformation(request, 0);
+
+        vhci::ioctl::plugin_hardware_batch *r{};
+        size_t length{};
+
+        if (auto err = WdfRequestRetrieveInputBuffer(request, sizeof(*r), reinterpret_cast<PVOID*>(&r), &length)) {
+                return err;
+        } else if (r->size != sizeof(*r)) {
+                Trace(TRACE_LEVEL_ERROR, "plugin_hardware_batch.size %lu != sizeof(plugin_hardware_batch) %Iu",
+                                          r->size, sizeof(*r));
+
+                return USBIP_ERROR_ABI;
+        } else if (!r->count || r->count > r->MAX_DEVICES) {
+                Trace(TRACE_LEVEL_ERROR, "count %lu", r->count);
+                return STATUS_INVALID_PARAMETER;
+        } else if (length != vhci::ioctl::plugin_hardware_batch_size(r->count)) {
+                return STATUS_INVALID_BUFFER_SIZE;
+        } else if (auto err = WdfRequestRetrieveOutputBuffer(request, length, nullptr, nullptr)) {
+                return err;
+        }
+
+        auto vhci = get_vhci(request);
+
+        WDFWORKITEM wi{};
+        if (auto err = create_workitem(wi, vhci)) {
+                Trace(TRACE_LEVEL_ERROR, "WdfWorkItemCreate %!STATUS!", err);
+                return err;
+        }
+
+        auto &ctx = *get_batch_ctx(wi);
+
+        ctx.vhci = vhci;
+        ctx.request = request;
+        ctx.r = r;
+
+        KeInitializeEvent(&ctx.completed, NotificationEvent, false);
+        KeInitializeEvent(&ctx.cancel, NotificationEvent, false);
+
+        libdrv::argv<ARG_WORKITEM>(WdfRequestWdmGetIrp(request)) = wi;
+
+        if (auto err = WdfRequestMarkCancelableEx(request, cancel_batch)) {
+                WdfObjectDelete(wi);
+                return err; // STATUS_CANCELLED
+        }
+
+        TraceDbg("req %04x, %lu device(s)", ptr04x(request), r->count);
+
+        WdfWorkItemEnqueue(wi);
+        return STATUS_PENDING;
+}
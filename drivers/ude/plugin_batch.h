@@ -0,0 +1,24 @@
+/*
+ * Copyright (C) 2024 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include <libdrv\codeseg.h>
+#include <wdf.h>
+
+namespace usbip
+{
+
+/*
+ * Handler of vhci::ioctl::PLUGIN_HARDWARE_BATCH.
+ *
+ * Addresses of each distinct host are resolved once and stored in the DNS cache,
+ * then PLUGIN_HARDWARE is sent to itself for every device at once.
+ * The request is completed after all of them.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS plugin_hardware_batch(_In_ WDFREQUEST request);
+
+} // namespace usbip
@@ -0,0 +1,34 @@
+/*
+ * Copyright (C) 2024 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include <wdm.h>
+
+namespace usbip
+{
+
+/*
+ * UdecxUsbDevicePlugOutAndDelete does not delete UDECXUSBDEVICE if it is called while PnP enumeration
+ * of the device is in progress, see device.cpp, detach. The enumeration is assumed to be completed
+ * if the device was configured or has been plugged in for the given delay.
+ *
+ * @param plugged microseconds since PLUGIN_HARDWARE when UdecxUsbDevicePlugIn was called, zero if it was not
+ * @param configured microseconds since PLUGIN_HARDWARE of the first SELECT_CONFIGURATION, zero if none
+ * @param now microseconds since PLUGIN_HARDWARE
+ * @param delay microseconds, zero disables deferral
+ * @return microseconds to wait before UdecxUsbDevicePlugOutAndDelete, zero if it must be called now
+ */
+constexpr ULONGLONG get_plugout_delay(
+        _In_ ULONGLONG plugged, _In_ ULONGLONG configured, _In_ ULONGLONG now, _In_ ULONGLONG delay)
+{
+        if (!plugged || configured || !delay) {
+                return 0;
+        }
+
+        auto deadline = plugged + delay;
+        return now < deadline ? deadline - now : 0;
+}
+
+} // namespace usbip
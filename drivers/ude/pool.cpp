@@ -0,0 +1,102 @@
+/*
+ * Copyright (C) 2024 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "pool.h"
+#include "trace.h"
+#include "pool.tmh"
+
+#include <libdrv\codeseg.h>
+
+namespace
+{
+
+using namespace usbip;
+
+pool_counter g_consumers[pool_consumers];
+ULONGLONG g_load_time; // KeQueryInterruptTime
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+inline auto& get_counter(_In_ pool_consumer c)
+{
+        NT_ASSERT(int(c) < ARRAYSIZE(g_consumers));
+        return g_consumers[int(c)];
+}
+
+} // namespace
+
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::copy(_Out_ vhci::pool_stats &dst, _In_ const pool_counter &src)
+{
+        dst.tag = 0;
+        dst.allocs = ReadNoFence64(&src.allocs);
+        dst.frees = ReadNoFence64(&src.frees);
+        dst.bytes = max(ReadNoFence64(&src.bytes), 0LL);
+        dst.peak = ReadNoFence64(&src.peak);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+void usbip::init_pool_stats()
+{
+        g_load_time = KeQueryInterruptTime();
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::charge(_In_ pool_consumer c, _In_ SIZE_T bytes)
+{
+        charge(get_counter(c), bytes);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::uncharge(_In_ pool_consumer c, _In_ SIZE_T bytes)
+{
+        uncharge(get_counter(c), bytes);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void *usbip::pool_alloc(_In_ pool_consumer c, _In_ POOL_TYPE type, _In_ SIZE_T bytes, _In_ bool zeroed)
+{
+        auto tag = get_pool_tag(c);
+
+        auto ptr = zeroed ? ExAllocatePoolZero(type, bytes, tag) :
+                            ExAllocatePoolUninitialized(type, bytes, tag);
+
+        if (ptr) {
+                charge(c, bytes);
+        }
+
+        return ptr;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::pool_free(_In_ pool_consumer c, _In_opt_ void *ptr, _In_ SIZE_T bytes)
+{
+        if (ptr) {
+                ExFreePoolWithTag(ptr, get_pool_tag(c));
+                uncharge(c, bytes);
+        }
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::get_pool_stats(_Inout_ vhci::ioctl::get_pool_stats &r)
+{
+        static_assert(pool_consumers <= ARRAYSIZE(r.consumers));
+
+        r.uptime = KeQueryInterruptTime() - g_load_time;
+        r.count = pool_consumers;
+
+        for (int i = 0; i < pool_consumers; ++i) {
+                auto &s = r.consumers[i];
+                copy(s, g_consumers[i]);
+                s.tag = pool_tags[i];
+        }
+}
@@ -0,0 +1,124 @@
+/*
+ * Copyright (C) 2024 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include "driver.h"
+#include "pool_counter.h"
+#include <usbip\vhci.h>
+
+namespace usbip
+{
+
+using vhci::pool_consumer;
+constexpr auto pool_consumers = int(pool_consumer::compression) + 1;
+
+/*
+ * Distinct tags let to find the consumer with poolmon, !poolused, etc.
+ * Tags are shown reversed, for example, 'KSWV' is VWSK.
+ */
+constexpr ULONG pool_tags[pool_consumers] {
+        pooltag, // VHCI
+        'KSWV', // wsk_context
+        'OSIV', // isoc
+        'NRDV', // payload (drain)
+        'VEDV', // device
+        'CSDV', // descriptors
+        'SNDV', // dns_cache
+        'TVEV', // events
+        'CRTV', // trace_ring
+        'PMCV', // compression
+};
+
+constexpr auto get_pool_tag(_In_ pool_consumer c)
+{
+        return pool_tags[int(c)];
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void copy(_Out_ vhci::pool_stats &dst, _In_ const pool_counter &src);
+
+/*
+ * Is called once on driver load, starts the uptime of vhci::ioctl::get_pool_stats.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+void init_pool_stats();
+
+/*
+ * For memory that is allocated by others, for example, by WdfMemoryCreate.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void charge(_In_ pool_consumer c, _In_ SIZE_T bytes);
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void uncharge(_In_ pool_consumer c, _In_ SIZE_T bytes);
+
+/*
+ * Allocates with the tag of the consumer and accounts the allocation.
+ * @param bytes must be passed to pool_free
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void *pool_alloc(_In_ pool_consumer c, _In_ POOL_TYPE type, _In_ SIZE_T bytes, _In_ bool zeroed = true);
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void pool_free(_In_ pool_consumer c, _In_opt_ void *ptr, _In_ SIZE_T bytes);
+
+/*
+ * Sets uptime and consumers.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void get_pool_stats(_Inout_ vhci::ioctl::get_pool_stats &r);
+
+class pool_ptr
+{
+public:
+        pool_ptr(_In_ pool_consumer c, _In_ POOL_TYPE type, _In_ SIZE_T bytes, _In_ bool zeroed = true) :
+                m_ptr(pool_alloc(c, type, bytes, zeroed)), m_bytes(bytes), m_consumer(c) {}
+
+        ~pool_ptr();
+
+        pool_ptr(const pool_ptr&) = delete;
+        pool_ptr& operator =(const pool_ptr&) = delete;
+
+        auto get() const { return m_ptr; }
+        explicit operator bool() const { return m_ptr; }
+
+        /*
+         * The allocation is also accounted in the given counter until it is freed.
+         */
+        void charge(_Inout_ pool_counter &owner);
+
+private:
+        void *m_ptr{};
+        SIZE_T m_bytes{};
+        pool_consumer m_consumer{};
+        pool_counter *m_owner{};
+};
+
+inline pool_ptr::~pool_ptr()
+{
+        if (m_owner) {
+                uncharge(*m_owner, m_bytes);
+        }
+
+        pool_free(m_consumer, m_ptr, m_bytes);
+}
+
+inline void pool_ptr::charge(_Inout_ pool_counter &owner)
+{
+        NT_ASSERT(m_ptr);
+        NT_ASSERT(!m_owner);
+
+        m_owner = &owner;
+        usbip::charge(owner, m_bytes);
+}
+
+} // namespace usbip
@@ -0,0 +1,48 @@
+/*
+ * Copyright (C) 2024 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include <wdm.h>
+
+namespace usbip
+{
+
+/*
+ * Accounting does not depend on the allocator, only interlocked operations are used.
+ */
+struct pool_counter
+{
+        volatile LONG64 allocs;
+        volatile LONG64 frees;
+        volatile LONG64 bytes;
+        volatile LONG64 peak;
+};
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+inline void charge(_Inout_ pool_counter &c, _In_ SIZE_T bytes)
+{
+        InterlockedIncrement64(&c.allocs);
+        auto cur = InterlockedAdd64(&c.bytes, bytes);
+
+        for (auto peak = ReadAcquire64(&c.peak); cur > peak; ) {
+                auto prev = InterlockedCompareExchange64(&c.peak, cur, peak);
+                if (prev == peak) {
+                        break;
+                }
+                peak = prev;
+        }
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+inline void uncharge(_Inout_ pool_counter &c, _In_ SIZE_T bytes)
+{
+        InterlockedIncrement64(&c.frees);
+        [[maybe_unused]] auto cur = InterlockedAdd64(&c.bytes, -LONG64(bytes));
+        NT_ASSERT(cur >= 0);
+}
+
+} // namespace usbip
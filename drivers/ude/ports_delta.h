@@ -0,0 +1,35 @@
+/*
+ * Copyright (C) 2024 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include <wdm.h>
+
+namespace usbip
+{
+
+/*
+ * @param since generation of the previous result, zero to get all devices
+ * @param since_epoch epoch of the previous result
+ * @param generation current, see vhci_ctx::generation
+ * @param epoch of this instance of the driver, see vhci_ctx::epoch
+ * @return true if all devices must be reported and the previous result must be discarded
+ */
+constexpr auto is_delta_reset(
+        _In_ UINT64 since, _In_ UINT64 since_epoch, _In_ UINT64 generation, _In_ UINT64 epoch)
+{
+        return !since || since_epoch != epoch || since > generation;
+}
+
+/*
+ * @param occupied the port has a device
+ * @param changed generation of the last change of the port, see vhci_ctx::changed
+ * @return true if the port must be reported by GET_IMPORTED_DEVICES_DELTA
+ */
+constexpr auto is_delta_reported(_In_ bool reset, _In_ bool occupied, _In_ UINT64 changed, _In_ UINT64 since)
+{
+        return reset ? occupied : changed > since;
+}
+
+} // namespace usbip
@@ -0,0 +1,425 @@
+/*
+ * Copyright (C) 2024 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "reconnect.h"
+#include "trace.h"
+#include "reconnect.tmh"
+
+#include "context.h"
+#include "vhci.h"
+#include "network.h"
+#include "persistent.h"
+#include "request_list.h"
+#include "wsk_receive.h"
+#include "dns_cache.h"
+#include "happy_eyeballs.h"
+#include "socket_buffers.h"
+
+#include <usbip\proto_op.h>
+
+#include <libdrv\dbgcommon.h>
+#include <libdrv\wait_timeout.h>
+
+namespace
+{
+
+using namespace usbip;
+
+const wchar_t grace_period_value_name[] = L"ReconnectGracePeriod";
+
+enum : ULONG {
+        MAX_GRACE_PERIOD = 24*60*60, // seconds
+        MAX_DELAY = 10, // seconds, between attempts
+        POLL_PERIOD = 1, // seconds, check for dev.unplugged
+};
+
+/*
+ * WSK functions that accept IRP are used synchronously by the receive thread.
+ */
+class wsk_irp
+{
+public:
+        wsk_irp() : m_irp(IoAllocateIrp(1, false)) { KeInitializeEvent(&m_event, NotificationEvent, false); }
+        ~wsk_irp() { if (m_irp) IoFreeIrp(m_irp); }
+
+        wsk_irp(_In_ const wsk_irp&) = delete;
+        wsk_irp& operator=(_In_ const wsk_irp&) = delete;
+
+        explicit operator bool() const { return m_irp; }
+        auto operator !() const { return !m_irp; }
+
+        _IRQL_requires_max_(DISPATCH_LEVEL)
+        IRP *prepare()
+        {
+                IoReuseIrp(m_irp, STATUS_UNSUCCESSFUL);
+                KeClearEvent(&m_event);
+                IoSetCompletionRoutine(m_irp, completion, &m_event, true, true, true);
+                return m_irp;
+        }
+
+        _IRQL_requires_max_(APC_LEVEL)
+        PAGED NTSTATUS wait(_In_ const device_ctx &dev, _In_ NTSTATUS st, _In_ ULONGLONG deadline);
+
+private:
+        IRP *m_irp{};
+        KEVENT m_event;
+
+        _Function_class_(IO_COMPLETION_ROUTINE)
+        _IRQL_requires_same_
+        _IRQL_requires_max_(DISPATCH_LEVEL)
+        static NTSTATUS completion(_In_ DEVICE_OBJECT*, _In_ IRP*, _In_reads_opt_(_Inexpressible_("varies")) void *context)
+        {
+                KeSetEvent(static_cast<KEVENT*>(context), IO_NO_INCREMENT, false);
+                return StopCompletion;
+        }
+};
+
+/*
+ * WSK completes IRP for any status, but libdrv wrappers can fail without calling WSK.
+ * IRP is cancelled if it is not completed until the deadline or the device is unplugged.
+ */
+_IRQL_requires_max_(APC_LEVEL)
+PAGED NTSTATUS wsk_irp::wait(_In_ const device_ctx &dev, _In_ NTSTATUS st, _In_ ULONGLONG deadline)
+{
+        PAGED_CODE();
+
+        if (st != STATUS_PENDING && !KeReadStateEvent(&m_event)) {
+                return st;
+        }
+
+        for (auto timeout = make_timeout(POLL_PERIOD*wdm::second, wdm::period::relative);
+             KeWaitForSingleObject(&m_event, Executive, KernelMode, false, &timeout) == STATUS_TIMEOUT; ) {
+
+                if (dev.unplugged || KeQueryInterruptTime() >= deadline) {
+                        IoCancelIrp(m_irp);
+                        NT_VERIFY(!KeWaitForSingleObject(&m_event, Executive, KernelMode, false, nullptr));
+                        break;
+                }
+        }
+
+        return m_irp->IoStatus.Status;
+}
+
+/*
+ * @return false if the device was unplugged
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto sleep(_In_ const device_ctx &dev, _In_ ULONGLONG deadline)
+{
+        PAGED_CODE();
+        auto delay = make_timeout(POLL_PERIOD*wdm::second, wdm::period::relative);
+
+        while (!dev.unplugged && KeQueryInterruptTime() < deadline) {
+                KeDelayExecutionThread(KernelMode, false, &delay);
+        }
+
+        return !dev.unplugged;
+}
+
+/*
+ * The server must export the same device, otherwise the client drivers would talk to a wrong one.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto import_same_device(_In_ SOCKET *sock, _In_ const device_ctx_ext &ext)
+{
+        PAGED_CODE();
+
+        if (auto err = send_req_import(sock, ext.busid)) {
+                Trace(TRACE_LEVEL_ERROR, "Send OP_REQ_IMPORT %!STATUS!", err);
+                return err;
+        }
+
+        op_import_reply reply;
+        if (auto err = recv_rep_import(sock, ext.busid, memory::stack, reply)) {
+                return err;
+        }
+
+        auto &udev = reply.udev;
+        auto &d = ext.dev;
+
+        auto devid = make_devid(static_cast<UINT16>(udev.busnum), static_cast<UINT16>(udev.devnum));
+
+        if (devid != d.devid || udev.speed != static_cast<UINT32>(d.speed) ||
+            udev.idVendor != d.vendor || udev.idProduct != d.product) {
+                Trace(TRACE_LEVEL_ERROR, "Other device is exported: devid %#x, speed %u, %04x:%04x",
+                                          devid, udev.speed, udev.idVendor, udev.idProduct);
+                return STATUS_NO_MATCH;
+        }
+
+        return STATUS_SUCCESS;
+}
+
+/*
+ * device_ctx_ext::features are used concurrently and can't be changed, the server must accept the same ones.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto request_same_features(_In_ SOCKET *sock, _In_ const device_ctx_ext &ext)
+{
+        PAGED_CODE();
+
+        auto features = ext.features;
+        if (!features) {
+                return STATUS_SUCCESS;
+        }
+
+        if (auto err = request_features(sock, features)) {
+                Trace(TRACE_LEVEL_ERROR, "OP_REQ_FEATURES %!STATUS!", err);
+                return err;
+        }
+
+        if (features != ext.features) {
+                Trace(TRACE_LEVEL_ERROR, "Accepted features %#x != %#x", features, ext.features);
+                return STATUS_NOT_SUPPORTED;
+        }
+
+        return STATUS_SUCCESS;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto connect(_Out_ SOCKET* &sock, _In_ const device_ctx &dev, _In_ ULONGLONG deadline)
+{
+        PAGED_CODE();
+        sock = nullptr;
+
+        wsk_irp irp;
+        if (!irp) {
+                return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        ADDRINFOEXW hints {
+                .ai_flags = AI_NUMERICSERV,
+                .ai_family = AF_UNSPEC,
+                .ai_socktype = SOCK_STREAM,
+                .ai_protocol = IPPROTO_TCP // zero isn't work
+        };
+
+        auto &ext = *dev.ext;
+        ADDRINFOEXW *addrinfo{};
+
+        NTSTATUS st;
+        bool cached = dns_cache_get(addrinfo, st, ext.node_name, ext.service_name, false);
+
+        if (cached) {
+                // fresh positive or negative entry
+        } else if (st = irp.wait(dev, wsk::getaddrinfo(addrinfo, &ext.node_name, &ext.service_name, &hints, irp.prepare()), 
+                                 deadline); !st) {
+                dns_cache_put(ext.node_name, ext.service_name, addrinfo, st);
+        } else if (NTSTATUS stale; st != STATUS_CANCELLED && 
+                   dns_cache_get(addrinfo, stale, ext.node_name, ext.service_name, true)) {
+                NT_ASSERT(!stale);
+                Trace(TRACE_LEVEL_WARNING, "getaddrinfo('%!USTR!:%!USTR!') %!STATUS!, using stale addresses",
+                                            &ext.node_name, &ext.service_name, st);
+                cached = true;
+                st = STATUS_SUCCESS;
+        } else {
+                dns_cache_put(ext.node_name, ext.service_name, nullptr, st);
+        }
+
+        if (st) {
+                Trace(TRACE_LEVEL_ERROR, "getaddrinfo('%!USTR!:%!USTR!') %!STATUS!",
+                                          &ext.node_name, &ext.service_name, st);
+                return st;
+        }
+
+        if (st = happy_eyeballs_connect(sock, *addrinfo, const_cast<KEVENT*>(&dev.unplugged_event), deadline); st) {
+                TraceDbg("connect %!STATUS!", st);
+        } else if (st = request_same_features(sock, ext); st) {
+                close_socket(sock);
+                free(sock);
+        } else if (st = import_same_device(sock, ext); st) {
+                close_socket(sock);
+                free(sock);
+        } else {
+                apply_socket_buffers(sock, ext.buffers); // not fatal
+        }
+
+        if (cached) {
+                free_cached_addrinfo(addrinfo);
+        } else {
+                wsk::free(addrinfo);
+        }
+
+        return st;
+}
+
+/*
+ * Socket is replaced under send_lock, so concurrent send() uses either socket.
+ * The previous socket is not freed because ::detach can use it,
+ * it will be freed by the next reconnect or with device_ctx_ext.
+ *
+ * Called while dev.reconnecting is set and after fail_pending_requests, send() does not send anything.
+ * Other threads can hold seqnums that were issued for the closed socket but were not sent yet.
+ * seqnum_epoch is incremented after seqnum is reset, send() fails such requests with RECONNECT_STATUS.
+ * A request whose epoch was read after the increment gets a seqnum from the fresh space.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void replace_socket(_Inout_ device_ctx &dev, _In_ SOCKET *sock)
+{
+        PAGED_CODE();
+
+        auto &ext = *dev.ext;
+        free(ext.prev_sock);
+
+        wdf::Lock lck(dev.send_lock);
+
+        ext.prev_sock = ext.sock;
+        ext.sock = sock;
+
+        static_assert(sizeof(dev.seqnum) == sizeof(LONG));
+        InterlockedExchange(reinterpret_cast<LONG*>(&dev.seqnum), 0); // fresh seqnum space
+        InterlockedIncrement(&dev.seqnum_epoch); // after the reset
+}
+
+/*
+ * Requests that were sent to the closed socket will never get USBIP_RET_SUBMIT.
+ * send() appends a request under send_lock, so the list has requests of the closed socket only.
+ * Requests that are sent after that are failed by send() with RECONNECT_STATUS, see dev.reconnecting.
+ * They are completed outside of send_lock because completion can dispatch a new URB.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void fail_pending_requests(_Inout_ device_ctx &dev)
+{
+        LIST_ENTRY list;
+        InitializeListHead(&list);
+
+        {
+                wdf::Lock lck(dev.send_lock);
+
+                while (auto request = device::remove_request(dev, device::any_request)) {
+                        InsertTailList(&list, &get_request_ctx(request)->entry);
+                }
+        }
+
+        ULONG cnt = 0;
+
+        for ( ; !IsListEmpty(&list); ++cnt) {
+                auto req = CONTAINING_RECORD(RemoveHeadList(&list), request_ctx, entry);
+                complete(get_handle(req), RECONNECT_STATUS);
+        }
+
+        if (cnt) {
+                TraceDbg("dev %04x, %lu request(s) completed", ptr04x(get_handle(&dev)), cnt);
+        }
+}
+
+constexpr auto get_delay(_In_ ULONG attempt)
+{
+        return min(1UL << min(attempt, 4UL), ULONG(MAX_DELAY)); // 1, 2, 4, 8, 10, 10, ...
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto restore_connection(_Inout_ device_ctx &dev, _In_ ULONGLONG deadline)
+{
+        PAGED_CODE();
+        NTSTATUS st = STATUS_CANCELLED;
+
+        for (ULONG attempt = 0; !dev.unplugged; ++attempt) {
+
+                device_state_changed(dev, vhci::state::connecting);
+
+                SOCKET *sock{};
+                st = connect(sock, dev, deadline);
+
+                if (!st) {
+                        replace_socket(dev, sock);
+                        break;
+                } else if (st == STATUS_NO_MATCH) { // do not retry
+                        break;
+                }
+
+                auto now = KeQueryInterruptTime();
+                if (now >= deadline || !sleep(dev, min(now + get_delay(attempt)*ULONGLONG(wdm::second), deadline))) {
+                        break;
+                }
+        }
+
+        return st;
+}
+
+} // namespace
+
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED ULONG usbip::get_reconnect_grace_period()
+{
+        PAGED_CODE();
+        ULONG val = 0;
+
+        Registry key;
+        if (auto err = open_parameters_key(key, KEY_QUERY_VALUE)) {
+                return val;
+        }
+
+        UNICODE_STRING name;
+        RtlUnicodeStringInit(&name, grace_period_value_name);
+
+        if (auto err = WdfRegistryQueryULong(key.get(), &name, &val)) {
+                if (err != STATUS_OBJECT_NAME_NOT_FOUND) {
+                        Trace(TRACE_LEVEL_ERROR, "WdfRegistryQueryULong('%!USTR!') %!STATUS!", &name, err);
+                }
+                val = 0;
+        }
+
+        return min(val, ULONG(MAX_GRACE_PERIOD));
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED bool usbip::reconnect(_Inout_ device_ctx &dev)
+{
+        PAGED_CODE();
+
+        if (dev.unplugged || !dev.reconnect_grace_period) {
+                return false;
+        }
+
+        auto device = get_handle(&dev);
+        dev.reconnecting = true;
+
+        if (close_socket(dev.sock())) {
+                Trace(TRACE_LEVEL_INFORMATION, "dev %04x, connection lost, reconnecting", ptr04x(device));
+                device_state_changed(dev, vhci::state::disconnected);
+        }
+
+        fail_pending_requests(dev);
+
+        auto start = KeQueryInterruptTime();
+        auto st = restore_connection(dev, start + dev.reconnect_grace_period*ULONGLONG(wdm::second));
+
+        if (st) {
+                Trace(TRACE_LEVEL_ERROR, "dev %04x, reconnect failed %!STATUS!", ptr04x(device), st);
+                dev.reconnecting = false;
+                return false;
+        }
+
+        if (dev.unplugged) { // ::detach could close the previous socket
+                close_socket(dev.sock());
+                dev.reconnecting = false;
+                return false;
+        }
+
+        dev.reconnecting = false;
+
+        auto duration = LONG64(KeQueryInterruptTime() - start);
+
+        ++dev.reconnects;
+        dev.reconnect_time += duration;
+        dev.last_reconnect_time = duration;
+
+        Trace(TRACE_LEVEL_INFORMATION, "dev %04x, reconnected in %lld ms, reconnects %lu, total %lld ms",
+                ptr04x(device), duration/wdm::msec, dev.reconnects, dev.reconnect_time/wdm::msec);
+
+        device_state_changed(dev, vhci::state::connected);
+        device_state_changed(dev, vhci::state::plugged);
+
+        return true;
+}
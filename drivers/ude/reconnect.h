@@ -0,0 +1,41 @@
+/*
+ * Copyright (C) 2024 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include <libdrv\codeseg.h>
+#include <wdm.h>
+
+namespace usbip
+{
+
+struct device_ctx;
+
+/*
+ * URBs that were sent to a server before connection loss or during reconnect are completed with this status.
+ * The server will never reply to them, a client driver can resubmit such URBs.
+ */
+constexpr auto RECONNECT_STATUS = STATUS_RETRY;
+
+/*
+ * @return seconds, zero if reconnect mode is disabled
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED ULONG get_reconnect_grace_period();
+
+/*
+ * Reconnect mode keeps the device plugged if the connection is lost.
+ * Pending URBs are failed, the same busid is imported again through a new connection,
+ * the device continues with a fresh seqnum space. The device is detached if the connection
+ * can't be restored during the grace period or the server exports other device under this busid.
+ *
+ * Must be called by the receive thread only.
+ * @return true if the connection was restored
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED bool reconnect(_Inout_ device_ctx &dev);
+
+} // namespace usbip
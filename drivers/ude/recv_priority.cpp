@@ -0,0 +1,181 @@
+/*
+ * Copyright (C) 2024 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "recv_priority.h"
+#include "trace.h"
+#include "recv_priority.tmh"
+
+#include "context.h"
+#include "persistent.h"
+
+#include <libdrv\ch9.h>
+
+namespace
+{
+
+using namespace usbip;
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto get_target_priority(_In_ const device_ctx &dev)
+{
+        return usbip::get_target_priority(dev.ext->recv_options.class_aware, dev.intf_priority);
+}
+
+/*
+ * The ideal processor assigned by the system is saved before it is changed for the first time
+ * and restored if the index is negative.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto set_ideal_processor(_Inout_ device_ctx &dev, _In_ int index)
+{
+        PAGED_CODE();
+        PROCESSOR_NUMBER num{};
+
+        if (index < 0) {
+                num = dev.recv_default_processor;
+        } else if (auto err = KeGetProcessorNumberFromIndex(index, &num)) {
+                Trace(TRACE_LEVEL_ERROR, "KeGetProcessorNumberFromIndex(%d) %!STATUS!", index, err);
+                return err;
+        } else if (dev.recv_processor < 0) {
+                auto &def = dev.recv_default_processor;
+                if (auto err = ZwQueryInformationThread(ZwCurrentThread(), ThreadIdealProcessorEx, 
+                                                        &def, sizeof(def), nullptr)) {
+                        Trace(TRACE_LEVEL_ERROR, "ZwQueryInformationThread(ThreadIdealProcessorEx) %!STATUS!", err);
+                        return err;
+                }
+        }
+
+        if (auto err = ZwSetInformationThread(ZwCurrentThread(), ThreadIdealProcessorEx, &num, sizeof(num))) {
+                Trace(TRACE_LEVEL_ERROR, "ZwSetInformationThread(ThreadIdealProcessorEx, group %d, number %d) %!STATUS!",
+                                          num.Group, num.Number, err);
+                return err;
+        }
+
+        dev.recv_processor = index < 0 ? -1 : index;
+        return STATUS_SUCCESS;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto query_value(_In_ WDFKEY key, _In_ const wchar_t *value_name, _In_ int default_value)
+{
+        PAGED_CODE();
+
+        UNICODE_STRING name;
+        RtlUnicodeStringInit(&name, value_name);
+
+        ULONG val{};
+        if (auto err = WdfRegistryQueryULong(key, &name, &val)) {
+                if (err != STATUS_OBJECT_NAME_NOT_FOUND) {
+                        Trace(TRACE_LEVEL_ERROR, "WdfRegistryQueryULong('%!USTR!') %!STATUS!", &name, err);
+                }
+                return default_value;
+        }
+
+        return static_cast<int>(min(val, ULONG(INT_MAX)));
+}
+
+} // namespace
+
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::set_interface_priority(_Inout_ device_ctx &dev, _In_ UCHAR intf_num, _In_ KPRIORITY priority)
+{
+        if (intf_num >= ARRAYSIZE(dev.intf_priority)) {
+                Trace(TRACE_LEVEL_ERROR, "InterfaceNumber %d is out of range", intf_num);
+                return;
+        }
+
+        NT_ASSERT(priority >= 0 && priority < HIGH_PRIORITY);
+        dev.intf_priority[intf_num] = static_cast<UCHAR>(priority);
+
+        InterlockedExchange(&dev.recv_options_changed, true);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::clear_interface_priority(_Inout_ device_ctx &dev)
+{
+        RtlZeroMemory(dev.intf_priority, sizeof(dev.intf_priority));
+        InterlockedExchange(&dev.recv_options_changed, true);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void usbip::get_default_recv_thread_options(_Out_ vhci::recv_thread_options &opts)
+{
+        PAGED_CODE();
+
+        opts = { .class_aware = false, .ideal_processor = opts.ANY_PROCESSOR };
+
+        Registry key;
+        if (auto err = open_parameters_key(key, KEY_QUERY_VALUE)) {
+                return;
+        }
+
+        opts.class_aware = !!query_value(key.get(), L"RecvThreadClassAware", opts.class_aware);
+        opts.ideal_processor = query_value(key.get(), L"RecvThreadIdealProcessor", opts.ideal_processor);
+
+        if (ULONG(opts.ideal_processor) >= KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS)) {
+                opts.ideal_processor = opts.ANY_PROCESSOR;
+        }
+
+        TraceDbg("class_aware %d, ideal_processor %d", opts.class_aware, opts.ideal_processor);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void usbip::apply_recv_thread_options(_Inout_ device_ctx &dev)
+{
+        PAGED_CODE();
+
+        if (!InterlockedExchange(&dev.recv_options_changed, false)) {
+                return;
+        }
+
+        if (auto prio = get_target_priority(dev); prio != dev.recv_priority) {
+                auto prev = KeSetPriorityThread(KeGetCurrentThread(), prio);
+                TraceDbg("dev %04x, priority %ld -> %ld", ptr04x(get_handle(&dev)), prev, prio);
+                dev.recv_priority = prio;
+        }
+
+        if (auto n = max(dev.ext->recv_options.ideal_processor, -1); n != dev.recv_processor) {
+                if (!set_ideal_processor(dev, n)) {
+                        TraceDbg("dev %04x, ideal processor %d", ptr04x(get_handle(&dev)), n);
+                }
+        }
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS usbip::set_recv_thread_options(
+        _Inout_ device_ctx &dev, _Inout_ vhci::recv_thread_options &r, _Out_ KPRIORITY &priority)
+{
+        PAGED_CODE();
+        auto &opts = dev.ext->recv_options;
+
+        if (r.ideal_processor == r.ANY_PROCESSOR) {
+                opts.ideal_processor = r.ANY_PROCESSOR;
+        } else if (r.ideal_processor >= 0) {
+                if (ULONG(r.ideal_processor) >= KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS)) {
+                        priority = 0;
+                        return STATUS_INVALID_PARAMETER;
+                }
+                opts.ideal_processor = r.ideal_processor;
+        }
+
+        if (r.class_aware >= 0) {
+                opts.class_aware = !!r.class_aware;
+        }
+
+        InterlockedExchange(&dev.recv_options_changed, true);
+
+        r = opts;
+        priority = get_target_priority(dev);
+
+        return STATUS_SUCCESS;
+}
@@ -0,0 +1,58 @@
+/*
+ * Copyright (C) 2024 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include "recv_priority_policy.h"
+
+#include <libdrv\codeseg.h>
+#include <usbip\vhci.h>
+
+namespace usbip
+{
+
+struct device_ctx;
+
+/*
+ * Is called for each selected alternate setting.
+ * @param priority see get_class_priority
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void set_interface_priority(_Inout_ device_ctx &dev, _In_ UCHAR intf_num, _In_ KPRIORITY priority);
+
+/*
+ * Is called on SELECT_CONFIGURATION, all interfaces are released.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void clear_interface_priority(_Inout_ device_ctx &dev);
+
+/*
+ * Defaults for new devices are read from the driver's Parameters key:
+ * RecvThreadClassAware - boolean, false if absent, all receive threads run at DEFAULT_RECV_PRIORITY;
+ * RecvThreadIdealProcessor - system-wide index of a processor, absent leaves the choice to the scheduler.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void get_default_recv_thread_options(_Out_ vhci::recv_thread_options &opts);
+
+/*
+ * Is called by the receive thread itself, it is never changed by others.
+ * New priority takes effect after the thread receives the next response of the server.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void apply_recv_thread_options(_Inout_ device_ctx &dev);
+
+/*
+ * @param r IN: new values, see vhci::ioctl::set_recv_thread_options; OUT: actual values
+ * @param priority that the thread will run at
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS set_recv_thread_options(
+        _Inout_ device_ctx &dev, _Inout_ vhci::recv_thread_options &r, _Out_ KPRIORITY &priority);
+
+} // namespace usbip
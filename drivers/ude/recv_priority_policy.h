@@ -0,0 +1,86 @@
+/*
+ * Copyright (C) 2024 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include <wdm.h>
+#include <usbspec.h>
+
+namespace usbip
+{
+
+enum : KPRIORITY { 
+        DEFAULT_RECV_PRIORITY = 8, // of system threads
+        AUDIO_PRIORITY = LOW_REALTIME_PRIORITY, // isochronous, a glitch is audible
+        VIDEO_PRIORITY = LOW_REALTIME_PRIORITY - 1, // isochronous or bulk streaming, a dropped frame is tolerable
+        INPUT_PRIORITY = LOW_REALTIME_PRIORITY - 2, // interrupt, low volume, interactive
+        SERIAL_PRIORITY = DEFAULT_RECV_PRIORITY + 2, // modems, network adapters, readers
+};
+
+/*
+ * The receive thread completes URBs, its priority matters if many devices are imported
+ * and some of them are isochronous or interactive.
+ *
+ * @return priority for the receive thread of a device that has an interface of this class,
+ *         zero if the class is not latency-sensitive
+ */
+constexpr KPRIORITY get_class_priority(_In_ int cls, _In_ int subclass, _In_ int proto)
+{
+        switch (cls) {
+        case USB_DEVICE_CLASS_AUDIO:
+                return AUDIO_PRIORITY;
+        case USB_DEVICE_CLASS_VIDEO:
+                return VIDEO_PRIORITY;
+        case USB_DEVICE_CLASS_AUDIO_VIDEO:
+                switch (subclass) {
+                case 2: // AVData Video Streaming Interface
+                        return VIDEO_PRIORITY;
+                case 3: // AVData Audio Streaming Interface
+                        return AUDIO_PRIORITY;
+                }
+                break;
+        case USB_DEVICE_CLASS_HUMAN_INTERFACE:
+                return INPUT_PRIORITY;
+        case USB_DEVICE_CLASS_WIRELESS_CONTROLLER:
+        case USB_DEVICE_CLASS_COMMUNICATIONS:
+        case USB_DEVICE_CLASS_PRINTER:
+        case USB_DEVICE_CLASS_SMART_CARD:
+                return SERIAL_PRIORITY;
+        case USB_DEVICE_CLASS_MISCELLANEOUS:
+                switch (subclass) {
+                case 4: // RNDIS over XXX
+                        return SERIAL_PRIORITY;
+                case 5: // Machine Vision Device conforming to the USB3 Vision specification
+                        switch (proto) {
+                        case 2: // USB3 Vision Streaming Interface
+                                return VIDEO_PRIORITY;
+                        }
+                        break;
+                }
+                break;
+        }
+
+        return 0; // mass storage, bulk transfers are throughput-bound
+}
+
+/*
+ * @param class_aware see vhci::recv_thread_options
+ * @param intf_priority see device_ctx::intf_priority
+ * @return priority the receive thread must run at
+ */
+template<size_t N>
+constexpr KPRIORITY get_target_priority(_In_ bool class_aware, _In_ const UCHAR (&intf_priority)[N])
+{
+        KPRIORITY prio = DEFAULT_RECV_PRIORITY;
+
+        if (class_aware) {
+                for (auto p: intf_priority) {
+                        prio = max(prio, KPRIORITY(p));
+                }
+        }
+
+        return prio;
+}
+
+} // namespace usbip
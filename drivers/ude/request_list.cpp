@@ -9,6 +9,8 @@
 #include "context.h"
 #include "wsk_context.h"
 #include "device_ioctl.h"
+#include "trace_ring.h"
+#include "deadline.h"
 
 namespace
 {
@@ -26,6 +28,8 @@ auto matches(_In_ WDFREQUEST request, _In_ const request_ctx &req, _In_ const de
                 return crit.request == request;
         case crit.ENDPOINT:
                 return crit.endpoint == req.endpoint;
+        case crit.ANY:
+                return true;
         }
 
         Trace(TRACE_LEVEL_ERROR, "Invalid union member selector %d", crit.what);
@@ -55,6 +59,7 @@ void usbip::device::append_request(_Inout_ device_ctx &dev, _In_ const wsk_conte
 {
         auto &req = *get_request_ctx(wsk.request); // is not zeroed
         req.cancelable = false;
+        init(req.deadline);
 
         NT_ASSERT(endpoint);
         req.endpoint = endpoint;
@@ -62,8 +67,31 @@ void usbip::device::append_request(_Inout_ device_ctx &dev, _In_ const wsk_conte
         req.seqnum = wsk.hdr.base.seqnum;
         NT_ASSERT(is_valid_seqnum(req.seqnum));
 
+        ULONG64 qpc;
+        req.length = wsk.hdr.base.command == USBIP_CMD_SUBMIT ? wsk.hdr.u.cmd_submit.transfer_buffer_length : 0;
+        req.send_time = KeQueryInterruptTimePrecise(&qpc);
+
+        if (auto &t = req.dispatch_time) {
+                trace_urb(vhci::trace_event::dispatch, dev, req, req.length, STATUS_SUCCESS, t);
+                t = 0; // request_ctx can be reused by a path that does not set it
+        }
+        trace_urb(vhci::trace_event::submit, dev, req, req.length, STATUS_SUCCESS);
+        auto deadline = get_deadline(dev, endpoint, wsk.hdr);
+
         wdf::Lock lck(dev.requests_lock);
         InsertTailList(&dev.requests, &req.entry);
+
+        if (deadline) {
+                if (!dev.deadlines.count) { // the timer is stopped, see remove_expired_requests
+                        start_deadline_timer(dev);
+                }
+                schedule(dev.deadlines, req.deadline, deadline);
+        }
+
+        ++get_endpoint_ctx(endpoint)->stats.submitted;
+        ++dev.inflight_requests;
+        dev.inflight_bytes += req.length;
+        dev.max_inflight_bytes = max(dev.max_inflight_bytes, dev.inflight_bytes);
 }
 
 /*
@@ -87,6 +115,9 @@ NTSTATUS usbip::device::mark_request_cancelable(_Inout_ device_ctx &dev, _In_ se
                 } else if (auto request = get_handle(req); auto err = WdfRequestMarkCancelableEx(request, cancel_request)) {
                         TraceDbg("%04x, %!STATUS!", ptr04x(request), err);
                         RemoveEntryList(entry);
+                        cancel(dev.deadlines, req->deadline);
+                        --dev.inflight_requests;
+                        dev.inflight_bytes -= req->length;
                         return err; // must do the same as cancel_request after that
                 } else {
                         req->cancelable = true;
@@ -104,7 +135,7 @@ NTSTATUS usbip::device::mark_request_cancelable(_Inout_ device_ctx &dev, _In_ se
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
 WDFREQUEST usbip::device::remove_request(
-        _In_ device_ctx &dev, _In_ const request_search &crit, _In_ bool unmark_cancelable)
+        _Inout_ device_ctx &dev, _In_ const request_search &crit, _In_ bool unmark_cancelable)
 {
         wdf::Lock lck(dev.requests_lock);
 
@@ -118,6 +149,9 @@ WDFREQUEST usbip::device::remove_request(
                 }
 
                 RemoveEntryList(entry);
+                cancel(dev.deadlines, req->deadline);
+                --dev.inflight_requests;
+                dev.inflight_bytes -= req->length;
 
                 if (!(unmark_cancelable && req->cancelable)) {
                         // not required
@@ -137,3 +171,42 @@ WDFREQUEST usbip::device::remove_request(
 
         return WDF_NO_HANDLE;
 }
+
+/*
+ * A request that is marked cancelable and is being cancelled is left for cancel_request.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::device::remove_expired_requests(_Inout_ device_ctx &dev, _In_ UINT64 now, _Inout_ LIST_ENTRY &expired)
+{
+        LIST_ENTRY list;
+        InitializeListHead(&list);
+
+        wdf::Lock lck(dev.requests_lock);
+        advance(dev.deadlines, now, list);
+
+        while (!IsListEmpty(&list)) {
+                auto entry = RemoveHeadList(&list);
+                InitializeListHead(entry);
+
+                auto req = CONTAINING_RECORD(entry, request_ctx, deadline.entry);
+                auto request = get_handle(req);
+
+                RemoveEntryList(&req->entry);
+                --dev.inflight_requests;
+                dev.inflight_bytes -= req->length;
+
+                if (req->cancelable) {
+                        if (auto err = WdfRequestUnmarkCancelable(request); err == STATUS_CANCELLED) {
+                                TraceDbg("%04x, unmark cancelable %!STATUS!", ptr04x(request), err);
+                                continue;
+                        }
+                }
+
+                InsertTailList(&expired, entry);
+        }
+
+        if (!dev.deadlines.count) { // under the lock, see start_deadline_timer
+                WdfTimerStop(dev.deadline_timer, false);
+        }
+}
@@ -20,6 +20,9 @@ namespace usbip
 namespace usbip::device
 {
 
+struct any_request_t { explicit any_request_t() = default; };
+inline constexpr any_request_t any_request{};
+
 struct request_search
 {
         request_search(_In_ WDFREQUEST req) : request(req), what(REQUEST) {}
@@ -29,10 +32,14 @@ struct request_search
                 request(reinterpret_cast<WDFREQUEST>(static_cast<uintptr_t>(n))), // for operator bool correctness
                 what(SEQNUM) { NT_ASSERT(seqnum == n); }
 
+        request_search(_In_ any_request_t) : 
+                request(reinterpret_cast<WDFREQUEST>(~uintptr_t())), // for operator bool correctness
+                what(ANY) {}
+
         explicit operator bool() const { return request; }; // largest in union
         auto operator !() const { return !request; }
 
-        auto multimatch() const { return what == ENDPOINT; }
+        auto multimatch() const { return what == ENDPOINT || what == ANY; }
 
         union {
                 WDFREQUEST request{};
@@ -40,7 +47,7 @@ struct request_search
                 seqnum_t seqnum;
         };
 
-        enum what_t { SEQNUM, REQUEST, ENDPOINT };
+        enum what_t { SEQNUM, REQUEST, ENDPOINT, ANY };
         what_t what; // union's member selector
 };
 
@@ -55,6 +62,16 @@ NTSTATUS mark_request_cancelable(_Inout_ device_ctx &dev, _In_ seqnum_t seqnum);
 
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
-WDFREQUEST remove_request(_In_ device_ctx &dev, _In_ const request_search &crit, _In_ bool unmark_cancelable = true);
+WDFREQUEST remove_request(_Inout_ device_ctx &dev, _In_ const request_search &crit, _In_ bool unmark_cancelable = true);
+
+/*
+ * Removes requests which deadline is reached, see deadline.h.
+ * Stops device_ctx::deadline_timer if no deadlines are left.
+ * @param now tick of device_ctx::deadlines
+ * @param expired list head of request_ctx::deadline.entry, the caller must complete these requests
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void remove_expired_requests(_Inout_ device_ctx &dev, _In_ UINT64 now, _Inout_ LIST_ENTRY &expired);
 
 } // namespace usbip::device
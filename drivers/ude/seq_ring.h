@@ -0,0 +1,96 @@
+/*
+ * Copyright (C) 2024 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include <wdm.h>
+
+namespace usbip
+{
+
+/*
+ * Ring of the last N elements that have consecutive sequence numbers, single producer and multiple consumers.
+ * Each consumer has its own cursor, the sequence number of the next element to read.
+ * The oldest elements are overwritten, a consumer that lags behind skips them.
+ *
+ * T::seqnum is set by push(). The ring does not lock, the caller must serialize access.
+ */
+template<typename T, ULONG N>
+struct seq_ring
+{
+        enum : ULONG { CAPACITY = N };
+        static_assert(N && !(N & (N - 1)), "power of two");
+
+        UINT64 seqnum; // of the next element, the first one is 1
+        T items[N]; // element with seqnum S is items[S % N]
+};
+
+template<typename T, ULONG N>
+inline void init(_Out_ seq_ring<T, N> &r)
+{
+        r.seqnum = 1;
+}
+
+/*
+ * @return the next element that must be filled by a caller and published by push()
+ */
+template<typename T, ULONG N>
+inline auto& next(_Inout_ seq_ring<T, N> &r)
+{
+        return r.items[r.seqnum % N];
+}
+
+template<typename T, ULONG N>
+inline void push(_Inout_ seq_ring<T, N> &r)
+{
+        next(r).seqnum = r.seqnum;
+        ++r.seqnum;
+}
+
+/*
+ * @param seqnum cursor of a consumer
+ */
+template<typename T, ULONG N>
+inline auto empty(_In_ const seq_ring<T, N> &r, _In_ UINT64 seqnum)
+{
+        return seqnum >= r.seqnum;
+}
+
+/*
+ * @return sequence number of the oldest element that is not overwritten
+ */
+template<typename T, ULONG N>
+inline auto oldest(_In_ const seq_ring<T, N> &r)
+{
+        return r.seqnum > N ? r.seqnum - N : 1;
+}
+
+/*
+ * @param seqnum of the next element to read, is advanced
+ * @param dst buffer for elements
+ * @param cnt max number of elements to read
+ * @param lost number of overwritten elements that are skipped
+ * @return number of read elements
+ */
+template<typename T, ULONG N>
+ULONG pop(
+        _In_ const seq_ring<T, N> &r, _Inout_ UINT64 &seqnum,
+        _Out_writes_(cnt) T *dst, _In_ ULONG cnt, _Out_ UINT64 &lost)
+{
+        lost = 0;
+
+        if (auto first = oldest(r); seqnum < first) {
+                lost = first - seqnum;
+                seqnum = first;
+        }
+
+        ULONG i = 0;
+        for ( ; i < cnt && !empty(r, seqnum); ++i, ++seqnum) {
+                dst[i] = r.items[seqnum % N];
+        }
+
+        return i;
+}
+
+} // namespace usbip
@@ -0,0 +1,39 @@
+/*
+ * Copyright (C) 2024 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include <usbip/proto.h>
+#include <wdm.h>
+
+namespace usbip
+{
+
+constexpr auto extract_num(seqnum_t seqnum) { return seqnum >> 1; }
+constexpr auto extract_dir(seqnum_t seqnum) { return usbip_dir(seqnum & 1); }
+constexpr bool is_valid_seqnum(seqnum_t seqnum) { return extract_num(seqnum); }
+
+/*
+ * First bit is reserved for direction of transfer (USBIP_DIR_OUT|USBIP_DIR_IN), zero is never returned.
+ * @param counter of a device or of a mux_session, the latter is shared by all its devices
+ * @see is_valid_seqnum
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+inline seqnum_t next_seqnum(_Inout_ seqnum_t &counter, _In_ bool dir_in)
+{
+        static_assert(!USBIP_DIR_OUT);
+        static_assert(USBIP_DIR_IN);
+
+        static_assert(sizeof(counter) == sizeof(LONG));
+        auto num = reinterpret_cast<volatile LONG*>(&counter);
+
+        while (true) {
+                if (seqnum_t n = InterlockedIncrement(num) << 1) {
+                        return n |= seqnum_t(dir_in);
+                }
+        }
+}
+
+} // namespace usbip
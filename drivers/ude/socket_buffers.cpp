@@ -0,0 +1,189 @@
+/*
+ * Copyright (C) 2024 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "socket_buffers.h"
+#include "trace.h"
+#include "socket_buffers.tmh"
+
+#include "context.h"
+#include "persistent.h"
+
+#include <libdrv\wait_timeout.h>
+
+namespace
+{
+
+using namespace usbip;
+
+enum {
+        MAX_BUFFER = 16*1024*1024, // bytes
+        AUTOTUNE_PERIOD = 1, // seconds
+};
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto query_value(_In_ WDFKEY key, _In_ const wchar_t *value_name, _In_ ULONG max_value)
+{
+        PAGED_CODE();
+
+        UNICODE_STRING name;
+        RtlUnicodeStringInit(&name, value_name);
+
+        ULONG val{};
+        if (auto err = WdfRegistryQueryULong(key, &name, &val)) {
+                if (err != STATUS_OBJECT_NAME_NOT_FOUND) {
+                        Trace(TRACE_LEVEL_ERROR, "WdfRegistryQueryULong('%!USTR!') %!STATUS!", &name, err);
+                }
+                val = 0;
+        }
+
+        return static_cast<int>(min(val, max_value));
+}
+
+/*
+ * @return power of two that is not less than n
+ */
+constexpr auto round_up(_In_ UINT64 n)
+{
+        UINT64 v = 1;
+        while (v < n) {
+                v <<= 1;
+        }
+        return v;
+}
+
+/*
+ * SO_RCVBUF is not set, that would disable receive window autotuning of TCP/IP stack.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void grow(_Inout_ device_ctx &dev, _In_ UINT64 target)
+{
+        PAGED_CODE();
+
+        auto sock = dev.sock();
+        int sndbuf{};
+
+        if (auto err = get_buffers(sock, &sndbuf, nullptr)) {
+                Trace(TRACE_LEVEL_ERROR, "get_buffers %!STATUS!", err);
+                return;
+        }
+
+        auto sz = static_cast<int>(min(round_up(target), UINT64(MAX_BUFFER)));
+        if (sz <= sndbuf) {
+                return;
+        }
+
+        auto &bufs = dev.ext->buffers;
+
+        if (auto err = set_buffers(sock, sz)) {
+                Trace(TRACE_LEVEL_ERROR, "set_buffers(%d) %!STATUS!", sz, err);
+                bufs.autotune = false; // do not try again
+                return;
+        }
+
+        bufs.sndbuf = sz;
+
+        TraceDbg("dev %04x, srtt %lld us, sndbuf %d -> %d", ptr04x(get_handle(&dev)),
+                  dev.srtt/(wdm::msec/1000), sndbuf, sz);
+}
+
+} // namespace
+
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void usbip::get_default_socket_buffers(_Out_ vhci::socket_buffers &bufs)
+{
+        PAGED_CODE();
+        bufs = {};
+
+        Registry key;
+        if (auto err = open_parameters_key(key, KEY_QUERY_VALUE)) {
+                return;
+        }
+
+        bufs.sndbuf = query_value(key.get(), L"SocketSendBuffer", MAX_BUFFER);
+        bufs.rcvbuf = query_value(key.get(), L"SocketReceiveBuffer", MAX_BUFFER);
+        bufs.autotune = query_value(key.get(), L"SocketBufferAutotune", 1);
+
+        TraceDbg("sndbuf %d, rcvbuf %d, autotune %d", bufs.sndbuf, bufs.rcvbuf, bufs.autotune);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS usbip::apply_socket_buffers(_In_ wsk::SOCKET *sock, _In_ const vhci::socket_buffers &bufs)
+{
+        PAGED_CODE();
+
+        auto err = set_buffers(sock, bufs.sndbuf, bufs.rcvbuf);
+        if (err) {
+                Trace(TRACE_LEVEL_ERROR, "set_buffers(sndbuf %d, rcvbuf %d) %!STATUS!", bufs.sndbuf, bufs.rcvbuf, err);
+        }
+
+        return err;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS usbip::set_socket_buffers(_Inout_ device_ctx &dev, _Inout_ vhci::socket_buffers &r)
+{
+        PAGED_CODE();
+        auto &bufs = dev.ext->buffers;
+
+        if (r.sndbuf > 0) {
+                bufs.sndbuf = min(r.sndbuf, int(MAX_BUFFER));
+        }
+
+        if (r.rcvbuf > 0) {
+                bufs.rcvbuf = min(r.rcvbuf, int(MAX_BUFFER));
+        }
+
+        if (r.autotune >= 0) {
+                bufs.autotune = !!r.autotune;
+        }
+
+        auto sock = dev.sock();
+
+        if (auto err = apply_socket_buffers(sock, bufs)) {
+                return err;
+        }
+
+        r.autotune = bufs.autotune;
+        return get_buffers(sock, &r.sndbuf, &r.rcvbuf);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void usbip::autotune_socket_buffers(_Inout_ device_ctx &dev, _In_ const request_ctx &req)
+{
+        PAGED_CODE();
+
+        ULONG64 qpc;
+        auto now = KeQueryInterruptTimePrecise(&qpc); // see request_ctx::send_time
+        auto rtt = static_cast<LONG64>(now - req.send_time);
+
+        dev.srtt = dev.srtt ? dev.srtt + (rtt - dev.srtt)/8 : rtt;
+        dev.completed_bytes += req.length;
+
+        auto elapsed = now - dev.autotune_time;
+        if (elapsed < AUTOTUNE_PERIOD*ULONGLONG(wdm::second)) {
+                return;
+        }
+
+        UINT64 inflight;
+        {
+                wdf::Lock lck(dev.requests_lock);
+                inflight = dev.max_inflight_bytes;
+                dev.max_inflight_bytes = dev.inflight_bytes;
+        }
+
+        if (dev.autotune_time && dev.ext->buffers.autotune) {
+                auto bdp = dev.completed_bytes*dev.srtt/elapsed; // throughput * srtt
+                grow(dev, 2*max(bdp, inflight));
+        }
+
+        dev.completed_bytes = 0;
+        dev.autotune_time = now;
+}
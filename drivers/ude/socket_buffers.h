@@ -0,0 +1,51 @@
+/*
+ * Copyright (C) 2024 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include <libdrv\codeseg.h>
+#include <libdrv\wsk_cpp.h>
+
+#include <usbip\vhci.h>
+
+namespace usbip
+{
+
+struct device_ctx;
+struct request_ctx;
+
+/*
+ * Defaults for new devices are read from the driver's Parameters key:
+ * SocketSendBuffer - bytes, SO_SNDBUF, zero or absent leaves the system default;
+ * SocketReceiveBuffer - bytes, SO_RCVBUF, the same;
+ * SocketBufferAutotune - boolean, see autotune_socket_buffers.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void get_default_socket_buffers(_Out_ vhci::socket_buffers &bufs);
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS apply_socket_buffers(_In_ wsk::SOCKET *sock, _In_ const vhci::socket_buffers &bufs);
+
+/*
+ * @param r IN: new values, see vhci::ioctl::set_socket_buffers; OUT: actual values of the socket
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS set_socket_buffers(_Inout_ device_ctx &dev, _Inout_ vhci::socket_buffers &r);
+
+/*
+ * Is called by the receive thread for every completed request.
+ *
+ * Round-trip time of requests is smoothed as in RFC 6298. Once per period SO_SNDBUF is grown
+ * to twice the maximum of bandwidth-delay product and peak in-flight bytes of transfer buffers.
+ * The receive buffer is left to the TCP/IP stack's window autotuning.
+ * The buffer is never shrunk, the new size is remembered and applied after reconnect too.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void autotune_socket_buffers(_Inout_ device_ctx &dev, _In_ const request_ctx &req);
+
+} // namespace usbip
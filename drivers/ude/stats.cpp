@@ -0,0 +1,90 @@
+/*
+ * Copyright (C) 2024 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "stats.h"
+#include "trace.h"
+#include "stats.tmh"
+
+#include "context.h"
+#include "stats_counters.h"
+
+#include <libdrv\ch9.h>
+
+namespace
+{
+
+using namespace usbip;
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void append(_Inout_ vhci::ioctl::get_device_stats &r, _In_ const endpoint_ctx &endp)
+{
+        if (r.count == ARRAYSIZE(r.endpoints)) {
+                return;
+        }
+
+        auto &d = endp.descriptor;
+        auto &s = r.endpoints[r.count++] = endp.stats;
+
+        s.address = d.bEndpointAddress;
+        s.type = static_cast<UINT8>(usb_endpoint_type(d));
+}
+
+} // namespace
+
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void usbip::update_stats(_In_ const request_ctx &req, _In_ const usbip_header &hdr, _In_ NTSTATUS status)
+{
+        PAGED_CODE();
+
+        auto &s = get_endpoint_ctx(req.endpoint)->stats;
+
+        ULONG64 qpc;
+        auto usec = get_latency(KeQueryInterruptTimePrecise(&qpc), req.send_time);
+
+        add_completed(s, usec, status, hdr.base.direction == USBIP_DIR_IN, hdr.u.ret_submit.actual_length);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::get_stats(_Out_ vhci::ioctl::get_device_stats &r, _In_ device_ctx &dev)
+{
+        auto &d = r.device;
+        d = {};
+
+        d.sent_requests = dev.sent_requests;
+        d.drained = dev.drained;
+        d.drained_bytes = dev.drained_bytes;
+        d.reconnects = dev.reconnects;
+        d.srtt = static_cast<UINT32>(dev.srtt/wdm::usec);
+
+        d.compressed_out = dev.compressed_out;
+        d.compressed_out_wire = dev.compressed_out_wire;
+        d.compressed_in = dev.compressed_in;
+        d.compressed_in_wire = dev.compressed_in_wire;
+        d.compress_skipped = dev.compress_skipped;
+        {
+                wdf::Lock lck(dev.requests_lock);
+                d.inflight_bytes = dev.inflight_bytes;
+                d.inflight = dev.inflight_requests;
+        }
+
+        r.count = 0;
+        if (!dev.ep0) {
+                return;
+        }
+
+        auto &ep0 = *get_endpoint_ctx(dev.ep0);
+        append(r, ep0);
+
+        auto head = &ep0.entry; // see endpoint_list.h
+        wdf::Lock lck(dev.endpoint_list_lock);
+
+        for (auto entry = head->Flink; entry != head; entry = entry->Flink) {
+                auto endp = CONTAINING_RECORD(entry, endpoint_ctx, entry);
+                append(r, *endp);
+        }
+}
@@ -0,0 +1,39 @@
+/*
+ * Copyright (C) 2024 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include <libdrv\codeseg.h>
+#include <usbip\vhci.h>
+
+struct usbip_header;
+
+namespace usbip
+{
+
+struct device_ctx;
+struct request_ctx;
+
+/*
+ * Counters do not require locks or interlocked operations except endpoint_stats::cancelled.
+ * endpoint_stats::submitted and device_ctx::inflight_requests are protected by device_ctx::requests_lock,
+ * the rest ones are updated by the receive thread only. Readers copy them without locking.
+ */
+
+/*
+ * Is called by the receive thread for every request that has USBIP_RET_SUBMIT.
+ * @param status of the request that will be completed
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void update_stats(_In_ const request_ctx &req, _In_ const usbip_header &hdr, _In_ NTSTATUS status);
+
+/*
+ * @param r r.port is ignored, the rest members are set
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void get_stats(_Out_ vhci::ioctl::get_device_stats &r, _In_ device_ctx &dev);
+
+} // namespace usbip
@@ -0,0 +1,46 @@
+/*
+ * Copyright (C) 2024 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include <usbip/endpoint_stats.h>
+#include <libdrv/wait_timeout.h>
+
+#include <wdm.h>
+
+namespace usbip
+{
+
+/*
+ * @param now interrupt time, see KeQueryInterruptTimePrecise
+ * @param send_time see request_ctx::send_time
+ * @return microseconds
+ */
+constexpr UINT64 get_latency(_In_ UINT64 now, _In_ UINT64 send_time)
+{
+        return now > send_time ? (now - send_time)/wdm::usec : 0;
+}
+
+/*
+ * Accounts a request that has USBIP_RET_SUBMIT.
+ * @param usec latency, see get_latency
+ * @param status of the request that will be completed
+ * @param dir_in USBIP_DIR_IN
+ * @param actual_length see ret_submit, is not counted if the request failed
+ */
+inline void add_completed(
+        _Inout_ vhci::endpoint_stats &s, _In_ UINT64 usec, _In_ NTSTATUS status, _In_ bool dir_in, _In_ INT32 actual_length)
+{
+        ++s.completed;
+        s.latency_sum += usec;
+        ++s.latency[vhci::latency_bucket(usec)];
+
+        if (NT_ERROR(status)) {
+                ++s.errors;
+        } else if (actual_length > 0) {
+                (dir_in ? s.bytes_in : s.bytes_out) += actual_length;
+        }
+}
+
+} // namespace usbip
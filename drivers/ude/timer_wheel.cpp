@@ -0,0 +1,124 @@
+/*
+ * Copyright (C) 2024 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "timer_wheel.h"
+
+namespace
+{
+
+using namespace usbip;
+
+constexpr UINT64 L0_MASK = timer_wheel::L0_SIZE - 1;
+constexpr UINT64 L1_MASK = timer_wheel::L1_SIZE - 1;
+
+/*
+ * @param t.expires must not be less than w.now
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void place(_Inout_ timer_wheel &w, _Inout_ wheel_timer &t)
+{
+        NT_ASSERT(t.expires >= w.now);
+        LIST_ENTRY *head{};
+
+        if (t.expires - w.now < timer_wheel::L0_SIZE) {
+                head = &w.l0[t.expires & L0_MASK];
+        } else {
+                auto cur = w.now >> timer_wheel::L0_BITS;
+                auto slot = t.expires >> timer_wheel::L0_BITS; // is greater than cur
+
+                if (slot - cur >= timer_wheel::L1_SIZE) {
+                        slot = cur + timer_wheel::L1_SIZE - 1; // will be cascaded again
+                }
+
+                head = &w.l1[slot & L1_MASK];
+        }
+
+        InsertTailList(head, &t.entry);
+}
+
+/*
+ * Is called when w.now enters the next L0_SIZE ticks.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void cascade(_Inout_ timer_wheel &w)
+{
+        auto &head = w.l1[(w.now >> timer_wheel::L0_BITS) & L1_MASK];
+
+        while (!IsListEmpty(&head)) { // place() never returns a timer to this slot
+                auto entry = RemoveHeadList(&head);
+                place(w, *CONTAINING_RECORD(entry, wheel_timer, entry));
+        }
+}
+
+} // namespace
+
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::init(_Out_ timer_wheel &w, _In_ UINT64 now)
+{
+        w.now = now;
+        w.count = 0;
+
+        for (auto &head: w.l0) {
+                InitializeListHead(&head);
+        }
+
+        for (auto &head: w.l1) {
+                InitializeListHead(&head);
+        }
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::schedule(_Inout_ timer_wheel &w, _Inout_ wheel_timer &t, _In_ UINT64 expires)
+{
+        NT_ASSERT(!is_scheduled(t));
+
+        t.expires = max(expires, w.now + 1);
+        place(w, t);
+
+        ++w.count;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::cancel(_Inout_ timer_wheel &w, _Inout_ wheel_timer &t)
+{
+        if (is_scheduled(t)) {
+                RemoveEntryList(&t.entry);
+                InitializeListHead(&t.entry);
+
+                NT_ASSERT(w.count);
+                --w.count;
+        }
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::advance(_Inout_ timer_wheel &w, _In_ UINT64 now, _Inout_ LIST_ENTRY &expired)
+{
+        while (w.now < now) {
+                if (!w.count) { // nothing to cascade or expire
+                        w.now = now;
+                        break;
+                }
+
+                if (!(++w.now & L0_MASK)) {
+                        cascade(w);
+                }
+
+                auto &head = w.l0[w.now & L0_MASK];
+
+                while (!IsListEmpty(&head)) {
+                        auto entry = RemoveHeadList(&head);
+                        NT_ASSERT(CONTAINING_RECORD(entry, wheel_timer, entry)->expires == w.now);
+
+                        InsertTailList(&expired, entry);
+                        --w.count;
+                }
+        }
+}
@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) 2024 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include <wdm.h>
+
+namespace usbip
+{
+
+/*
+ * Hierarchical timer wheel of two levels, time is measured in ticks.
+ * Scheduling and cancellation of a timer are O(1), expiration is amortized O(1).
+ *
+ * Level 0 has a slot per tick for the nearest L0_SIZE ticks.
+ * Level 1 has a slot per L0_SIZE ticks, its slot is cascaded to level 0 when the time reaches it.
+ * Timers that are farther than level 1 can cover are put in its last slot and are cascaded again.
+ *
+ * The wheel does not lock, does not allocate memory and does not read the clock.
+ */
+struct timer_wheel
+{
+        enum {
+                L0_BITS = 8,
+                L1_BITS = 6,
+                L0_SIZE = 1 << L0_BITS,
+                L1_SIZE = 1 << L1_BITS,
+        };
+
+        UINT64 now; // current tick, timers that expire at or before it are already removed
+        ULONG count; // number of scheduled timers
+
+        LIST_ENTRY l0[L0_SIZE];
+        LIST_ENTRY l1[L1_SIZE];
+};
+
+struct wheel_timer
+{
+        LIST_ENTRY entry; // points to itself if the timer is not scheduled
+        UINT64 expires; // tick
+};
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void init(_Out_ timer_wheel &w, _In_ UINT64 now);
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+inline void init(_Out_ wheel_timer &t)
+{
+        InitializeListHead(&t.entry);
+        t.expires = 0;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+inline auto is_scheduled(_In_ const wheel_timer &t)
+{
+        return t.entry.Flink != &t.entry;
+}
+
+/*
+ * @param t must not be scheduled
+ * @param expires tick, a timer in the past expires on the next tick
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void schedule(_Inout_ timer_wheel &w, _Inout_ wheel_timer &t, _In_ UINT64 expires);
+
+/*
+ * Does nothing if the timer is not scheduled.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void cancel(_Inout_ timer_wheel &w, _Inout_ wheel_timer &t);
+
+/*
+ * Moves expired timers to the list, their entries must be reinitialized by the caller.
+ * @param now current tick
+ * @param expired list head
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void advance(_Inout_ timer_wheel &w, _In_ UINT64 now, _Inout_ LIST_ENTRY &expired);
+
+} // namespace usbip
@@ -0,0 +1,259 @@
+/*
+ * Copyright (C) 2024 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "trace_ring.h"
+#include "trace.h"
+#include "trace_ring.tmh"
+
+#include "context.h"
+#include "pool.h"
+#include "persistent.h"
+
+#include <libdrv\ch9.h>
+
+namespace
+{
+
+using namespace usbip;
+
+enum {
+        DEFAULT_RECORDS = 1024, // per processor
+        MAX_RECORDS = 64*1024,
+};
+
+struct slot
+{
+        volatile LONG64 stamp; // position of the record + 1, is zeroed while the record is being written
+        vhci::trace_record rec;
+};
+
+struct DECLSPEC_CACHEALIGN cpu_ring
+{
+        volatile LONG64 head; // position of the next record to write, it is reserved by writers
+        LONG64 tail; // position of the next record to read, protected by trace_rings::lock
+        slot *slots; // slot of position N is slots[N & (capacity - 1)]
+};
+
+struct trace_rings
+{
+        FAST_MUTEX lock; // serializes readers
+        SIZE_T size; // of the allocation, including slots
+        ULONG capacity; // slots per processor, power of two
+        ULONG cpu_cnt;
+        cpu_ring cpus[ANYSIZE_ARRAY];
+};
+
+trace_rings *g_rings; // NULL if the trace is disabled
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void write(
+        _Inout_ trace_rings &r, _In_ vhci::trace_event event, _In_ const device_ctx &dev, _In_ seqnum_t seqnum, 
+        _In_ UINT32 ep, _In_ UINT32 length, _In_ LONG status, _In_ ULONGLONG time)
+{
+        auto cpu = KeGetCurrentProcessorNumberEx(nullptr);
+        if (cpu >= r.cpu_cnt) { // hot added
+                return;
+        }
+
+        auto &ring = r.cpus[cpu];
+        auto pos = InterlockedIncrement64(&ring.head) - 1; // the thread can be preempted at PASSIVE_LEVEL
+
+        auto &s = ring.slots[pos & (r.capacity - 1)];
+        InterlockedExchange64(&s.stamp, 0);
+
+        if (!time) {
+                ULONG64 qpc;
+                time = KeQueryInterruptTimePrecise(&qpc);
+        }
+
+        s.rec = vhci::trace_record {
+                .time = time,
+                .seqnum = seqnum,
+                .devid = dev.devid(),
+                .length = length,
+                .status = status,
+                .event = event,
+                .ep = static_cast<UINT8>(ep),
+                .dir = static_cast<UINT8>(extract_dir(seqnum)),
+                .port = static_cast<UINT8>(dev.port),
+        };
+
+        WriteRelease64(&s.stamp, pos + 1);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto query_capacity()
+{
+        PAGED_CODE();
+
+        ULONG val = DEFAULT_RECORDS;
+
+        if (Registry key; !open_parameters_key(key, KEY_QUERY_VALUE)) {
+                UNICODE_STRING name;
+                RtlUnicodeStringInit(&name, L"TraceRingSize");
+
+                if (auto err = WdfRegistryQueryULong(key.get(), &name, &val)) {
+                        if (err != STATUS_OBJECT_NAME_NOT_FOUND) {
+                                Trace(TRACE_LEVEL_ERROR, "WdfRegistryQueryULong('%!USTR!') %!STATUS!", &name, err);
+                        }
+                        val = DEFAULT_RECORDS;
+                }
+        }
+
+        if (!val) {
+                return val;
+        }
+
+        ULONG n = 1;
+        while (n < min(val, ULONG(MAX_RECORDS))) {
+                n <<= 1;
+        }
+        return n;
+}
+
+/*
+ * Copy the record if it is published and is not overwritten.
+ * @return false if the record is still being written
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto read(_Out_ vhci::trace_record &dst, _Inout_ bool &copied, _In_ const slot &s, _In_ LONG64 pos)
+{
+        PAGED_CODE();
+
+        copied = false;
+        auto stamp = ReadAcquire64(&s.stamp);
+
+        if (stamp <= pos) { // a writer has reserved it, but has not published yet
+                return false;
+        } else if (stamp == pos + 1) {
+                dst = s.rec;
+                KeMemoryBarrier();
+                copied = ReadNoFence64(&s.stamp) == stamp;
+        }
+
+        return true;
+}
+
+} // namespace
+
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS usbip::init_trace_ring()
+{
+        PAGED_CODE();
+        NT_ASSERT(!g_rings);
+
+        auto capacity = query_capacity();
+        if (!capacity) {
+                Trace(TRACE_LEVEL_INFORMATION, "disabled");
+                return STATUS_SUCCESS;
+        }
+
+        auto cpu_cnt = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+
+        auto hdr_size = offsetof(trace_rings, cpus) + cpu_cnt*sizeof(cpu_ring);
+        auto size = hdr_size + SIZE_T(cpu_cnt)*capacity*sizeof(slot);
+
+        auto r = (trace_rings*)pool_alloc(pool_consumer::trace_ring, NonPagedPoolNx, size);
+        if (!r) {
+                Trace(TRACE_LEVEL_ERROR, "Can't allocate %Iu bytes", size);
+                return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        ExInitializeFastMutex(&r->lock);
+        r->size = size;
+        r->capacity = capacity;
+        r->cpu_cnt = cpu_cnt;
+
+        auto slots = reinterpret_cast<slot*>(reinterpret_cast<char*>(r) + hdr_size);
+        for (ULONG i = 0; i < cpu_cnt; ++i) {
+                r->cpus[i].slots = slots + SIZE_T(i)*capacity;
+        }
+
+        Trace(TRACE_LEVEL_INFORMATION, "%lu record(s) per processor, %lu processor(s), %Iu bytes", 
+                                        capacity, cpu_cnt, size);
+
+        g_rings = r;
+        return STATUS_SUCCESS;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void usbip::delete_trace_ring()
+{
+        PAGED_CODE();
+
+        if (auto r = (trace_rings*)InterlockedExchangePointer(reinterpret_cast<PVOID*>(&g_rings), nullptr)) {
+                pool_free(pool_consumer::trace_ring, r, r->size);
+        }
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::trace_urb(
+        _In_ vhci::trace_event event, _In_ const device_ctx &dev, _In_ seqnum_t seqnum, _In_ UINT32 ep,
+        _In_ UINT32 length, _In_ LONG status)
+{
+        if (auto r = g_rings) {
+                write(*r, event, dev, seqnum, ep, length, status, 0);
+        }
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::trace_urb(
+        _In_ vhci::trace_event event, _In_ const device_ctx &dev, _In_ const request_ctx &req, 
+        _In_ UINT32 length, _In_ NTSTATUS status, _In_ ULONGLONG time)
+{
+        if (auto r = g_rings) {
+                auto &endp = *get_endpoint_ctx(req.endpoint);
+                write(*r, event, dev, req.seqnum, usb_endpoint_num(endp.descriptor), length, status, time);
+        }
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED ULONG usbip::read_trace_ring(
+        _Out_writes_to_(cnt, return) vhci::trace_record *dst, _In_ ULONG cnt, _Out_ UINT64 &dropped)
+{
+        PAGED_CODE();
+        dropped = 0;
+
+        auto r = g_rings;
+        if (!r) {
+                return 0;
+        }
+
+        ULONG n = 0;
+        ExAcquireFastMutex(&r->lock);
+
+        for (ULONG i = 0; i < r->cpu_cnt && n < cnt; ++i) {
+                auto &ring = r->cpus[i];
+                auto head = ReadAcquire64(&ring.head);
+
+                if (auto oldest = head - LONG64(r->capacity); ring.tail < oldest) {
+                        dropped += oldest - ring.tail;
+                        ring.tail = oldest;
+                }
+
+                for ( ; ring.tail < head && n < cnt; ++ring.tail) {
+                        auto &s = ring.slots[ring.tail & (r->capacity - 1)];
+
+                        if (bool copied; !read(dst[n], copied, s, ring.tail)) {
+                                break; // read the rest next time
+                        } else if (copied) {
+                                ++n;
+                        } else {
+                                ++dropped;
+                        }
+                }
+        }
+
+        ExReleaseFastMutex(&r->lock);
+        return n;
+}
@@ -0,0 +1,65 @@
+/*
+ * Copyright (C) 2024 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include <libdrv\codeseg.h>
+#include <usbip\proto.h>
+#include <usbip\vhci.h>
+
+namespace usbip
+{
+
+struct device_ctx;
+struct request_ctx;
+
+/*
+ * Driver-wide binary trace of URB processing, it is cheap enough to be always enabled
+ * unlike WPP tracing at VERBOSE level that formats every usbip_header.
+ *
+ * Each processor has its own ring of fixed-size records, the oldest records are overwritten.
+ * Writers do not take locks, a record is reserved by interlocked increment of the ring's head
+ * and is published by its stamp, a reader skips records which are overwritten while it copies them.
+ *
+ * The size is read from the driver's Parameters key:
+ * TraceRingSize - records per processor, is rounded up to a power of two, default is 1024, zero disables the trace.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS init_trace_ring();
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void delete_trace_ring();
+
+/*
+ * @param ep endpoint number
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void trace_urb(
+        _In_ vhci::trace_event event, _In_ const device_ctx &dev, _In_ seqnum_t seqnum, _In_ UINT32 ep,
+        _In_ UINT32 length, _In_ LONG status);
+
+/*
+ * request_ctx::endpoint must be set.
+ * @param time of the event, KeQueryInterruptTimePrecise; zero if the event happens now
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void trace_urb(
+        _In_ vhci::trace_event event, _In_ const device_ctx &dev, _In_ const request_ctx &req, 
+        _In_ UINT32 length, _In_ NTSTATUS status, _In_ ULONGLONG time = 0);
+
+/*
+ * Read records are removed from the rings.
+ * @param dropped number of records that were lost since the previous call
+ * @return number of records that were written to dst
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED ULONG read_trace_ring(
+        _Out_writes_to_(cnt, return) vhci::trace_record *dst, _In_ ULONG cnt, _Out_ UINT64 &dropped);
+
+} // namespace usbip
@@ -7,8 +7,14 @@
 #include "vhci.tmh"
 
 #include "device.h"
+#include "driver.h"
 #include "vhci_ioctl.h"
 #include "persistent.h"
+#include "event_ring.h"
+#include "pool.h"
+#include "filter_request.h"
+
+#include <libdrv\wait_timeout.h>
 
 #include <ntstrsafe.h>
 
@@ -65,6 +71,10 @@ PAGED void vhci_cleanup(_In_ WDFOBJECT object)
         TraceDbg("vhci %04x", ptr04x(vhci));
 
         attach_thread_join(vhci);
+
+        if (auto &ctx = *get_vhci_ctx(vhci); ctx.events) { // WDFMEMORY is a child of vhci
+                uncharge(pool_consumer::events, sizeof(*ctx.events));
+        }
 }
 
 _Function_class_(EVT_WDF_IO_QUEUE_IO_CANCELED_ON_QUEUE)
@@ -106,6 +116,10 @@ PAGED auto init_context(_In_ WDFDEVICE vhci)
         PAGED_CODE();
         auto &ctx = *get_vhci_ctx(vhci);
 
+        LARGE_INTEGER now;
+        KeQuerySystemTimePrecise(&now);
+        ctx.epoch = now.QuadPart; // unique for each instance, is never zero
+
         WDF_OBJECT_ATTRIBUTES attr;
         WDF_OBJECT_ATTRIBUTES_INIT(&attr);
         attr.ParentObject = vhci;
@@ -115,6 +129,11 @@ PAGED auto init_context(_In_ WDFDEVICE vhci)
                 return err;
         }
 
+        if (auto err = WdfWaitLockCreate(&attr, &ctx.sessions_lock)) {
+                Trace(TRACE_LEVEL_ERROR, "WdfWaitLockCreate %!STATUS!", err);
+                return err;
+        }
+
         if (auto err = WdfWaitLockCreate(&attr, &ctx.events_lock)) {
                 Trace(TRACE_LEVEL_ERROR, "WdfWaitLockCreate %!STATUS!", err);
                 return err;
@@ -124,8 +143,18 @@ PAGED auto init_context(_In_ WDFDEVICE vhci)
                 return err;
         }
 
+        WDFMEMORY mem{};
+        if (auto err = WdfMemoryCreate(&attr, PagedPool, get_pool_tag(pool_consumer::events), sizeof(*ctx.events), 
+                                       &mem, reinterpret_cast<PVOID*>(&ctx.events))) {
+                Trace(TRACE_LEVEL_ERROR, "WdfMemoryCreate %!STATUS!", err);
+                return err;
+        }
+        charge(pool_consumer::events, sizeof(*ctx.events)); // see vhci_cleanup
+        init(*ctx.events);
+
         KeInitializeEvent(&ctx.attach_thread_stop, NotificationEvent, false);
         InitializeListHead(&ctx.fileobjects);
+        InitializeListHead(&ctx.sessions);
 
         return STATUS_SUCCESS;
 }
@@ -246,25 +275,22 @@ PAGED NTSTATUS vhci_query_remove(_In_ WDFDEVICE vhci)
         PAGED_CODE();
         TraceDbg("%04x", ptr04x(vhci));
 
+        auto &removing = get_vhci_ctx(vhci)->removing;
+        static_assert(sizeof(removing) == sizeof(CHAR));
+        InterlockedExchange8(PCHAR(&removing), true); // full barrier, see device.cpp, defer_plugout
+
+        for (int port = 1; port <= ARRAYSIZE(vhci_ctx::devices); ++port) {
+                if (auto dev = vhci::get_device(vhci, port); auto hdev = dev.get<UDECXUSBDEVICE>()) {
+                        device::plugout_deferred(hdev);
+                }
+        }
+
         detach_all_devices(vhci, vhci::detach_call::async_nowait); // must not block this callback for long time
         purge_read_queue(vhci); // detach notifications will not be received due to detach_call::async_nowait
 
         return STATUS_SUCCESS;
 }
 
-_IRQL_requires_same_
-_IRQL_requires_max_(PASSIVE_LEVEL)
-PAGED auto create_collection(_Out_ WDFCOLLECTION &result, _In_ WDFOBJECT parent)
-{
-        PAGED_CODE();
-
-        WDF_OBJECT_ATTRIBUTES attr;
-        WDF_OBJECT_ATTRIBUTES_INIT(&attr);
-        attr.ParentObject = parent;
-
-        return WdfCollectionCreate(&attr, &result);
-}
-
 _Function_class_(EVT_WDF_DEVICE_FILE_CREATE)
 _IRQL_requires_same_
 _IRQL_requires_max_(PASSIVE_LEVEL)
@@ -276,16 +302,12 @@ PAGED void device_file_create(_In_ WDFDEVICE vhci, _In_ WDFREQUEST request, _In_
         auto &fobj = *get_fileobject_ctx(fileobj);
         InitializeListHead(&fobj.entry);
 
-        auto st = create_collection(fobj.events, fileobj);
-
-        if (NT_ERROR(st)) {
-                Trace(TRACE_LEVEL_ERROR, "WdfCollectionCreate %!STATUS!", st);
-        } else if (auto v = get_vhci_ctx(vhci)) {
+        if (auto v = get_vhci_ctx(vhci)) {
                 wdf::WaitLock lck(v->events_lock);
                 InsertTailList(&v->fileobjects, &fobj.entry);
         }
 
-        WdfRequestComplete(request, st);
+        WdfRequestComplete(request, STATUS_SUCCESS);
 }
 
 _Function_class_(EVT_WDF_FILE_CLEANUP)
@@ -449,7 +471,8 @@ PAGED auto create_vhci(_Out_ WDFDEVICE &vhci, _In_ WDFDEVICE_INIT *init)
         }
 
         init_func_t* const functions[] { init_context, configure, create_interfaces, 
-                                         add_usbdevice_emulation, vhci::create_queues };
+                                         add_usbdevice_emulation, vhci::create_queues,
+                                         filter::add_request_interface };
 
         for (auto f: functions) {
                 if (auto err = f(vhci)) {
@@ -480,33 +503,15 @@ auto get_port_range(_In_ usb_device_speed speed)
 _IRQL_requires_same_
 _IRQL_requires_max_(PASSIVE_LEVEL)
 PAGED auto make_device_state(
-        _In_ WDFOBJECT parent, _In_ const device_ctx_ext &ext, _In_ int port, _In_ vhci::state state)
+        _Out_ vhci::device_state &r, _In_ const device_ctx_ext &ext, _In_ int port, _In_ vhci::state state)
 {
         PAGED_CODE();
 
-        WDF_OBJECT_ATTRIBUTES attr;
-        WDF_OBJECT_ATTRIBUTES_INIT(&attr);
-        attr.EvtDestroyCallback = [] (auto p) { TraceDbg("destroy %04x", ptr04x(p)); };
-        attr.ParentObject = parent;
-
-        WDFMEMORY mem{};
-        vhci::device_state *r{};
-        if (auto err = WdfMemoryCreate(&attr, PagedPool, 0, sizeof(*r), &mem, reinterpret_cast<PVOID*>(&r))) {
-                Trace(TRACE_LEVEL_ERROR, "WdfMemoryCreate %!STATUS!", err);
-                return mem;
-        }
-
-        RtlZeroMemory(r, sizeof(*r));
-        r->size = sizeof(*r);
-        r->state = state;
-
-        if (auto err = fill(*r, ext, port)) {
-                WdfObjectDelete(mem);
-                mem = WDF_NO_HANDLE;
-        }
+        RtlZeroMemory(&r, sizeof(r));
+        r.size = sizeof(r);
+        r.state = state;
 
-        TraceDbg("%04x", ptr04x(mem));
-        return mem;
+        return fill(r, ext, port);
 }
 
 /*
@@ -514,49 +519,39 @@ PAGED auto make_device_state(
  */
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
-PAGED void process_event(_In_ WDFQUEUE queue, _Inout_ fileobject_ctx &fobj, _In_ WDFMEMORY evt)
+PAGED void process_event(_In_ vhci_ctx &vhci, _Inout_ fileobject_ctx &fobj)
 {
         PAGED_CODE();
 
         auto fileobj = get_handle(&fobj);
         WDFREQUEST request{};
 
-        switch (auto st = WdfIoQueueRetrieveRequestByFileObject(queue, fileobj, &request)) {
+        switch (auto st = WdfIoQueueRetrieveRequestByFileObject(vhci.reads, fileobj, &request)) {
         case STATUS_SUCCESS:
-                NT_ASSERT(!WdfCollectionGetCount(fobj.events));
-                vhci::complete_read(request, evt);
+                vhci::complete_read(request, fobj, *vhci.events);
                 break;
-        case STATUS_NO_MORE_ENTRIES:
-                if (auto err = WdfCollectionAdd(fobj.events, evt)) { // append and increment reference count
-                        Trace(TRACE_LEVEL_ERROR, "WdfCollectionAdd %!STATUS!", err);
-                } else if (auto cnt = WdfCollectionGetCount(fobj.events); cnt > fobj.MAX_EVENTS) {
-                        auto head = WdfCollectionGetFirstItem(fobj.events);
-                        WdfCollectionRemove(fobj.events, head); // decrements reference count
-
-                        TraceDbg("fobj %04x, drop %04x[0], add %04x[%lu]",
-                                  ptr04x(fileobj), ptr04x(head), ptr04x(evt), --cnt - 1);
-                } else {
-                        TraceDbg("fobj %04x, add %04x[%lu]", ptr04x(fileobj), ptr04x(evt), cnt - 1);
-                }
+        case STATUS_NO_MORE_ENTRIES: // the event stays in the ring until IRP_MJ_READ
+                TraceDbg("fobj %04x, %I64u event(s) pending", ptr04x(fileobj), vhci.events->seqnum - fobj.seqnum);
                 break;
         default:
                 Trace(TRACE_LEVEL_ERROR, "WdfIoQueueRetrieveRequestByFileObject %!STATUS!", st);
         }
 }
 
+/*
+ * vhci_ctx::events_lock must be acquired.
+ */
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
-PAGED void process_event(_In_ vhci_ctx &vhci, _In_ WDFMEMORY evt)
+PAGED void process_event(_In_ vhci_ctx &vhci)
 {
         PAGED_CODE();
-
         int cnt = 0;
-        wdf::WaitLock lck(vhci.events_lock);
 
         for (auto head = &vhci.fileobjects, entry = head->Flink; entry != head; entry = entry->Flink) {
                 auto &fobj = *CONTAINING_RECORD(entry, fileobject_ctx, entry);
                 if (fobj.process_events) {
-                        process_event(vhci.reads, fobj, evt);
+                        process_event(vhci, fobj);
                         ++cnt;
                 }
         }
@@ -588,6 +583,53 @@ PAGED auto get_detach_function(_In_ vhci::detach_call how)
         return f;
 }
 
+/*
+ * Devices are detached concurrently by work items, at most device::MAX_WAIT_DETACH at once.
+ * Next device is detached as soon as any of them is done.
+ * All devices are detached on return, the deadline only limits the time before it is reported.
+ * Each detach closes the socket, joins the receive thread and waits for plugout, 
+ * so one-by-one detach of many devices can take tens of seconds.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void detach_all_and_wait(_In_ WDFDEVICE vhci)
+{
+        PAGED_CODE();
+
+        enum { DETACH_ALL_TIMEOUT = 30 }; // seconds, for all devices, then it is reported and waiting goes on
+
+        wdf::ObjectRef devices[ARRAYSIZE(vhci_ctx::devices)];
+        int cnt = 0;
+
+        for (int port = 1; port <= ARRAYSIZE(devices); ++port) {
+                if (auto dev = vhci::get_device(vhci, port)) {
+                        devices[cnt++].swap(dev);
+                }
+        }
+
+        auto deadline = KeQueryInterruptTime() + DETACH_ALL_TIMEOUT*ULONGLONG(wdm::second);
+
+        UDECXUSBDEVICE detaching[device::MAX_WAIT_DETACH]; // are referenced by devices
+        int busy = 0;
+
+        for (int i = 0; i < cnt || busy; ) {
+                if (i < cnt && busy < ARRAYSIZE(detaching)) {
+                        auto device = devices[i++].get<UDECXUSBDEVICE>();
+                        if (auto err = device::async_detach_nowait(device); NT_ERROR(err)) {
+                                Trace(TRACE_LEVEL_ERROR, "dev %04x, async_detach_nowait %!STATUS!", ptr04x(device), err);
+                        } else {
+                                detaching[busy++] = device;
+                        }
+                } else if (auto k = device::wait_any_detach_until(detaching, busy, deadline); k >= 0) {
+                        detaching[k] = detaching[--busy];
+                } else {
+                        Trace(TRACE_LEVEL_ERROR, "%d device(s), deadline is exceeded, waiting for %d detach(es) "
+                                                 "and %d pending", cnt, busy, cnt - i);
+                        deadline = device::NO_DEADLINE; // callers rely on that all devices are detached
+                }
+        }
+}
+
 } // namespace
 
 
@@ -613,6 +655,7 @@ int usbip::vhci::claim_roothub_port(_In_ UDECXUSBDEVICE device)
 
                 if (auto &handle = vhci.devices[i]; !handle) {
                         WdfObjectReference(handle = device);
+                        vhci.changed[i] = ++vhci.generation;
                         
                         port = i + 1;
                         NT_ASSERT(is_valid_port(port));
@@ -645,6 +688,7 @@ int usbip::vhci::reclaim_roothub_port(_In_ UDECXUSBDEVICE device)
                 NT_ASSERT(handle == device);
 
                 handle = WDF_NO_HANDLE;
+                vhci.changed[port - 1] = ++vhci.generation;
                 port = 0;
         }
         lck.release(); // explicit call to satisfy code analyzer and get rid of warning C28166
@@ -656,6 +700,24 @@ int usbip::vhci::reclaim_roothub_port(_In_ UDECXUSBDEVICE device)
         return portnum;
 }
 
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::vhci::get_snapshot(_Out_ ports_snapshot &s, _In_ WDFDEVICE vhci)
+{
+        auto &ctx = *get_vhci_ctx(vhci);
+
+        wdf::Lock lck(ctx.devices_lock); 
+
+        s.generation = ctx.generation;
+        RtlCopyMemory(s.changed, ctx.changed, sizeof(s.changed));
+
+        for (int i = 0; i < ARRAYSIZE(s.devices); ++i) {
+                s.devices[i].reset(ctx.devices[i]); // adds reference
+        }
+
+        lck.release(); // explicit call to satisfy code analyzer and get rid of warning C28166
+}
+
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
 wdf::ObjectRef usbip::vhci::get_device(_In_ WDFDEVICE vhci, _In_ int port)
@@ -677,6 +739,54 @@ wdf::ObjectRef usbip::vhci::get_device(_In_ WDFDEVICE vhci, _In_ int port)
         return ptr;
 }
 
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+bool usbip::vhci::reserve_bandwidth(
+        _In_ WDFDEVICE vhci, _Inout_ device_ctx &dev, _Inout_ bandwidth_budget &b,
+        _In_ UCHAR intf, _In_ UINT64 demand, _Out_ bool &exceeded)
+{
+        auto &ctx = *get_vhci_ctx(vhci);
+        auto speed = static_cast<usb_device_speed>(dev.speed());
+
+        b.bus_used = 0;
+        b.link_used = 0;
+
+        wdf::Lock lck(ctx.devices_lock); 
+
+        for (auto handle: ctx.devices) {
+                auto other = handle ? get_device_ctx(handle) : nullptr;
+                if (!other || other == &dev) {
+                        continue;
+                }
+
+                auto total = other->bandwidth.total;
+
+                if (same_bus(speed, static_cast<usb_device_speed>(other->speed()))) {
+                        b.bus_used += total;
+                }
+
+                if (other->link == dev.link) {
+                        b.link_used += total;
+                }
+        }
+
+        auto admitted = admit(dev.bandwidth, b, dev.bw_policy, intf, demand, exceeded);
+
+        lck.release(); // explicit call to satisfy code analyzer and get rid of warning C28166
+        return admitted;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::vhci::release_bandwidth(_In_ WDFDEVICE vhci, _Inout_ device_ctx &dev)
+{
+        auto &ctx = *get_vhci_ctx(vhci);
+
+        wdf::Lock lck(ctx.devices_lock); 
+        release(dev.bandwidth);
+        lck.release(); // explicit call to satisfy code analyzer and get rid of warning C28166
+}
+
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
 PAGED void usbip::vhci::detach_all_devices(_In_ WDFDEVICE vhci, _In_ detach_call how)
@@ -684,6 +794,12 @@ PAGED void usbip::vhci::detach_all_devices(_In_ WDFDEVICE vhci, _In_ detach_call
         PAGED_CODE();
 
         TraceDbg("%04x", ptr04x(vhci));
+
+        if (how == detach_call::async_wait) {
+                detach_all_and_wait(vhci);
+                return;
+        }
+
         auto detach = get_detach_function(how);
 
         for (int port = 1; port <= ARRAYSIZE(vhci_ctx::devices); ++port) {
@@ -708,38 +824,44 @@ PAGED NTSTATUS usbip::vhci::fill(_Out_ imported_device &dev, _In_ const device_c
         }
 //
         static_cast<imported_device_properties&>(dev) = ext.dev;
+        dev.timings = ext.timings;
         return STATUS_SUCCESS;
 }
 
+/*
+ * Completes IRP_MJ_READ with as many events as fit into its buffer.
+ */
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
-PAGED void usbip::vhci::complete_read(_In_ WDFREQUEST request, _In_ WDFMEMORY evt)
+PAGED void usbip::vhci::complete_read(_In_ WDFREQUEST request, _Inout_ fileobject_ctx &fobj, _In_ const event_ring &ring)
 {
         PAGED_CODE();
 
         device_state *dst{};
-        auto dst_sz = sizeof(*dst);
+        size_t length{};
+        ULONG_PTR written = 0;
 
-        auto st = WdfRequestRetrieveOutputBuffer(request, dst_sz, reinterpret_cast<PVOID*>(&dst), nullptr);
+        auto st = WdfRequestRetrieveOutputBuffer(request, sizeof(*dst), reinterpret_cast<PVOID*>(&dst), &length);
         
         if (NT_SUCCESS(st)) {
-                size_t size{};
-                *dst = *reinterpret_cast<device_state*>(WdfMemoryGetBuffer(evt, &size));
-                NT_ASSERT(size == dst_sz);
+                UINT64 lost;
+                auto cnt = pop(ring, fobj.seqnum, dst, static_cast<ULONG>(length/sizeof(*dst)), lost);
+                NT_ASSERT(cnt);
+
+                if (lost) {
+                        TraceDbg("fobj %04x, %I64u event(s) lost", ptr04x(WdfRequestGetFileObject(request)), lost);
+                }
+                written = cnt*sizeof(*dst);
         } else {
                 Trace(TRACE_LEVEL_ERROR, "WdfRequestRetrieveOutputBuffer %!STATUS!", st);
-                dst_sz = 0;
         }
 
-        TraceDbg("fobj %04x, req %04x, device_state %04x, %!STATUS!", ptr04x(WdfRequestGetFileObject(request)), 
-                  ptr04x(request), ptr04x(evt), st);
+        TraceDbg("fobj %04x, req %04x, %Iu event(s), next seqnum %I64u, %!STATUS!", 
+                  ptr04x(WdfRequestGetFileObject(request)), ptr04x(request), written/sizeof(*dst), fobj.seqnum, st);
 
-        WdfRequestCompleteWithInformation(request, st, dst_sz);
+        WdfRequestCompleteWithInformation(request, st, written);
 }
 
-/*
- * Each WDFMEMORY object is shared between FILEOBJECT-s, thus parent is set to WDFDEVICE.
- */
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
 PAGED void usbip::vhci::device_state_changed(
@@ -748,23 +870,23 @@ PAGED void usbip::vhci::device_state_changed(
         PAGED_CODE();
 
         auto &ctx = *get_vhci_ctx(vhci);
-        auto subscribers = ctx.events_subscribers;
 
         TraceDbg("%!USTR!:%!USTR!/%!USTR!, port %d, %!vhci_state!, subscribers %d", 
-                  &ext.node_name, &ext.service_name, &ext.busid, port, int(state), subscribers);
+                  &ext.node_name, &ext.service_name, &ext.busid, port, int(state), ctx.events_subscribers);
 
-        if (!subscribers) {
-                wdf::WaitLock lck(ctx.events_lock);
-                if (!ctx.events_subscribers) {
-                        return; // don't create device_state unnecessarily
-                }
+        wdf::WaitLock lck(ctx.events_lock);
+
+        if (!ctx.events_subscribers) {
+                return; // nobody will read it
         }
 
-        if (auto evt = make_device_state(vhci, ext, port, state)) {
-                process_event(ctx, evt);
-                WdfObjectDelete(evt); // will be deleted after its reference count becomes zero
+        auto &ring = *ctx.events;
+
+        if (auto err = make_device_state(next(ring), ext, port, state)) {
+                Trace(TRACE_LEVEL_ERROR, "Failed to create state '%!vhci_state!' %!STATUS!", int(state), err);
         } else {
-                Trace(TRACE_LEVEL_ERROR, "Failed to create state '%!vhci_state!'", int(state));
+                push(ring);
+                process_event(ctx);
         }
 }
 
@@ -32,6 +32,40 @@ _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
 wdf::ObjectRef get_device(_In_ WDFDEVICE vhci, _In_ int port);
 
+/*
+ * Admits and reserves periodic bandwidth of an alternate setting, see usbip::admit.
+ * The budget is shared with other devices on the same bus and of the same server (device_ctx::link),
+ * the check and the reservation are made under devices_lock.
+ *
+ * @param b bus and link must be set, bus_used and link_used are set by the function
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+bool reserve_bandwidth(
+        _In_ WDFDEVICE vhci, _Inout_ device_ctx &dev, _Inout_ bandwidth_budget &b,
+        _In_ UCHAR intf, _In_ UINT64 demand, _Out_ bool &exceeded);
+
+/*
+ * Releases bandwidth of all interfaces of the device.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void release_bandwidth(_In_ WDFDEVICE vhci, _Inout_ device_ctx &dev);
+
+/*
+ * Consistent view of hub ports, see vhci::ioctl::get_imported_devices_delta.
+ */
+struct ports_snapshot
+{
+        UINT64 generation;
+        UINT64 changed[TOTAL_PORTS]; // generation of the last change of the port
+        wdf::ObjectRef devices[TOTAL_PORTS]; // UDECXUSBDEVICE
+};
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void get_snapshot(_Out_ ports_snapshot &s, _In_ WDFDEVICE vhci);
+
 enum class detach_call { async_wait, async_nowait, direct };
 
 _IRQL_requires_same_
@@ -52,7 +86,7 @@ inline auto fill(_Out_ imported_device &dev, _In_ const device_ctx &ctx)
 
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
-PAGED void complete_read(_In_ WDFREQUEST request, _In_ WDFMEMORY evt);
+PAGED void complete_read(_In_ WDFREQUEST request, _Inout_ fileobject_ctx &fobj, _In_ const event_ring &ring);
 
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
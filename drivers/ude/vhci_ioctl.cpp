@@ -12,12 +12,26 @@
 #include "network.h"
 #include "ioctl.h"
 #include "persistent.h"
+#include "descriptor_cache.h"
+#include "dns_cache.h"
+#include "happy_eyeballs.h"
+#include "socket_buffers.h"
+#include "recv_priority.h"
+#include "mux.h"
+#include "compression.h"
+#include "plugin_batch.h"
+#include "event_ring.h"
+#include "stats.h"
+#include "trace_ring.h"
+#include "pool.h"
+#include "ports_delta.h"
 
 #include <usbip\proto_op.h>
 
 #include <libdrv\dbgcommon.h>
 #include <libdrv\strconv.h>
 #include <libdrv\irp.h>
+#include <libdrv\wait_timeout.h>
 
 #include <ntstrsafe.h>
 #include <usbuser.h>
@@ -30,7 +44,8 @@ using namespace usbip;
 static_assert(sizeof(vhci::imported_device_location::service) == NI_MAXSERV);
 static_assert(sizeof(vhci::imported_device_location::host) == NI_MAXHOST);
 
-enum { ARG_INFO, ARG_FUNCTION, ARG_AI }; // the fourth parameter is used by WSK subsystem
+enum { ARG_INFO, ARG_FUNCTION, ARG_CANCEL }; // the fourth parameter is used by WSK subsystem
+enum { CONNECT_TIMEOUT = 5 }; // seconds for each address family, see get_connect_deadline
 
 struct workitem_ctx
 {
@@ -39,19 +54,21 @@ struct workitem_ctx
 
         device_ctx_ext *ext;
         ADDRINFOEXW *addrinfo; // list head
+        bool cached; // the result of dns_cache_get, addrinfo is NULL for a negative entry
+
+        KEVENT cancel; // request is cancelled while connecting, see cancel_connect
 };
 WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(workitem_ctx, get_workitem_ctx)
 
 _IRQL_requires_same_
 _IRQL_requires_max_(PASSIVE_LEVEL)
-PAGED auto set_args(_In_ WDFREQUEST request, _In_ const char *function, _In_opt_ const ADDRINFOEXW *ai = nullptr)
+PAGED auto set_args(_In_ WDFREQUEST request, _In_ const char *function)
 {
         PAGED_CODE();
         auto irp = WdfRequestWdmGetIrp(request);
 
         libdrv::argv<ARG_INFO>(irp) = reinterpret_cast<void*>(WdfRequestGetInformation(request)); // backup
         libdrv::argv<ARG_FUNCTION>(irp) = const_cast<char*>(function);
-        libdrv::argv<ARG_AI>(irp) = const_cast<ADDRINFOEXW*>(ai);
 
         return irp;
 }
@@ -70,77 +87,24 @@ PAGED void log(_In_ const usbip_usb_device &d)
                 d.bConfigurationValue, d.bNumConfigurations, d.bNumInterfaces);
 }
 
-/*
- * @see <linux>/tools/usb/usbip/src/usbipd.c, recv_request_import
- */
-_IRQL_requires_same_
-_IRQL_requires_(PASSIVE_LEVEL)
-PAGED auto send_req_import(_In_ device_ctx_ext &ext)
-{
-        PAGED_CODE();
-
-        struct {
-                op_common hdr{ USBIP_VERSION, OP_REQ_IMPORT, ST_OK };
-                op_import_request body{};
-        } req;
-
-        static_assert(sizeof(req) == sizeof(req.hdr) + sizeof(req.body)); // packed
-
-        if (auto &busid = req.body.busid; auto err = libdrv::unicode_to_utf8(busid, sizeof(busid), ext.busid)) {
-                Trace(TRACE_LEVEL_ERROR, "unicode_to_utf8('%!USTR!') %!STATUS!", &ext.busid, err);
-                return err;
-        }
-
-        PACK_OP_COMMON(false, &req.hdr);
-        PACK_OP_IMPORT_REQUEST(false, &req.body);
-
-        return send(ext.sock, memory::stack, &req, sizeof(req));
-}
-
-_IRQL_requires_same_
-_IRQL_requires_(PASSIVE_LEVEL)
-PAGED NTSTATUS recv_rep_import(_In_ device_ctx_ext &ext, _In_ memory pool, _Out_ op_import_reply &reply)
-{
-        PAGED_CODE();
-        RtlZeroMemory(&reply, sizeof(reply));
-
-        if (auto err = recv_op_common(ext.sock, OP_REP_IMPORT)) {
-                return err;
-        }
-
-        if (auto err = recv(ext.sock, pool, &reply, sizeof(reply))) {
-                Trace(TRACE_LEVEL_ERROR, "Receive op_import_reply %!STATUS!", err);
-                return err;
-        }
-        PACK_OP_IMPORT_REPLY(false, &reply);
-
-        if (char busid[sizeof(reply.udev.busid)];
-            auto err = libdrv::unicode_to_utf8(busid, sizeof(busid), ext.busid)) {
-                Trace(TRACE_LEVEL_ERROR, "unicode_to_utf8('%!USTR!') %!STATUS!", &ext.busid, err);
-                return err;
-        } else if (strncmp(reply.udev.busid, busid, sizeof(busid))) {
-                Trace(TRACE_LEVEL_ERROR, "Received busid '%s' != '%s'", reply.udev.busid, busid);
-                return USBIP_ERROR_PROTOCOL;
-        }
-
-        return STATUS_SUCCESS;
-}
-
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
 PAGED auto import_remote_device(_Inout_ device_ctx_ext &ext)
 {
         PAGED_CODE();
+        op_import_reply reply;
 
-        if (auto err = send_req_import(ext)) {
+        if (ext.session) {
+                if (auto err = import_device(ext, reply)) {
+                        return err;
+                }
+        } else if (auto err = send_req_import(ext.sock, ext.busid)) {
                 Trace(TRACE_LEVEL_ERROR, "Send OP_REQ_IMPORT %!STATUS!", err);
                 return err;
-        }
-
-        op_import_reply reply;
-        if (auto err = recv_rep_import(ext, memory::stack, reply)) {
+        } else if (auto err = recv_rep_import(ext.sock, ext.busid, memory::stack, reply)) {
                 return err;
         }
+        set_milestone(ext.timings.imported, ext);
  
         auto &udev = reply.udev; 
         log(udev);
@@ -152,6 +116,10 @@ PAGED auto import_remote_device(_Inout_ device_ctx_ext &ext)
                 d->product = udev.idProduct;
         }
 
+        if (auto err = load_descriptor_cache(ext, udev)) {
+                Trace(TRACE_LEVEL_WARNING, "load_descriptor_cache %!STATUS!", err); // not fatal
+        }
+
         return STATUS_SUCCESS;
 }
 
@@ -182,6 +150,7 @@ PAGED NTSTATUS plugin(_Out_ int &port, _In_ UDECXUSBDEVICE device)
                 return err;
         }
 
+        set_milestone(dev.ext->timings.plugged, *dev.ext);
         return STATUS_SUCCESS;
 }
 
@@ -195,52 +164,8 @@ PAGED auto start_device(_Out_ int &port, _In_ UDECXUSBDEVICE device)
                 return err;
         }
 
-        return device::recv_thread_start(device);
-}
-
-/*
- * TCP_NODELAY is not supported, see WSK_FLAG_NODELAY.
- */
-_IRQL_requires_same_
-_IRQL_requires_(PASSIVE_LEVEL)
-PAGED auto set_options(_In_ wsk::SOCKET *sock)
-{
-        PAGED_CODE();
-
-        auto keepalive = [] (auto idle, auto cnt, auto intvl) constexpr { return idle + cnt*intvl; };
-
-        int idle = 0;
-        int cnt = 0;
-        int intvl = 0;
-
-        if (auto err = get_keepalive_opts(sock, &idle, &cnt, &intvl)) {
-                Trace(TRACE_LEVEL_ERROR, "get_keepalive_opts %!STATUS!", err);
-                return err;
-        }
-
-        Trace(TRACE_LEVEL_VERBOSE, "get keepalive: idle(%d sec) + cnt(%d)*intvl(%d sec) => %d sec", 
-                idle, cnt, intvl, keepalive(idle, cnt, intvl));
-
-        enum { IDLE = 30, CNT = 9, INTVL = 10 };
-
-        if (auto err = set_keepalive(sock, IDLE, CNT, INTVL)) {
-                Trace(TRACE_LEVEL_ERROR, "set_keepalive %!STATUS!", err);
-                return err;
-        }
-
-        bool optval{};
-        if (auto err = get_keepalive(sock, optval)) {
-                Trace(TRACE_LEVEL_ERROR, "get_keepalive %!STATUS!", err);
-                return err;
-        }
-
-        NT_VERIFY(!get_keepalive_opts(sock, &idle, &cnt, &intvl));
-
-        Trace(TRACE_LEVEL_VERBOSE, "set keepalive: idle(%d sec) + cnt(%d)*intvl(%d sec) => %d sec", 
-                idle, cnt, intvl, keepalive(idle, cnt, intvl));
-
-        bool ok = optval && keepalive(idle, cnt, intvl) == keepalive(IDLE, CNT, INTVL);
-        return ok ? STATUS_SUCCESS : STATUS_UNSUCCESSFUL;
+        auto &dev = *get_device_ctx(device);
+        return dev.ext->session ? add_device(dev) : device::recv_thread_start(device);
 }
 
 _IRQL_requires_same_
@@ -264,6 +189,7 @@ PAGED auto connected(_In_ WDFREQUEST request, _Inout_ device_ctx_ext* &ext)
         if (auto err = device::create(dev, vhci, ext)) {
                 return err;
         }
+        set_milestone(ext->timings.created, *ext);
         ext = nullptr; // now dev owns it
 
         if (auto err = start_device(r->port, dev)) {
@@ -297,87 +223,141 @@ NTSTATUS irp_complete(
         return StopCompletion;
 }
 
+/*
+ * Serve a stale entry if the resolver has failed, otherwise remember the failure.
+ */
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
-PAGED auto create_socket(_Inout_ wsk::SOCKET* &sock, _In_ const ADDRINFOEXW &ai)
+PAGED auto on_addrinfo(_Inout_ workitem_ctx &ctx, _In_ NTSTATUS st)
 {
         PAGED_CODE();
-        NT_ASSERT(!sock);
+        auto &ext = *ctx.ext;
 
-        if (auto err = socket(sock, static_cast<ADDRESS_FAMILY>(ai.ai_family), 
-                                static_cast<USHORT>(ai.ai_socktype), ai.ai_protocol, 
-                                WSK_FLAG_CONNECTION_SOCKET, nullptr, nullptr)) {
-                NT_ASSERT(!sock);
-                Trace(TRACE_LEVEL_ERROR, "socket %!STATUS!", err);
-                return err;
+        if (ctx.cached) {
+                // nothing to do
+        } else if (NT_SUCCESS(st)) {
+                dns_cache_put(ext.node_name, ext.service_name, ctx.addrinfo, st);
+        } else if (st == STATUS_CANCELLED) {
+                // request is cancelled
+        } else if (NTSTATUS stale; dns_cache_get(ctx.addrinfo, stale, ext.node_name, ext.service_name, true)) {
+                NT_ASSERT(!stale);
+                Trace(TRACE_LEVEL_WARNING, "getaddrinfo('%!USTR!:%!USTR!') %!STATUS!, using stale addresses", 
+                                            &ext.node_name, &ext.service_name, st);
+                ctx.cached = true;
+                st = STATUS_SUCCESS;
+        } else {
+                dns_cache_put(ext.node_name, ext.service_name, nullptr, st);
         }
 
-        if (auto err = set_options(sock)) {
-                return err;
-        }
+        return st;
+}
 
-        SOCKADDR_INET any { // see INADDR_ANY, IN6ADDR_ANY_INIT
-                .si_family = static_cast<ADDRESS_FAMILY>(ai.ai_family)
-        };
+/*
+ * Does not complete the request, it wakes up happy_eyeballs_connect.
+ */
+_Function_class_(EVT_WDF_REQUEST_CANCEL)
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void NTAPI cancel_connect(_In_ WDFREQUEST request)
+{
+        auto irp = WdfRequestWdmGetIrp(request);
+        TraceDbg("req %04x", ptr04x(request));
 
-        if (auto err = bind(sock, reinterpret_cast<SOCKADDR*>(&any))) {
-                Trace(TRACE_LEVEL_ERROR, "bind %!STATUS!", err);
-                return err;
+        auto cancel = libdrv::argv<KEVENT*, ARG_CANCEL>(irp);
+        KeSetEvent(cancel, IO_NO_INCREMENT, false);
+}
+
+/*
+ * The connection is established by a system work item, it must not be occupied for TCP timeouts of all addresses.
+ * Address families are raced by happy_eyeballs_connect, each one gets CONNECT_TIMEOUT.
+ * @return KeQueryInterruptTime
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto get_connect_deadline(_In_ const ADDRINFOEXW &head)
+{
+        bool inet{};
+        bool inet6{};
+
+        for (auto ai = &head; ai; ai = ai->ai_next) {
+                switch (ai->ai_family) {
+                case AF_INET:
+                        inet = true;
+                        break;
+                case AF_INET6:
+                        inet6 = true;
+                }
         }
 
-        return STATUS_SUCCESS;
+        auto families = max(inet + inet6, 1);
+        return KeQueryInterruptTime() + families*CONNECT_TIMEOUT*ULONGLONG(wdm::second);
 }
 
+/*
+ * A standard server closes the connection after OP_REQ_FEATURES, see negotiate_features.
+ * Both connections are made before the same deadline.
+ */
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
-PAGED auto connect(
-        _In_ WDFREQUEST request, _In_ WDFWORKITEM wi, _Inout_ wsk::SOCKET* &sock, _In_ const ADDRINFOEXW &ai)
+PAGED auto connect_socket(_Inout_ workitem_ctx &ctx)
 {
         PAGED_CODE();
+        auto &ext = *ctx.ext;
 
-        if (auto &sa = *reinterpret_cast<SOCKADDR_INET*>(ai.ai_addr); sa.si_family == AF_INET) {
-                auto &v4 = sa.Ipv4;
-                TraceDbg("%!IPADDR!", v4.sin_addr.s_addr);
-        } else {
-                auto &v6 = sa.Ipv6;
-                TraceDbg("%!BIN!", WppBinary(&v6.sin6_addr, sizeof(v6.sin6_addr)));
+        if (join_session(ctx.vhci, ext)) {
+                return STATUS_SUCCESS;
         }
 
-        if (auto err = create_socket(sock, ai)) {
-                return err;
+        auto deadline = get_connect_deadline(*ctx.addrinfo);
+
+        auto st = happy_eyeballs_connect(ext.sock, *ctx.addrinfo, &ctx.cancel, deadline);
+        if (!NT_SUCCESS(st)) {
+                return st;
         }
 
-        auto irp = set_args(request, __func__, &ai);
-        IoSetCompletionRoutine(irp, irp_complete, wi, true, true, true);
+        apply_socket_buffers(ext.sock, ext.buffers); // not fatal
 
-        auto st = connect(sock, ai.ai_addr, irp); // completion handler will be called anyway
-        TraceDbg("%!STATUS!", st);
+        if (auto features = get_requested_features(ctx.vhci, ext);
+            features && negotiate_features(ctx.vhci, ext, features) && !ext.sock) {
+                st = happy_eyeballs_connect(ext.sock, *ctx.addrinfo, &ctx.cancel, deadline);
+                if (NT_SUCCESS(st)) {
+                        apply_socket_buffers(ext.sock, ext.buffers);
+                }
+        }
 
-        return STATUS_PENDING;
+        return st;
 }
 
+/*
+ * Connection attempts to all resolved addresses are raced, see happy_eyeballs_connect.
+ * The request can be cancelled while they are in progress.
+ */
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
-PAGED auto on_connect(
-        _In_ WDFREQUEST request, _In_ WDFWORKITEM wi, _Inout_ device_ctx_ext* &ext, _In_ const ADDRINFOEXW &ai)
+PAGED auto connect(_In_ WDFREQUEST request, _Inout_ workitem_ctx &ctx)
 {
         PAGED_CODE();
 
-        auto st = WdfRequestGetStatus(request);
+        KeInitializeEvent(&ctx.cancel, NotificationEvent, false);
+        libdrv::argv<ARG_CANCEL>(WdfRequestWdmGetIrp(request)) = &ctx.cancel;
+
+        if (auto err = WdfRequestMarkCancelableEx(request, cancel_connect)) {
+                return err; // STATUS_CANCELLED
+        }
+
+        auto st = connect_socket(ctx);
+        TraceDbg("%!STATUS!", st);
 
         if (NT_SUCCESS(st)) {
-                st = connected(request, ext);
-                NT_ASSERT(st != STATUS_PENDING);
-        } else {
-                NT_VERIFY(NT_SUCCESS(close(ext->sock)));
-                free(ext->sock);
+                set_milestone(ctx.ext->timings.connected, *ctx.ext);
+        }
 
-                if (st != STATUS_CANCELLED && ai.ai_next) {
-                        st = connect(request, wi, ext->sock, *ai.ai_next);
-                }
+        if (WdfRequestUnmarkCancelable(request) == STATUS_CANCELLED) { // cancel_connect has been or will be called
+                NT_VERIFY(!KeWaitForSingleObject(&ctx.cancel, Executive, KernelMode, false, nullptr));
+                st = STATUS_CANCELLED;
         }
 
-        return st;
+        return NT_SUCCESS(st) ? connected(request, ctx.ext) : st;
 }
 
 _Function_class_(EVT_WDF_WORKITEM)
@@ -397,18 +377,15 @@ PAGED void NTAPI complete(_In_ WDFWORKITEM wi)
         auto st = WdfRequestGetStatus(request);
         TraceDbg("%s %!STATUS!", function, st);
 
-        if (auto ai = libdrv::argv<ADDRINFOEXW*, ARG_AI>(irp)) {
-                st = on_connect(request, wi, ctx.ext, *ai);
-        } else if (NT_SUCCESS(st)) { // on_addrinfo
+        if (st = on_addrinfo(ctx, st); NT_SUCCESS(st)) {
                 NT_ASSERT(ctx.addrinfo);
-                st = connect(request, wi, ctx.ext->sock, *ctx.addrinfo);
+                set_milestone(ctx.ext->timings.resolved, *ctx.ext);
+                st = connect(request, ctx);
         }
 
-        if (st != STATUS_PENDING) {
-                TraceDbg("req %04x, %!STATUS!", ptr04x(request), st);
-                WdfRequestComplete(request, st);
-                WdfObjectDelete(wi); // do not use ctx.request more, see workitem_cleanup
-        }
+        TraceDbg("req %04x, %!STATUS!", ptr04x(request), st);
+        WdfRequestComplete(request, st);
+        WdfObjectDelete(wi); // do not use ctx.request more, see workitem_cleanup
 }
 
 /*
@@ -427,7 +404,11 @@ PAGED void workitem_cleanup(_In_ WDFOBJECT obj)
         TraceDbg("request %04x, addrinfo %04x, device_ctx_ext %04x", 
                   ptr04x(ctx.request), ptr04x(ctx.addrinfo), ptr04x(ctx.ext));
 
-        wsk::free(ctx.addrinfo);
+        if (ctx.cached) {
+                free_cached_addrinfo(ctx.addrinfo);
+        } else {
+                wsk::free(ctx.addrinfo);
+        }
         ctx.addrinfo = nullptr;
 
         if (auto &ext = ctx.ext) {
@@ -472,10 +453,19 @@ PAGED void getaddrinfo(_In_ WDFREQUEST request, _In_ WDFWORKITEM wi, _Inout_ wor
                 .ai_protocol = IPPROTO_TCP // zero isn't work
         };
 
+        NT_ASSERT(!ctx.addrinfo);
+
+        if (NTSTATUS st; dns_cache_get(ctx.addrinfo, st, ext.node_name, ext.service_name, false)) {
+                ctx.cached = true;
+                auto irp = set_args(request, "dns_cache_get");
+                irp->IoStatus.Status = st; // see WdfRequestGetStatus in complete()
+                WdfWorkItemEnqueue(wi);
+                return;
+        }
+
         auto irp = set_args(request, __func__);
         IoSetCompletionRoutine(irp, irp_complete, wi, true, true, true);
                          
-        NT_ASSERT(!ctx.addrinfo);
         auto st = wsk::getaddrinfo(ctx.addrinfo, &ext.node_name, &ext.service_name, &hints, irp);
         TraceDbg("%!STATUS!", st);
 }
@@ -503,6 +493,10 @@ PAGED auto plugin_hardware( _In_ WDFREQUEST request, _In_ const vhci::ioctl::plu
                 WdfObjectDelete(wi);
                 return err;
         }
+        get_default_socket_buffers(ctx.ext->buffers);
+        get_default_recv_thread_options(ctx.ext->recv_options);
+        init_compression(*ctx.ext);
+        ctx.ext->attach_start = KeQueryInterruptTime();
 
         device_state_changed(vhci, *ctx.ext, 0, vhci::state::connecting);
 
@@ -575,6 +569,198 @@ PAGED NTSTATUS plugout_hardware(_In_ WDFREQUEST request)
         return st;
 }
 
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS set_socket_buffers(_In_ WDFREQUEST request)
+{
+        PAGED_CODE();
+        WdfRequestSetInformation(request, 0);
+
+        vhci::ioctl::set_socket_buffers *r{};
+
+        if (size_t length; 
+            auto err = WdfRequestRetrieveInputBuffer(request, sizeof(*r), reinterpret_cast<PVOID*>(&r), &length)) {
+                return err;
+        } else if (length != sizeof(*r)) {
+                return STATUS_INVALID_BUFFER_SIZE;
+        } else if (r->size != sizeof(*r)) {
+                Trace(TRACE_LEVEL_ERROR, "set_socket_buffers.size %lu != sizeof(set_socket_buffers) %Iu",
+                                          r->size, sizeof(*r));
+
+                return USBIP_ERROR_ABI;
+        } else if (auto err = WdfRequestRetrieveOutputBuffer(request, sizeof(*r), nullptr, nullptr)) {
+                return err;
+        }
+
+        TraceDbg("port %d, sndbuf %d, rcvbuf %d, autotune %d", r->port, r->sndbuf, r->rcvbuf, r->autotune);
+
+        if (!is_valid_port(r->port)) {
+                return STATUS_INVALID_PARAMETER;
+        }
+
+        auto dev = vhci::get_device(get_vhci(request), r->port);
+        if (!dev) {
+                return STATUS_DEVICE_NOT_CONNECTED;
+        }
+
+        auto &ctx = *get_device_ctx(dev.get());
+
+        if (auto err = set_socket_buffers(ctx, *r)) {
+                return err;
+        }
+
+        WdfRequestSetInformation(request, sizeof(*r));
+        return STATUS_SUCCESS;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS set_recv_thread_options(_In_ WDFREQUEST request)
+{
+        PAGED_CODE();
+        WdfRequestSetInformation(request, 0);
+
+        vhci::ioctl::set_recv_thread_options *r{};
+
+        if (size_t length; 
+            auto err = WdfRequestRetrieveInputBuffer(request, sizeof(*r), reinterpret_cast<PVOID*>(&r), &length)) {
+                return err;
+        } else if (length != sizeof(*r)) {
+                return STATUS_INVALID_BUFFER_SIZE;
+        } else if (r->size != sizeof(*r)) {
+                Trace(TRACE_LEVEL_ERROR, "set_recv_thread_options.size %lu != sizeof(set_recv_thread_options) %Iu",
+                                          r->size, sizeof(*r));
+
+                return USBIP_ERROR_ABI;
+        } else if (auto err = WdfRequestRetrieveOutputBuffer(request, sizeof(*r), nullptr, nullptr)) {
+                return err;
+        }
+
+        TraceDbg("port %d, class_aware %d, ideal_processor %d", r->port, r->class_aware, r->ideal_processor);
+
+        if (!is_valid_port(r->port)) {
+                return STATUS_INVALID_PARAMETER;
+        }
+
+        auto dev = vhci::get_device(get_vhci(request), r->port);
+        if (!dev) {
+                return STATUS_DEVICE_NOT_CONNECTED;
+        }
+
+        auto &ctx = *get_device_ctx(dev.get());
+
+        if (auto err = set_recv_thread_options(ctx, *r, r->priority)) {
+                return err;
+        }
+
+        WdfRequestSetInformation(request, sizeof(*r));
+        return STATUS_SUCCESS;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS get_device_stats(_In_ WDFREQUEST request)
+{
+        PAGED_CODE();
+        WdfRequestSetInformation(request, 0);
+
+        vhci::ioctl::get_device_stats *r{};
+
+        if (size_t length; 
+            auto err = WdfRequestRetrieveInputBuffer(request, sizeof(*r), reinterpret_cast<PVOID*>(&r), &length)) {
+                return err;
+        } else if (length != sizeof(*r)) {
+                return STATUS_INVALID_BUFFER_SIZE;
+        } else if (r->size != sizeof(*r)) {
+                Trace(TRACE_LEVEL_ERROR, "get_device_stats.size %lu != sizeof(get_device_stats) %Iu",
+                                          r->size, sizeof(*r));
+
+                return USBIP_ERROR_ABI;
+        } else if (auto err = WdfRequestRetrieveOutputBuffer(request, sizeof(*r), nullptr, nullptr)) {
+                return err;
+        }
+
+        if (!is_valid_port(r->port)) {
+                return STATUS_INVALID_PARAMETER;
+        }
+
+        auto dev = vhci::get_device(get_vhci(request), r->port);
+        if (!dev) {
+                return STATUS_DEVICE_NOT_CONNECTED;
+        }
+
+        get_stats(*r, *get_device_ctx(dev.get()));
+        TraceDbg("port %d, %lu endpoint(s)", r->port, r->count);
+
+        WdfRequestSetInformation(request, sizeof(*r));
+        return STATUS_SUCCESS;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS get_trace(_In_ WDFREQUEST request)
+{
+        PAGED_CODE();
+        WdfRequestSetInformation(request, 0);
+
+        vhci::ioctl::get_trace *r{};
+        constexpr auto hdr_size = offsetof(vhci::ioctl::get_trace, records);
+
+        size_t outlen;
+        if (auto err = WdfRequestRetrieveOutputBuffer(request, hdr_size, reinterpret_cast<PVOID*>(&r), &outlen)) {
+                return err;
+        } else if (r->size != sizeof(*r)) {
+                Trace(TRACE_LEVEL_ERROR, "get_trace.size %lu != sizeof(get_trace) %Iu", r->size, sizeof(*r));
+                return USBIP_ERROR_ABI;
+        }
+
+        auto max_cnt = static_cast<ULONG>((outlen - hdr_size)/sizeof(*r->records));
+        r->count = read_trace_ring(r->records, max_cnt, r->dropped);
+
+        TraceDbg("%lu record(s), dropped %I64u", r->count, r->dropped);
+
+        WdfRequestSetInformation(request, vhci::ioctl::get_trace_size(r->count));
+        return STATUS_SUCCESS;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS get_pool_stats(_In_ WDFREQUEST request)
+{
+        PAGED_CODE();
+        WdfRequestSetInformation(request, 0);
+
+        vhci::ioctl::get_pool_stats *r{};
+
+        if (auto err = WdfRequestRetrieveOutputBuffer(request, sizeof(*r), reinterpret_cast<PVOID*>(&r), nullptr)) {
+                return err;
+        } else if (r->size != sizeof(*r)) {
+                Trace(TRACE_LEVEL_ERROR, "get_pool_stats.size %lu != sizeof(get_pool_stats) %Iu", r->size, sizeof(*r));
+                return USBIP_ERROR_ABI;
+        }
+
+        usbip::get_pool_stats(*r);
+
+        auto vhci = get_vhci(request);
+        r->undeleted_devices = get_vhci_ctx(vhci)->undeleted;
+        r->device_count = 0;
+
+        static_assert(ARRAYSIZE(vhci_ctx::devices) <= ARRAYSIZE(r->devices));
+
+        for (int port = 1; port <= ARRAYSIZE(vhci_ctx::devices); ++port) {
+                if (auto dev = vhci::get_device(vhci, port)) {
+                        auto &d = r->devices[r->device_count++];
+                        d.port = port;
+                        usbip::copy(d.usage, get_device_ctx(dev.get())->pool);
+                }
+        }
+
+        TraceDbg("%lu consumer(s), %lu device(s)", r->count, r->device_count);
+
+        WdfRequestSetInformation(request, sizeof(*r));
+        return STATUS_SUCCESS;
+}
+
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
 PAGED NTSTATUS get_imported_devices(_In_ WDFREQUEST request)
@@ -621,6 +807,81 @@ PAGED NTSTATUS get_imported_devices(_In_ WDFREQUEST request)
         return STATUS_SUCCESS;
 }
 
+/*
+ * Ports are copied at once, a change that is made while filling the result will be reported next time.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS get_imported_devices_delta(_In_ WDFREQUEST request)
+{
+        PAGED_CODE();
+        WdfRequestSetInformation(request, 0);
+
+        vhci::ioctl::get_imported_devices_delta *r{};
+        constexpr auto hdr_size = offsetof(vhci::ioctl::get_imported_devices_delta, devices);
+        size_t outlen;
+
+        if (auto err = WdfRequestRetrieveInputBuffer(request, hdr_size, reinterpret_cast<PVOID*>(&r), nullptr)) {
+                return err;
+        } else if (r->size != sizeof(*r)) {
+                Trace(TRACE_LEVEL_ERROR, "get_imported_devices_delta.size %lu != sizeof(get_imported_devices_delta) %Iu", 
+                                          r->size, sizeof(*r));
+
+                return USBIP_ERROR_ABI;
+        } else if (auto err = WdfRequestRetrieveOutputBuffer(request, hdr_size, nullptr, &outlen)) {
+                return err;
+        }
+
+        auto max_cnt = (outlen - hdr_size)/sizeof(*r->devices);
+
+        vhci::ports_snapshot snap;
+        get_snapshot(snap, get_vhci(request));
+
+        auto since = r->generation; // the input and output buffers are the same
+        auto epoch = get_vhci_ctx(get_vhci(request))->epoch;
+
+        auto reset = is_delta_reset(since, r->epoch, snap.generation, epoch);
+
+        ULONG cnt = 0;
+
+        for (int i = 0; i < ARRAYSIZE(snap.devices); ++i) {
+                if (!is_delta_reported(reset, bool(snap.devices[i]), snap.changed[i], since)) {
+                        continue;
+                } else if (cnt++ >= max_cnt) { // size query or the buffer is too small, just count
+                        continue;
+                }
+
+                auto &e = r->devices[cnt - 1];
+                RtlZeroMemory(&e, sizeof(e));
+
+                if (auto dev = snap.devices[i].get<UDECXUSBDEVICE>()) {
+                        if (auto err = fill(e.device, *get_device_ctx(dev))) {
+                                return err;
+                        }
+                } else {
+                        e.removed = true;
+                        e.device.port = i + 1;
+                }
+        }
+
+        TraceDbg("generation %I64u -> %I64u, %lu change(s), max %Iu", since, snap.generation, cnt, max_cnt);
+
+        if (max_cnt && cnt > max_cnt) {
+                return STATUS_BUFFER_TOO_SMALL;
+        }
+
+        r->generation = snap.generation;
+        r->epoch = epoch;
+        r->count = cnt;
+        r->reset = reset;
+
+        auto written = vhci::ioctl::get_imported_devices_delta_size(max_cnt ? cnt : 0);
+        NT_ASSERT(written <= outlen);
+        WdfRequestSetInformation(request, written);
+
+        return STATUS_SUCCESS;
+}
+
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
 PAGED auto set_persistent(_In_ WDFREQUEST request)
@@ -714,9 +975,6 @@ PAGED void device_control(
         NTSTATUS st;
 
         switch (IoControlCode) {
-        case vhci::ioctl::PLUGIN_HARDWARE:
-                st = plugin_hardware(Request);
-                break;
         case vhci::ioctl::PLUGOUT_HARDWARE:
                 st = plugout_hardware(Request);
                 break;
@@ -749,6 +1007,10 @@ PAGED void device_control(
  * or the value after the write took place, but not some sort of mixture of the two.
  *
  * @see Raymond Chen, The inability to lock someone out of the registry is a feature, not a bug
+ *
+ * PLUGIN_HARDWARE is asynchronous, each request has its own work item and device_ctx_ext.
+ * If it is dispatched sequentially, an unreachable host delays all other attach requests
+ * until a connect timeout, see persistent.cpp.
  */
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
@@ -757,12 +1019,28 @@ PAGED decltype(get_persistent) *get_parallel_handler(_In_ ULONG IoControlCode)
         PAGED_CODE();
 
         switch (IoControlCode) {
+        case vhci::ioctl::PLUGIN_HARDWARE:
+                return plugin_hardware;
+        case vhci::ioctl::PLUGIN_HARDWARE_BATCH:
+                return plugin_hardware_batch;
         case vhci::ioctl::GET_IMPORTED_DEVICES:
                 return get_imported_devices;
+        case vhci::ioctl::GET_IMPORTED_DEVICES_DELTA:
+                return get_imported_devices_delta;
         case vhci::ioctl::SET_PERSISTENT:
                 return set_persistent;
         case vhci::ioctl::GET_PERSISTENT:
                 return get_persistent;
+        case vhci::ioctl::SET_SOCKET_BUFFERS:
+                return set_socket_buffers;
+        case vhci::ioctl::GET_DEVICE_STATS:
+                return get_device_stats;
+        case vhci::ioctl::GET_TRACE:
+                return get_trace;
+        case vhci::ioctl::GET_POOL_STATS:
+                return get_pool_stats;
+        case vhci::ioctl::SET_RECV_THREAD_OPTIONS:
+                return set_recv_thread_options;
         default:
                 return nullptr;
         }
@@ -818,7 +1096,7 @@ PAGED void device_read(_In_ WDFQUEUE queue, _In_ WDFREQUEST request, _In_ size_t
 
         TraceDbg("fobj %04x, request %04x, length %Iu", ptr04x(fileobj), ptr04x(request), length);
 
-        if (length != sizeof(vhci::device_state)) {
+        if (!length || length % sizeof(vhci::device_state)) { // several events can be read at once
                 WdfRequestCompleteWithInformation(request, STATUS_INVALID_BUFFER_SIZE, 0);
                 return;
         }
@@ -828,14 +1106,16 @@ PAGED void device_read(_In_ WDFQUEUE queue, _In_ WDFREQUEST request, _In_ size_t
         
         wdf::WaitLock lck(vhci.events_lock);
 
+        auto &ring = *vhci.events;
+
         if (auto &val = fobj.process_events; !val) {
                 ++vhci.events_subscribers;
+                fobj.seqnum = ring.seqnum; // events that were issued before are not delivered
                 val = true;
         }
 
-        if (auto evt = (WDFMEMORY)WdfCollectionGetFirstItem(fobj.events)) {
-                vhci::complete_read(request, evt);
-                WdfCollectionRemove(fobj.events, evt); // decrements reference count
+        if (!empty(ring, fobj.seqnum)) {
+                vhci::complete_read(request, fobj, ring);
         } else if (auto err = WdfRequestForwardToIoQueue(request, vhci.reads)) {
                 Trace(TRACE_LEVEL_ERROR, "WdfRequestForwardToIoQueue %!STATUS!", err);
                 if (err == STATUS_WDF_BUSY) { // the queue is not accepting new requests, purged
@@ -6,6 +6,10 @@
 #include "trace.h"
 #include "wsk_context.tmh"
 
+#include "context.h"
+#include "pool.h"
+#include "compression.h"
+
 #include <libdrv/codeseg.h>
 
 namespace
@@ -34,11 +38,8 @@ void free_function_ex(_In_ __drv_freesMem(Mem) void *Buffer, _Inout_ LOOKASIDE_L
                 IoFreeIrp(irp);
         }
 
-        if (auto ptr = ctx->isoc) {
-                ExFreePoolWithTag(ptr, g_tag);
-        }
-
-        ExFreePoolWithTag(ctx, g_tag);
+        pool_free(pool_consumer::isoc, ctx->isoc, ctx->isoc_alloc_cnt*sizeof(*ctx->isoc));
+        pool_free(pool_consumer::wsk_context, ctx, sizeof(*ctx));
 }
 
 _IRQL_requires_same_
@@ -47,8 +48,9 @@ void *allocate_function_ex(_In_ POOL_TYPE PoolType, _In_ SIZE_T NumberOfBytes, _
 {
         NT_ASSERT(PoolType == NonPagedPoolNx);
         NT_ASSERT(Tag == g_tag);
+        NT_ASSERT(NumberOfBytes == sizeof(wsk_context));
 
-        auto ctx = (wsk_context*)ExAllocatePoolZero(PoolType, NumberOfBytes, Tag);
+        auto ctx = (wsk_context*)pool_alloc(pool_consumer::wsk_context, PoolType, NumberOfBytes);
         if (!ctx) {
                 Trace(TRACE_LEVEL_ERROR, "Can't allocate %Iu bytes", NumberOfBytes);
                 return nullptr;
@@ -130,21 +132,23 @@ void usbip::delete_wsk_context_list()
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
 auto usbip::alloc_wsk_context(
-        _In_ device_ctx *dev, _In_opt_ WDFREQUEST request, _In_ ULONG NumberOfPackets) -> wsk_context*
+        _In_opt_ device_ctx *dev, _In_opt_ WDFREQUEST request, _In_ ULONG NumberOfPackets) -> wsk_context*
 {
-        NT_ASSERT(dev);
-
         auto ctx = ::alloc_wsk_context(NumberOfPackets);
         if (ctx) {
                 ctx->dev = dev;
                 ctx->request = request;
+                if (dev) {
+                        ctx->seqnum_epoch = ReadAcquire(&dev->seqnum_epoch); // before next_seqnum
+                        charge(dev->pool, sizeof(*ctx));
+                }
         }
 
         return ctx;
 }
 
 /*
- * alloc_wsk_context sets dev, request, is_isoc. It's safe do not clear them.
+ * alloc_wsk_context sets dev, request, seqnum_epoch, is_isoc. It's safe do not clear them.
  */
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
@@ -155,6 +159,11 @@ void usbip::free(_In_opt_ wsk_context *ctx, _In_ bool reuse_irp)
         }
 
         ctx->mdl_buf.reset();
+        free_compressed(*ctx);
+
+        if (auto dev = ctx->dev) {
+                uncharge(dev->pool, sizeof(*ctx));
+        }
 
         if (reuse_irp) {
                 IoReuseIrp(ctx->wsk_irp, STATUS_SUCCESS);
@@ -177,14 +186,12 @@ NTSTATUS usbip::prepare_isoc(_In_ wsk_context &ctx, _In_ ULONG NumberOfPackets)
         ULONG isoc_len = NumberOfPackets*sizeof(*ctx.isoc);
 
         if (ctx.isoc_alloc_cnt < NumberOfPackets) {
-                auto isoc = (usbip_iso_packet_descriptor*)ExAllocatePoolZero(NonPagedPoolNx, isoc_len, g_tag);
+                auto isoc = (usbip_iso_packet_descriptor*)pool_alloc(pool_consumer::isoc, NonPagedPoolNx, isoc_len);
                 if (!isoc) {
                         return STATUS_INSUFFICIENT_RESOURCES;
                 }
 
-                if (ctx.isoc) {
-                        ExFreePoolWithTag(ctx.isoc, g_tag);
-                }
+                pool_free(pool_consumer::isoc, ctx.isoc, ctx.isoc_alloc_cnt*sizeof(*ctx.isoc));
 
                 ctx.isoc = isoc;
                 ctx.isoc_alloc_cnt = NumberOfPackets;
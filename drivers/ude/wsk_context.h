@@ -16,12 +16,14 @@ struct device_ctx;
 
 struct wsk_context
 {
-        device_ctx *dev; // UDECXUSBDEVICE can be obtained from WDFREQUEST, but it is optional
+        device_ctx *dev; // UDECXUSBDEVICE can be obtained from WDFREQUEST, but it is optional; NULL for mux_session
 
         // transient data
 
         WDFREQUEST request; // can be WDF_NO_HANDLE
-        Mdl mdl_buf; // describes URB_FROM_IRP()->TransferBuffer(MDL)
+        LONG seqnum_epoch; // device_ctx::seqnum_epoch before hdr.base.seqnum was issued
+        Mdl mdl_buf; // describes URB_FROM_IRP()->TransferBuffer(MDL) or compressed payload
+        LONG compress_buffer; // bit of device_ctx_ext::compress_busy, zero if compress() was not used
 
         // preallocated data
 
@@ -48,7 +50,7 @@ void delete_wsk_context_list();
 
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
-wsk_context *alloc_wsk_context(_In_ device_ctx *dev, _In_opt_ WDFREQUEST request, _In_ ULONG NumberOfPackets = 0);
+wsk_context *alloc_wsk_context(_In_opt_ device_ctx *dev, _In_opt_ WDFREQUEST request, _In_ ULONG NumberOfPackets = 0);
 
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
@@ -13,6 +13,15 @@
 #include "network.h"
 #include "driver.h"
 #include "ioctl.h"
+#include "descriptor_cache.h"
+#include "reconnect.h"
+#include "socket_buffers.h"
+#include "recv_priority.h"
+#include "mux.h"
+#include "stats.h"
+#include "trace_ring.h"
+#include "pool.h"
+#include "compression.h"
 
 #include <libdrv\usbd_helper.h>
 #include <libdrv\dbgcommon.h>
@@ -20,6 +29,7 @@
 #include <libdrv\irp.h>
 #include <libdrv\pdu.h>
 #include <libdrv\ch9.h>
+#include <libdrv\wait_timeout.h>
 
 extern "C" {
 #include <usbdlib.h>
@@ -236,6 +246,41 @@ PAGED auto fill_isoc_data(_Inout_ _URB_ISOCH_TRANSFER &r, _In_opt_ UCHAR *buffer
 	return STATUS_SUCCESS;
 }
 
+/*
+ * start_frame of a completed isoch transfer is a sample of the server's bus frame clock.
+ * The transfer completed about srtt/2 before the reply was received.
+ * @return ret.start_frame as a local frame number
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto update_frame_clock(_Inout_ device_ctx &dev, _In_ WDFREQUEST request, _In_ const usbip_header_ret_submit &ret)
+{
+	auto now = KeQueryInterruptTime();
+	auto start_frame = static_cast<ULONG>(ret.start_frame);
+
+	UINT64 time{};
+	bool sample = !ret.status && ret.number_of_packets > 0 && ret.error_count < ret.number_of_packets;
+
+	if (sample) {
+		auto &d = get_endpoint_ctx(get_request_ctx(request)->endpoint)->descriptor;
+		auto uframes = UINT64(ret.number_of_packets) << (d.bInterval ? min(d.bInterval, 16) - 1 : 0);
+
+		if (dev.speed() < USB_SPEED_HIGH) { // bInterval is in frames
+			uframes *= 8;
+		}
+
+		time = now - dev.srtt/2 - uframes*125*wdm::usec;
+	}
+
+	wdf::Lock lck(dev.clock_lock);
+
+	if (sample) {
+		add_sample(dev.clock, time, start_frame);
+	}
+
+	return to_local_frame(dev.clock, now, start_frame);
+}
+
 /*
  * Layout: transfer buffer(IN only), usbip_iso_packet_descriptor[].
  */
@@ -253,8 +298,9 @@ PAGED auto isoch_transfer(_In_ wsk_context &ctx, _In_ const usbip_header_ret_sub
 		r.Hdr.Status = USBD_STATUS_ISOCH_REQUEST_FAILED;
 	}
 
-	if (r.TransferFlags & USBD_START_ISO_TRANSFER_ASAP) {
-		r.StartFrame = ret.start_frame;
+	if (auto frame = update_frame_clock(*ctx.dev, ctx.request, ret);
+	    r.TransferFlags & USBD_START_ISO_TRANSFER_ASAP) {
+		r.StartFrame = frame;
 	}
 
 	if (cnt >= 0 && ULONG(cnt) == r.NumberOfPackets) {
@@ -327,6 +373,8 @@ PAGED void post_control_transfer(_In_ const device_ctx &dev, _In_ const _URB_CON
 		}
 		break;
 	}
+
+	put_cached_descriptor(dev, get_setup_packet(r), dsc, dsc_len);
 }
 
 _IRQL_requires_same_
@@ -474,17 +522,14 @@ PAGED auto prepare_wsk_mdl(_Out_ MDL* &mdl, _Inout_ wsk_context &ctx, _Inout_ UR
 
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
-PAGED auto receive(_Inout_ wsk_context &ctx, _Inout_ WSK_BUF &buf)
+PAGED auto receive(_Inout_ SOCKET *sock, _Inout_ WSK_BUF &buf, _In_opt_ WDFREQUEST request)
 {
 	PAGED_CODE();
 
-	auto &dev = *ctx.dev;
-	NT_ASSERT(verify(buf, ctx.is_isoc));
-
 	SIZE_T actual{};
-	auto st = receive(dev.sock(), &buf, WSK_FLAG_WAITALL, &actual);
+	auto st = receive(sock, &buf, WSK_FLAG_WAITALL, &actual);
 
-	TraceWSK("req %04x, %!STATUS!, %Iu byte(s)", ptr04x(ctx.request), st, actual);
+	TraceWSK("req %04x, %!STATUS!, %Iu byte(s)", ptr04x(request), st, actual);
 
 	return  NT_ERROR(st) ? st :
 		actual == buf.Length ? STATUS_SUCCESS :
@@ -494,7 +539,20 @@ PAGED auto receive(_Inout_ wsk_context &ctx, _Inout_ WSK_BUF &buf)
 
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
-PAGED auto drain_payload(_Inout_ wsk_context &ctx, _In_ size_t length)
+PAGED auto receive(_Inout_ wsk_context &ctx, _Inout_ WSK_BUF &buf)
+{
+	PAGED_CODE();
+	NT_ASSERT(verify(buf, ctx.is_isoc));
+
+	return receive(ctx.dev->sock(), buf, ctx.request);
+}
+
+/*
+ * @param ctx.dev is NULL if the device has left mux_session
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto drain_payload(_Inout_ SOCKET *sock, _Inout_ wsk_context &ctx, _In_ size_t length)
 {
 	PAGED_CODE();
 
@@ -503,7 +561,8 @@ PAGED auto drain_payload(_Inout_ wsk_context &ctx, _In_ size_t length)
 		return STATUS_INVALID_PARAMETER;
 	}
 
-	unique_ptr payload(libdrv::uninitialized, NonPagedPoolNx, length);
+	pool_ptr payload(pool_consumer::payload, NonPagedPoolNx, length, false);
+	auto dev = ctx.dev;
 
 	if (auto ptr = payload.get()) {
 		ctx.mdl_buf = Mdl(ptr, ULONG(length));
@@ -512,18 +571,69 @@ PAGED auto drain_payload(_Inout_ wsk_context &ctx, _In_ size_t length)
 		return STATUS_INSUFFICIENT_RESOURCES;
 	}
 
+	if (dev) {
+		payload.charge(dev->pool);
+	}
+
 	if (auto err = ctx.mdl_buf.prepare_nonpaged()) {
 		Trace(TRACE_LEVEL_ERROR, "prepare_nonpaged %!STATUS!", err);
 		return err;
 	}
 
 	WSK_BUF buf{ .Mdl = ctx.mdl_buf.get(), .Length = length };
-	return receive(ctx, buf);
+
+	auto st = receive(sock, buf, ctx.request);
+	if (!st && dev) {
+		++dev->drained;
+		dev->drained_bytes += length;
+	}
+
+	return st;
 }
 
+/*
+ * @param buf transfer buffer, see prepare_wsk_mdl
+ * @param length of compressed payload, see USBIP_FEATURE_COMPRESS
+ */
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
-PAGED auto recv_payload(_Inout_ wsk_context &ctx, _In_ size_t length)
+PAGED auto recv_compressed(_Inout_ wsk_context &ctx, _In_ const WSK_BUF &buf, _In_ ULONG length)
+{
+	PAGED_CODE();
+	auto &dev = *ctx.dev;
+
+	pool_ptr payload(pool_consumer::compression, NonPagedPoolNx, length, false);
+	auto ptr = payload.get();
+
+	if (!ptr) {
+		Trace(TRACE_LEVEL_ERROR, "Can't allocate %lu bytes", length);
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	payload.charge(dev.pool);
+
+	Mdl mdl(ptr, length);
+	if (auto err = mdl.prepare_nonpaged()) {
+		Trace(TRACE_LEVEL_ERROR, "prepare_nonpaged %!STATUS!", err);
+		return err;
+	}
+
+	WSK_BUF src{ .Mdl = mdl.get(), .Length = length };
+
+	auto st = receive(dev.sock(), src, ctx.request);
+	if (!st) {
+		st = decompress(dev, buf.Mdl, ULONG(buf.Length), ptr, length);
+	}
+
+	return st;
+}
+
+/*
+ * @param compressed length of compressed payload, zero if it is not compressed
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto recv_payload(_Inout_ wsk_context &ctx, _In_ size_t length, _In_ ULONG compressed)
 {
 	PAGED_CODE();
 
@@ -535,7 +645,7 @@ PAGED auto recv_payload(_Inout_ wsk_context &ctx, _In_ size_t length)
 		return err;
 	}
 
-	return receive(ctx, buf);
+	return compressed ? recv_compressed(ctx, buf, compressed) : receive(ctx, buf);
 }
 
 /*
@@ -554,7 +664,13 @@ PAGED auto ret_command(_Inout_ wsk_context &ctx)
 	PAGED_CODE();
 	auto &hdr = ctx.hdr;
 
-	auto request = hdr.base.command == USBIP_RET_SUBMIT ? // request must be completed
+	auto submit = hdr.base.command == USBIP_RET_SUBMIT;
+
+	trace_urb(vhci::trace_event::recv, *ctx.dev, hdr.base.seqnum, hdr.base.ep, 
+		  submit ? static_cast<UINT32>(hdr.u.ret_submit.actual_length) : 0,
+		  submit ? hdr.u.ret_submit.status : hdr.u.ret_unlink.status);
+
+	auto request = submit ? // request must be completed
 		       device::remove_request(*ctx.dev, hdr.base.seqnum) : WDF_NO_HANDLE;
 
 	char buf[DBG_USBIP_HDR_BUFSZ];
@@ -566,7 +682,7 @@ PAGED auto ret_command(_Inout_ wsk_context &ctx)
 
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
-PAGED auto validate_header(_Inout_ usbip_header &hdr)
+PAGED auto validate_header(_Inout_ usbip_header &hdr, _In_ bool mux)
 {
 	PAGED_CODE();
 	byteswap_header(hdr, swap_dir::net2host);
@@ -586,6 +702,11 @@ PAGED auto validate_header(_Inout_ usbip_header &hdr)
 	}	break;
 	case USBIP_RET_UNLINK:
 		break;
+	case USBIP_RET_IMPORT:
+		if (mux) {
+			break;
+		}
+		[[fallthrough]];
 	default:
 		Trace(TRACE_LEVEL_ERROR, "USBIP_RET_* expected, got %!usbip_request_type!", cmd);
 		return false;
@@ -602,9 +723,12 @@ PAGED auto validate_header(_Inout_ usbip_header &hdr)
 	return ok;
 }
 
+/*
+ * @param mux USBIP_RET_IMPORT is accepted, see mux_session
+ */
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
-PAGED auto recv_usbip_header(_Inout_ wsk_context &ctx)
+PAGED auto recv_usbip_header(_Inout_ SOCKET *sock, _Inout_ wsk_context &ctx, _In_ bool mux)
 {
 	PAGED_CODE();
 
@@ -613,11 +737,55 @@ PAGED auto recv_usbip_header(_Inout_ wsk_context &ctx)
 
 	WSK_BUF buf{ .Mdl = ctx.mdl_hdr.get(), .Length = sizeof(ctx.hdr) };
 
-	if (auto err = receive(ctx, buf)) {
+	if (auto err = receive(sock, buf, ctx.request)) {
 		return err;
 	}
 
-	return validate_header(ctx.hdr) ? STATUS_SUCCESS : STATUS_INVALID_PARAMETER;
+	return validate_header(ctx.hdr, mux) ? STATUS_SUCCESS : STATUS_INVALID_PARAMETER;
+}
+
+/*
+ * @param shared the connection is used by other devices, the payload must be received anyway
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto dispatch(_Inout_ device_ctx &dev, _Inout_ wsk_context &ctx, _In_ bool shared)
+{
+	PAGED_CODE();
+	NTSTATUS status{};
+
+	NT_ASSERT(!ctx.request); // must be completed and zeroed on every loop
+	ctx.request = ret_command(ctx);
+
+	if (auto sz = get_payload_size(ctx.hdr); !sz) {
+		//
+	} else if (dev.unplugged && !shared) {
+		status = STATUS_CANCELLED; // do not receive payload
+	} else if (auto compressed = get_compressed_size(ctx.hdr, dev.ext->features);
+		    compressed >= sz) {
+		Trace(TRACE_LEVEL_ERROR, "Compressed payload %lu >= actual_length %Iu", compressed, sz);
+		status = USBIP_ERROR_PROTOCOL;
+	} else {
+		status = ctx.request ? recv_payload(ctx, sz, compressed) :
+				       drain_payload(dev.sock(), ctx, compressed ? compressed : sz);
+
+		auto &hdr = ctx.hdr;
+		trace_urb(vhci::trace_event::payload, dev, hdr.base.seqnum, hdr.base.ep, ULONG(sz), status);
+	}
+
+	if (auto &req = ctx.request) {
+		auto &r = *get_request_ctx(req);
+		autotune_socket_buffers(dev, r);
+
+		auto st = status ? status : ret_submit(ctx);
+		auto actual_length = static_cast<UINT32>(ctx.hdr.u.ret_submit.actual_length);
+
+		update_stats(r, ctx.hdr, st);
+		trace_urb(vhci::trace_event::complete, dev, r, actual_length, st);
+		complete_and_set_null(req, st);
+	}
+
+	return status;
 }
 
 _IRQL_requires_same_
@@ -626,23 +794,39 @@ PAGED void recv_loop(_Inout_ device_ctx &dev, _Inout_ wsk_context &ctx)
 {
 	PAGED_CODE();
 
-	for (NTSTATUS status{}; !(status || dev.unplugged || recv_usbip_header(ctx)); ) {
+	apply_recv_thread_options(dev);
 
-		NT_ASSERT(!ctx.request); // must be completed and zeroed on every loop
-		ctx.request = ret_command(ctx);
+	for (NTSTATUS status{}; !(status || dev.unplugged || recv_usbip_header(dev.sock(), ctx, false)); ) {
+		status = dispatch(dev, ctx, false);
+		apply_recv_thread_options(dev);
+	}
+}
 
-		if (auto sz = get_payload_size(ctx.hdr); !sz) {
-			//
-		} else if (dev.unplugged) {
-			status = STATUS_CANCELLED; // do not receive payload
-		} else {
-			auto f = ctx.request ? recv_payload : drain_payload;
-			status = f(ctx, sz);
-		}
+/*
+ * Responses are dispatched by devid, the responses for a device that has left the session are drained.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void recv_loop(_Inout_ mux_session &s, _Inout_ wsk_context &ctx)
+{
+	PAGED_CODE();
 
-		if (auto &req = ctx.request) {
-			auto st = status ? status : ret_submit(ctx);
-			complete_and_set_null(req, st);
+	for (NTSTATUS status{}; !(status || recv_usbip_header(s.sock, ctx, true)); ) {
+		auto &hdr = ctx.hdr;
+
+		if (hdr.base.command == USBIP_RET_IMPORT) {
+			status = ret_import(s, hdr);
+		} else if (auto dev = acquire_device(s, hdr.base.devid)) {
+			ctx.dev = dev;
+			status = dispatch(*dev, ctx, true);
+			ctx.dev = nullptr; // see free(wsk_context*)
+			release_device(*dev);
+		} else if (auto sz = get_payload_size(hdr)) {
+			if (auto compressed = get_compressed_size(hdr, s.features)) {
+				sz = compressed;
+			}
+			TraceDbg("devid %#x is not attached, drain %Iu bytes", hdr.base.devid, sz);
+			status = drain_payload(s.sock, ctx, sz);
 		}
 	}
 }
@@ -659,12 +843,13 @@ PAGED void usbip::recv_thread_function(_In_ void *context)
 	auto device = static_cast<UDECXUSBDEVICE>(context);
 	TraceDbg("dev %04x", ptr04x(device));
 
-	//KeSetPriorityThread(KeGetCurrentThread(), LOW_REALTIME_PRIORITY);
 	auto dev = get_device_ctx(device);
 
 	if (auto ctx = alloc_wsk_context(dev, WDF_NO_HANDLE)) {
-		recv_loop(*dev, *ctx);
-		NT_ASSERT(!ctx->request);
+		do {
+			recv_loop(*dev, *ctx);
+			NT_ASSERT(!ctx->request);
+		} while (reconnect(*dev));
 		free(ctx, true);
 	}
 
@@ -676,6 +861,28 @@ PAGED void usbip::recv_thread_function(_In_ void *context)
 	TraceDbg("dev %04x, exited", ptr04x(device));
 }
 
+/*
+ * Priority and ideal processor of devices are not applied because the thread serves all of them.
+ */
+_IRQL_requires_same_
+_Function_class_(KSTART_ROUTINE)
+PAGED void usbip::mux_recv_thread_function(_In_ void *context)
+{
+	PAGED_CODE();
+
+	auto &s = *static_cast<mux_session*>(context);
+	TraceDbg("session %04x", ptr04x(get_handle(&s)));
+
+	if (auto ctx = alloc_wsk_context(nullptr, WDF_NO_HANDLE)) {
+		recv_loop(s, *ctx);
+		NT_ASSERT(!ctx->request);
+		free(ctx, true);
+	}
+
+	session_lost(s);
+	TraceDbg("session %04x, exited", ptr04x(get_handle(&s)));
+}
+
 /*
  * To ensure compatibility with existing USB drivers, the UDE client must call WdfRequestComplete at DISPATCH_LEVEL.
  * @see Write a UDE client driver
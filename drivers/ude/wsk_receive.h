@@ -14,6 +14,13 @@ _IRQL_requires_same_
 _Function_class_(KSTART_ROUTINE)
 PAGED void recv_thread_function(_In_ void *context);
 
+/*
+ * @param context mux_session*, see mux.h
+ */
+_IRQL_requires_same_
+_Function_class_(KSTART_ROUTINE)
+PAGED void mux_recv_thread_function(_In_ void *context);
+
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
 void complete(_In_ WDFREQUEST request, _In_ NTSTATUS status);
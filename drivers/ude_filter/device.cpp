@@ -1,5 +1,5 @@
 /*
- * Copyright (C) 2022 - 2023 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ * Copyright (C) 2022 - 2024 Vadym Hrynchyshyn <vadimgrn@gmail.com>
  */
 
 #include <ntifs.h>
@@ -18,6 +18,26 @@ namespace
 
 using namespace usbip;
 
+/*
+ * Ports of UDE roothub have the same numbers as vhci::imported_device_location::port.
+ */
+_IRQL_requires_(PASSIVE_LEVEL)
+_IRQL_requires_same_
+PAGED auto get_port(_In_ DEVICE_OBJECT *pdo)
+{
+	PAGED_CODE();
+
+	ULONG addr{};
+	ULONG len{};
+
+	if (auto err = IoGetDeviceProperty(pdo, DevicePropertyAddress, sizeof(addr), &addr, &len)) {
+		Trace(TRACE_LEVEL_ERROR, "IoGetDeviceProperty(DevicePropertyAddress) %!STATUS!", err);
+		return 0;
+	}
+
+	return static_cast<int>(addr);
+}
+
 _IRQL_requires_(PASSIVE_LEVEL)
 _IRQL_requires_same_
 PAGED auto init(_Inout_ filter_ext &f, _In_opt_ filter_ext *parent)
@@ -32,7 +52,15 @@ PAGED auto init(_Inout_ filter_ext &f, _In_opt_ filter_ext *parent)
 		Trace(TRACE_LEVEL_ERROR, "Acquire remove lock %!STATUS!", err);
 		return err;
 	} else {
-		f.device.parent_remove_lock = lck;
+		auto &dev = f.device;
+		dev.parent_remove_lock = lck;
+
+		if (auto &r = parent->hub.request; r.Size) {
+			dev.request = &r;
+		}
+
+		dev.port = get_port(f.pdo);
+		TraceDbg("pdo %04x, port %d", ptr04x(f.pdo), dev.port);
 	}
 
 	return STATUS_SUCCESS;
@@ -49,6 +77,9 @@ PAGED void do_destroy(_Inout_ filter_ext &f)
 		if (auto ptr = hub.previous) {
 			ExFreePoolWithTag(ptr, pooltag);
 		}
+		if (hub.request.Size) {
+			filter::put_request_interface(hub.request);
+		}
 	} else {
 		auto &dev = f.device;
 		NT_ASSERT(!dev.usbd_handle); // @see IRP_MN_REMOVE_DEVICE
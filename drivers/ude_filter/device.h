@@ -1,9 +1,10 @@
 /*
- * Copyright (C) 2022 - 2023 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ * Copyright (C) 2022 - 2024 Vadym Hrynchyshyn <vadimgrn@gmail.com>
  */
 
 #pragma once
 
+#include "request.h"
 #include <libdrv\codeseg.h>
 
 #include <usb.h>
@@ -29,11 +30,14 @@ struct filter_ext
 	union {
 		struct {
 			DEVICE_RELATIONS *previous; // children
+			filter::request_interface request; // zeroed if not available, see IRP_MN_START_DEVICE
 		} hub; // is_hub == true
 
 		struct {
 			IO_REMOVE_LOCK *parent_remove_lock; // -> hub filter_ext.remove_lock
 			USBD_HANDLE usbd_handle;
+			const filter::request_interface *request; // -> hub filter_ext.hub.request, NULL if not available
+			int port; // roothub port, DevicePropertyAddress of the PDO
 		} device; // is_hub == false
 	};
 	bool is_hub;
@@ -8,138 +8,43 @@
 
 #include "irp.h"
 #include "request.h"
-#include "driver.h"
 
 #include <libdrv\remove_lock.h>
 #include <libdrv\usbd_helper.h>
 #include <libdrv\dbgcommon.h>
 #include <libdrv\ioctl.h>
 #include <libdrv\select.h>
-#include <libdrv\urb_ptr.h>
 
 namespace
 {
 
 using namespace usbip;
 
-enum { ARG_URB, ARG_TAG };
-
-/*
- * @param result of make_irp() 
- * IO_REMOVE_LOCK must be used because IRP_MN_REMOVE_DEVICE can remove FiDO prior this callback.
- */
-_IRQL_requires_same_
-_IRQL_requires_max_(DISPATCH_LEVEL)
-auto free(_Inout_ filter_ext &fltr, _In_ IRP *irp)
-{
-	auto urb = libdrv::argv<URB*, ARG_URB>(irp);
-	NT_ASSERT(urb);
-
-	auto tag = libdrv::argv<ARG_TAG>(irp);
-	NT_ASSERT(tag);
-
-	TraceDbg("dev %04x, urb %04x -> target %04x, %!STATUS!, USBD_STATUS_%s", ptr04x(fltr.self), 
-		  ptr04x(urb), ptr04x(fltr.target), irp->IoStatus.Status, get_usbd_status(URB_STATUS(urb)));
-
-	{
-		libdrv::urb_ptr a(fltr.device.usbd_handle, urb);
-		unique_ptr b(urb->UrbControlTransferEx.TransferBuffer);
-	}
-
-	IoFreeIrp(irp);
-	return tag;
-}
-
-_Function_class_(IO_COMPLETION_ROUTINE)
-_IRQL_requires_same_
-_IRQL_requires_max_(DISPATCH_LEVEL)
-NTSTATUS on_send_request(
-	_In_ DEVICE_OBJECT*, _In_ IRP *irp, _In_reads_opt_(_Inexpressible_("varies")) void *context)
-{
-	auto &fltr = *static_cast<filter_ext*>(context);
-
-	auto tag = free(fltr, irp);
-	libdrv::RemoveLockGuard guard(fltr.remove_lock, libdrv::adopt_lock, tag);
-
-	return StopCompletion;
-}
-
-_IRQL_requires_max_(DISPATCH_LEVEL)
-_IRQL_requires_same_
-auto send_request(
-	_In_ filter_ext &fltr, _Inout_ libdrv::RemoveLockGuard &lck, 
-	_Inout_ unique_ptr &TransferBuffer, _In_ USHORT function)
-{
-	auto target = fltr.target;
-
-	libdrv::irp_ptr irp(target->StackSize, false);
-	if (!irp) {
-		Trace(TRACE_LEVEL_ERROR, "IoAllocateIrp error");
-		return STATUS_INSUFFICIENT_RESOURCES;
-	}
-
-	auto next_stack = IoGetNextIrpStackLocation(irp.get());
-
-	next_stack->MajorFunction = IRP_MJ_INTERNAL_DEVICE_CONTROL;
-	libdrv::DeviceIoControlCode(next_stack) = IOCTL_INTERNAL_USB_SUBMIT_URB;
-
-	if (auto err = IoSetCompletionRoutineEx(target, irp.get(), on_send_request, &fltr, true, true, true)) {
-		Trace(TRACE_LEVEL_ERROR, "IoSetCompletionRoutineEx %!STATUS!", err);
-		return err;
-	}
-
-	libdrv::urb_ptr urb(fltr.device.usbd_handle);
-	if (auto err = urb.alloc(next_stack)) {
-		Trace(TRACE_LEVEL_ERROR, "USBD_UrbAllocate %!STATUS!", err);
-		return err;
-	}
-
-	filter::pack_request(urb.get()->UrbControlTransferEx, TransferBuffer.release(), function);
-	TraceDbg("dev %04x, urb %04x -> target %04x", ptr04x(fltr.self), ptr04x(urb.get()), ptr04x(target));
-
-	libdrv::argv<ARG_URB>(irp.get()) = urb.release();
-
-	libdrv::argv<ARG_TAG>(irp.get()) = lck.tag();
-	lck.clear();
-
-	return IoCallDriver(target, irp.release()); // completion routine will be called anyway
-}
-
-_IRQL_requires_same_
-_IRQL_requires_max_(DISPATCH_LEVEL)
-void send_urb(_In_ filter_ext &fltr, _Inout_ libdrv::RemoveLockGuard &lck, _In_ const URB &urb)
-{
-	if (auto &hdr = urb.UrbHeader;
-	    auto buf = unique_ptr(libdrv::uninitialized, NonPagedPoolNx, hdr.Length)) {
-		RtlCopyMemory(buf.get(), &urb, hdr.Length);
-		send_request(fltr, lck, buf, hdr.Function);
-	} else {
-		Trace(TRACE_LEVEL_ERROR, "Can't allocate %lu bytes", hdr.Length);
-	}
-}
-
 /*
+ * The URB is completed but not freed yet, the request is processed synchronously.
  * @see drivers/usb/usbip/stub_rx.c, tweak_set_configuration_cmd
  */
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
-void select_configuration(_In_ filter_ext &fltr, _Inout_ libdrv::RemoveLockGuard &lck, _In_ const _URB_SELECT_CONFIGURATION &r)
+void send_request(_In_ filter_ext &fltr, _In_ const URB &urb)
 {
-	{
-		char buf[libdrv::SELECT_CONFIGURATION_STR_BUFSZ];
-		TraceDbg("dev %04x, %s", ptr04x(fltr.self), libdrv::select_configuration_str(buf, sizeof(buf), &r));
+	auto &dev = fltr.device;
+
+	auto r = dev.request;
+	if (!r) {
+		Trace(TRACE_LEVEL_ERROR, "dev %04x, request interface is not available", ptr04x(fltr.self));
+		return;
 	}
 
-	if (ULONG len{}; unique_ptr buf = clone(len, r, NonPagedPoolNx, buf.pooltag)) {
-		send_request(fltr, lck, buf, r.Hdr.Function);
-	} else {
-		Trace(TRACE_LEVEL_ERROR, "Can't allocate %lu bytes", len);
+	if (auto err = filter::call_request_interface(*r, dev.port, urb)) {
+		Trace(TRACE_LEVEL_ERROR, "dev %04x, port %d, %s %!STATUS!", ptr04x(fltr.self), dev.port, 
+			urb_function_str(urb.UrbHeader.Function), err);
 	}
 }
 
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
-void post_process_urb(_In_ filter_ext &fltr, _Inout_ libdrv::RemoveLockGuard &lck, _In_ const URB &urb)
+void post_process_urb(_In_ filter_ext &fltr, _In_ const URB &urb)
 {
 	bool send{};
 	
@@ -167,25 +72,29 @@ void post_process_urb(_In_ filter_ext &fltr, _Inout_ libdrv::RemoveLockGuard &lc
 		break;
 	case URB_FUNCTION_SELECT_CONFIGURATION:
 		static_assert(is_request_function(URB_FUNCTION_SELECT_CONFIGURATION));
-		select_configuration(fltr, lck, urb.UrbSelectConfiguration);
+		if constexpr (auto &r = urb.UrbSelectConfiguration; true) {
+			char buf[libdrv::SELECT_CONFIGURATION_STR_BUFSZ];
+			TraceDbg("dev %04x, %s", ptr04x(fltr.self), libdrv::select_configuration_str(buf, sizeof(buf), &r));
+		}
+		send = true;
 		break;
 	default:
 		TraceDbg("dev %04x, %s", ptr04x(fltr.self), urb_function_str(hdr.Function));
 	}
 
 	if (send) {
-		send_urb(fltr, lck, urb);
+		send_request(fltr, urb);
 	}
 }
 
 /*
  * IRP -> usbip2_filter.sys -> ucx01000.sys -> udecx.sys -> usbip2_ude.sys
  * IRP can be completed by ucx01000 or udecx, in such case usbip2_ude will not receive it.
- * To detect such issues, all IRPs are inspected upon completion.
+ * To detect such issues, IRPs are inspected upon completion, see need_completion.
  */
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
-void post_process_irp(_In_ filter_ext &fltr, _Inout_ libdrv::RemoveLockGuard &lck, _In_ IRP *irp)
+void post_process_irp(_In_ filter_ext &fltr, _In_ IRP *irp)
 {
 	auto status = irp->IoStatus.Status;
 
@@ -197,7 +106,7 @@ void post_process_irp(_In_ filter_ext &fltr, _Inout_ libdrv::RemoveLockGuard &lc
 		Trace(TRACE_LEVEL_ERROR, "dev %04x, %s, USBD_STATUS_%s, %!STATUS!", ptr04x(fltr.self), 
 			urb_function_str(hdr.Function), get_usbd_status(hdr.Status), status);
 	} else {
-		post_process_urb(fltr, lck, *urb);
+		post_process_urb(fltr, *urb);
 	}
 }
 
@@ -209,7 +118,7 @@ NTSTATUS irp_completed(_In_ DEVICE_OBJECT*, _In_ IRP *irp, _In_reads_opt_(_Inexp
 	auto &fltr = *static_cast<filter_ext*>(context);
 	libdrv::RemoveLockGuard lck(fltr.remove_lock, libdrv::adopt_lock, irp);
 
-	post_process_irp(fltr, lck, irp);
+	post_process_irp(fltr, irp);
 
 	if (irp->PendingReturned) {
 		IoMarkIrpPending(irp);
@@ -218,6 +127,18 @@ NTSTATUS irp_completed(_In_ DEVICE_OBJECT*, _In_ IRP *irp, _In_reads_opt_(_Inexp
 	return ContinueCompletion;
 }
 
+/*
+ * Data transfers are the most of URBs, a completion routine doubles the cost of such IRPs,
+ * so they are forwarded as is. Other IOCTLs are rare and are inspected for diagnostics.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto need_completion(_In_ IRP *irp)
+{
+	return  libdrv::DeviceIoControlCode(irp) != IOCTL_INTERNAL_USB_SUBMIT_URB ||
+		filter::is_request_function(libdrv::urb_from_irp(irp)->UrbHeader.Function);
+}
+
 _IRQL_requires_max_(DISPATCH_LEVEL)
 _IRQL_requires_same_
 auto pre_process_irp(_In_ filter_ext &fltr, _In_ IRP *irp, _Inout_ libdrv::RemoveLockGuard &lck)
@@ -251,5 +172,5 @@ NTSTATUS usbip::int_dev_ctrl(_In_ DEVICE_OBJECT *devobj, _In_ IRP *irp)
 		return CompleteRequest(irp, err);
 	}
 
-	return fltr.is_hub ? ForwardIrp(fltr, irp) : pre_process_irp(fltr, irp, lck);
+	return fltr.is_hub || !need_completion(irp) ? ForwardIrp(fltr, irp) : pre_process_irp(fltr, irp, lck);
 }
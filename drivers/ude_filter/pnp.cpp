@@ -211,6 +211,27 @@ PAGED auto query_interface(_Inout_ filter_ext &fltr, _In_ IRP *irp, _In_ const Q
 	return CompleteRequest(irp, st);
 }
 
+/*
+ * Device filters are created later, see query_bus_relations.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto start_device(_Inout_ filter_ext &fltr, _In_ IRP *irp)
+{
+	PAGED_CODE();
+
+	auto st = ForwardIrpSynchronously(fltr, irp);
+
+	if (auto &r = fltr.hub.request; NT_SUCCESS(st) && fltr.is_hub && !r.Size) {
+		if (auto err = filter::get_request_interface(r, fltr.pdo)) {
+			Trace(TRACE_LEVEL_CRITICAL, "dev %04x, get_request_interface %!STATUS!", ptr04x(fltr.self), err);
+		}
+	}
+
+	CompleteRequest(irp);
+	return st;
+}
+
 } // namespace
 
 
@@ -231,11 +252,7 @@ PAGED NTSTATUS usbip::pnp(_In_ DEVICE_OBJECT *devobj, _In_ IRP *irp)
 
 	switch (auto &stack = *IoGetCurrentIrpStackLocation(irp); stack.MinorFunction) {
 	case IRP_MN_START_DEVICE: // must be started after lower device objects
-		{
-			auto st = ForwardIrpSynchronously(fltr, irp);
-			CompleteRequest(irp);
-			return st;
-		}
+		return start_device(fltr, irp);
 	case IRP_MN_REMOVE_DEVICE:
 		return remove_device(fltr, irp, lck);
 	case IRP_MN_QUERY_DEVICE_RELATIONS:
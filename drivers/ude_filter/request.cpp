@@ -2,29 +2,207 @@
  * Copyright (C) 2023 - 2024 Vadym Hrynchyshyn <vadimgrn@gmail.com>
  */
 
+#include <initguid.h> // must be the first to define GUIDs
+
 #include "request.h"
+#include "trace.h"
+#include "request.tmh"
+
+#include <usbip\vhci.h>
+#include <devpkey.h>
+
+namespace
+{
+
+using namespace usbip;
+
+using device_id = WCHAR[200]; // MAX_DEVICE_ID_LEN of cfgmgr32.h
+
+/*
+ * @param hub_pdo PDO of the roothub, its parent is VHCI device
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto get_parent_id(_Out_ device_id &id, _In_ DEVICE_OBJECT *hub_pdo)
+{
+        PAGED_CODE();
+
+        ULONG size;
+        DEVPROPTYPE type;
+
+        auto err = IoGetDevicePropertyData(hub_pdo, &DEVPKEY_Device_Parent, LOCALE_NEUTRAL, 0, 
+                                           sizeof(id), id, &size, &type);
+        if (err) {
+                Trace(TRACE_LEVEL_ERROR, "IoGetDevicePropertyData(DEVPKEY_Device_Parent) %!STATUS!", err);
+        } else if (type != DEVPROP_TYPE_STRING) {
+                Trace(TRACE_LEVEL_ERROR, "DEVPKEY_Device_Parent type %#lx", type);
+                err = STATUS_INVALID_DEVICE_STATE;
+        }
+
+        return err;
+}
+
+/*
+ * @return true if the interface belongs to the device with given instance id
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto is_interface_of(_In_ const UNICODE_STRING &name, _In_ const device_id &instance_id)
+{
+        PAGED_CODE();
+
+        device_id id;
+        ULONG size;
+        DEVPROPTYPE type;
+
+        if (auto err = IoGetDeviceInterfacePropertyData(const_cast<UNICODE_STRING*>(&name), 
+                                                         &DEVPKEY_Device_InstanceId, LOCALE_NEUTRAL, 0, 
+                                                         sizeof(id), id, &size, &type)) {
+                Trace(TRACE_LEVEL_ERROR, "IoGetDeviceInterfacePropertyData('%!USTR!') %!STATUS!", &name, err);
+                return false;
+        }
+
+        return type == DEVPROP_TYPE_STRING && !_wcsicmp(id, instance_id);
+}
+
+/*
+ * There can be several VHCI devices, the interface of the one that has enumerated the roothub is used.
+ * The file object is not kept open, otherwise VHCI device could not be removed.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto get_vhci(_Out_ FILE_OBJECT* &fileobj, _Out_ DEVICE_OBJECT* &devobj, _In_ DEVICE_OBJECT *hub_pdo)
+{
+        PAGED_CODE();
+
+        fileobj = nullptr;
+        devobj = nullptr;
+
+        device_id parent;
+        if (auto err = get_parent_id(parent, hub_pdo)) {
+                return err;
+        }
+
+        auto guid = &vhci::GUID_DEVINTERFACE_USB_HOST_CONTROLLER;
+        PWSTR list{}; // REG_MULTI_SZ
+
+        if (auto err = IoGetDeviceInterfaces(guid, nullptr, 0, &list)) {
+                Trace(TRACE_LEVEL_ERROR, "IoGetDeviceInterfaces(%!GUID!) %!STATUS!", guid, err);
+                return err;
+        }
+
+        auto st = STATUS_NOT_FOUND;
+
+        for (auto str = list; *str; str += wcslen(str) + 1) {
+                UNICODE_STRING name;
+                RtlUnicodeStringInit(&name, str);
+
+                if (!is_interface_of(name, parent)) {
+                        continue;
+                }
+
+                st = IoGetDeviceObjectPointer(&name, FILE_READ_DATA, &fileobj, &devobj);
+                if (st) {
+                        Trace(TRACE_LEVEL_ERROR, "IoGetDeviceObjectPointer('%!USTR!') %!STATUS!", &name, st);
+                }
+                break;
+        }
+
+        if (st == STATUS_NOT_FOUND) {
+                Trace(TRACE_LEVEL_ERROR, "%!GUID! of '%S' not found", guid, parent);
+        }
+
+        ExFreePool(list);
+        return st;
+}
 
 /*
- * UDECXUSBDEVICE never receives USB_REQUEST_SET_CONFIGURATION and USB_REQUEST_SET_INTERFACE 
- * in URB_FUNCTION_CONTROL_TRANSFER because UDE handles them itself. Therefore these requests 
- * are passed as USB_REQUEST_GET_FIRMWARE_STATUS.
+ * @param devobj top of the device stack
  */
 _IRQL_requires_same_
-_IRQL_requires_max_(DISPATCH_LEVEL)
-void usbip::filter::pack_request(
-        _Out_ _URB_CONTROL_TRANSFER_EX &r, _In_ void *TransferBuffer, _In_ USHORT function)
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto query_interface(_In_ DEVICE_OBJECT *devobj, _Out_ filter::request_interface &r)
 {
-        r.Hdr.Length = sizeof(r);
-        r.Hdr.Function = URB_FUNCTION_CONTROL_TRANSFER_EX;
+        PAGED_CODE();
+
+        KEVENT event;
+        KeInitializeEvent(&event, NotificationEvent, false);
+
+        IO_STATUS_BLOCK ios{};
+
+        auto irp = IoBuildSynchronousFsdRequest(IRP_MJ_PNP, devobj, nullptr, 0, nullptr, &event, &ios);
+        if (!irp) {
+                Trace(TRACE_LEVEL_ERROR, "IoBuildSynchronousFsdRequest error");
+                return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        irp->IoStatus.Status = STATUS_NOT_SUPPORTED; // PnP IRPs must be initialized with it
+
+        auto &stack = *IoGetNextIrpStackLocation(irp);
+        stack.MinorFunction = IRP_MN_QUERY_INTERFACE;
+
+        auto &qi = stack.Parameters.QueryInterface;
+        qi.InterfaceType = &filter::GUID_REQUEST_INTERFACE;
+        qi.Size = sizeof(r);
+        qi.Version = filter::REQUEST_INTERFACE_VERSION;
+        qi.Interface = &r;
+        qi.InterfaceSpecificData = nullptr;
+
+        auto st = IoCallDriver(devobj, irp);
+        if (st == STATUS_PENDING) {
+                KeWaitForSingleObject(&event, Executive, KernelMode, false, nullptr);
+                st = ios.Status;
+        }
 
-        r.TransferBuffer = TransferBuffer;
-        NT_ASSERT(!r.TransferBufferLength);
+        if (st) {
+                Trace(TRACE_LEVEL_ERROR, "IRP_MN_QUERY_INTERFACE %!STATUS!", st);
+        }
 
-        r.TransferFlags = USBD_DEFAULT_PIPE_TRANSFER | USBD_TRANSFER_DIRECTION_IN;
-        r.Timeout = impl::const_part | function;
+        return st;
+}
+
+} // namespace
+
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS usbip::filter::get_request_interface(_Out_ request_interface &r, _In_ DEVICE_OBJECT *hub_pdo)
+{
+        PAGED_CODE();
+        RtlZeroMemory(&r, sizeof(r));
+
+        FILE_OBJECT *fileobj;
+        DEVICE_OBJECT *devobj;
+
+        if (auto err = get_vhci(fileobj, devobj, hub_pdo)) {
+                return err;
+        }
+
+        auto st = query_interface(devobj, r);
+        ObDereferenceObject(fileobj);
+
+        if (st) {
+                RtlZeroMemory(&r, sizeof(r));
+        } else if (!is_compatible(r)) {
+                Trace(TRACE_LEVEL_ERROR, "Version %d, Size %d are not supported", r.Version, r.Size);
+                put_request_interface(r);
+                st = STATUS_NOT_SUPPORTED;
+        } else {
+                TraceDbg("Version %d, Size %d, Context %04x", r.Version, r.Size, ptr04x(r.Context));
+        }
+
+        return st;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void usbip::filter::put_request_interface(_Inout_ request_interface &r)
+{
+        PAGED_CODE();
 
-        get_setup_packet(r) = impl::setup_packet;
+        if (auto f = r.InterfaceDereference) {
+                f(r.Context);
+        }
 
-        NT_ASSERT(is_request(r));
-        NT_ASSERT(get_function(r) == function);
+        RtlZeroMemory(&r, sizeof(r));
 }
@@ -0,0 +1,77 @@
+/*
+ * Copyright (C) 2024 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include <wdm.h>
+#include <usb.h>
+
+namespace usbip::filter
+{
+
+enum { REQUEST_INTERFACE_VERSION = 1 };
+
+/*
+ * @param Context see INTERFACE::Context
+ * @param port roothub port of the device
+ */
+using select_configuration_t = NTSTATUS (_In_ void *Context, _In_ int port, _In_ const _URB_SELECT_CONFIGURATION &r);
+using select_interface_t = NTSTATUS (_In_ void *Context, _In_ int port, _In_ const _URB_SELECT_INTERFACE &r);
+using reset_pipe_t = NTSTATUS (_In_ void *Context, _In_ int port, _In_ const _URB_PIPE_REQUEST &r);
+
+/*
+ * Functions can be called at DISPATCH_LEVEL.
+ * A new member must be added to the end and REQUEST_INTERFACE_VERSION must be incremented.
+ */
+struct request_interface : INTERFACE
+{
+        select_configuration_t *SelectConfiguration;
+        select_interface_t *SelectInterface;
+        reset_pipe_t *ResetPipe; // SYNC_RESET_PIPE_AND_CLEAR_STALL, SYNC_RESET_PIPE, SYNC_CLEAR_STALL
+};
+
+/*
+ * @return true if request_interface must be called upon completion of the URB
+ */
+constexpr auto is_request_function(_In_ int function)
+{
+        switch (function) {
+        case URB_FUNCTION_SYNC_RESET_PIPE_AND_CLEAR_STALL:
+        case URB_FUNCTION_SYNC_RESET_PIPE:
+        case URB_FUNCTION_SYNC_CLEAR_STALL:
+        case URB_FUNCTION_SELECT_INTERFACE:
+        case URB_FUNCTION_SELECT_CONFIGURATION:
+                return true;
+        }
+
+        return false;
+}
+
+/*
+ * @return false if the interface of usbip2_ude is older than the filter expects
+ */
+constexpr auto is_compatible(_In_ const request_interface &r)
+{
+        return r.Version >= REQUEST_INTERFACE_VERSION && r.Size >= sizeof(r);
+}
+
+/*
+ * Calls the function of the interface that corresponds to the completed URB.
+ * @param port roothub port of the device
+ * @param urb is_request_function(urb.UrbHeader.Function) must be true
+ */
+inline NTSTATUS call_request_interface(_In_ const request_interface &r, _In_ int port, _In_ const URB &urb)
+{
+        switch (auto func = urb.UrbHeader.Function) {
+        case URB_FUNCTION_SELECT_CONFIGURATION:
+                return r.SelectConfiguration(r.Context, port, urb.UrbSelectConfiguration);
+        case URB_FUNCTION_SELECT_INTERFACE:
+                return r.SelectInterface(r.Context, port, urb.UrbSelectInterface);
+        default:
+                NT_ASSERT(is_request_function(func));
+                return r.ResetPipe(r.Context, port, urb.UrbPipeRequest);
+        }
+}
+
+} // namespace usbip::filter
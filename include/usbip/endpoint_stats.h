@@ -0,0 +1,49 @@
+/*
+ * Copyright (C) 2024 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#ifdef _KERNEL_MODE
+  #include <wdm.h>
+#else
+  #include <windows.h>
+#endif
+
+namespace usbip::vhci
+{
+
+/*
+ * Counters of an endpoint since it was created.
+ * Latency is the time between sending of USBIP_CMD_SUBMIT and receiving of USBIP_RET_SUBMIT.
+ */
+struct endpoint_stats
+{
+        enum { LATENCY_BUCKETS = 24 }; // the last one also counts latencies of 2^23 us and longer
+
+        UINT8 address; // bEndpointAddress
+        UINT8 type; // USB_ENDPOINT_TYPE_XXX
+
+        UINT64 submitted; // requests are sent to a server
+        UINT64 completed; // USBIP_RET_SUBMIT is received
+        UINT64 errors; // completed with an error
+        UINT64 cancelled; // completed without USBIP_RET_SUBMIT, USBIP_CMD_UNLINK is sent
+        UINT64 bytes_out; // actual_length of completed transfers
+        UINT64 bytes_in;
+
+        UINT64 latency_sum; // microseconds, the mean is latency_sum/completed
+        UINT64 latency[LATENCY_BUCKETS]; // [0] is less than 1 us, [i] is [2^(i-1), 2^i) us
+};
+
+/*
+ * @param usec latency in microseconds
+ * @return index in endpoint_stats::latency
+ */
+constexpr auto latency_bucket(_In_ UINT64 usec)
+{
+        int i = 0;
+        for ( ; usec && i < endpoint_stats::LATENCY_BUCKETS - 1; usec >>= 1, ++i);
+        return i;
+}
+
+} // namespace usbip::vhci
@@ -11,7 +11,12 @@ enum usbip_request_type
 	USBIP_CMD_SUBMIT = 1,
 	USBIP_CMD_UNLINK,
 	USBIP_RET_SUBMIT,
-	USBIP_RET_UNLINK
+	USBIP_RET_UNLINK,
+
+	// usbip-win extension USBIP_FEATURE_MUX, see <usbip\proto_op.h>
+	USBIP_CMD_IMPORT = 0x10,
+	USBIP_RET_IMPORT,
+	USBIP_CMD_RELEASE,
 };
 
 enum usbip_dir { USBIP_DIR_OUT, USBIP_DIR_IN }; // transfer direction like USB_DIR_IN, USB_DIR_OUT
@@ -115,6 +120,24 @@ struct usbip_header_ret_unlink {
 	INT32	status;
 };
 
+/*
+ * usbip-win extension, several devices share one connection.
+ *
+ * CMD_IMPORT is followed by op_import_request, devid is zero.
+ * RET_IMPORT is followed by op_import_reply if status is ST_OK, devid is of the imported device.
+ * CMD_RELEASE unlinks all URBs of devid and releases the device, it has no reply.
+ * The server must set devid of every RET_SUBMIT and RET_UNLINK, and ignore commands for released devid.
+ * A seqnum is unique within the connection, the devices share one counter.
+ */
+struct usbip_header_cmd_import {
+	UINT32	length; /* of the following data */
+};
+
+struct usbip_header_ret_import {
+	INT32	status; /* op_status_t */
+	UINT32	length; /* of the following data */
+};
+
 /*
 * All usbip packets use a common header to keep code simple.
 */
@@ -126,6 +149,8 @@ struct usbip_header {
 		struct usbip_header_ret_submit	ret_submit;
 		struct usbip_header_cmd_unlink	cmd_unlink;
 		struct usbip_header_ret_unlink	ret_unlink;
+		struct usbip_header_cmd_import	cmd_import;
+		struct usbip_header_ret_import	ret_import;
 	} u;
 };
 
@@ -148,6 +148,50 @@ struct op_crypkey_reply {
 };
 
 
+/* ---------------------------------------------------------------------- */
+/*
+ * Negotiate usbip-win extensions, must be the first request on a connection.
+ * A server that does not support it closes the connection, the client connects again.
+ * The connection stays in the same state if none of the features is accepted.
+ */
+#define OP_FEATURES	0x7F
+#define OP_REQ_FEATURES	(OP_REQUEST | OP_FEATURES)
+#define OP_REP_FEATURES	(OP_REPLY   | OP_FEATURES)
+
+enum : UINT32 {
+	/*
+	 * Several devices over one connection. The connection is switched to URB mode without a device,
+	 * devices are imported by USBIP_CMD_IMPORT, see usbip_header_cmd_import.
+	 */
+	USBIP_FEATURE_MUX = 1 << 0,
+
+	/*
+	 * Payloads of non-isochronous transfers can be compressed in both directions by XPRESS (LZ77),
+	 * see RtlCompressBuffer. The length of compressed payload is carried by the fields that are not used
+	 * by such transfers: start_frame of USBIP_CMD_SUBMIT, error_count of USBIP_RET_SUBMIT.
+	 * It is zero if the payload is sent as is, otherwise it is less than transfer_buffer_length
+	 * or actual_length that keep the length of original data. A receiver does not need to know
+	 * the type of the endpoint, the client compresses payloads of bulk endpoints only.
+	 */
+	USBIP_FEATURE_COMPRESS = 1 << 1,
+};
+
+struct op_features_request {
+	UINT32 features; // requested, USBIP_FEATURE_XXX
+};
+
+struct op_features_reply {
+	UINT32 features; // accepted, a subset of requested
+};
+
+#define PACK_OP_FEATURES_REQUEST(pack, request)  do {\
+	usbip_net_pack_uint32_t(pack, &(request)->features);\
+} while (0)
+
+#define PACK_OP_FEATURES_REPLY(pack, reply)  do {\
+	usbip_net_pack_uint32_t(pack, &(reply)->features);\
+} while (0)
+
 /* ---------------------------------------------------------------------- */
 /* Retrieve the list of exported USB devices. */
 #define OP_DEVLIST	0x05
@@ -17,6 +17,7 @@
 
 #include "ch9.h"
 #include "consts.h"
+#include "endpoint_stats.h"
 
 /*
  * Strings encoding is UTF8. 
@@ -55,13 +56,132 @@ struct imported_device_properties
         UINT16 product;
 };
 
-struct imported_device : imported_device_location, imported_device_properties {};
+/*
+ * Milestones of attaching, microseconds since PLUGIN_HARDWARE is received, zero if not reached.
+ */
+struct attach_timings
+{
+        UINT32 resolved; // host name is resolved or is taken from the cache
+        UINT32 connected; // TCP/IP connection is established
+        UINT32 imported; // OP_REP_IMPORT is received
+        UINT32 created; // UDECXUSBDEVICE is created
+        UINT32 plugged; // UdecxUsbDevicePlugIn is called
+        UINT32 first_urb; // the first URB is submitted, PnP enumeration is started
+        UINT32 configured; // the first URB_FUNCTION_SELECT_CONFIGURATION
+};
+
+struct imported_device : imported_device_location, imported_device_properties
+{
+        attach_timings timings;
+};
 
 enum class state { unplugged, connecting, connected, plugged, disconnected, unplugging };
 
+/*
+ * Buffers of TCP/IP connection with a server.
+ * Zero sizes leave the system defaults, setting SO_RCVBUF disables receive window autotuning of TCP/IP stack.
+ */
+struct socket_buffers
+{
+        int sndbuf; // bytes, SO_SNDBUF
+        int rcvbuf; // bytes, SO_RCVBUF
+        int autotune; // boolean, grow SO_SNDBUF up to bandwidth-delay product of URBs
+};
+
+/*
+ * Scheduling of the thread that receives responses of a server for a device.
+ */
+struct recv_thread_options
+{
+        enum { ANY_PROCESSOR = -1, KEEP_PROCESSOR = -2 };
+
+        int class_aware; // boolean, the priority follows the most latency-sensitive class of selected interfaces
+        int ideal_processor; // system-wide index of a processor, ANY_PROCESSOR lets the scheduler choose
+};
+
 struct device_state : base, imported_device
 {
         state state;
+        UINT64 seqnum; // consecutive numbers, a gap means that events were lost
+};
+
+struct device_stats
+{
+        UINT64 sent_requests; // were sent successfully, including USBIP_CMD_UNLINK
+        UINT64 drained; // USBIP_RET_SUBMIT for already completed requests
+        UINT64 drained_bytes; // their payload that was read and discarded
+
+        UINT64 inflight_bytes; // SUM(TransferBufferLength) of requests that are waiting for USBIP_RET_SUBMIT
+        ULONG inflight; // number of such requests
+
+        ULONG reconnects; // successful
+        UINT32 srtt; // microseconds, smoothed round-trip time of requests
+
+        // bulk payloads, USBIP_FEATURE_COMPRESS
+        UINT64 compressed_out; // original length of payloads that were sent compressed
+        UINT64 compressed_out_wire; // their length on the wire
+        UINT64 compressed_in; // original length of payloads that were received compressed
+        UINT64 compressed_in_wire; // their length on the wire
+        UINT64 compress_skipped; // payloads that were sent as is because the data is incompressible
+};
+
+enum class trace_event : UINT8 
+{ 
+        submit = 1, // request is appended to the list, see request_ctx
+        send, // USBIP_CMD_SUBMIT or USBIP_CMD_UNLINK is sent
+        recv, // USBIP_RET_SUBMIT or USBIP_RET_UNLINK is received
+        complete, // request is completed after USBIP_RET_SUBMIT
+        unlink, // request is completed without USBIP_RET_SUBMIT
+        dispatch, // URB is received from UDE, the time is recorded with submit event
+        prepare, // MDL of usbip_header and transfer buffer is being built
+        locked, // device_ctx::send_lock is acquired, WskSend is being called
+        payload, // payload of USBIP_RET_SUBMIT is received
+};
+
+/*
+ * Binary record of URB processing, see ioctl::get_trace.
+ */
+struct trace_record
+{
+        UINT64 time; // KeQueryInterruptTimePrecise, 100-nanosecond units
+        UINT32 seqnum; // usbip_header_basic::seqnum
+        UINT32 devid;
+        UINT32 length; // TransferBufferLength, actual_length or bytes sent
+        LONG status; // NTSTATUS; usbip_header_ret_submit::status for recv event
+        trace_event event;
+        UINT8 ep; // endpoint number
+        UINT8 dir; // usbip_dir
+        UINT8 port;
+};
+static_assert(sizeof(trace_record) == 32);
+
+/*
+ * Consumers of memory pool, each one allocates with its own pool tag.
+ */
+enum class pool_consumer : UINT8
+{
+        other, // allocations that are not listed below
+        wsk_context, // lookaside list of wsk_context
+        isoc, // arrays of usbip_iso_packet_descriptor of wsk_context
+        payload, // buffers for discarded payload of USBIP_RET_SUBMIT
+        device, // device_ctx_ext, it lives until UDECXUSBDEVICE is destroyed
+        descriptors, // descriptor_cache of persistent devices
+        dns_cache,
+        events, // event ring of VHCI, paged pool
+        trace_ring,
+        compression, // compressed payloads and workspaces, see USBIP_FEATURE_COMPRESS
+};
+
+/*
+ * Counters of allocations since the driver is loaded.
+ */
+struct pool_stats
+{
+        UINT32 tag; // pool tag, zero for a device
+        UINT64 allocs;
+        UINT64 frees;
+        UINT64 bytes; // currently allocated
+        UINT64 peak; // high-water mark of bytes
 };
 
 } // namespace usbip::vhci
@@ -76,6 +196,13 @@ enum class function { // 12 bit
         get_imported_devices,
         set_persistent,
         get_persistent,
+        set_socket_buffers,
+        plugin_hardware_batch,
+        get_imported_devices_delta,
+        get_device_stats,
+        get_trace,
+        get_pool_stats,
+        set_recv_thread_options,
 };
 
 constexpr auto make(function id)
@@ -89,15 +216,61 @@ enum {
         GET_IMPORTED_DEVICES = make(function::get_imported_devices),
         SET_PERSISTENT = make(function::set_persistent),
         GET_PERSISTENT = make(function::get_persistent),
+        SET_SOCKET_BUFFERS = make(function::set_socket_buffers),
+        PLUGIN_HARDWARE_BATCH = make(function::plugin_hardware_batch),
+        GET_IMPORTED_DEVICES_DELTA = make(function::get_imported_devices_delta),
+        GET_DEVICE_STATS = make(function::get_device_stats),
+        GET_TRACE = make(function::get_trace),
+        GET_POOL_STATS = make(function::get_pool_stats),
+        SET_RECV_THREAD_OPTIONS = make(function::set_recv_thread_options),
 };
 
 struct plugin_hardware : base, imported_device_location {};
 
+/*
+ * Devices are attached concurrently, addresses of the same host are resolved once.
+ * The request succeeds if the input is valid, results are reported for each device.
+ */
+struct plugin_hardware_batch : base
+{
+        enum { MAX_DEVICES = 64 };
+        ULONG count; // IN, number of devices
+
+        struct entry : imported_device_location
+        {
+                LONG status; // OUT, NTSTATUS, port is zero if it is an error
+        } devices[ANYSIZE_ARRAY];
+};
+
+constexpr auto plugin_hardware_batch_size(_In_ ULONG n)
+{
+        return offsetof(plugin_hardware_batch, devices) + n*sizeof(*plugin_hardware_batch::devices);
+}
+
 struct plugout_hardware : base
 {
         int port; // all ports if <= 0
 };
 
+/*
+ * IN: sizes that are less or equal to zero and negative autotune do not change the current values.
+ * OUT: actual values.
+ */
+struct set_socket_buffers : base, socket_buffers
+{
+        int port;
+};
+
+/*
+ * IN: negative class_aware and ideal_processor KEEP_PROCESSOR do not change the current values.
+ * OUT: actual values.
+ */
+struct set_recv_thread_options : base, recv_thread_options
+{
+        int port;
+        LONG priority; // OUT, KPRIORITY that the thread runs at
+};
+
 struct get_imported_devices : base
 {
         imported_device devices[ANYSIZE_ARRAY];
@@ -108,4 +281,80 @@ constexpr auto get_imported_devices_size(_In_ ULONG n)
         return offsetof(get_imported_devices, devices) + n*sizeof(*get_imported_devices::devices);
 }
 
+/*
+ * The generation is incremented each time a device occupies or frees a hub port.
+ * Only ports that have been changed since the given generation are reported.
+ * Generations of different instances of the driver are unrelated, epoch distinguishes them.
+ * If the output buffer has no room for devices, only count is returned (size query).
+ */
+struct get_imported_devices_delta : base
+{
+        UINT64 generation; // IN, of the previous result, zero to get all devices; OUT, current
+        UINT64 epoch; // IN, of the previous result; OUT, of the driver instance, all devices are reported if they differ
+        ULONG count; // OUT, number of entries, the required number for size query
+        bool reset; // OUT, all devices are reported, the previous result must be discarded
+
+        struct entry
+        {
+                bool removed; // the port is free, only device.port is set
+                imported_device device;
+        } devices[ANYSIZE_ARRAY];
+};
+
+constexpr auto get_imported_devices_delta_size(_In_ ULONG n)
+{
+        return offsetof(get_imported_devices_delta, devices) + n*sizeof(*get_imported_devices_delta::devices);
+}
+
+/*
+ * Counters are read without locking, they can be a bit inconsistent with each other.
+ */
+struct get_device_stats : base
+{
+        enum { MAX_ENDPOINTS = 32 }; // default control pipe, 15 IN and 15 OUT endpoints
+
+        int port; // IN
+        device_stats device; // OUT
+        ULONG count; // OUT, number of endpoints
+        endpoint_stats endpoints[MAX_ENDPOINTS]; // OUT, endpoints[0] is the default control pipe
+};
+
+/*
+ * Records are removed from the trace ring, each processor has its own one.
+ * Records of a processor are in the order of time, the records of different processors are not merged.
+ */
+struct get_trace : base
+{
+        UINT64 dropped; // OUT, records that were overwritten before they were read
+        ULONG count; // OUT, number of records
+        trace_record records[ANYSIZE_ARRAY];
+};
+
+constexpr auto get_trace_size(_In_ ULONG n)
+{
+        return offsetof(get_trace, records) + n*sizeof(*get_trace::records);
+}
+
+/*
+ * Allocation rate of a consumer is allocs/uptime.
+ * Per-device usage counts wsk_context-s and payload buffers while the device holds them.
+ */
+struct get_pool_stats : base
+{
+        enum { MAX_CONSUMERS = 16, MAX_DEVICES = 64 };
+
+        UINT64 uptime; // OUT, 100-nanosecond units since the driver is loaded
+        ULONG undeleted_devices; // OUT, UDECXUSBDEVICE-s that are plugged out, but are not destroyed yet
+
+        ULONG count; // OUT, number of consumers
+        pool_stats consumers[MAX_CONSUMERS]; // OUT, consumers[i] is for pool_consumer(i)
+
+        ULONG device_count; // OUT
+        struct device
+        {
+                int port;
+                pool_stats usage;
+        } devices[MAX_DEVICES]; // OUT
+};
+
 } // namespace usbip::vhci::ioctl
@@ -0,0 +1,128 @@
+/*
+ * Copyright (C) 2024 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "check.h"
+#include <ude/attach_policy.h>
+
+namespace
+{
+
+using namespace usbip::attach;
+
+constexpr NTSTATUS SUCCESS = 0;
+constexpr NTSTATUS ERROR = static_cast<NTSTATUS>(0xC00000E5); // STATUS_INTERNAL_ERROR
+
+void immediate()
+{
+        CHECK(!get_delay(0, 12345));
+        CHECK(!get_delay(1, 12345));
+}
+
+/*
+ * The delay is in [half, full] of the exponential one.
+ */
+void jitter()
+{
+        for (ULONG attempt = 2; attempt < 64; ++attempt) {
+                auto shift = min(attempt - 2, ULONG(10));
+                auto full = min(ULONG(UNIT_DELAY) << shift, ULONG(MAX_DELAY));
+
+                CHECK(get_delay(attempt, 0) == full/2);
+                CHECK(get_delay(attempt, full/2) == full);
+                CHECK(get_delay(attempt, full/2 + 1) == full/2); // wraps
+
+                for (ULONG random = 0; random < 4096; random += 7) {
+                        auto d = get_delay(attempt, random);
+                        CHECK(d >= full/2 && d <= full);
+                }
+        }
+}
+
+void exponential()
+{
+        CHECK(get_delay(2, ~0U) <= UNIT_DELAY);
+        CHECK(get_delay(3, 0) == UNIT_DELAY);
+        CHECK(get_delay(4, 0) == 2*UNIT_DELAY);
+        CHECK(get_delay(5, 0) == 4*UNIT_DELAY);
+
+        for (ULONG attempt = 2; attempt < 1000; ++attempt) {
+                CHECK(get_delay(attempt, 0) <= get_delay(attempt + 1, 0));
+        }
+}
+
+/*
+ * The shift is bounded, a large attempt number does not overflow.
+ */
+void cap()
+{
+        CHECK(get_delay(100, 0) == MAX_DELAY/2);
+        CHECK(get_delay(~0U, ~0U) <= MAX_DELAY);
+
+        ULONG random = MAX_DELAY/2;
+        CHECK(get_delay(~0U, random) == MAX_DELAY);
+}
+
+void transitions()
+{
+        CHECK(on_completed(SUCCESS, false, true) == done);
+        CHECK(on_completed(SUCCESS, true, false) == done);
+
+        CHECK(on_completed(ERROR, false, true) == idle); // next attempt
+        CHECK(on_completed(ERROR, false, false) == done);
+        CHECK(on_completed(ERROR, true, true) == done); // removed from the registry
+}
+
+/*
+ * The request of an entry refers to it until it is processed by on_completed.
+ */
+void removal()
+{
+        CHECK(can_remove(idle));
+        CHECK(can_remove(done));
+
+        CHECK(!can_remove(pending));
+        CHECK(!can_remove(completing));
+        CHECK(!can_remove(completed));
+        CHECK(!can_remove(unused));
+}
+
+/*
+ * A host is unreachable for several attempts, then the device is attached.
+ */
+void retries()
+{
+        LONG state = idle;
+        ULONG attempt = 0;
+        ULONGLONG elapsed = 0;
+
+        for (int i = 0; i < 8; ++i) {
+                CHECK(state == idle);
+                state = pending;
+
+                state = on_completed(ERROR, false, true);
+                elapsed += get_delay(++attempt, 0);
+        }
+
+        CHECK(state == idle);
+        CHECK(attempt == 8);
+        CHECK(elapsed == (0 + 5 + 10 + 20 + 40 + 80 + 160 + 320));
+
+        state = on_completed(SUCCESS, false, true);
+        CHECK(state == done);
+        CHECK(can_remove(state));
+}
+
+} // namespace
+
+
+int main()
+{
+        immediate();
+        jitter();
+        exponential();
+        cap();
+        transitions();
+        removal();
+        retries();
+}
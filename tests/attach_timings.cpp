@@ -0,0 +1,117 @@
+/*
+ * Copyright (C) 2024 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "check.h"
+#include <ude/milestone.h>
+#include <usbip/phases.h>
+
+namespace
+{
+
+using namespace usbip;
+
+constexpr ULONGLONG START = 123'456'789; // 100-nanosecond units
+constexpr ULONGLONG MSEC = 10'000;
+
+void milestone()
+{
+        CHECK(get_milestone(START, START + MSEC) == 1000);
+        CHECK(get_milestone(START, START + 15) == 1);
+        CHECK(get_milestone(START, START) == 1); // zero means that it is not reached
+}
+
+/*
+ * UINT32 holds 71 minutes, a later milestone must not wrap to a small value.
+ */
+void saturation()
+{
+        auto max_time = START + 10ULL*MAXUINT32;
+
+        CHECK(get_milestone(START, max_time) == MAXUINT32);
+        CHECK(get_milestone(START, max_time + 10) == MAXUINT32);
+        CHECK(get_milestone(START, START + 3600*1000*MSEC) == 3'600'000'000U);
+        CHECK(get_milestone(START, START + 24*3600*1000*MSEC) == MAXUINT32);
+}
+
+void set_once()
+{
+        UINT32 m{};
+
+        set_milestone(m, START, START + 5*MSEC);
+        CHECK(m == 5000);
+
+        set_milestone(m, START, START + 9*MSEC);
+        CHECK(m == 5000);
+}
+
+void all_phases()
+{
+        attach_timings t {
+                .resolved = 1500,
+                .connected = 3000,
+                .imported = 3250,
+                .created = 4000,
+                .plugged = 5000,
+                .first_urb = 15000,
+                .configured = 115000,
+        };
+
+        CHECK(format_phases(t) == "resolve 1.5, connect 1.5, import 0.2, create 0.8, plugin 1.0, "
+                                  "first URB 10.0, configure 100.0");
+}
+
+/*
+ * The duration of the next phase is counted from the last reached milestone.
+ */
+void not_reached()
+{
+        attach_timings t {
+                .resolved = 1000,
+                .connected = 2000,
+                .imported = 3000,
+                .created = 4000,
+                .plugged = 5000,
+        };
+
+        CHECK(format_phases(t) == "resolve 1.0, connect 1.0, import 1.0, create 1.0, plugin 1.0, "
+                                  "first URB -, configure -");
+
+        t.first_urb = 0;
+        t.configured = 7000;
+        CHECK(format_phases(t).ends_with("first URB -, configure 2.0"));
+
+        CHECK(format_phases(attach_timings{}) == "resolve -, connect -, import -, create -, plugin -, "
+                                                 "first URB -, configure -");
+}
+
+/*
+ * Milestones of concurrent paths are not ordered, see set_milestone.
+ */
+void unordered()
+{
+        attach_timings t {
+                .resolved = 1000,
+                .connected = 2000,
+                .imported = 3000,
+                .created = 4000,
+                .plugged = 6000,
+                .first_urb = 5000,
+                .configured = 8000,
+        };
+
+        CHECK(format_phases(t).ends_with("plugin 2.0, first URB 0.0, configure 3.0"));
+}
+
+} // namespace
+
+
+int main()
+{
+        milestone();
+        saturation();
+        set_once();
+        all_phases();
+        not_reached();
+        unordered();
+}
@@ -0,0 +1,121 @@
+/*
+ * Copyright (C) 2024 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "check.h"
+#include <ude/bandwidth.h>
+
+namespace
+{
+
+using namespace usbip;
+
+constexpr USB_ENDPOINT_DESCRIPTOR endpoint(UCHAR type, USHORT wMaxPacketSize, UCHAR bInterval)
+{
+        return { sizeof(USB_ENDPOINT_DESCRIPTOR), USB_ENDPOINT_DESCRIPTOR_TYPE, 0x81, type, wMaxPacketSize, bInterval };
+}
+
+void bus()
+{
+        CHECK(bus_bandwidth(USB_SPEED_FULL) == 1'350'000);
+        CHECK(bus_bandwidth(USB_SPEED_HIGH) == 48'000'000);
+        CHECK(bus_bandwidth(USB_SPEED_UNKNOWN) == 0);
+
+        CHECK(same_bus(USB_SPEED_LOW, USB_SPEED_HIGH));
+        CHECK(same_bus(USB_SPEED_SUPER, USB_SPEED_SUPER_PLUS));
+        CHECK(!same_bus(USB_SPEED_HIGH, USB_SPEED_SUPER));
+}
+
+void periodic()
+{
+        auto bulk = endpoint(USB_ENDPOINT_TYPE_BULK, 512, 0);
+        CHECK(!periodic_bandwidth(bulk, nullptr, USB_SPEED_HIGH));
+
+        auto iso = endpoint(USB_ENDPOINT_TYPE_ISOCHRONOUS, 1023, 1);
+        CHECK(periodic_bandwidth(iso, nullptr, USB_SPEED_FULL) == 1023*1000);
+
+        auto intr = endpoint(USB_ENDPOINT_TYPE_INTERRUPT, 8, 10); // every 10 frames
+        CHECK(periodic_bandwidth(intr, nullptr, USB_SPEED_LOW) == 800);
+
+        auto hs_iso = endpoint(USB_ENDPOINT_TYPE_ISOCHRONOUS, 1024 | (2 << 11), 1); // three transactions
+        CHECK(periodic_bandwidth(hs_iso, nullptr, USB_SPEED_HIGH) == 3*1024*8000);
+
+        auto hs_intr = endpoint(USB_ENDPOINT_TYPE_INTERRUPT, 64, 4); // every 8 microframes
+        CHECK(periodic_bandwidth(hs_intr, nullptr, USB_SPEED_HIGH) == 64*1000);
+        CHECK(!periodic_bandwidth(hs_intr, nullptr, USB_SPEED_UNKNOWN));
+
+        auto ss_iso = endpoint(USB_ENDPOINT_TYPE_ISOCHRONOUS, 1024, 1);
+        CHECK(periodic_bandwidth(ss_iso, nullptr, USB_SPEED_SUPER) == 1024*8000);
+
+        USB_SUPERSPEED_ENDPOINT_COMPANION_DESCRIPTOR comp{};
+        comp.bLength = sizeof(comp);
+        comp.bDescriptorType = USB_SUPERSPEED_ENDPOINT_COMPANION_DESCRIPTOR_TYPE;
+        comp.bMaxBurst = 1;
+        comp.bmAttributes.Isochronous.Mult = 2;
+        CHECK(periodic_bandwidth(ss_iso, &comp, USB_SPEED_SUPER) == 1024*2*3*8000);
+
+        comp.wBytesPerInterval = 3000;
+        CHECK(periodic_bandwidth(ss_iso, &comp, USB_SPEED_SUPER) == 3000*8000);
+}
+
+void admission()
+{
+        bandwidth_budget b{ .bus = 1000, .bus_used = 600, .link = 0, .link_used = 0 };
+        bandwidth_reservation r{};
+        bool exceeded;
+
+        CHECK(admit(r, b, bandwidth_policy::reject, 0, 300, exceeded));
+        CHECK(!exceeded);
+        CHECK(r.total == 300);
+
+        CHECK(!admit(r, b, bandwidth_policy::reject, 1, 200, exceeded)); // 600 + 300 + 200 > 1000
+        CHECK(exceeded);
+        CHECK(r.intf[1] == 0);
+        CHECK(r.total == 300);
+
+        CHECK(admit(r, b, bandwidth_policy::reject, 0, 400, exceeded)); // the previous reservation is replaced
+        CHECK(!exceeded);
+        CHECK(r.total == 400);
+
+        CHECK(admit(r, b, bandwidth_policy::warn, 1, 200, exceeded));
+        CHECK(exceeded);
+        CHECK(r.total == 600);
+
+        CHECK(admit(r, b, bandwidth_policy::allow, 2, 5000, exceeded));
+        CHECK(!exceeded);
+        CHECK(r.total == 5600);
+
+        CHECK(admit(r, b, bandwidth_policy::reject, 2, 0, exceeded)); // zero bandwidth alternate setting
+        CHECK(!exceeded);
+        CHECK(r.total == 600);
+
+        release(r);
+        CHECK(!r.total && !r.intf[0] && !r.intf[1]);
+}
+
+void link()
+{
+        bandwidth_budget b{ .bus = 1'000'000, .bus_used = 0, .link = 1000, .link_used = 900 };
+        bandwidth_reservation r{};
+        bool exceeded;
+
+        CHECK(admit(r, b, bandwidth_policy::reject, 3, 100, exceeded));
+        CHECK(!admit(r, b, bandwidth_policy::reject, 4, 1, exceeded));
+        CHECK(exceeded);
+
+        b.link = 0; // unlimited
+        CHECK(admit(r, b, bandwidth_policy::reject, 4, 1000, exceeded));
+        CHECK(!exceeded);
+        CHECK(r.total == 1100);
+}
+
+} // namespace
+
+
+int main()
+{
+        bus();
+        periodic();
+        admission();
+        link();
+}
@@ -0,0 +1,140 @@
+/*
+ * Copyright (C) 2024 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "check.h"
+#include <usbip/chrome_trace.h>
+
+namespace
+{
+
+using namespace usbip;
+using enum trace_event;
+
+auto record(UINT64 time, trace_event event, UINT32 seqnum, UINT8 port = 1)
+{
+        return trace_record{ .time = time, .seqnum = seqnum, .devid = 0x10002, .event = event, .ep = 1, .dir = 1, .port = port };
+}
+
+auto count(const std::string &s, const std::string &what)
+{
+        int cnt{};
+
+        for (auto pos = s.find(what); pos != s.npos; pos = s.find(what, pos + what.size())) {
+                ++cnt;
+        }
+
+        return cnt;
+}
+
+void commands()
+{
+        std::vector<trace_record> v {
+                record(10, dispatch, 1),
+                record(11, dispatch, 2),
+                record(12, submit, 1),
+                record(13, submit, 2),
+                record(14, complete, 2),
+                record(15, complete, 1),
+                record(16, dispatch, 3, 2),
+        };
+
+        auto urbs = group_by_urb(v, {});
+        CHECK(urbs.size() == 3);
+
+        CHECK(urbs[0][int(dispatch)] == &v[0]);
+        CHECK(urbs[0][int(submit)] == &v[2]);
+        CHECK(urbs[0][int(complete)] == &v[5]);
+
+        CHECK(urbs[1][int(dispatch)] == &v[1]);
+        CHECK(urbs[1][int(complete)] == &v[4]);
+
+        CHECK(urbs[2][int(dispatch)] == &v[6]);
+
+        urbs = group_by_urb(v, {2});
+        CHECK(urbs.size() == 1);
+        CHECK(urbs[0][int(dispatch)] == &v[6]);
+}
+
+/*
+ * Seqnum starts over after a reconnect.
+ */
+void reused_seqnum()
+{
+        std::vector<trace_record> v {
+                record(10, submit, 1),
+                record(11, send, 1),
+                record(12, unlink, 1), // reconnect
+                record(20, submit, 1),
+                record(21, send, 1),
+                record(22, recv, 1),
+                record(23, complete, 1),
+                record(30, complete, 1), // head records were dropped
+                record(40, dispatch, 1),
+                record(41, submit, 1),
+        };
+
+        auto urbs = group_by_urb(v, {});
+        CHECK(urbs.size() == 4);
+
+        CHECK(urbs[0][int(submit)] == &v[0]);
+        CHECK(urbs[0][int(unlink)] == &v[2]);
+
+        CHECK(urbs[1][int(submit)] == &v[3]);
+        CHECK(urbs[1][int(complete)] == &v[6]);
+
+        CHECK(urbs[2][int(complete)] == &v[7]);
+        CHECK(!urbs[2][int(submit)]);
+
+        CHECK(urbs[3][int(dispatch)] == &v[8]);
+        CHECK(urbs[3][int(submit)] == &v[9]);
+}
+
+void unknown_event()
+{
+        std::vector<trace_record> v {
+                record(10, trace_event(0), 1),
+                record(11, trace_event(100), 1),
+        };
+
+        CHECK(group_by_urb(v, {}).empty());
+}
+
+/*
+ * WskReceive is completed before WskSend.
+ */
+void tracks()
+{
+        std::vector<trace_record> v {
+                record(0, dispatch, 7),
+                record(10, prepare, 7),
+                record(20, submit, 7),
+                record(30, locked, 7),
+                record(50, recv, 7),
+                record(60, send, 7),
+                record(70, payload, 7),
+                record(80, complete, 7),
+        };
+
+        auto s = to_chrome_trace(v, {});
+
+        CHECK(count(s, R"("ph":"b")") == count(s, R"("ph":"e")"));
+        CHECK(count(s, R"("name":"process_name")") == 1);
+
+        CHECK(count(s, R"("name":"URB","cat":"ep1 In","ph":"b","id":"0x1")") == 1);
+        CHECK(count(s, R"("name":"WskSend","cat":"ep1 In","ph":"b","id":"0x1 WskSend","ts":3.0)") == 1);
+        CHECK(count(s, R"("name":"server","cat":"ep1 In","ph":"b","id":"0x1 server","ts":3.0)") == 1);
+        CHECK(count(s, R"("name":"server","cat":"ep1 In","ph":"e","id":"0x1 server","ts":5.0)") == 1);
+        CHECK(count(s, R"("name":"payload","cat":"ep1 In","ph":"b","id":"0x1")") == 1);
+}
+
+} // namespace
+
+
+int main()
+{
+        commands();
+        reused_seqnum();
+        unknown_event();
+        tracks();
+}
@@ -0,0 +1,131 @@
+/*
+ * Copyright (C) 2024 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "check.h"
+#include <ude/compression_policy.h>
+
+namespace
+{
+
+using namespace usbip;
+
+constexpr UINT32 FEATURES = USBIP_FEATURE_MUX | USBIP_FEATURE_COMPRESS;
+
+auto cmd_submit(_In_ INT32 number_of_packets = number_of_packets_non_isoch)
+{
+        usbip_header hdr{};
+        hdr.base.command = USBIP_CMD_SUBMIT;
+        hdr.u.cmd_submit.transfer_buffer_length = 4096;
+        hdr.u.cmd_submit.number_of_packets = number_of_packets;
+        return hdr;
+}
+
+/*
+ * As after validate_header.
+ */
+auto ret_submit(_In_ INT32 number_of_packets = 0)
+{
+        usbip_header hdr{};
+        hdr.base.command = USBIP_RET_SUBMIT;
+        hdr.u.ret_submit.actual_length = 4096;
+        hdr.u.ret_submit.number_of_packets = number_of_packets;
+        return hdr;
+}
+
+void size_decision()
+{
+        CHECK(get_compression_limit(4096) == 3584);
+        CHECK(get_compression_limit(COMPRESS_MIN_THRESHOLD) == 448);
+
+        CHECK(!is_compressible(4096, 0)); // disabled
+        CHECK(!is_compressible(511, 512));
+        CHECK(is_compressible(512, 512));
+        CHECK(is_compressible(COMPRESS_MAX_LENGTH, 512));
+        CHECK(!is_compressible(COMPRESS_MAX_LENGTH + 1, 512));
+}
+
+void cmd_framing()
+{
+        auto hdr = cmd_submit();
+        CHECK(!get_compressed_size(hdr, FEATURES));
+
+        set_compressed_size(hdr, 1000);
+        CHECK(get_compressed_size(hdr, FEATURES) == 1000);
+        CHECK(!get_compressed_size(hdr, USBIP_FEATURE_MUX)); // was not negotiated
+
+        hdr = cmd_submit(8); // isoch, start_frame is a frame number
+        hdr.u.cmd_submit.start_frame = 1000;
+        CHECK(!get_compressed_size(hdr, FEATURES));
+}
+
+/*
+ * start_frame of INT transfers is a frame number, it must not be taken for a length.
+ */
+void ret_framing()
+{
+        auto hdr = ret_submit();
+        hdr.u.ret_submit.start_frame = 1234;
+        CHECK(!get_compressed_size(hdr, FEATURES));
+
+        hdr.u.ret_submit.error_count = 1000;
+        CHECK(get_compressed_size(hdr, FEATURES) == 1000);
+        CHECK(!get_compressed_size(hdr, 0));
+
+        hdr.u.ret_submit.error_count = -1;
+        CHECK(!get_compressed_size(hdr, FEATURES));
+
+        hdr = ret_submit(8); // isoch, error_count is the number of failed packets
+        hdr.u.ret_submit.error_count = 2;
+        CHECK(!get_compressed_size(hdr, FEATURES));
+
+        hdr = ret_submit();
+        hdr.base.command = USBIP_RET_UNLINK;
+        hdr.u.ret_submit.error_count = 1000;
+        CHECK(!get_compressed_size(hdr, FEATURES));
+}
+
+void backoff()
+{
+        UCHAR n = 0;
+        UCHAR expected[] { 1, 2, 4, 8, 16, 32, 64, 64, 64 };
+
+        for (auto e: expected) {
+                n = next_backoff(n);
+                CHECK(n == e);
+        }
+}
+
+void buffers()
+{
+        volatile LONG busy = 0;
+        LONG bits[COMPRESS_BUFFERS]{};
+
+        for (int i = 0; i < COMPRESS_BUFFERS; ++i) {
+                bits[i] = acquire_compress_buffer(busy);
+                CHECK(bits[i] == 1 << i);
+                CHECK(get_compress_buffer_index(bits[i]) == i);
+        }
+
+        CHECK(!acquire_compress_buffer(busy)); // all are in use, the payload is sent as is
+
+        release_compress_buffer(busy, bits[1]);
+        CHECK(acquire_compress_buffer(busy) == bits[1]);
+
+        for (auto b: bits) {
+                release_compress_buffer(busy, b);
+        }
+        CHECK(!busy);
+}
+
+} // namespace
+
+
+int main()
+{
+        size_decision();
+        cmd_framing();
+        ret_framing();
+        backoff();
+        buffers();
+}
@@ -0,0 +1,290 @@
+/*
+ * Copyright (C) 2024 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "check.h"
+#include <ude/descriptor_cache_format.h>
+
+namespace
+{
+
+using namespace usbip;
+
+/*
+ * REG_BINARY value as it is read from the registry.
+ */
+struct value
+{
+        union {
+                descriptor_cache_header hdr;
+                UCHAR buf[512];
+        };
+        ULONG size; // actual
+
+        auto records() const { return &hdr + 1; }
+};
+
+auto make_udev()
+{
+        usbip_usb_device udev{};
+
+        udev.speed = 3; // USB_SPEED_HIGH
+        udev.idVendor = 0x1234;
+        udev.idProduct = 0x5678;
+        udev.bcdDevice = 0x0100;
+        udev.bDeviceClass = 0xEF;
+        udev.bDeviceSubClass = 2;
+        udev.bDeviceProtocol = 1;
+        udev.bNumConfigurations = 1;
+
+        return udev;
+}
+
+auto make_device_descriptor(_In_ const usbip_usb_device &udev)
+{
+        USB_DEVICE_DESCRIPTOR d{};
+
+        d.bLength = sizeof(d);
+        d.bDescriptorType = USB_DEVICE_DESCRIPTOR_TYPE;
+        d.bcdUSB = 0x0200;
+        d.bDeviceClass = udev.bDeviceClass;
+        d.bDeviceSubClass = udev.bDeviceSubClass;
+        d.bDeviceProtocol = udev.bDeviceProtocol;
+        d.bMaxPacketSize0 = 64;
+        d.idVendor = udev.idVendor;
+        d.idProduct = udev.idProduct;
+        d.bcdDevice = udev.bcdDevice;
+        d.bNumConfigurations = udev.bNumConfigurations;
+
+        return d;
+}
+
+/*
+ * Configuration descriptor followed by an interface descriptor.
+ */
+struct configuration
+{
+        USB_CONFIGURATION_DESCRIPTOR cd;
+        UCHAR intf[9];
+};
+
+auto make_configuration()
+{
+        configuration c{};
+
+        c.cd.bLength = sizeof(c.cd);
+        c.cd.bDescriptorType = USB_CONFIGURATION_DESCRIPTOR_TYPE;
+        c.cd.wTotalLength = sizeof(c);
+        c.cd.bNumInterfaces = 1;
+        c.cd.bConfigurationValue = 1;
+
+        c.intf[0] = sizeof(c.intf);
+        c.intf[1] = USB_INTERFACE_DESCRIPTOR_TYPE;
+
+        return c;
+}
+
+/*
+ * As put_cached_descriptor does.
+ */
+void append(_Inout_ value &v, _In_ UINT16 wValue, _In_ const void *data, _In_ UINT16 len)
+{
+        descriptor_cache_record r{ wValue, 0, len };
+
+        auto dst = v.buf + sizeof(v.hdr) + v.hdr.length;
+        std::memcpy(dst, &r, sizeof(r));
+        std::memcpy(dst + sizeof(r), data, len);
+
+        v.hdr.length += sizeof(r) + len;
+        ++v.hdr.count;
+
+        v.size = sizeof(v.hdr) + v.hdr.length;
+}
+
+auto make_value(_In_ const usbip_usb_device &udev)
+{
+        value v{};
+        init(v.hdr, udev);
+        v.size = sizeof(v.hdr);
+
+        auto dd = make_device_descriptor(udev);
+        append(v, USB_DEVICE_DESCRIPTOR_TYPE << 8, &dd, sizeof(dd));
+
+        auto cfg = make_configuration();
+        append(v, USB_CONFIGURATION_DESCRIPTOR_TYPE << 8, &cfg, sizeof(cfg));
+
+        return v;
+}
+
+auto get_descriptor(_In_ UCHAR bmRequestType, _In_ UCHAR type, _In_ UCHAR index = 0)
+{
+        USB_DEFAULT_PIPE_SETUP_PACKET pkt{};
+
+        pkt.bmRequestType.B = bmRequestType;
+        pkt.bRequest = USB_REQUEST_GET_DESCRIPTOR;
+        pkt.wValue.HiByte = type;
+        pkt.wValue.LowByte = index;
+        pkt.wLength = 255;
+
+        return pkt;
+}
+
+void cacheable()
+{
+        CHECK(is_cacheable(get_descriptor(0x80, USB_DEVICE_DESCRIPTOR_TYPE)));
+        CHECK(is_cacheable(get_descriptor(0x80, USB_CONFIGURATION_DESCRIPTOR_TYPE)));
+        CHECK(is_cacheable(get_descriptor(0x80, USB_BOS_DESCRIPTOR_TYPE)));
+
+        CHECK(!is_cacheable(get_descriptor(0x80, USB_STRING_DESCRIPTOR_TYPE, 3))); // can be a serial number
+        CHECK(!is_cacheable(get_descriptor(0x81, USB_CONFIGURATION_DESCRIPTOR_TYPE))); // interface
+        CHECK(!is_cacheable(get_descriptor(0xA0, USB_DEVICE_DESCRIPTOR_TYPE))); // class
+
+        auto pkt = get_descriptor(0x80, USB_DEVICE_DESCRIPTOR_TYPE);
+        pkt.bRequest = 0; // GET_STATUS
+        CHECK(!is_cacheable(pkt));
+}
+
+void full_length()
+{
+        auto cfg = make_configuration();
+        auto &d = reinterpret_cast<const USB_COMMON_DESCRIPTOR&>(cfg);
+
+        CHECK(get_full_length(d, sizeof(cfg)) == sizeof(cfg));
+        CHECK(get_full_length(d, sizeof(cfg.cd)) == sizeof(cfg)); // wTotalLength of a truncated descriptor
+        CHECK(!get_full_length(d, sizeof(USB_BOS_DESCRIPTOR) - 1));
+
+        auto dd = make_device_descriptor(make_udev());
+        CHECK(get_full_length(reinterpret_cast<const USB_COMMON_DESCRIPTOR&>(dd), 8) == sizeof(dd));
+}
+
+void valid()
+{
+        auto udev = make_udev();
+        auto v = make_value(udev);
+
+        CHECK(is_valid(v.hdr, v.records()));
+        CHECK(is_valid(v.hdr, v.size, udev));
+
+        auto r = find(v.hdr, v.records(), USB_CONFIGURATION_DESCRIPTOR_TYPE << 8, 0);
+        CHECK(r && r->wLength == sizeof(configuration));
+        CHECK(!find(v.hdr, v.records(), USB_CONFIGURATION_DESCRIPTOR_TYPE << 8 | 1, 0));
+        CHECK(!find(v.hdr, v.records(), USB_BOS_DESCRIPTOR_TYPE << 8, 0));
+
+        value empty{};
+        init(empty.hdr, udev);
+        CHECK(is_valid(empty.hdr, sizeof(empty.hdr), udev));
+}
+
+void header()
+{
+        auto udev = make_udev();
+
+        auto v = make_value(udev);
+        CHECK(!is_valid(v.hdr, sizeof(v.hdr) - 1, udev));
+        CHECK(!is_valid(v.hdr, v.size - 1, udev)); // length mismatch
+        CHECK(!is_valid(v.hdr, v.size + 1, udev));
+
+        v.hdr.magic = 0;
+        CHECK(!is_valid(v.hdr, v.size, udev));
+
+        v = make_value(udev);
+        ++v.hdr.version;
+        CHECK(!is_valid(v.hdr, v.size, udev));
+}
+
+/*
+ * The device was updated or another device has the same VID:PID on that busid.
+ */
+void device_changed()
+{
+        auto udev = make_udev();
+        auto v = make_value(udev);
+
+        auto u = udev;
+        u.speed = 5; // USB_SPEED_SUPER
+        CHECK(!is_valid(v.hdr, v.size, u));
+
+        u = udev;
+        ++u.bcdDevice;
+        CHECK(!is_valid(v.hdr, v.size, u));
+
+        u = udev;
+        ++u.bNumConfigurations;
+        CHECK(!is_valid(v.hdr, v.size, u));
+
+        u = udev;
+        u.bDeviceClass = 0;
+        CHECK(!is_valid(v.hdr, v.size, u));
+
+        u = udev;
+        ++u.busnum; // is not saved
+        ++u.devnum;
+        CHECK(is_valid(v.hdr, v.size, u));
+}
+
+void device_descriptor()
+{
+        auto udev = make_udev();
+
+        value v{};
+        init(v.hdr, udev);
+        v.size = sizeof(v.hdr);
+
+        auto dd = make_device_descriptor(udev);
+        ++dd.idProduct;
+        append(v, USB_DEVICE_DESCRIPTOR_TYPE << 8, &dd, sizeof(dd));
+
+        CHECK(is_valid(v.hdr, v.records())); // well-formed
+        CHECK(!is_valid(v.hdr, v.size, udev));
+}
+
+void malformed()
+{
+        auto udev = make_udev();
+
+        auto v = make_value(udev);
+        --v.hdr.count; // trailing bytes
+        CHECK(!is_valid(v.hdr, v.records()));
+
+        v = make_value(udev);
+        ++v.hdr.count; // past the end
+        CHECK(!is_valid(v.hdr, v.records()));
+
+        v = make_value(udev);
+        v.hdr.length -= 1;
+        v.size -= 1;
+        CHECK(!is_valid(v.hdr, v.size, udev)); // truncated descriptor
+
+        auto cfg = make_configuration();
+
+        value w{};
+        init(w.hdr, udev);
+        append(w, USB_BOS_DESCRIPTOR_TYPE << 8, &cfg, sizeof(cfg)); // type mismatch
+        CHECK(!is_valid(w.hdr, w.records()));
+
+        w = value{};
+        init(w.hdr, udev);
+        cfg.cd.wTotalLength += 1;
+        append(w, USB_CONFIGURATION_DESCRIPTOR_TYPE << 8, &cfg, sizeof(cfg)); // incomplete
+        CHECK(!is_valid(w.hdr, w.records()));
+
+        w = value{};
+        init(w.hdr, udev);
+        UCHAR b = 0;
+        append(w, USB_DEVICE_DESCRIPTOR_TYPE << 8, &b, sizeof(b)); // shorter than USB_COMMON_DESCRIPTOR
+        CHECK(!is_valid(w.hdr, w.records()));
+}
+
+} // namespace
+
+
+int main()
+{
+        cacheable();
+        full_length();
+        valid();
+        header();
+        device_changed();
+        device_descriptor();
+        malformed();
+}
@@ -0,0 +1,109 @@
+/*
+ * Copyright (C) 2024 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "check.h"
+#include <ude/dns_policy.h>
+
+namespace
+{
+
+using namespace usbip;
+
+constexpr NTSTATUS ERROR = static_cast<NTSTATUS>(0xC0000034); // STATUS_OBJECT_NAME_NOT_FOUND
+constexpr NTSTATUS NOT_FOUND = static_cast<NTSTATUS>(0xC0000225); // STATUS_NOT_FOUND, is not special
+
+constexpr dns_ttl ttl{ .positive = 300, .negative = 30, .stale = 86'400 };
+
+struct entry : dns_slot
+{
+        int key;
+};
+
+void unused()
+{
+        dns_slot s{};
+        CHECK(lookup(s, ttl, 1000, false) == dns_lookup::miss);
+        CHECK(lookup(s, ttl, 1000, true) == dns_lookup::miss);
+}
+
+void positive()
+{
+        dns_slot s{};
+        store(s, 0, 1000);
+
+        CHECK(lookup(s, ttl, 1000, false) == dns_lookup::fresh);
+        CHECK(lookup(s, ttl, 1299, false) == dns_lookup::fresh);
+        CHECK(lookup(s, ttl, 1299, true) == dns_lookup::fresh);
+
+        CHECK(lookup(s, ttl, 1300, false) == dns_lookup::miss); // expired
+        CHECK(lookup(s, ttl, 1300, true) == dns_lookup::stale); // the resolver has failed
+
+        CHECK(lookup(s, ttl, 1000 + ttl.stale - 1, true) == dns_lookup::stale);
+        CHECK(lookup(s, ttl, 1000 + ttl.stale, true) == dns_lookup::miss);
+}
+
+void negative()
+{
+        for (auto err: {ERROR, NOT_FOUND}) {
+                dns_slot s{};
+                store(s, err, 1000);
+
+                CHECK(lookup(s, ttl, 1029, false) == dns_lookup::negative);
+                CHECK(lookup(s, ttl, 1030, false) == dns_lookup::miss);
+
+                CHECK(lookup(s, ttl, 1000, true) == dns_lookup::miss); // is never served as stale
+        }
+}
+
+void replace()
+{
+        dns_slot s{};
+        CHECK(can_replace(s, ERROR));
+        CHECK(can_replace(s, 0));
+
+        store(s, 0, 1000);
+        CHECK(!can_replace(s, ERROR)); // keep the addresses for serve-stale
+        CHECK(can_replace(s, 0));
+
+        store(s, ERROR, 2000);
+        CHECK(can_replace(s, NOT_FOUND));
+        CHECK(can_replace(s, 0));
+}
+
+void eviction()
+{
+        entry v[3]{};
+        bool evicted;
+
+        for (int i = 0; i < 3; ++i) {
+                auto &e = evict(v, evicted);
+                CHECK(!evicted);
+                CHECK(&e == &v[i]);
+
+                store(e, 0, 100 + i);
+                e.key = i;
+        }
+
+        v[0].last_used = 500; // recently used
+
+        auto &e = evict(v, evicted);
+        CHECK(evicted);
+        CHECK(e.key == 1);
+
+        e.time = 0; // is released
+        CHECK(&evict(v, evicted) == &e);
+        CHECK(!evicted);
+}
+
+} // namespace
+
+
+int main()
+{
+        unused();
+        positive();
+        negative();
+        replace();
+        eviction();
+}
@@ -0,0 +1,120 @@
+/*
+ * Copyright (C) 2024 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "check.h"
+#include <ude/stats_counters.h>
+
+#include <numeric>
+
+namespace
+{
+
+using namespace usbip;
+using vhci::endpoint_stats;
+using vhci::latency_bucket;
+
+constexpr NTSTATUS STATUS_SUCCESS = 0;
+constexpr NTSTATUS STATUS_UNSUCCESSFUL = static_cast<NTSTATUS>(0xC0000001);
+constexpr NTSTATUS STATUS_BUFFER_OVERFLOW = static_cast<NTSTATUS>(0x80000005); // warning, data is returned
+
+auto total(const endpoint_stats &s)
+{
+        return std::accumulate(std::begin(s.latency), std::end(s.latency), UINT64());
+}
+
+void buckets()
+{
+        CHECK(latency_bucket(0) == 0);
+        CHECK(latency_bucket(1) == 1);
+
+        for (int i = 1; i < endpoint_stats::LATENCY_BUCKETS - 1; ++i) {
+                auto lo = 1ULL << (i - 1);
+                auto hi = (1ULL << i) - 1;
+                CHECK(latency_bucket(lo) == i);
+                CHECK(latency_bucket(hi) == i);
+        }
+
+        constexpr auto last = endpoint_stats::LATENCY_BUCKETS - 1;
+        CHECK(latency_bucket(1ULL << (last - 1)) == last);
+        CHECK(latency_bucket(1ULL << last) == last); // saturates
+        CHECK(latency_bucket(MAXULONGLONG) == last);
+}
+
+/*
+ * Interrupt time is in 100 ns units.
+ */
+void latency()
+{
+        CHECK(get_latency(1000, 1000) == 0);
+        CHECK(get_latency(1009, 1000) == 0);
+        CHECK(get_latency(1010, 1000) == 1);
+        CHECK(get_latency(1000 + 15'625*10, 1000) == 15'625); // a clock tick
+        CHECK(get_latency(1000, 1010) == 0); // is not negative
+}
+
+void counters()
+{
+        endpoint_stats s{};
+
+        add_completed(s, 0, STATUS_SUCCESS, true, 64);
+        add_completed(s, 100, STATUS_SUCCESS, false, 512);
+        add_completed(s, 130, STATUS_BUFFER_OVERFLOW, true, 16);
+        add_completed(s, 5000, STATUS_UNSUCCESSFUL, true, 4096); // is not counted as transferred
+        add_completed(s, 7, STATUS_SUCCESS, true, 0);
+        add_completed(s, 7, STATUS_SUCCESS, true, -1);
+
+        CHECK(s.completed == 6);
+        CHECK(s.errors == 1);
+        CHECK(s.bytes_in == 80);
+        CHECK(s.bytes_out == 512);
+        CHECK(s.latency_sum == 5244);
+
+        CHECK(total(s) == s.completed);
+        CHECK(s.latency[0] == 1);
+        CHECK(s.latency[3] == 2); // 7
+        CHECK(s.latency[7] == 1); // 100
+        CHECK(s.latency[8] == 1); // 130
+        CHECK(s.latency[13] == 1); // 5000
+
+        CHECK(!s.submitted && !s.cancelled); // are updated elsewhere
+}
+
+/*
+ * The histogram approximates percentiles within a factor of two, the mean is exact.
+ */
+void accuracy()
+{
+        endpoint_stats s{};
+        UINT64 sum = 0;
+
+        for (UINT64 usec = 0; usec < 100'000; usec += 37) {
+                add_completed(s, usec, STATUS_SUCCESS, true, 1);
+                sum += usec;
+        }
+
+        CHECK(total(s) == s.completed);
+        CHECK(s.bytes_in == s.completed);
+        CHECK(s.latency_sum == sum);
+
+        UINT64 median = 0;
+        for (UINT64 i = 0, cnt = 0; i < endpoint_stats::LATENCY_BUCKETS; ++i) {
+                if ((cnt += s.latency[i]) >= s.completed/2) {
+                        median = 1ULL << i; // upper bound of the bucket
+                        break;
+                }
+        }
+
+        CHECK(median >= 50'000 && median < 2*50'000);
+}
+
+} // namespace
+
+
+int main()
+{
+        buckets();
+        latency();
+        counters();
+        accuracy();
+}
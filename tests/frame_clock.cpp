@@ -0,0 +1,182 @@
+/*
+ * Copyright (C) 2024 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "check.h"
+#include <ude/frame_clock.h>
+
+namespace
+{
+
+using namespace usbip;
+
+constexpr UINT64 MS = 10'000; // 100-nanosecond units
+
+/*
+ * Bus frame clock of the server.
+ */
+struct server_clock
+{
+        double ppm; // drift
+        double offset; // frames at time zero
+        int shift; // 0 - frames, 3 - microframes
+        ULONG modulus; // in its units
+
+        auto frames(UINT64 time) const { return offset + time*(1 + ppm/1'000'000)/MS; }
+        auto raw(UINT64 time) const { return static_cast<ULONG>(UINT64(frames(time)*(1 << shift)) & (modulus - 1)); }
+};
+
+/*
+ * Deterministic jitter of sample times, [-max_jitter, max_jitter].
+ */
+struct jitter
+{
+        UINT32 seed = 12345;
+        INT64 max_jitter;
+
+        auto operator()()
+        {
+                seed = seed*1103515245 + 12345;
+                return static_cast<INT64>((seed >> 8) % (2*max_jitter + 1)) - max_jitter;
+        }
+};
+
+/*
+ * @return local frame minus server's frame at the time, in frames
+ */
+auto phase_error(const frame_clock &c, UINT64 frame, const server_clock &srv, UINT64 time)
+{
+        auto m = frames_modulus(c);
+        auto local = to_server_frame(c, static_cast<ULONG>(frame)) >> c.shift;
+        auto remote = srv.raw(time) >> c.shift;
+
+        auto diff = static_cast<INT64>((local - remote) & (m - 1));
+        return diff >= INT64(m/2) ? diff - INT64(m) : diff;
+}
+
+/*
+ * Samples every 8 ms, the clock is read every millisecond.
+ * @return max abs phase error after the clock is locked
+ */
+auto run(const server_clock &srv, INT64 max_jitter, UINT64 duration)
+{
+        UINT64 start = 1'000*MS; // arbitrary interrupt time
+        frame_clock c;
+        init(c, start);
+
+        jitter rnd{ .max_jitter = max_jitter };
+        UINT64 prev{};
+        INT64 max_err{};
+
+        for (UINT64 t = 0; t < duration; t += MS) {
+                auto now = start + t;
+
+                auto frame = current_frame(c, now);
+                CHECK(frame >= prev); // never goes backward
+                prev = frame;
+
+                if (t % (8*MS)) {
+                        continue;
+                }
+
+                if (is_locked(c) && t > duration/4) { // some time to compensate the drift
+                        auto err = phase_error(c, frame, srv, t);
+                        max_err = max(max_err, err < 0 ? -err : err);
+                }
+
+                add_sample(c, now + rnd(), srv.raw(t));
+        }
+
+        CHECK(is_locked(c));
+        CHECK(c.shift == srv.shift);
+        CHECK(c.modulus == srv.modulus);
+
+        return max_err;
+}
+
+void drift_frames()
+{
+        server_clock srv{ .ppm = 500, .offset = 100, .shift = 0, .modulus = 2048 };
+        CHECK(run(srv, 0, 60'000*MS) <= 1);
+
+        srv.ppm = -500;
+        CHECK(run(srv, 0, 60'000*MS) <= 1);
+}
+
+void drift_microframes()
+{
+        server_clock srv{ .ppm = 300, .offset = 7, .shift = 3, .modulus = 1 << 14 };
+        CHECK(run(srv, 0, 60'000*MS) <= 1);
+
+        srv.ppm = -300;
+        CHECK(run(srv, 0, 60'000*MS) <= 1);
+}
+
+void jitter_frames()
+{
+        server_clock srv{ .ppm = 200, .offset = 1500, .shift = 0, .modulus = 2048 };
+        CHECK(run(srv, MS/2, 60'000*MS) <= 1);
+}
+
+void jitter_microframes()
+{
+        server_clock srv{ .ppm = -200, .offset = 5000, .shift = 3, .modulus = 1 << 14 };
+        CHECK(run(srv, MS/2, 60'000*MS) <= 1);
+}
+
+/*
+ * A negative phase error must not move the frame number backward.
+ */
+void monotonic()
+{
+        server_clock srv{ .ppm = 0, .offset = 0, .shift = 0, .modulus = 2048 };
+
+        UINT64 now = 0;
+        frame_clock c;
+        init(c, now);
+
+        for ( ; !is_locked(c); now += 8*MS) {
+                add_sample(c, now, srv.raw(now));
+        }
+
+        auto frame = current_frame(c, now);
+        add_sample(c, now, srv.raw(now - 7*MS)); // the server is behind by seven frames
+
+        for (int i = 0; i < 8; ++i, now += MS/4) {
+                auto cur = current_frame(c, now);
+                CHECK(cur >= frame);
+                frame = cur;
+        }
+}
+
+/*
+ * The same numbering as current_frame is used until the clock is locked.
+ */
+void unlocked_numbering()
+{
+        server_clock srv{ .ppm = 0, .offset = 1000, .shift = 3, .modulus = 1 << 14 };
+
+        UINT64 now = 50*MS;
+        frame_clock c;
+        init(c, 0);
+
+        add_sample(c, now, srv.raw(now));
+        CHECK(!is_locked(c));
+
+        auto frame = to_local_frame(c, now, srv.raw(now));
+        CHECK(frame == current_frame(c, now));
+        CHECK(frame == 50);
+}
+
+} // namespace
+
+
+int main()
+{
+        drift_frames();
+        drift_microframes();
+        jitter_frames();
+        jitter_microframes();
+        monotonic();
+        unlocked_numbering();
+}
@@ -0,0 +1,250 @@
+/*
+ * Copyright (C) 2024 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "check.h"
+#include <ude/happy_eyeballs_policy.h>
+
+namespace
+{
+
+using namespace usbip::happy_eyeballs;
+
+enum { AF_INET = 2, AF_INET6 = 23 };
+enum { DELAY = 250, MAX_ATTEMPTS = 8 }; // milliseconds, see happy_eyeballs.cpp
+
+constexpr auto NEVER = ~0ULL;
+
+/*
+ * Outcome of a connection attempt to the address.
+ */
+struct addrinfo
+{
+        int ai_family;
+        addrinfo *ai_next{};
+
+        ULONGLONG duration{}; // of the attempt, NEVER if it hangs until TCP timeout
+        bool success{};
+};
+
+template<size_t N>
+auto& link(_Inout_ addrinfo (&v)[N])
+{
+        for (size_t i = 0; i + 1 < N; ++i) {
+                v[i].ai_next = &v[i + 1];
+        }
+        return v[0];
+}
+
+struct result
+{
+        const addrinfo *winner;
+        bool timeout;
+        ULONGLONG time; // when the race has finished
+        ULONGLONG started[16]; // time of each attempt in the order of starting
+        ULONG cnt;
+};
+
+/*
+ * The loop of happy_eyeballs_connect with the simulated clock.
+ */
+template<size_t N>
+auto race(_In_ const addrinfo &head, _In_ ULONGLONG deadline, _In_ ULONG max_pending = MAX_ATTEMPTS)
+{
+        const addrinfo *addrs[N];
+
+        schedule s{};
+        s.addr_cnt = interleave(addrs, head);
+        s.max_pending = max_pending;
+
+        ULONGLONG completion[N]{}; // of the attempts to addrs, zero if not started or completed
+
+        result r{};
+        ULONGLONG now = 0;
+
+        while (true) {
+                if (can_start(s, now)) {
+                        auto i = next_address(s);
+                        auto d = addrs[i]->duration;
+
+                        completion[i] = d == NEVER ? NEVER : now + d;
+                        r.started[r.cnt++] = now;
+
+                        on_started(s, now, DELAY);
+                }
+
+                if (!s.pending) {
+                        break;
+                }
+
+                auto wakeup = get_wakeup(s, deadline);
+                ULONG done = N;
+
+                for (ULONG i = 0; i < s.next; ++i) {
+                        if (completion[i] && completion[i] <= wakeup && (done == N || completion[i] < completion[done])) {
+                                done = i;
+                        }
+                }
+
+                if (done == N) {
+                        now = wakeup;
+                        if (now >= deadline) {
+                                r.timeout = true;
+                                break;
+                        }
+                        continue;
+                }
+
+                now = completion[done];
+                completion[done] = 0;
+
+                auto success = addrs[done]->success;
+                on_completed(s, success);
+
+                if (success) {
+                        r.winner = addrs[done];
+                        break;
+                }
+        }
+
+        r.time = now;
+        return r;
+}
+
+void order()
+{
+        addrinfo v[] { {AF_INET6}, {AF_INET6}, {AF_INET6}, {AF_INET}, {AF_INET} };
+        const addrinfo *addrs[8];
+
+        CHECK(interleave(addrs, link(v)) == ARRAYSIZE(v));
+
+        const addrinfo *expected[] { &v[0], &v[3], &v[1], &v[4], &v[2] };
+        for (size_t i = 0; i < ARRAYSIZE(expected); ++i) {
+                CHECK(addrs[i] == expected[i]);
+        }
+}
+
+void order_first_family()
+{
+        addrinfo v[] { {AF_INET}, {AF_INET6}, {AF_INET6}, {AF_INET} };
+        const addrinfo *addrs[8];
+
+        CHECK(interleave(addrs, link(v)) == ARRAYSIZE(v));
+
+        const addrinfo *expected[] { &v[0], &v[1], &v[3], &v[2] };
+        for (size_t i = 0; i < ARRAYSIZE(expected); ++i) {
+                CHECK(addrs[i] == expected[i]);
+        }
+}
+
+void order_truncated()
+{
+        addrinfo v[6] { {AF_INET6}, {AF_INET6}, {AF_INET6}, {AF_INET6}, {AF_INET}, {AF_INET} };
+        const addrinfo *addrs[3];
+
+        CHECK(interleave(addrs, link(v)) == 3);
+        CHECK(addrs[0] == &v[0]);
+        CHECK(addrs[1] == &v[4]);
+        CHECK(addrs[2] == &v[1]);
+}
+
+/*
+ * A dead IPv6 address does not cost a TCP timeout.
+ */
+void stagger()
+{
+        addrinfo v[] { {AF_INET6, nullptr, NEVER}, {AF_INET, nullptr, 30, true} };
+
+        auto r = race<8>(link(v), NEVER);
+        CHECK(r.winner == &v[1]);
+        CHECK(r.cnt == 2);
+        CHECK(r.started[0] == 0);
+        CHECK(r.started[1] == DELAY);
+        CHECK(r.time == DELAY + 30);
+}
+
+void fail_fast()
+{
+        addrinfo v[] { {AF_INET6, nullptr, 10}, {AF_INET, nullptr, 20}, {AF_INET6, nullptr, 30, true} };
+
+        auto r = race<8>(link(v), NEVER);
+        CHECK(r.winner == &v[2]);
+        CHECK(r.cnt == 3);
+        CHECK(r.started[1] == 10); // immediately after the failure
+        CHECK(r.started[2] == 30);
+        CHECK(r.time == 60);
+}
+
+/*
+ * Pending attempts are not cancelled when the next one is started.
+ */
+void slower_first()
+{
+        addrinfo v[] { {AF_INET6, nullptr, 300, true}, {AF_INET, nullptr, 100, true} };
+
+        auto r = race<8>(link(v), NEVER);
+        CHECK(r.winner == &v[0]);
+        CHECK(r.cnt == 2);
+        CHECK(r.time == 300);
+
+        v[0].duration = 500;
+        r = race<8>(link(v), NEVER);
+        CHECK(r.winner == &v[1]);
+        CHECK(r.time == DELAY + 100);
+}
+
+void all_failed()
+{
+        addrinfo v[] { {AF_INET6, nullptr, 10}, {AF_INET, nullptr, 1000}, {AF_INET6, nullptr, 10} };
+
+        auto r = race<8>(link(v), NEVER);
+        CHECK(!r.winner);
+        CHECK(!r.timeout);
+        CHECK(r.cnt == 3);
+        CHECK(r.time == 1010);
+}
+
+void deadline()
+{
+        addrinfo v[] { {AF_INET6, nullptr, NEVER}, {AF_INET, nullptr, NEVER}, {AF_INET6, nullptr, NEVER} };
+
+        auto r = race<8>(link(v), 600);
+        CHECK(r.timeout);
+        CHECK(r.cnt == 3);
+        CHECK(r.time == 600);
+
+        r = race<8>(link(v), 100);
+        CHECK(r.timeout);
+        CHECK(r.cnt == 1);
+        CHECK(r.time == 100);
+}
+
+/*
+ * The next attempt waits for a free slot.
+ */
+void max_pending()
+{
+        addrinfo v[] { {AF_INET6, nullptr, 1000}, {AF_INET, nullptr, 1000}, {AF_INET6, nullptr, 5, true} };
+
+        auto r = race<8>(link(v), NEVER, 2);
+        CHECK(r.winner == &v[2]);
+        CHECK(r.started[1] == DELAY);
+        CHECK(r.started[2] == 1000);
+        CHECK(r.time == 1005);
+}
+
+} // namespace
+
+
+int main()
+{
+        order();
+        order_first_family();
+        order_truncated();
+        stagger();
+        fail_fast();
+        slower_first();
+        all_failed();
+        deadline();
+        max_pending();
+}
@@ -0,0 +1,226 @@
+/*
+ * Copyright (C) 2024 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "check.h"
+#include <ude/ports_delta.h>
+#include <libusbip/src/merge_delta.h>
+
+namespace
+{
+
+using namespace usbip;
+
+enum { PORTS = 8 };
+
+struct imported_device
+{
+        int port{};
+        int id{}; // of the attached device
+};
+
+struct entry
+{
+        bool removed{};
+        imported_device device{};
+};
+
+/*
+ * vhci_ctx and get_imported_devices_delta.
+ */
+struct driver
+{
+        UINT64 epoch{};
+        UINT64 generation{};
+
+        int ids[PORTS]{}; // zero if the port is free
+        UINT64 changed[PORTS]{};
+
+        void set(int port, int id)
+        {
+                ids[port - 1] = id;
+                changed[port - 1] = ++generation;
+        }
+
+        struct reply
+        {
+                UINT64 generation{};
+                UINT64 epoch{};
+                bool reset{};
+                std::vector<entry> entries{};
+        };
+
+        auto query(UINT64 since, UINT64 since_epoch) const
+        {
+                reply r{ .generation = generation, .epoch = epoch };
+                r.reset = is_delta_reset(since, since_epoch, generation, epoch);
+
+                for (int i = 0; i < PORTS; ++i) {
+                        if (is_delta_reported(r.reset, ids[i], changed[i], since)) {
+                                r.entries.push_back({ .removed = !ids[i], .device = { .port = i + 1, .id = ids[i] } });
+                        }
+                }
+
+                return r;
+        }
+};
+
+/*
+ * update_imported_devices.
+ */
+struct client
+{
+        std::vector<imported_device> devices{};
+        UINT64 generation{};
+        UINT64 epoch{};
+
+        auto update(const driver &drv)
+        {
+                auto r = drv.query(generation, epoch);
+                merge_delta(devices, r.entries.data(), r.entries.size(), r.reset, [] (auto &d) { return d; });
+
+                generation = r.generation;
+                epoch = r.epoch;
+
+                return r;
+        }
+
+        auto in_sync(const driver &drv) const
+        {
+                size_t cnt = 0;
+
+                for (int i = 0; i < PORTS; ++i) {
+                        if (drv.ids[i]) {
+                                if (cnt == devices.size() || devices[cnt].port != i + 1 || devices[cnt].id != drv.ids[i]) {
+                                        return false;
+                                }
+                                ++cnt;
+                        }
+                }
+
+                return cnt == devices.size();
+        }
+};
+
+void first_call()
+{
+        driver drv{ .epoch = 1000 };
+        drv.set(3, 30);
+        drv.set(1, 10);
+
+        client c{};
+        auto r = c.update(drv);
+
+        CHECK(r.reset);
+        CHECK(r.entries.size() == 2); // free ports are not reported
+        CHECK(c.in_sync(drv));
+        CHECK(c.devices[0].port == 1);
+}
+
+void incremental()
+{
+        driver drv{ .epoch = 1000 };
+        drv.set(1, 10);
+        drv.set(2, 20);
+
+        client c{};
+        c.update(drv);
+
+        auto r = c.update(drv);
+        CHECK(!r.reset);
+        CHECK(r.entries.empty());
+
+        drv.set(2, 0); // detached
+        drv.set(5, 50);
+        drv.set(1, 11); // another device on the same port
+
+        r = c.update(drv);
+        CHECK(!r.reset);
+        CHECK(r.entries.size() == 3);
+        CHECK(c.in_sync(drv));
+
+        drv.set(6, 60);
+        drv.set(6, 0); // is reported as removed, the client has never seen it
+
+        r = c.update(drv);
+        CHECK(r.entries.size() == 1 && r.entries[0].removed);
+        CHECK(c.in_sync(drv));
+}
+
+/*
+ * The generation of a new instance of the driver has caught up with the stale one of the client.
+ */
+void reload()
+{
+        driver old{ .epoch = 1000 };
+        for (int port = 1; port <= 4; ++port) {
+                old.set(port, port*10);
+        }
+
+        client c{};
+        c.update(old);
+        CHECK(c.generation == 4);
+
+        driver drv{ .epoch = 2000 };
+        for (int id = 1; id <= 5; ++id) {
+                drv.set(8, id);
+        }
+        CHECK(drv.generation > c.generation);
+
+        auto r = c.update(drv);
+        CHECK(r.reset);
+        CHECK(c.in_sync(drv));
+        CHECK(c.devices.size() == 1);
+
+        CHECK(!is_delta_reset(4, 1000, 5, 1000)); // the same instance would report only port 8
+}
+
+void generation_rules()
+{
+        CHECK(is_delta_reset(0, 1000, 5, 1000)); // the first call
+        CHECK(is_delta_reset(6, 1000, 5, 1000)); // is ahead of the driver
+        CHECK(is_delta_reset(5, 0, 5, 1000));
+        CHECK(!is_delta_reset(5, 1000, 5, 1000));
+
+        CHECK(is_delta_reported(true, true, 1, 5));
+        CHECK(!is_delta_reported(true, false, 7, 5));
+        CHECK(is_delta_reported(false, false, 7, 5));
+        CHECK(!is_delta_reported(false, true, 5, 5));
+}
+
+void merge()
+{
+        std::vector<imported_device> v { {2, 20}, {4, 40} };
+        auto same = [] (auto &d) { return d; };
+
+        entry e[] {
+                { .removed = true, .device = { .port = 3 } }, // is absent
+                { .device = { .port = 1, .id = 10 } },
+                { .device = { .port = 4, .id = 41 } },
+                { .device = { .port = 3, .id = 30 } },
+                { .removed = true, .device = { .port = 2 } },
+        };
+
+        merge_delta(v, e, ARRAYSIZE(e), false, same);
+
+        CHECK(v.size() == 3);
+        CHECK(v[0].port == 1 && v[0].id == 10);
+        CHECK(v[1].port == 3 && v[1].id == 30);
+        CHECK(v[2].port == 4 && v[2].id == 41);
+
+        merge_delta(v, e + 1, 1, true, same);
+        CHECK(v.size() == 1);
+        CHECK(v[0].port == 1);
+}
+
+} // namespace
+
+
+int main()
+{
+        first_call();
+        incremental();
+        reload();
+        generation_rules();
+        merge();
+}
@@ -0,0 +1,51 @@
+/*
+ * Copyright (C) 2024 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+/*
+ * The subset of <basetsd.h> and <ntdef.h> that is used by the portable code.
+ */
+
+#include <cstdint>
+#include <cstddef>
+
+using CHAR = char;
+using UCHAR = uint8_t;
+using SHORT = int16_t;
+using USHORT = uint16_t;
+using LONG = int32_t;
+using ULONG = uint32_t;
+using LONG64 = int64_t;
+using LONGLONG = int64_t;
+using ULONG64 = uint64_t;
+using ULONGLONG = uint64_t;
+
+using INT8 = int8_t;
+using UINT8 = uint8_t;
+using INT16 = int16_t;
+using UINT16 = uint16_t;
+using INT32 = int32_t;
+using UINT32 = uint32_t;
+using INT64 = int64_t;
+using UINT64 = uint64_t;
+
+using LONG_PTR = intptr_t;
+using ULONG_PTR = uintptr_t;
+using SIZE_T = size_t;
+
+#define MAXUINT32 (~UINT32(0))
+#define MAXULONGLONG (~ULONGLONG(0))
+
+using BOOLEAN = UCHAR;
+using NTSTATUS = LONG;
+
+union LARGE_INTEGER
+{
+        struct {
+                ULONG LowPart;
+                LONG HighPart;
+        };
+        LONGLONG QuadPart;
+};
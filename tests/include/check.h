@@ -0,0 +1,19 @@
+/*
+ * Copyright (C) 2024 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include <cstdio>
+#include <cstdlib>
+
+/*
+ * Unlike assert, is not disabled by NDEBUG.
+ */
+#define CHECK(e) \
+        do { \
+                if (!(e)) { \
+                        std::fprintf(stderr, "%s(%d): CHECK(%s) failed\n", __FILE__, __LINE__, #e); \
+                        std::exit(EXIT_FAILURE); \
+                } \
+        } while (false)
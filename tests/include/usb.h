@@ -0,0 +1,260 @@
+/*
+ * Copyright (C) 2024 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+/*
+ * The subset of <usb.h> and <usbspec.h> that is used by the portable code of the drivers.
+ */
+
+#include <ntdef.h>
+
+enum {
+        USB_DEVICE_DESCRIPTOR_TYPE = 1,
+        USB_CONFIGURATION_DESCRIPTOR_TYPE,
+        USB_STRING_DESCRIPTOR_TYPE,
+        USB_INTERFACE_DESCRIPTOR_TYPE,
+        USB_ENDPOINT_DESCRIPTOR_TYPE,
+        USB_BOS_DESCRIPTOR_TYPE = 0x0F,
+        USB_SUPERSPEED_ENDPOINT_COMPANION_DESCRIPTOR_TYPE = 0x30,
+};
+
+enum {
+        USB_DEVICE_CLASS_AUDIO = 0x01,
+        USB_DEVICE_CLASS_COMMUNICATIONS = 0x02,
+        USB_DEVICE_CLASS_HUMAN_INTERFACE = 0x03,
+        USB_DEVICE_CLASS_PRINTER = 0x07,
+        USB_DEVICE_CLASS_STORAGE = 0x08,
+        USB_DEVICE_CLASS_SMART_CARD = 0x0B,
+        USB_DEVICE_CLASS_VIDEO = 0x0E,
+        USB_DEVICE_CLASS_AUDIO_VIDEO = 0x10,
+        USB_DEVICE_CLASS_WIRELESS_CONTROLLER = 0xE0,
+        USB_DEVICE_CLASS_MISCELLANEOUS = 0xEF,
+};
+
+#define USB_ENDPOINT_TYPE_MASK 0x03
+#define USB_ENDPOINT_TYPE_CONTROL 0x00
+#define USB_ENDPOINT_TYPE_ISOCHRONOUS 0x01
+#define USB_ENDPOINT_TYPE_BULK 0x02
+#define USB_ENDPOINT_TYPE_INTERRUPT 0x03
+
+enum {
+        USB_ENDPOINT_DIRECTION_MASK = 0x80,
+        USB_ENDPOINT_ADDRESS_MASK = 0x0F,
+        USB_DEFAULT_ENDPOINT_ADDRESS = 0,
+};
+
+#define USB_ENDPOINT_DIRECTION_OUT(addr) (!((addr) & USB_ENDPOINT_DIRECTION_MASK))
+#define USB_ENDPOINT_DIRECTION_IN(addr) ((addr) & USB_ENDPOINT_DIRECTION_MASK)
+
+enum USBD_PIPE_TYPE {
+        UsbdPipeTypeControl,
+        UsbdPipeTypeIsochronous,
+        UsbdPipeTypeBulk,
+        UsbdPipeTypeInterrupt
+};
+
+enum { USB_REQUEST_GET_DESCRIPTOR = 0x06 };
+
+#pragma pack(push, 1)
+
+union BM_REQUEST_TYPE
+{
+        struct {
+                UCHAR Recipient : 2;
+                UCHAR Reserved : 3;
+                UCHAR Type : 2;
+                UCHAR Dir : 1;
+        } s;
+        UCHAR B;
+};
+
+struct USB_DEFAULT_PIPE_SETUP_PACKET
+{
+        BM_REQUEST_TYPE bmRequestType;
+        UCHAR bRequest;
+
+        union {
+                struct {
+                        UCHAR LowByte;
+                        UCHAR HiByte;
+                };
+                USHORT W;
+        } wValue;
+
+        union {
+                struct {
+                        UCHAR LowByte;
+                        UCHAR HiByte;
+                };
+                USHORT W;
+        } wIndex;
+
+        USHORT wLength;
+};
+
+struct USB_COMMON_DESCRIPTOR
+{
+        UCHAR bLength;
+        UCHAR bDescriptorType;
+};
+
+struct USB_DEVICE_DESCRIPTOR
+{
+        UCHAR bLength;
+        UCHAR bDescriptorType;
+        USHORT bcdUSB;
+        UCHAR bDeviceClass;
+        UCHAR bDeviceSubClass;
+        UCHAR bDeviceProtocol;
+        UCHAR bMaxPacketSize0;
+        USHORT idVendor;
+        USHORT idProduct;
+        USHORT bcdDevice;
+        UCHAR iManufacturer;
+        UCHAR iProduct;
+        UCHAR iSerialNumber;
+        UCHAR bNumConfigurations;
+};
+
+struct USB_CONFIGURATION_DESCRIPTOR
+{
+        UCHAR bLength;
+        UCHAR bDescriptorType;
+        USHORT wTotalLength;
+        UCHAR bNumInterfaces;
+        UCHAR bConfigurationValue;
+        UCHAR iConfiguration;
+        UCHAR bmAttributes;
+        UCHAR MaxPower;
+};
+
+struct USB_BOS_DESCRIPTOR
+{
+        UCHAR bLength;
+        UCHAR bDescriptorType;
+        USHORT wTotalLength;
+        UCHAR bNumDeviceCaps;
+};
+
+struct USB_ENDPOINT_DESCRIPTOR
+{
+        UCHAR bLength;
+        UCHAR bDescriptorType;
+        UCHAR bEndpointAddress;
+        UCHAR bmAttributes;
+        USHORT wMaxPacketSize;
+        UCHAR bInterval;
+};
+
+struct USB_SUPERSPEED_ENDPOINT_COMPANION_DESCRIPTOR
+{
+        UCHAR bLength;
+        UCHAR bDescriptorType;
+        UCHAR bMaxBurst;
+        union {
+                UCHAR AsUchar;
+                struct {
+                        UCHAR MaxStreams : 5;
+                        UCHAR Reserved1 : 3;
+                } Bulk;
+                struct {
+                        UCHAR Mult : 2;
+                        UCHAR Reserved2 : 5;
+                        UCHAR SspCompanion : 1;
+                } Isochronous;
+        } bmAttributes;
+        USHORT wBytesPerInterval;
+};
+
+#pragma pack(pop)
+
+enum {
+        URB_FUNCTION_SELECT_CONFIGURATION = 0x0000,
+        URB_FUNCTION_SELECT_INTERFACE = 0x0001,
+        URB_FUNCTION_ABORT_PIPE = 0x0002,
+        URB_FUNCTION_GET_CURRENT_FRAME_NUMBER = 0x0007,
+        URB_FUNCTION_CONTROL_TRANSFER = 0x0008,
+        URB_FUNCTION_BULK_OR_INTERRUPT_TRANSFER = 0x0009,
+        URB_FUNCTION_ISOCH_TRANSFER = 0x000A,
+        URB_FUNCTION_GET_DESCRIPTOR_FROM_DEVICE = 0x000B,
+        URB_FUNCTION_RESET_PIPE = 0x001E,
+        URB_FUNCTION_SYNC_RESET_PIPE_AND_CLEAR_STALL = URB_FUNCTION_RESET_PIPE,
+        URB_FUNCTION_GET_CONFIGURATION = 0x0026,
+        URB_FUNCTION_GET_INTERFACE = 0x0027,
+        URB_FUNCTION_SYNC_RESET_PIPE = 0x0030,
+        URB_FUNCTION_SYNC_CLEAR_STALL = 0x0031,
+        URB_FUNCTION_CONTROL_TRANSFER_EX = 0x0032,
+};
+
+using USBD_STATUS = LONG;
+using USBD_PIPE_HANDLE = void*;
+using USBD_CONFIGURATION_HANDLE = void*;
+using USBD_INTERFACE_HANDLE = void*;
+
+struct USBD_PIPE_INFORMATION
+{
+        USHORT MaximumPacketSize;
+        UCHAR EndpointAddress;
+        UCHAR Interval;
+        USBD_PIPE_TYPE PipeType;
+        USBD_PIPE_HANDLE PipeHandle;
+        ULONG MaximumTransferSize;
+        ULONG PipeFlags;
+};
+
+struct USBD_INTERFACE_INFORMATION
+{
+        USHORT Length;
+        UCHAR InterfaceNumber;
+        UCHAR AlternateSetting;
+        UCHAR Class;
+        UCHAR SubClass;
+        UCHAR Protocol;
+        UCHAR Reserved;
+        USBD_INTERFACE_HANDLE InterfaceHandle;
+        ULONG NumberOfPipes;
+        USBD_PIPE_INFORMATION Pipes[1];
+};
+
+struct _URB_HEADER
+{
+        USHORT Length;
+        USHORT Function;
+        USBD_STATUS Status;
+        void *UsbdDeviceHandle;
+        ULONG UsbdFlags;
+};
+
+struct _URB_SELECT_CONFIGURATION
+{
+        _URB_HEADER Hdr;
+        USB_CONFIGURATION_DESCRIPTOR *ConfigurationDescriptor; // null if unconfigured
+        USBD_CONFIGURATION_HANDLE ConfigurationHandle;
+        USBD_INTERFACE_INFORMATION Interface;
+};
+
+struct _URB_SELECT_INTERFACE
+{
+        _URB_HEADER Hdr;
+        USBD_CONFIGURATION_HANDLE ConfigurationHandle;
+        USBD_INTERFACE_INFORMATION Interface;
+};
+
+struct _URB_PIPE_REQUEST
+{
+        _URB_HEADER Hdr;
+        USBD_PIPE_HANDLE PipeHandle;
+        ULONG Reserved;
+};
+
+struct URB
+{
+        union {
+                _URB_HEADER UrbHeader;
+                _URB_SELECT_INTERFACE UrbSelectInterface;
+                _URB_SELECT_CONFIGURATION UrbSelectConfiguration;
+                _URB_PIPE_REQUEST UrbPipeRequest;
+        };
+};
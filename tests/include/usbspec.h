@@ -0,0 +1,11 @@
+/*
+ * Copyright (C) 2024 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+/*
+ * The definitions of <usbspec.h> are in the stub of <usb.h>.
+ */
+
+#include <usb.h>
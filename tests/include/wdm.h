@@ -0,0 +1,176 @@
+/*
+ * Copyright (C) 2024 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+/*
+ * The subset of <wdm.h> that is used by the portable code of the drivers.
+ */
+
+#include <basetsd.h>
+
+#include <cassert>
+#include <cstddef>
+#include <cstring>
+#include <iterator>
+#include <type_traits>
+
+#define NT_ASSERT(e) assert(e)
+#define NT_SUCCESS(status) (static_cast<NTSTATUS>(status) >= 0)
+#define NT_ERROR(status) (static_cast<ULONG>(status) >> 30 == 3)
+#define ARRAYSIZE(a) std::size(a)
+#define RtlEqualMemory(dst, src, len) (!std::memcmp((dst), (src), (len)))
+
+using KPRIORITY = LONG;
+
+#define LOW_REALTIME_PRIORITY 16
+#define HIGH_PRIORITY 31
+
+#define PASSIVE_LEVEL 0
+#define APC_LEVEL 1
+#define DISPATCH_LEVEL 2
+
+#define _IRQL_requires_same_
+#define _IRQL_requires_(irql)
+#define _IRQL_requires_max_(irql)
+
+#define _In_
+#define _In_opt_
+#define _Out_
+#define _Out_opt_
+#define _Inout_
+#define _Inout_opt_
+#define _In_reads_(n)
+#define _Out_writes_(n)
+
+/*
+ * Macros in <minwindef.h>, arguments can have different types.
+ */
+template<typename A, typename B>
+constexpr std::common_type_t<A, B> max(A a, B b) { return a > b ? a : b; }
+
+template<typename A, typename B>
+constexpr std::common_type_t<A, B> min(A a, B b) { return a < b ? a : b; }
+
+/*
+ * Interlocked functions have full barrier semantics.
+ */
+inline LONG InterlockedIncrement(_Inout_ volatile LONG *p)
+{
+        return __atomic_add_fetch(p, 1, __ATOMIC_SEQ_CST);
+}
+
+inline LONG InterlockedCompareExchange(_Inout_ volatile LONG *p, _In_ LONG exchange, _In_ LONG comparand)
+{
+        __atomic_compare_exchange_n(p, &comparand, exchange, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+        return comparand;
+}
+
+inline LONG InterlockedAnd(_Inout_ volatile LONG *p, _In_ LONG value)
+{
+        return __atomic_fetch_and(p, value, __ATOMIC_SEQ_CST);
+}
+
+inline LONG ReadNoFence(_In_ const volatile LONG *p)
+{
+        return __atomic_load_n(p, __ATOMIC_RELAXED);
+}
+
+inline LONG64 InterlockedIncrement64(_Inout_ volatile LONG64 *p)
+{
+        return __atomic_add_fetch(p, 1, __ATOMIC_SEQ_CST);
+}
+
+inline LONG64 InterlockedAdd64(_Inout_ volatile LONG64 *p, _In_ LONG64 value)
+{
+        return __atomic_add_fetch(p, value, __ATOMIC_SEQ_CST);
+}
+
+inline LONG64 InterlockedCompareExchange64(_Inout_ volatile LONG64 *p, _In_ LONG64 exchange, _In_ LONG64 comparand)
+{
+        __atomic_compare_exchange_n(p, &comparand, exchange, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+        return comparand;
+}
+
+inline LONG64 ReadAcquire64(_In_ const volatile LONG64 *p)
+{
+        return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+inline LONG64 ReadNoFence64(_In_ const volatile LONG64 *p)
+{
+        return __atomic_load_n(p, __ATOMIC_RELAXED);
+}
+
+using PINTERFACE_REFERENCE = void (*)(void *Context);
+using PINTERFACE_DEREFERENCE = void (*)(void *Context);
+
+struct INTERFACE
+{
+        USHORT Size;
+        USHORT Version;
+        void *Context;
+        PINTERFACE_REFERENCE InterfaceReference;
+        PINTERFACE_DEREFERENCE InterfaceDereference;
+};
+
+#define CONTAINING_RECORD(address, type, field) \
+        reinterpret_cast<type*>(reinterpret_cast<char*>(address) - offsetof(type, field))
+
+struct LIST_ENTRY
+{
+        LIST_ENTRY *Flink;
+        LIST_ENTRY *Blink;
+};
+using PLIST_ENTRY = LIST_ENTRY*;
+
+inline void InitializeListHead(_Out_ LIST_ENTRY *head)
+{
+        head->Flink = head->Blink = head;
+}
+
+inline bool IsListEmpty(_In_ const LIST_ENTRY *head)
+{
+        return head->Flink == head;
+}
+
+inline bool RemoveEntryList(_In_ LIST_ENTRY *entry)
+{
+        auto prev = entry->Blink;
+        auto next = entry->Flink;
+
+        prev->Flink = next;
+        next->Blink = prev;
+
+        return prev == next;
+}
+
+inline auto RemoveHeadList(_Inout_ LIST_ENTRY *head)
+{
+        auto entry = head->Flink;
+        RemoveEntryList(entry);
+        return entry;
+}
+
+inline void InsertTailList(_Inout_ LIST_ENTRY *head, _Inout_ LIST_ENTRY *entry)
+{
+        auto prev = head->Blink;
+
+        entry->Flink = head;
+        entry->Blink = prev;
+
+        prev->Flink = entry;
+        head->Blink = entry;
+}
+
+inline void InsertHeadList(_Inout_ LIST_ENTRY *head, _Inout_ LIST_ENTRY *entry)
+{
+        auto next = head->Flink;
+
+        entry->Flink = next;
+        entry->Blink = head;
+
+        next->Blink = entry;
+        head->Flink = entry;
+}
@@ -0,0 +1,41 @@
+/*
+ * Copyright (C) 2024 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "check.h"
+#include <ude/plugout_policy.h>
+
+namespace
+{
+
+using namespace usbip;
+
+constexpr ULONGLONG DELAY = 3'000'000; // microseconds
+
+void not_deferred()
+{
+        CHECK(!get_plugout_delay(0, 0, 100, DELAY)); // UdecxUsbDevicePlugIn was not called
+        CHECK(!get_plugout_delay(1000, 500'000, 600'000, DELAY)); // enumeration has completed
+        CHECK(!get_plugout_delay(1000, 0, 2000, 0)); // disabled
+}
+
+void deferred()
+{
+        constexpr ULONGLONG plugged = 250'000;
+
+        CHECK(get_plugout_delay(plugged, 0, plugged, DELAY) == DELAY);
+        CHECK(get_plugout_delay(plugged, 0, plugged + 1'000'000, DELAY) == DELAY - 1'000'000);
+        CHECK(get_plugout_delay(plugged, 0, plugged + DELAY - 1, DELAY) == 1);
+
+        CHECK(!get_plugout_delay(plugged, 0, plugged + DELAY, DELAY)); // expired
+        CHECK(!get_plugout_delay(plugged, 0, plugged + 10*DELAY, DELAY));
+}
+
+} // namespace
+
+
+int main()
+{
+        not_deferred();
+        deferred();
+}
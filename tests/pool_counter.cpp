@@ -0,0 +1,90 @@
+/*
+ * Copyright (C) 2024 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "check.h"
+#include <ude/pool_counter.h>
+
+#include <thread>
+#include <vector>
+
+namespace
+{
+
+using namespace usbip;
+
+void basic()
+{
+        pool_counter c{};
+
+        charge(c, 100);
+        charge(c, 50);
+        CHECK(c.allocs == 2);
+        CHECK(c.bytes == 150);
+        CHECK(c.peak == 150);
+
+        uncharge(c, 100);
+        CHECK(c.frees == 1);
+        CHECK(c.bytes == 50);
+        CHECK(c.peak == 150); // is not decreased
+
+        charge(c, 80);
+        CHECK(c.bytes == 130);
+        CHECK(c.peak == 150);
+
+        charge(c, 40);
+        CHECK(c.peak == 170);
+
+        uncharge(c, 50);
+        uncharge(c, 80);
+        uncharge(c, 40);
+
+        CHECK(c.allocs == c.frees);
+        CHECK(!c.bytes);
+        CHECK(c.peak == 170);
+}
+
+/*
+ * Each thread holds at most two allocations at a time.
+ */
+void concurrent()
+{
+        pool_counter c{};
+
+        constexpr auto threads = 8;
+        constexpr auto loops = 100'000;
+        constexpr SIZE_T small = 16, large = 1024;
+
+        std::vector<std::thread> v;
+
+        for (int i = 0; i < threads; ++i) {
+                v.emplace_back([&c] {
+                        for (int j = 0; j < loops; ++j) {
+                                charge(c, small);
+                                charge(c, large);
+                                uncharge(c, large);
+                                uncharge(c, small);
+                        }
+                });
+        }
+
+        for (auto &t: v) {
+                t.join();
+        }
+
+        CHECK(c.allocs == 2*threads*loops);
+        CHECK(c.frees == c.allocs);
+        CHECK(!c.bytes);
+
+        CHECK(c.peak >= LONG64(small + large));
+        CHECK(c.peak <= LONG64(threads*(small + large)));
+}
+
+} // namespace
+
+
+int main()
+{
+        basic();
+        concurrent();
+}
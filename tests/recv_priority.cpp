@@ -0,0 +1,155 @@
+/*
+ * Copyright (C) 2024 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "check.h"
+#include <ude/recv_priority_policy.h>
+
+#include <vector>
+
+namespace
+{
+
+using namespace usbip;
+
+void classes()
+{
+        CHECK(get_class_priority(USB_DEVICE_CLASS_AUDIO, 2, 0) == AUDIO_PRIORITY);
+        CHECK(get_class_priority(USB_DEVICE_CLASS_VIDEO, 2, 0) == VIDEO_PRIORITY);
+        CHECK(get_class_priority(USB_DEVICE_CLASS_HUMAN_INTERFACE, 1, 2) == INPUT_PRIORITY);
+        CHECK(get_class_priority(USB_DEVICE_CLASS_COMMUNICATIONS, 2, 1) == SERIAL_PRIORITY);
+        CHECK(get_class_priority(USB_DEVICE_CLASS_SMART_CARD, 0, 0) == SERIAL_PRIORITY);
+
+        CHECK(get_class_priority(USB_DEVICE_CLASS_AUDIO_VIDEO, 2, 0) == VIDEO_PRIORITY);
+        CHECK(get_class_priority(USB_DEVICE_CLASS_AUDIO_VIDEO, 3, 0) == AUDIO_PRIORITY);
+        CHECK(!get_class_priority(USB_DEVICE_CLASS_AUDIO_VIDEO, 1, 0)); // control interface
+
+        CHECK(get_class_priority(USB_DEVICE_CLASS_MISCELLANEOUS, 4, 1) == SERIAL_PRIORITY);
+        CHECK(get_class_priority(USB_DEVICE_CLASS_MISCELLANEOUS, 5, 2) == VIDEO_PRIORITY);
+        CHECK(!get_class_priority(USB_DEVICE_CLASS_MISCELLANEOUS, 5, 0));
+        CHECK(!get_class_priority(USB_DEVICE_CLASS_MISCELLANEOUS, 2, 1)); // IAD
+
+        CHECK(!get_class_priority(USB_DEVICE_CLASS_STORAGE, 6, 0x50));
+        CHECK(!get_class_priority(0xFF, 0, 0)); // vendor specific
+
+        static_assert(AUDIO_PRIORITY > VIDEO_PRIORITY);
+        static_assert(VIDEO_PRIORITY > INPUT_PRIORITY);
+        static_assert(INPUT_PRIORITY > SERIAL_PRIORITY);
+        static_assert(SERIAL_PRIORITY > DEFAULT_RECV_PRIORITY);
+        static_assert(AUDIO_PRIORITY < HIGH_PRIORITY);
+}
+
+/*
+ * As filter_request.cpp does on SELECT_CONFIGURATION and SELECT_INTERFACE.
+ */
+void webcam()
+{
+        UCHAR intf[32]{};
+        CHECK(get_target_priority(true, intf) == DEFAULT_RECV_PRIORITY); // not configured
+
+        intf[1] = 0; // video streaming, alternate setting 0 has no bandwidth
+        intf[3] = 0; // audio streaming
+        CHECK(get_target_priority(true, intf) == DEFAULT_RECV_PRIORITY);
+
+        intf[1] = VIDEO_PRIORITY;
+        CHECK(get_target_priority(true, intf) == VIDEO_PRIORITY);
+        CHECK(get_target_priority(false, intf) == DEFAULT_RECV_PRIORITY); // is opt-in
+
+        intf[3] = AUDIO_PRIORITY; // the microphone is started
+        CHECK(get_target_priority(true, intf) == AUDIO_PRIORITY);
+
+        intf[3] = 0;
+        CHECK(get_target_priority(true, intf) == VIDEO_PRIORITY);
+}
+
+struct result
+{
+        int worst{}; // us, the longest time between arrival of a response and completion of all pending ones
+        int overruns{}; // the previous response was not completed when the next one arrived
+};
+
+/*
+ * One processor runs the ready thread of the highest priority and preempts a lower one at once,
+ * threads of the same priority are switched after the quantum.
+ * Receive threads of mass storage devices are always ready, the receive thread of an audio
+ * device gets a response every period and needs some processor time to complete it.
+ */
+auto simulate(_In_ KPRIORITY audio, _In_ KPRIORITY storage, _In_ int storage_threads)
+{
+        enum { PERIOD = 1000, COST = 50, QUANTUM = 10'000, DURATION = 200'000 }; // us
+
+        int n = storage_threads + 1; // [0] is audio
+        std::vector<KPRIORITY> prio(n, storage);
+        prio[0] = audio;
+
+        int pending = 0; // processor time the audio thread needs
+        int arrived = 0;
+
+        int current = n - 1;
+        int slice = 0;
+
+        result r;
+
+        for (int t = 0; t < DURATION; ++t) {
+                if (!(t % PERIOD)) {
+                        if (pending) {
+                                ++r.overruns;
+                        } else {
+                                arrived = t;
+                        }
+                        pending += COST;
+                }
+
+                auto ready = [&pending] (int i) { return i || pending; };
+
+                int next = -1;
+                for (int k = 1; k <= n; ++k) { // round-robin among threads of the same priority
+                        auto i = (current + k) % n;
+                        if (ready(i) && (next < 0 || prio[i] > prio[next])) {
+                                next = i;
+                        }
+                }
+
+                if (!(ready(current) && prio[current] >= prio[next] && slice < QUANTUM)) {
+                        current = next;
+                        slice = 0;
+                }
+
+                ++slice;
+
+                if (!current && !--pending) {
+                        r.worst = max(r.worst, t + 1 - arrived);
+                }
+        }
+
+        return r;
+}
+
+void jitter()
+{
+        UCHAR audio[32]{};
+        audio[1] = static_cast<UCHAR>(get_class_priority(USB_DEVICE_CLASS_AUDIO, 2, 0));
+
+        UCHAR storage[32]{};
+        storage[0] = static_cast<UCHAR>(get_class_priority(USB_DEVICE_CLASS_STORAGE, 6, 0x50));
+
+        enum { STORAGE_THREADS = 4 };
+
+        auto r = simulate(get_target_priority(false, audio), get_target_priority(false, storage), STORAGE_THREADS);
+        CHECK(r.worst > 1000); // waits for the quantums of the other threads
+        CHECK(r.overruns);
+
+        r = simulate(get_target_priority(true, audio), get_target_priority(true, storage), STORAGE_THREADS);
+        CHECK(r.worst == 50); // is never delayed
+        CHECK(!r.overruns);
+}
+
+} // namespace
+
+
+int main()
+{
+        classes();
+        webcam();
+        jitter();
+}
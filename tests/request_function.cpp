@@ -0,0 +1,54 @@
+/*
+ * Copyright (C) 2024 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "check.h"
+#include <ude_filter/request_function.h>
+
+namespace
+{
+
+using namespace usbip;
+
+void requests()
+{
+        CHECK(filter::is_request_function(URB_FUNCTION_SELECT_CONFIGURATION));
+        CHECK(filter::is_request_function(URB_FUNCTION_SELECT_INTERFACE));
+        CHECK(filter::is_request_function(URB_FUNCTION_SYNC_RESET_PIPE_AND_CLEAR_STALL));
+        CHECK(filter::is_request_function(URB_FUNCTION_SYNC_RESET_PIPE));
+        CHECK(filter::is_request_function(URB_FUNCTION_SYNC_CLEAR_STALL));
+}
+
+/*
+ * Must be forwarded without a completion routine.
+ */
+void transfers()
+{
+        CHECK(!filter::is_request_function(URB_FUNCTION_CONTROL_TRANSFER));
+        CHECK(!filter::is_request_function(URB_FUNCTION_CONTROL_TRANSFER_EX));
+        CHECK(!filter::is_request_function(URB_FUNCTION_BULK_OR_INTERRUPT_TRANSFER));
+        CHECK(!filter::is_request_function(URB_FUNCTION_ISOCH_TRANSFER));
+        CHECK(!filter::is_request_function(URB_FUNCTION_GET_DESCRIPTOR_FROM_DEVICE));
+        CHECK(!filter::is_request_function(URB_FUNCTION_ABORT_PIPE));
+}
+
+void count()
+{
+        int cnt{};
+
+        for (int func = 0; func <= 0xFFFF; ++func) {
+                cnt += filter::is_request_function(func);
+        }
+
+        CHECK(cnt == 5);
+}
+
+} // namespace
+
+
+int main()
+{
+        requests();
+        transfers();
+        count();
+}
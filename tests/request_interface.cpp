@@ -0,0 +1,200 @@
+/*
+ * Copyright (C) 2024 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "check.h"
+#include <ude_filter/request_function.h>
+
+namespace
+{
+
+using namespace usbip::filter;
+
+/*
+ * What usbip2_ude has received, Context of the interface points to it.
+ */
+struct vhci
+{
+        int references;
+
+        int port;
+        int function; // URB_FUNCTION_XXX
+        const void *urb;
+};
+
+constexpr NTSTATUS STATUS_SUCCESS = 0;
+constexpr NTSTATUS STATUS_NO_SUCH_DEVICE = static_cast<NTSTATUS>(0xC000000E);
+
+enum { PLUGGED_PORT = 3 };
+
+auto& save(_In_ void *Context, _In_ int port, _In_ int function, _In_ const void *urb)
+{
+        auto &v = *static_cast<vhci*>(Context);
+
+        v.port = port;
+        v.function = function;
+        v.urb = urb;
+
+        return v;
+}
+
+NTSTATUS select_configuration(_In_ void *Context, _In_ int port, _In_ const _URB_SELECT_CONFIGURATION &r)
+{
+        save(Context, port, URB_FUNCTION_SELECT_CONFIGURATION, &r);
+        return port == PLUGGED_PORT ? STATUS_SUCCESS : STATUS_NO_SUCH_DEVICE;
+}
+
+NTSTATUS select_interface(_In_ void *Context, _In_ int port, _In_ const _URB_SELECT_INTERFACE &r)
+{
+        save(Context, port, URB_FUNCTION_SELECT_INTERFACE, &r);
+        return port == PLUGGED_PORT ? STATUS_SUCCESS : STATUS_NO_SUCH_DEVICE;
+}
+
+NTSTATUS reset_pipe(_In_ void *Context, _In_ int port, _In_ const _URB_PIPE_REQUEST &r)
+{
+        save(Context, port, r.Hdr.Function, &r);
+        return port == PLUGGED_PORT ? STATUS_SUCCESS : STATUS_NO_SUCH_DEVICE;
+}
+
+void reference(_In_ void *Context)
+{
+        ++static_cast<vhci*>(Context)->references;
+}
+
+void dereference(_In_ void *Context)
+{
+        --static_cast<vhci*>(Context)->references;
+}
+
+/*
+ * As add_request_interface does.
+ */
+auto make_interface(_In_ vhci &v)
+{
+        request_interface r{};
+
+        r.Size = static_cast<USHORT>(sizeof(r));
+        r.Version = REQUEST_INTERFACE_VERSION;
+        r.Context = &v;
+        r.InterfaceReference = reference;
+        r.InterfaceDereference = dereference;
+
+        r.SelectConfiguration = select_configuration;
+        r.SelectInterface = select_interface;
+        r.ResetPipe = reset_pipe;
+
+        return r;
+}
+
+auto make_urb(_In_ int function)
+{
+        URB urb{};
+        urb.UrbHeader.Length = sizeof(urb);
+        urb.UrbHeader.Function = static_cast<USHORT>(function);
+        return urb;
+}
+
+/*
+ * Members are appended, the filter and usbip2_ude can be of different versions.
+ */
+void layout()
+{
+        request_interface r{};
+
+        auto offset = [&r] (auto &member)
+        {
+                return reinterpret_cast<const char*>(&member) - reinterpret_cast<const char*>(&r);
+        };
+
+        CHECK(offset(r.SelectConfiguration) == sizeof(INTERFACE));
+        CHECK(offset(r.SelectInterface) == sizeof(INTERFACE) + sizeof(void*));
+        CHECK(offset(r.ResetPipe) == sizeof(INTERFACE) + 2*sizeof(void*));
+
+        static_assert(static_cast<USHORT>(sizeof(r)) == sizeof(r)); // INTERFACE::Size
+}
+
+void compatible()
+{
+        vhci v{};
+        auto r = make_interface(v);
+        CHECK(is_compatible(r));
+
+        auto newer = r;
+        ++newer.Version;
+        newer.Size += sizeof(void*); // a member was added
+        CHECK(is_compatible(newer));
+
+        auto older = r;
+        --older.Version;
+        CHECK(!is_compatible(older));
+
+        auto truncated = r;
+        truncated.Size -= sizeof(void*); // ResetPipe is absent
+        CHECK(!is_compatible(truncated));
+}
+
+void dispatch()
+{
+        vhci v{};
+        auto r = make_interface(v);
+
+        int functions[] {
+                URB_FUNCTION_SELECT_CONFIGURATION,
+                URB_FUNCTION_SELECT_INTERFACE,
+                URB_FUNCTION_SYNC_RESET_PIPE_AND_CLEAR_STALL,
+                URB_FUNCTION_SYNC_RESET_PIPE,
+                URB_FUNCTION_SYNC_CLEAR_STALL,
+        };
+
+        for (auto func: functions) {
+                CHECK(is_request_function(func));
+
+                auto urb = make_urb(func);
+                v = {};
+
+                CHECK(call_request_interface(r, PLUGGED_PORT, urb) == STATUS_SUCCESS);
+                CHECK(v.function == func);
+                CHECK(v.port == PLUGGED_PORT);
+                CHECK(v.urb == &urb); // is passed by reference, the URB is not freed yet
+        }
+
+        auto urb = make_urb(URB_FUNCTION_SELECT_INTERFACE);
+        urb.UrbSelectInterface.Interface.InterfaceNumber = 1;
+        urb.UrbSelectInterface.Interface.AlternateSetting = 2;
+
+        CHECK(call_request_interface(r, PLUGGED_PORT + 1, urb) == STATUS_NO_SUCH_DEVICE);
+        CHECK(v.port == PLUGGED_PORT + 1);
+
+        auto &i = static_cast<const _URB_SELECT_INTERFACE*>(v.urb)->Interface;
+        CHECK(i.InterfaceNumber == 1 && i.AlternateSetting == 2);
+}
+
+/*
+ * The framework calls InterfaceReference for the copy it returns, put_request_interface releases it.
+ */
+void references()
+{
+        vhci v{};
+        auto r = make_interface(v);
+
+        r.InterfaceReference(r.Context);
+        CHECK(v.references == 1);
+
+        auto copy = r;
+        CHECK(call_request_interface(copy, PLUGGED_PORT, make_urb(URB_FUNCTION_SYNC_RESET_PIPE)) == STATUS_SUCCESS);
+        CHECK(v.references == 1); // calls do not reference the context
+
+        copy.InterfaceDereference(copy.Context);
+        CHECK(!v.references);
+}
+
+} // namespace
+
+
+int main()
+{
+        layout();
+        compatible();
+        dispatch();
+        references();
+}
@@ -0,0 +1,134 @@
+/*
+ * Copyright (C) 2024 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "check.h"
+#include <ude/seq_ring.h>
+
+namespace
+{
+
+using namespace usbip;
+
+struct event
+{
+        UINT64 seqnum;
+        int value;
+};
+
+using ring = seq_ring<event, 8>;
+
+void publish(ring &r, int value)
+{
+        next(r).value = value;
+        push(r);
+}
+
+void read_all()
+{
+        ring r;
+        init(r);
+
+        UINT64 cursor = 1;
+        CHECK(empty(r, cursor));
+
+        for (int i = 1; i <= 5; ++i) {
+                publish(r, 10*i);
+        }
+        CHECK(!empty(r, cursor));
+
+        event v[3];
+        UINT64 lost;
+
+        CHECK(pop(r, cursor, v, 3, lost) == 3); // partial read
+        CHECK(!lost);
+        CHECK(v[0].seqnum == 1 && v[0].value == 10);
+        CHECK(v[2].seqnum == 3 && v[2].value == 30);
+        CHECK(cursor == 4);
+
+        CHECK(pop(r, cursor, v, 3, lost) == 2);
+        CHECK(v[1].seqnum == 5 && v[1].value == 50);
+        CHECK(empty(r, cursor));
+
+        CHECK(!pop(r, cursor, v, 3, lost));
+        CHECK(!lost);
+}
+
+/*
+ * A consumer that lags behind skips overwritten events, the gap in seqnum tells how many.
+ */
+void overwrite()
+{
+        ring r;
+        init(r);
+
+        UINT64 slow = 1;
+        UINT64 fast = 1;
+
+        event v[ring::CAPACITY];
+        UINT64 lost;
+
+        for (int i = 1; i <= 20; ++i) {
+                publish(r, i);
+
+                if (!(i % 4)) {
+                        CHECK(pop(r, fast, v, ARRAYSIZE(v), lost) == 4);
+                        CHECK(!lost);
+                        CHECK(v[3].value == i);
+                }
+        }
+
+        CHECK(oldest(r) == 20 - ring::CAPACITY + 1);
+
+        CHECK(pop(r, slow, v, ARRAYSIZE(v), lost) == ring::CAPACITY);
+        CHECK(lost == 20 - ring::CAPACITY);
+        CHECK(v[0].seqnum == lost + 1);
+        CHECK(v[ring::CAPACITY - 1].seqnum == 20);
+        CHECK(slow == fast);
+
+        for (ULONG i = 1; i < ring::CAPACITY; ++i) {
+                CHECK(v[i].seqnum == v[i - 1].seqnum + 1);
+                CHECK(v[i].value == int(v[i].seqnum));
+        }
+}
+
+/*
+ * The cursor keeps up while the ring wraps around many times.
+ */
+void wrap()
+{
+        ring r;
+        init(r);
+
+        UINT64 cursor = 1;
+        event v[3];
+        UINT64 lost;
+
+        for (int i = 1; i <= 1000; ++i) {
+                publish(r, i);
+
+                if (i % 3) {
+                        continue;
+                }
+
+                CHECK(pop(r, cursor, v, 3, lost) == 3);
+                CHECK(!lost);
+
+                for (auto &e: v) {
+                        CHECK(e.value == int(e.seqnum));
+                }
+                CHECK(v[2].value == i);
+        }
+
+        CHECK(r.seqnum - cursor == 1); // the last one is not read
+}
+
+} // namespace
+
+
+int main()
+{
+        read_all();
+        overwrite();
+        wrap();
+}
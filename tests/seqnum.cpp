@@ -0,0 +1,106 @@
+/*
+ * Copyright (C) 2024 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "check.h"
+#include <ude/seqnum.h>
+
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+namespace
+{
+
+using namespace usbip;
+
+void direction()
+{
+        seqnum_t counter{};
+
+        auto out = next_seqnum(counter, false);
+        CHECK(extract_num(out) == 1);
+        CHECK(extract_dir(out) == USBIP_DIR_OUT);
+
+        auto in = next_seqnum(counter, true);
+        CHECK(extract_num(in) == 2);
+        CHECK(extract_dir(in) == USBIP_DIR_IN);
+
+        CHECK(is_valid_seqnum(out));
+        CHECK(is_valid_seqnum(in));
+        CHECK(!is_valid_seqnum(USBIP_DIR_IN));
+}
+
+/*
+ * The number that is shifted out to zero is skipped.
+ */
+void wrap()
+{
+        for (seqnum_t start: {0x7FFF'FFFEU, 0xFFFF'FFFEU}) {
+                seqnum_t counter = start;
+                auto n = next_seqnum(counter, false);
+
+                CHECK(n == (start + 1) << 1);
+                CHECK(is_valid_seqnum(n));
+        }
+
+        seqnum_t counter = 0xFFFF'FFFFU; // the next number is zero
+        CHECK(next_seqnum(counter, true) == (1U << 1 | USBIP_DIR_IN));
+
+        counter = 0x7FFF'FFFFU; // the next number 0x8000'0000 is shifted out to zero
+        CHECK(next_seqnum(counter, false) == (0x8000'0001U << 1));
+}
+
+/*
+ * Devices of a mux session share the counter, the server never gets the same seqnum twice.
+ */
+void shared()
+{
+        seqnum_t counter{};
+
+        constexpr auto devices = 4;
+        constexpr auto loops = 50'000;
+
+        std::vector<seqnum_t> v[devices];
+        std::vector<std::thread> threads;
+
+        for (int i = 0; i < devices; ++i) {
+                threads.emplace_back([&counter, &r = v[i], i]
+                {
+                        r.reserve(loops);
+                        for (int j = 0; j < loops; ++j) {
+                                r.push_back(next_seqnum(counter, (i + j) & 1));
+                        }
+                });
+        }
+
+        for (auto &t: threads) {
+                t.join();
+        }
+
+        std::vector<seqnum_t> nums;
+
+        for (auto &r: v) {
+                CHECK(std::is_sorted(r.begin(), r.end(), [] (auto a, auto b) { return extract_num(a) < extract_num(b); }));
+                for (auto n: r) {
+                        nums.push_back(extract_num(n));
+                }
+        }
+
+        std::sort(nums.begin(), nums.end());
+
+        CHECK(nums.size() == devices*loops);
+        CHECK(std::adjacent_find(nums.begin(), nums.end()) == nums.end());
+        CHECK(nums.front() == 1);
+        CHECK(nums.back() == devices*loops);
+}
+
+} // namespace
+
+
+int main()
+{
+        direction();
+        wrap();
+        shared();
+}
@@ -0,0 +1,163 @@
+/*
+ * Copyright (C) 2024 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "check.h"
+#include <ude/timer_wheel.h>
+
+#include <vector>
+
+namespace
+{
+
+using namespace usbip;
+
+struct timer : wheel_timer
+{
+        UINT64 deadline; // requested
+        bool fired;
+};
+
+/*
+ * @return number of expired timers, every one is checked against its deadline
+ */
+auto advance(timer_wheel &w, UINT64 now)
+{
+        LIST_ENTRY expired;
+        InitializeListHead(&expired);
+
+        advance(w, now, expired);
+        CHECK(w.now == now);
+
+        int cnt = 0;
+
+        for ( ; !IsListEmpty(&expired); ++cnt) {
+                auto entry = RemoveHeadList(&expired);
+                InitializeListHead(entry);
+
+                auto &t = static_cast<timer&>(*CONTAINING_RECORD(entry, wheel_timer, entry));
+                CHECK(!t.fired);
+                CHECK(t.expires <= now);
+                CHECK(t.expires == t.deadline);
+                t.fired = true;
+        }
+
+        return cnt;
+}
+
+void basic()
+{
+        timer_wheel w;
+        init(w, 100);
+
+        timer t{};
+        init(t);
+        CHECK(!is_scheduled(t));
+
+        schedule(w, t, 50); // in the past
+        CHECK(is_scheduled(t));
+        CHECK(t.expires == 101);
+        t.deadline = t.expires;
+
+        CHECK(!advance(w, 100));
+        CHECK(advance(w, 101) == 1);
+        CHECK(t.fired);
+        CHECK(!w.count);
+
+        t.fired = false;
+        schedule(w, t, t.deadline = 200);
+        cancel(w, t);
+        cancel(w, t); // does nothing
+        CHECK(!is_scheduled(t));
+        CHECK(!advance(w, 1000));
+}
+
+/*
+ * Level 1, timers beyond its range and cascading.
+ */
+void far_timers()
+{
+        UINT64 now = 5;
+        timer_wheel w;
+        init(w, now);
+
+        const UINT64 delays[] = {
+                1, timer_wheel::L0_SIZE - 1, timer_wheel::L0_SIZE, timer_wheel::L0_SIZE + 1,
+                timer_wheel::L0_SIZE*timer_wheel::L1_SIZE - 1, timer_wheel::L0_SIZE*timer_wheel::L1_SIZE,
+                10*timer_wheel::L0_SIZE*timer_wheel::L1_SIZE + 3 };
+
+        std::vector<timer> v(std::size(delays));
+
+        for (size_t i = 0; i < v.size(); ++i) {
+                auto &t = v[i];
+                init(t);
+                schedule(w, t, t.deadline = now + delays[i]);
+        }
+
+        for (auto &t: v) {
+                CHECK(!advance(w, t.deadline - 1));
+                CHECK(advance(w, t.deadline) == 1);
+                CHECK(t.fired);
+        }
+
+        CHECK(!w.count);
+}
+
+/*
+ * Random schedule, cancel and advance are compared with expected deadlines.
+ */
+void random_operations()
+{
+        UINT32 seed = 1;
+        auto rnd = [&seed] (UINT32 n) { seed = seed*1103515245 + 12345; return (seed >> 8) % n; };
+
+        UINT64 now = 1'000'000;
+        timer_wheel w;
+        init(w, now);
+
+        std::vector<timer> v(500);
+        for (auto &t: v) {
+                init(t);
+        }
+
+        for (int i = 0; i < 20'000; ++i) {
+                auto &t = v[rnd(UINT32(v.size()))];
+
+                if (is_scheduled(t)) {
+                        if (rnd(4)) {
+                                cancel(w, t);
+                                t.deadline = 0;
+                        }
+                } else {
+                        t.fired = false;
+                        auto delay = rnd(8) ? rnd(2*timer_wheel::L0_SIZE) : rnd(4*timer_wheel::L0_SIZE*timer_wheel::L1_SIZE);
+                        schedule(w, t, t.deadline = now + 1 + delay);
+                }
+
+                ULONG scheduled = 0;
+                for (auto &t: v) {
+                        scheduled += is_scheduled(t);
+                }
+                CHECK(w.count == scheduled);
+
+                now += rnd(3) ? rnd(4) : rnd(3*timer_wheel::L0_SIZE);
+                advance(w, now);
+
+                for (auto &t: v) { // every expired timer has fired, others are still scheduled
+                        if (t.deadline) {
+                                CHECK(is_scheduled(t) == (t.deadline > now));
+                                CHECK(t.fired == (t.deadline <= now));
+                        }
+                }
+        }
+}
+
+} // namespace
+
+
+int main()
+{
+        basic();
+        far_timers();
+        random_operations();
+}
@@ -0,0 +1,26 @@
+/*
+ * Copyright (C) 2024 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include <windows.h>
+
+namespace usbip
+{
+
+/*
+ * Milestones of attaching, microseconds since the driver has received the request, zero if not reached.
+ */
+struct attach_timings
+{
+        UINT32 resolved{}; // host name is resolved or is taken from the cache
+        UINT32 connected{}; // TCP/IP connection is established
+        UINT32 imported{}; // OP_REP_IMPORT is received
+        UINT32 created{}; // emulated USB device is created
+        UINT32 plugged{}; // emulated USB device is plugged in
+        UINT32 first_urb{}; // the first URB is submitted, PnP enumeration is started
+        UINT32 configured{}; // the first configuration is selected
+};
+
+} // namespace usbip
@@ -51,6 +51,8 @@ USBIP_API const char *get_tcp_port() noexcept;
 
 /**
  * This call is blocking and cannot be cancelled.
+ * If the hostname has several addresses, connection attempts are staggered and run concurrently,
+ * the first established connection is returned (RFC 8305, Happy Eyeballs).
  * @param hostname name or IP address of a host to connect to
  * @param service TCP/IP port number of symbolic name
  * @return call GetLastError() if returned handle is invalid
@@ -0,0 +1,49 @@
+/*
+ * Copyright (C) 2024 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <vector>
+
+namespace usbip
+{
+
+/*
+ * Applies the result of GET_IMPORTED_DEVICES_DELTA to the result of the previous call.
+ *
+ * @param devices sorted by port, remain sorted
+ * @param entries vhci::ioctl::get_imported_devices_delta::entry or any type with removed and device.port
+ * @param reset the previous result must be discarded
+ * @param make converts entry.device to T
+ */
+template<typename T, typename E, typename F>
+void merge_delta(std::vector<T> &devices, const E *entries, size_t count, bool reset, F &&make)
+{
+        if (reset) {
+                devices.clear();
+        }
+
+        auto by_port = [] (auto &d, auto port) { return d.port < port; };
+
+        for (size_t i = 0; i < count; ++i) {
+                auto &e = entries[i];
+                auto port = e.device.port;
+
+                auto it = std::lower_bound(devices.begin(), devices.end(), port, by_port);
+                bool found = it != devices.end() && it->port == port;
+
+                if (e.removed) {
+                        if (found) {
+                                devices.erase(it);
+                        }
+                } else if (found) {
+                        *it = make(e.device);
+                } else {
+                        devices.insert(it, make(e.device));
+                }
+        }
+}
+
+} // namespace usbip
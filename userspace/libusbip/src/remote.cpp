@@ -14,6 +14,8 @@
 #include <usbip\proto_op.h>
 
 #include <chrono>
+#include <vector>
+#include <algorithm>
 
 #include <ws2tcpip.h>
 #include <mstcpip.h>
@@ -24,6 +26,8 @@ namespace
 
 using namespace usbip;
 
+enum { CONNECTION_ATTEMPT_DELAY = 250 }; // milliseconds, recommended by RFC 8305
+
 /*
  * @see inet_ntop 
  */
@@ -65,11 +69,6 @@ inline auto set_keepalive(_Inout_ set_last_error &last, _In_ SOCKET s)
 	return do_setsockopt(last, s, SOL_SOCKET, SO_KEEPALIVE, true);
 }
 
-inline auto set_ipv6only(_Inout_ set_last_error &last, _In_ SOCKET s, _In_ bool ipv6only)
-{
-	return do_setsockopt(last, s, IPPROTO_IPV6, IPV6_V6ONLY, ipv6only);
-}
-
 auto set_nonblock(_Inout_ set_last_error &last, _In_ SOCKET s, _In_ bool nonblock)
 {
 	u_long mode = nonblock;
@@ -254,45 +253,6 @@ auto prepare_event(_Inout_ set_last_error &last, _In_ SOCKET s, _In_ WSAEVENT ev
 	return true;
 }
 
-auto try_connect(_In_ SOCKET s, _In_ WSAEVENT evt, _In_ const sockaddr &addr, _In_ DWORD len)
-{
-	libusbip::output(L"connecting to {}", address_to_string(addr, len));
-
-	if (auto err = connect(s, &addr, len) ? WSAGetLastError() : 0; !err) {
-		return 0;
-	} else if (err != WSAEWOULDBLOCK) {
-		libusbip::output("connect error {}", err);
-		return err;
-	}
-
-	int err;
-
-	switch (auto ret = WSAWaitForMultipleEvents(1, &evt, false, WSA_INFINITE, true)) {
-	case WSA_WAIT_EVENT_0:
-		if (WSANETWORKEVENTS events; WSAEnumNetworkEvents(s, evt, &events)) { // resets event if success
-			err = WSAGetLastError();
-			libusbip::output("WSAEnumNetworkEvents error {}", err);
-		} else {
-			assert(events.lNetworkEvents & FD_CONNECT);
-			err = events.iErrorCode[FD_CONNECT_BIT];
-		}
-		break;
-	case WSA_WAIT_IO_COMPLETION: // see QueueUserAPC
-		libusbip::output("connect cancelled");
-		err = ERROR_CANCELLED;
-		break;
-	default:
-		assert(ret == WSA_WAIT_FAILED);
-
-		err = WSAGetLastError();
-		assert(err != ERROR_CANCELLED);
-
-		libusbip::output("WSAWaitForMultipleEvents -> {}, error {}", ret, err);
-	}
-
-	return err;
-}
-
 INT wait_for_resolve(_Inout_ OVERLAPPED &ovlp, _In_opt_ HANDLE cancel, _In_ bool alertable)
 {
 	INT err;
@@ -323,7 +283,7 @@ INT wait_for_resolve(_Inout_ OVERLAPPED &ovlp, _In_opt_ HANDLE cancel, _In_ bool
 /*
  * Numeric IP addresses like "XXX.XXX.XXX.XXX" are resolved instantly. 
  */
-auto resolve(_Inout_ set_last_error &last, _In_ const char *hostname, _In_ const char *service)
+auto resolve(_Inout_ set_last_error &last, _In_ const char *hostname, _In_ const char *service, _In_ bool alertable)
 {
 	std::unique_ptr<ADDRINFOEX, decltype(FreeAddrInfoEx)&> ptr(nullptr, FreeAddrInfoEx);
 
@@ -350,7 +310,7 @@ auto resolve(_Inout_ set_last_error &last, _In_ const char *hostname, _In_ const
 
 	switch (last.error) {
 	case WSA_IO_PENDING:
-		if (last.error = wait_for_resolve(ovlp, cancel, true); last.error) {
+		if (last.error = wait_for_resolve(ovlp, cancel, alertable); last.error) {
 			break;
 		}
 		[[fallthrough]];
@@ -364,105 +324,221 @@ auto resolve(_Inout_ set_last_error &last, _In_ const char *hostname, _In_ const
 	return ptr;
 }
 
-inline auto connect_by_name(_In_ SOCKET s, _In_ LPCWSTR hostname, _In_ _In_ LPCWSTR service) noexcept
+/*
+ * RFC 8305, 4. Sorting Addresses.
+ * Families are alternated starting with the family of the first address.
+ */
+auto interleave(_In_ const ADDRINFOEX *head)
 {
-	return WSAConnectByName(s, const_cast<wchar_t*>(hostname), const_cast<wchar_t*>(service), 
-				nullptr, nullptr, // LocalAddress
-				nullptr, nullptr, // RemoteAddress
-				nullptr, nullptr);
-}
+	std::vector<const ADDRINFOEX*> first;
+	std::vector<const ADDRINFOEX*> second;
 
-} // namespace
+	for (auto ai = head; ai; ai = ai->ai_next) {
+		(ai->ai_family == head->ai_family ? first : second).push_back(ai);
+	}
 
+	std::vector<const ADDRINFOEX*> v;
+	v.reserve(first.size() + second.size());
 
-const char* usbip::get_tcp_port() noexcept
-{
-	return tcp_port;
+	for (size_t i = 0; i < std::max(first.size(), second.size()); ++i) {
+		if (i < first.size()) {
+			v.push_back(first[i]);
+		}
+		if (i < second.size()) {
+			v.push_back(second[i]);
+		}
+	}
+
+	return v;
 }
 
+struct attempt
+{
+	Socket sock;
+	WSAEvent evt;
+};
+
 /*
- * QueueUserAPC() does not terminate connect/WSAConnectByName.
+ * @return zero if connected, WSAEWOULDBLOCK if connection is in progress, error code otherwise
  */
-auto usbip::connect(_In_ const char *hostname, _In_ const char *service) -> Socket
+int start_attempt(_Inout_ set_last_error &last, _Inout_ attempt &a, _In_ const ADDRINFOEX &ai)
 {
-	auto host = utf8_to_wchar(hostname);
-	auto svc = utf8_to_wchar(service);
+	libusbip::output(L"connecting to {}", address_to_string(*ai.ai_addr, static_cast<DWORD>(ai.ai_addrlen)));
 
-	set_last_error last(NO_ERROR); // restore after sock.close()
-	Socket sock;
-
-	for (auto family: {AF_INET, AF_INET6}) {
+	a.sock.reset(socket(ai.ai_family, ai.ai_socktype, ai.ai_protocol));
+	if (!a.sock) {
+		last.error = WSAGetLastError();
+		libusbip::output("socket(family={}) error {}", ai.ai_family, last.error);
+		return last.error;
+	}
 
-		sock.reset(socket(family, SOCK_STREAM, 0));
+	a.evt.reset(WSACreateEvent());
+	if (!a.evt) {
+		last.error = WSAGetLastError();
+		libusbip::output("WSACreateEvent error {}", last.error);
+		return last.error;
+	}
 
-		if (!sock) {
-			last.error = WSAGetLastError();
-			libusbip::output("socket(family={}) error {}", family, last.error);
-		} else if (family == AF_INET6 && !set_ipv6only(last, sock.get(), false)) {
-			//
-		} else if (!set_options(last, sock.get())) {
-			//
-		} else if (!connect_by_name(sock.get(), host.c_str(), svc.c_str())) {
-			last.error = WSAGetLastError();
-			libusbip::output("WSAConnectByName(family={}) error {}", family, last.error);
-			break; // it makes no sense to try next family
-		} else if (setsockopt(sock.get(), SOL_SOCKET, SO_UPDATE_CONNECT_CONTEXT, nullptr, 0)) {
-			last.error = WSAGetLastError();
-			libusbip::output("setsockopt(SO_UPDATE_CONNECT_CONTEXT) error {}", last.error);
-			break;
-		} else {
-			return sock;
-		}
+	if (auto ok = set_options(last, a.sock.get()) && prepare_event(last, a.sock.get(), a.evt.get()); !ok) {
+		return last.error;
 	}
 
-	sock.close();
-	return sock;
+	if (!connect(a.sock.get(), ai.ai_addr, static_cast<int>(ai.ai_addrlen))) {
+		return 0;
+	} else if (auto err = WSAGetLastError(); err == WSAEWOULDBLOCK) {
+		return err;
+	} else {
+		last.error = err;
+		libusbip::output("connect error {}", err);
+		return err;
+	}
 }
 
-auto usbip::connect(_In_ const char *hostname, _In_ const char *service, _In_ unsigned long options) -> Socket
+/*
+ * @return error code of the completed connection attempt
+ */
+int get_connect_result(_In_ const attempt &a)
 {
-	set_last_error last(ERROR_INVALID_PARAMETER); // restore after sock.close()
-	Socket sock;
+	int err;
 
-	if (options != CANCEL_BY_APC) {
-		return sock;
+	if (WSANETWORKEVENTS events; WSAEnumNetworkEvents(a.sock.get(), a.evt.get(), &events)) { // resets event if success
+		err = WSAGetLastError();
+		libusbip::output("WSAEnumNetworkEvents error {}", err);
+	} else {
+		assert(events.lNetworkEvents & FD_CONNECT);
+		if (err = events.iErrorCode[FD_CONNECT_BIT]; err) {
+			libusbip::output("connect error {}", err);
+		}
 	}
 
-	auto ai = resolve(last, hostname, service);
-	if (!ai) {
-		return sock;
-	}
+	return err;
+}
 
-	WSAEvent evt(WSACreateEvent());
-	if (!evt) {
+/*
+ * Cancel the association and selection of network events, return socket to blocking mode.
+ */
+auto set_blocking(_Inout_ set_last_error &last, _In_ SOCKET s)
+{
+	if (WSAEventSelect(s, WSA_INVALID_EVENT, 0)) {
 		last.error = WSAGetLastError();
-		libusbip::output("WSACreateEvent error {}", last.error);
-		return sock;
+		libusbip::output("WSAEventSelect(0) error {}", last.error);
+		return false;
 	}
 
-	for (auto r = ai.get(); r; r = r->ai_next) {
+	return set_nonblock(last, s, false);
+}
 
-		sock.reset(socket(r->ai_family, r->ai_socktype, r->ai_protocol));
+/*
+ * RFC 8305, Happy Eyeballs Version 2: Better Connectivity Using Concurrency.
+ * 
+ * Next connection attempt is started after CONNECTION_ATTEMPT_DELAY or immediately if the previous one has failed,
+ * pending attempts are not cancelled. The first established connection wins, others are closed.
+ * So a dead address of one family does not cost a full TCP timeout before the other family is tried.
+ * 
+ * @param alertable the call is canceled by APC, see QueueUserAPC
+ */
+auto connect_any(_Inout_ set_last_error &last, _In_ const ADDRINFOEX *head, _In_ bool alertable)
+{
+	auto addrs = interleave(head);
+	auto next = addrs.begin();
 
-		if (!sock) {
-			last.error = WSAGetLastError();
-			libusbip::output("socket(family={}) error {}", r->ai_family, last.error);
-		} else if (auto ok = set_options(last, sock.get()) && prepare_event(last, sock.get(), evt.get()); !ok) {
-			//
-		} else if (auto err = try_connect(sock.get(), evt.get(), *r->ai_addr, static_cast<DWORD>(r->ai_addrlen))) {
-			if (last.error = err; err == ERROR_CANCELLED) {
+	std::vector<attempt> pending;
+	std::vector<WSAEVENT> events;
+
+	auto can_start = [&next, &addrs, &pending] 
+	{ 
+		return next != addrs.end() && pending.size() < WSA_MAXIMUM_WAIT_EVENTS; 
+	};
+
+	while (true) {
+		if (can_start()) {
+			switch (attempt a; start_attempt(last, a, **next++)) {
+			case 0:
+				if (set_blocking(last, a.sock.get())) {
+					return std::move(a.sock);
+				}
+				continue;
+			case WSAEWOULDBLOCK:
+				pending.push_back(std::move(a));
 				break;
+			default:
+				continue; // start the next one immediately
+			}
+		}
+
+		if (pending.empty()) {
+			break; // all attempts have failed
+		}
+
+		events.clear();
+		for (auto &a: pending) {
+			events.push_back(a.evt.get());
+		}
+
+		auto cnt = static_cast<DWORD>(events.size());
+		auto timeout = can_start() ? DWORD(CONNECTION_ATTEMPT_DELAY) : WSA_INFINITE;
+
+		auto ret = WSAWaitForMultipleEvents(cnt, events.data(), false, timeout, alertable);
+
+		if (ret == WSA_WAIT_TIMEOUT) {
+			continue; // time to start the next attempt
+		} else if (ret == WSA_WAIT_IO_COMPLETION) { // see QueueUserAPC
+			libusbip::output("connect cancelled");
+			last.error = ERROR_CANCELLED;
+			break;
+		} else if (ret >= WSA_WAIT_EVENT_0 && ret < WSA_WAIT_EVENT_0 + cnt) {
+			auto i = pending.begin() + (ret - WSA_WAIT_EVENT_0);
+			auto a = std::move(*i);
+			pending.erase(i);
+
+			if (auto err = get_connect_result(a)) {
+				last.error = err;
+			} else if (set_blocking(last, a.sock.get())) {
+				return std::move(a.sock);
 			}
-		} else if (WSAEventSelect(sock.get(), WSA_INVALID_EVENT, 0)) { // cancel the association and selection of network events
+		} else {
+			assert(ret == WSA_WAIT_FAILED);
 			last.error = WSAGetLastError();
-			libusbip::output("WSAEventSelect(0) error {}", last.error);
-		} else if (set_nonblock(last, sock.get(), false)) {
-			return sock;
+			libusbip::output("WSAWaitForMultipleEvents -> {}, error {}", ret, last.error);
+			break;
 		}
 	}
 
-	sock.close();
-	return sock;
+	return Socket(); // pending attempts are closed
+}
+
+} // namespace
+
+
+const char* usbip::get_tcp_port() noexcept
+{
+	return tcp_port;
+}
+
+auto usbip::connect(_In_ const char *hostname, _In_ const char *service) -> Socket
+{
+	set_last_error last(NO_ERROR); // restore after sockets are closed
+
+	if (auto ai = resolve(last, hostname, service, false)) {
+		return connect_any(last, ai.get(), false);
+	}
+
+	return Socket();
+}
+
+auto usbip::connect(_In_ const char *hostname, _In_ const char *service, _In_ unsigned long options) -> Socket
+{
+	set_last_error last(ERROR_INVALID_PARAMETER); // restore after sockets are closed
+
+	if (options != CANCEL_BY_APC) {
+		return Socket();
+	}
+
+	if (auto ai = resolve(last, hostname, service, true)) {
+		return connect_any(last, ai.get(), true);
+	}
+
+	return Socket();
 }
 
 bool usbip::enum_exportable_devices(
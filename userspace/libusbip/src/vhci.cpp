@@ -5,14 +5,18 @@
 #include "..\vhci.h"
 
 #include "device_speed.h"
+#include "merge_delta.h"
 #include "output.h"
 
 #include <resources\messages.h>
 #include <cfgmgr32.h>
+#include <ntsecapi.h>
 
 #include <initguid.h>
 #include <usbip\vhci.h>
 
+#include <algorithm>
+
 namespace
 {
 
@@ -88,6 +92,16 @@ auto make_imported_device(_In_ const vhci::imported_device &s)
                 .speed = win_speed(s.speed),
                 .vendor = s.vendor,
                 .product = s.product,
+
+                .timings {
+                        .resolved = s.timings.resolved,
+                        .connected = s.timings.connected,
+                        .imported = s.timings.imported,
+                        .created = s.timings.created,
+                        .plugged = s.timings.plugged,
+                        .first_urb = s.timings.first_urb,
+                        .configured = s.timings.configured,
+                },
         };
 
         assign(d.location, s);
@@ -98,7 +112,8 @@ auto make_device_state(_In_ const vhci::device_state &r)
 {
         return device_state {
                 .device = make_imported_device(r),
-                .state = static_cast<state>(r.state)
+                .state = static_cast<state>(r.state),
+                .seqnum = r.seqnum,
         };
 }
 
@@ -156,6 +171,90 @@ auto get_path()
         }
 }
 
+constexpr auto plugin_outlen = offsetof(vhci::ioctl::plugin_hardware, port) + sizeof(vhci::ioctl::plugin_hardware::port);
+
+void remap_attach_error()
+{
+        auto err = GetLastError();
+        if (auto code = map_attach_error(err); code != err) {
+                SetLastError(code);
+        }
+}
+
+auto start(_Inout_ vhci::async_op &op, _In_ HANDLE dev, _In_ DWORD code, _In_ DWORD outlen)
+{
+        op.dev = dev;
+        op.overlapped = { .hEvent = op.overlapped.hEvent };
+
+        auto buf = op.buf.data();
+        auto inlen = static_cast<DWORD>(op.buf.size());
+
+        return DeviceIoControl(dev, code, buf, inlen, outlen ? buf : nullptr, outlen, nullptr, &op.overlapped) ||
+               GetLastError() == ERROR_IO_PENDING;
+}
+
+/*
+ * Is completed in the thread pool.
+ */
+struct callback_op : vhci::async_op
+{
+        ~callback_op()
+        {
+                if (wait) {
+                        CloseThreadpoolWait(wait);
+                }
+        }
+
+        NullableHandle event;
+        PTP_WAIT wait{};
+
+        std::function<void(vhci::async_op&)> on_completed;
+        std::shared_ptr<callback_op> self; // keeps alive until completed
+};
+
+void CALLBACK on_signaled(
+        _Inout_ PTP_CALLBACK_INSTANCE, _Inout_opt_ void *context, _Inout_ PTP_WAIT, _In_ TP_WAIT_RESULT)
+{
+        auto &op = *static_cast<callback_op*>(context);
+        auto self = std::move(op.self); // op is destroyed on return
+
+        op.on_completed(op);
+}
+
+auto make_callback_op(_In_ std::function<void(vhci::async_op&)> on_completed)
+{
+        auto op = std::make_shared<callback_op>();
+
+        op->event.reset(CreateEvent(nullptr, true, false, nullptr));
+        if (!op->event) {
+                return decltype(op)();
+        }
+        op->overlapped.hEvent = op->event.get();
+
+        op->wait = CreateThreadpoolWait(on_signaled, op.get(), nullptr);
+        if (!op->wait) {
+                return decltype(op)();
+        }
+
+        op->on_completed = std::move(on_completed);
+        return op;
+}
+
+/*
+ * @param started the result of attach_async or detach_async
+ */
+std::shared_ptr<vhci::async_op> arm(_In_ std::shared_ptr<callback_op> op, _In_ bool started)
+{
+        if (!started) {
+                return {};
+        }
+
+        op->self = op;
+        SetThreadpoolWait(op->wait, op->overlapped.hEvent, nullptr);
+
+        return op;
+}
+
 } // namespace
 
 
@@ -249,6 +348,63 @@ std::vector<usbip::imported_device> usbip::vhci::get_imported_devices(_In_ HANDL
         return result;
 }
 
+bool usbip::vhci::update_imported_devices(
+        _In_ HANDLE dev, _Inout_ std::vector<usbip::imported_device> &devices, _Inout_ imported_devices_cursor &cursor)
+{
+        constexpr auto hdr_size = offsetof(ioctl::get_imported_devices_delta, devices);
+
+        std::vector<char> buf;
+
+        imported_devices_cursor current{};
+        ULONG count{};
+        bool reset{};
+
+        for (ULONG cnt = 0; true; ) {
+                buf.resize(cnt ? ioctl::get_imported_devices_delta_size(cnt) : hdr_size);
+
+                auto r = reinterpret_cast<ioctl::get_imported_devices_delta*>(buf.data());
+                r->size = sizeof(*r);
+                r->generation = cursor.generation;
+                r->epoch = cursor.epoch;
+
+                auto len = static_cast<DWORD>(buf.size());
+
+                if (DWORD BytesReturned{}; // must be set if the last arg is NULL
+                    DeviceIoControl(dev, ioctl::GET_IMPORTED_DEVICES_DELTA, r, hdr_size, r, len, &BytesReturned, nullptr)) {
+                        
+                        if (BytesReturned < hdr_size) [[unlikely]] {
+                                SetLastError(USBIP_ERROR_DRIVER_RESPONSE);
+                                return false;
+                        }
+
+                        current = { .generation = r->generation, .epoch = r->epoch };
+                        count = r->count;
+                        reset = r->reset;
+
+                        if (!cnt && count) { // size query
+                                cnt = count;
+                                continue;
+                        } else if (BytesReturned != ioctl::get_imported_devices_delta_size(count)) {
+                                SetLastError(USBIP_ERROR_DRIVER_RESPONSE);
+                                return false;
+                        }
+
+                        break;
+
+                } else if (GetLastError() != ERROR_INSUFFICIENT_BUFFER) {
+                        return false;
+                } else {
+                        cnt = 0; // changed since the size query, repeat
+                }
+        }
+
+        auto r = reinterpret_cast<ioctl::get_imported_devices_delta*>(buf.data());
+        merge_delta(devices, r->devices, count, reset, make_imported_device);
+
+        cursor = current;
+        return true;
+}
+
 int usbip::vhci::attach(_In_ HANDLE dev, _In_ const device_location &location)
 {
         ioctl::plugin_hardware r {{ .size = sizeof(r) }};
@@ -257,12 +413,10 @@ int usbip::vhci::attach(_In_ HANDLE dev, _In_ const device_location &location)
                 return 0;
         }
 
-        constexpr auto outlen = offsetof(ioctl::plugin_hardware, port) + sizeof(r.port);
-
         if (DWORD BytesReturned{}; // must be set if the last arg is NULL
-            DeviceIoControl(dev, ioctl::PLUGIN_HARDWARE, &r, sizeof(r), &r, outlen, &BytesReturned, nullptr)) {
+            DeviceIoControl(dev, ioctl::PLUGIN_HARDWARE, &r, sizeof(r), &r, plugin_outlen, &BytesReturned, nullptr)) {
 
-                if (BytesReturned != outlen) [[unlikely]] {
+                if (BytesReturned != plugin_outlen) [[unlikely]] {
                         SetLastError(USBIP_ERROR_DRIVER_RESPONSE);
                 } else {
                         assert(r.port > 0);
@@ -270,12 +424,60 @@ int usbip::vhci::attach(_In_ HANDLE dev, _In_ const device_location &location)
                 }
         }
 
-        auto err = GetLastError();
-        if (auto code = map_attach_error(err); code != err) {
-                SetLastError(code);
+        remap_attach_error();
+        return 0;
+}
+
+std::vector<attach_result> usbip::vhci::attach(
+        _In_ HANDLE dev, _In_ const std::vector<device_location> &locations, _Out_ bool &success)
+{
+        std::vector<attach_result> result;
+        success = false;
+
+        auto cnt = static_cast<ULONG>(locations.size());
+        if (!cnt || cnt > ioctl::plugin_hardware_batch::MAX_DEVICES) {
+                SetLastError(ERROR_INVALID_PARAMETER);
+                return result;
         }
 
-        return 0;
+        auto len = static_cast<DWORD>(ioctl::plugin_hardware_batch_size(cnt));
+        std::vector<char> buf(len);
+
+        auto r = reinterpret_cast<ioctl::plugin_hardware_batch*>(buf.data());
+        r->size = sizeof(*r);
+        r->count = cnt;
+
+        for (ULONG i = 0; i < cnt; ++i) {
+                if (!assign(r->devices[i], locations[i])) {
+                        SetLastError(ERROR_INVALID_PARAMETER);
+                        return result;
+                }
+        }
+
+        if (DWORD BytesReturned{}; // must be set if the last arg is NULL
+            !DeviceIoControl(dev, ioctl::PLUGIN_HARDWARE_BATCH, r, len, r, len, &BytesReturned, nullptr)) {
+                return result;
+        } else if (BytesReturned != len) [[unlikely]] {
+                SetLastError(USBIP_ERROR_DRIVER_RESPONSE);
+                return result;
+        }
+
+        result.resize(cnt);
+
+        for (ULONG i = 0; i < cnt; ++i) {
+                auto &d = r->devices[i];
+                auto &res = result[i];
+
+                if (d.status >= 0) { // NT_SUCCESS
+                        assert(d.port > 0);
+                        res.port = d.port;
+                } else {
+                        res.error = map_attach_error(LsaNtStatusToWinError(d.status));
+                }
+        }
+
+        success = true;
+        return result;
 }
 
 bool usbip::vhci::detach(_In_ HANDLE dev, _In_ int port)
@@ -287,6 +489,310 @@ bool usbip::vhci::detach(_In_ HANDLE dev, _In_ int port)
         return DeviceIoControl(dev, ioctl::PLUGOUT_HARDWARE, &r, sizeof(r), nullptr, 0, &BytesReturned, nullptr);
 }
 
+bool usbip::vhci::attach_async(_In_ HANDLE dev, _In_ const device_location &location, _Inout_ async_op &op)
+{
+        op.buf.assign(sizeof(ioctl::plugin_hardware), 0);
+
+        auto &r = *reinterpret_cast<ioctl::plugin_hardware*>(op.buf.data());
+        r.size = sizeof(r);
+
+        if (!assign(r, location)) {
+                SetLastError(ERROR_INVALID_PARAMETER);
+                return false;
+        }
+
+        if (!start(op, dev, ioctl::PLUGIN_HARDWARE, plugin_outlen)) {
+                remap_attach_error();
+                return false;
+        }
+
+        return true;
+}
+
+bool usbip::vhci::detach_async(_In_ HANDLE dev, _In_ int port, _Inout_ async_op &op)
+{
+        op.buf.assign(sizeof(ioctl::plugout_hardware), 0);
+
+        auto &r = *reinterpret_cast<ioctl::plugout_hardware*>(op.buf.data());
+        r.size = sizeof(r);
+        r.port = port;
+
+        return start(op, dev, ioctl::PLUGOUT_HARDWARE, 0);
+}
+
+int usbip::vhci::get_attach_result(_In_ async_op &op, _In_ bool wait)
+{
+        DWORD BytesReturned{};
+
+        if (!GetOverlappedResult(op.dev, &op.overlapped, &BytesReturned, wait)) {
+                remap_attach_error();
+                return 0;
+        } else if (BytesReturned != plugin_outlen) [[unlikely]] {
+                SetLastError(USBIP_ERROR_DRIVER_RESPONSE);
+                return 0;
+        }
+
+        auto &r = *reinterpret_cast<ioctl::plugin_hardware*>(op.buf.data());
+        assert(r.port > 0);
+
+        return r.port;
+}
+
+bool usbip::vhci::get_detach_result(_In_ async_op &op, _In_ bool wait)
+{
+        DWORD BytesReturned{};
+        return GetOverlappedResult(op.dev, &op.overlapped, &BytesReturned, wait);
+}
+
+bool usbip::vhci::cancel(_In_ async_op &op)
+{
+        return CancelIoEx(op.dev, &op.overlapped);
+}
+
+std::shared_ptr<vhci::async_op> usbip::vhci::attach_async(
+        _In_ HANDLE dev, _In_ const device_location &location, _In_ attach_callback callback)
+{
+        auto op = make_callback_op([callback = std::move(callback)] (auto &ao)
+        {
+                attach_result r { .port = get_attach_result(ao, false) };
+                if (!r.port) {
+                        r.error = GetLastError();
+                }
+                callback(r);
+        });
+
+        return op ? arm(op, attach_async(dev, location, *op)) : nullptr;
+}
+
+std::shared_ptr<vhci::async_op> usbip::vhci::detach_async(
+        _In_ HANDLE dev, _In_ int port, _In_ detach_callback callback)
+{
+        auto op = make_callback_op([callback = std::move(callback)] (auto &ao)
+        {
+                auto ok = get_detach_result(ao, false);
+                callback(ok ? ERROR_SUCCESS : GetLastError());
+        });
+
+        return op ? arm(op, detach_async(dev, port, *op)) : nullptr;
+}
+
+bool usbip::vhci::set_socket_buffers(_In_ HANDLE dev, _In_ int port, _Inout_ usbip::socket_buffers &bufs)
+{
+        ioctl::set_socket_buffers r;
+        r.size = sizeof(r);
+        r.port = port;
+        r.sndbuf = bufs.sndbuf;
+        r.rcvbuf = bufs.rcvbuf;
+        r.autotune = bufs.autotune;
+
+        DWORD BytesReturned{}; // must be set if the last arg is NULL
+
+        if (!DeviceIoControl(dev, ioctl::SET_SOCKET_BUFFERS, &r, sizeof(r), &r, sizeof(r), &BytesReturned, nullptr)) {
+                return false;
+        }
+
+        assert(BytesReturned == sizeof(r));
+
+        bufs.sndbuf = r.sndbuf;
+        bufs.rcvbuf = r.rcvbuf;
+        bufs.autotune = r.autotune;
+
+        return true;
+}
+
+bool usbip::vhci::set_recv_thread_options(_In_ HANDLE dev, _In_ int port, _Inout_ usbip::recv_thread_options &opts)
+{
+        ioctl::set_recv_thread_options r;
+        r.size = sizeof(r);
+        r.port = port;
+        r.class_aware = opts.class_aware;
+        r.ideal_processor = opts.ideal_processor;
+
+        DWORD BytesReturned{}; // must be set if the last arg is NULL
+
+        if (!DeviceIoControl(dev, ioctl::SET_RECV_THREAD_OPTIONS, &r, sizeof(r), &r, sizeof(r), 
+                             &BytesReturned, nullptr)) {
+                return false;
+        }
+
+        assert(BytesReturned == sizeof(r));
+
+        opts.class_aware = r.class_aware;
+        opts.ideal_processor = r.ideal_processor;
+        opts.priority = r.priority;
+
+        return true;
+}
+
+bool usbip::vhci::get_device_stats(_In_ HANDLE dev, _In_ int port, _Out_ usbip::device_stats &stats)
+{
+        stats = {};
+
+        auto r = std::make_unique<ioctl::get_device_stats>();
+        r->size = sizeof(*r);
+        r->port = port;
+
+        DWORD BytesReturned{}; // must be set if the last arg is NULL
+
+        if (!DeviceIoControl(dev, ioctl::GET_DEVICE_STATS, r.get(), sizeof(*r), r.get(), sizeof(*r), 
+                             &BytesReturned, nullptr)) {
+                return false;
+        }
+
+        assert(BytesReturned == sizeof(*r));
+        auto &d = r->device;
+
+        stats.sent_requests = d.sent_requests;
+        stats.drained = d.drained;
+        stats.drained_bytes = d.drained_bytes;
+        stats.inflight_bytes = d.inflight_bytes;
+        stats.inflight = d.inflight;
+        stats.reconnects = d.reconnects;
+        stats.srtt = d.srtt;
+        stats.compressed_out = d.compressed_out;
+        stats.compressed_out_wire = d.compressed_out_wire;
+        stats.compressed_in = d.compressed_in;
+        stats.compressed_in_wire = d.compressed_in_wire;
+        stats.compress_skipped = d.compress_skipped;
+
+        static_assert(usbip::endpoint_stats::latency_buckets == vhci::endpoint_stats::LATENCY_BUCKETS);
+        stats.endpoints.resize(r->count);
+
+        for (ULONG i = 0; i < r->count; ++i) {
+                auto &s = r->endpoints[i];
+                auto &e = stats.endpoints[i];
+
+                e.address = s.address;
+                e.type = s.type;
+                e.submitted = s.submitted;
+                e.completed = s.completed;
+                e.errors = s.errors;
+                e.cancelled = s.cancelled;
+                e.bytes_out = s.bytes_out;
+                e.bytes_in = s.bytes_in;
+                e.latency_sum = s.latency_sum;
+                std::copy(std::begin(s.latency), std::end(s.latency), e.latency.begin());
+        }
+
+        return true;
+}
+
+bool usbip::vhci::read_trace(_In_ HANDLE dev, _Out_ std::vector<usbip::trace_record> &records, _Out_ UINT64 &dropped)
+{
+        records.clear();
+        dropped = 0;
+
+        static_assert(sizeof(usbip::trace_record) == sizeof(vhci::trace_record));
+        constexpr ULONG max_cnt = 16*1024; // per call
+
+        std::vector<char> buf(ioctl::get_trace_size(max_cnt));
+        auto r = reinterpret_cast<ioctl::get_trace*>(buf.data());
+
+        while (true) {
+                r->size = sizeof(*r);
+
+                DWORD BytesReturned{}; // must be set if the last arg is NULL
+
+                if (!DeviceIoControl(dev, ioctl::GET_TRACE, r, sizeof(*r), r, DWORD(buf.size()), &BytesReturned, nullptr)) {
+                        return false;
+                }
+
+                assert(BytesReturned == ioctl::get_trace_size(r->count));
+
+                dropped += r->dropped;
+
+                for (ULONG i = 0; i < r->count; ++i) {
+                        auto &s = r->records[i];
+                        records.push_back(usbip::trace_record {
+                                .time = s.time,
+                                .seqnum = s.seqnum,
+                                .devid = s.devid,
+                                .length = s.length,
+                                .status = s.status,
+                                .event = static_cast<usbip::trace_event>(s.event),
+                                .ep = s.ep,
+                                .dir = s.dir,
+                                .port = s.port,
+                        });
+                }
+
+                if (r->count < max_cnt) {
+                        break;
+                }
+        }
+
+        auto by_time = [] (auto &a, auto &b) { return a.time < b.time; }; // records of each processor are sorted
+        std::stable_sort(records.begin(), records.end(), by_time);
+
+        return true;
+}
+
+bool usbip::vhci::get_pool_stats(_In_ HANDLE dev, _Out_ usbip::pool_usage &usage)
+{
+        usage = {};
+
+        auto r = std::make_unique<ioctl::get_pool_stats>();
+        r->size = sizeof(*r);
+
+        DWORD BytesReturned{}; // must be set if the last arg is NULL
+
+        if (!DeviceIoControl(dev, ioctl::GET_POOL_STATS, r.get(), sizeof(*r), r.get(), sizeof(*r), 
+                             &BytesReturned, nullptr)) {
+                return false;
+        }
+
+        assert(BytesReturned == sizeof(*r));
+        usage.uptime = r->uptime;
+        usage.undeleted_devices = r->undeleted_devices;
+
+        auto make = [] (auto &s, auto name, auto port)
+        {
+                return usbip::pool_stats {
+                        .name = name,
+                        .tag = s.tag,
+                        .port = port,
+                        .allocs = s.allocs,
+                        .frees = s.frees,
+                        .bytes = s.bytes,
+                        .peak = s.peak,
+                };
+        };
+
+        // vhci::pool_consumer
+        const char* names[] = { "other", "wsk_context", "isoc", "payload", "device", "descriptors", 
+                                "dns_cache", "events", "trace_ring", "compression" };
+
+        for (ULONG i = 0; i < r->count && i < ARRAYSIZE(r->consumers); ++i) {
+                auto name = i < ARRAYSIZE(names) ? names[i] : "";
+                usage.consumers.push_back(make(r->consumers[i], name, 0));
+        }
+
+        for (ULONG i = 0; i < r->device_count && i < ARRAYSIZE(r->devices); ++i) {
+                auto &d = r->devices[i];
+                usage.devices.push_back(make(d.usage, "device", d.port));
+        }
+
+        return true;
+}
+
+const char* usbip::vhci::get_trace_event_str(_In_ usbip::trace_event event) noexcept
+{
+        static_assert(int(trace_event::submit) == int(vhci::trace_event::submit));
+        static_assert(int(trace_event::send) == int(vhci::trace_event::send));
+        static_assert(int(trace_event::recv) == int(vhci::trace_event::recv));
+        static_assert(int(trace_event::complete) == int(vhci::trace_event::complete));
+        static_assert(int(trace_event::unlink) == int(vhci::trace_event::unlink));
+        static_assert(int(trace_event::dispatch) == int(vhci::trace_event::dispatch));
+        static_assert(int(trace_event::prepare) == int(vhci::trace_event::prepare));
+        static_assert(int(trace_event::locked) == int(vhci::trace_event::locked));
+        static_assert(int(trace_event::payload) == int(vhci::trace_event::payload));
+
+        const char* v[] = { "", "submit", "send", "recv", "complete", "unlink", "dispatch", "prepare", "locked", "payload" };
+
+        auto idx = static_cast<int>(event);
+        return idx >= 0 && idx < ARRAYSIZE(v) ? v[idx] : "";
+}
+
 USBIP_API DWORD usbip::vhci::get_device_state_size() noexcept
 {
         return sizeof(vhci::device_state);
@@ -327,3 +833,45 @@ bool usbip::vhci::read_device_state(_In_ HANDLE dev, _Inout_ usbip::device_state
                 return get_device_state(result, &r, actual);
         }
 }
+
+bool usbip::vhci::read_device_states(
+        _In_ HANDLE dev, _Out_ std::vector<usbip::device_state> &result, _In_ DWORD max_count, 
+        _Inout_ UINT64 &seqnum, _Out_ UINT64 &dropped)
+{
+        result.clear();
+        dropped = 0;
+
+        std::vector<vhci::device_state> v(max_count ? max_count : 1);
+        auto len = static_cast<DWORD>(v.size()*sizeof(v.front()));
+
+        if (DWORD actual; !ReadFile(dev, v.data(), len, &actual, nullptr)) {
+                return false;
+        } else if (!actual) {
+                SetLastError(ERROR_HANDLE_EOF);
+                return false;
+        } else if (actual % sizeof(v.front())) {
+                SetLastError(USBIP_ERROR_DRIVER_RESPONSE);
+                return false;
+        } else {
+                v.resize(actual/sizeof(v.front()));
+        }
+
+        result.reserve(v.size());
+
+        for (auto &r: v) {
+                if (r.size != sizeof(r)) {
+                        result.clear();
+                        SetLastError(USBIP_ERROR_ABI);
+                        return false;
+                }
+
+                if (seqnum && r.seqnum > seqnum + 1) {
+                        dropped += r.seqnum - seqnum - 1;
+                }
+                seqnum = r.seqnum;
+
+                result.push_back(make_device_state(r));
+        }
+
+        return true;
+}
@@ -0,0 +1,41 @@
+/*
+ * Copyright (C) 2024 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include <windows.h>
+
+namespace usbip
+{
+
+enum class trace_event : UINT8 
+{ 
+        submit = 1, // request is queued to be sent to a server
+        send, // command is sent
+        recv, // response is received
+        complete, // request is completed after the response
+        unlink, // request is completed without the response
+        dispatch, // URB is received by the driver
+        prepare, // command is being prepared for sending
+        locked, // command is being sent
+        payload, // payload of the response is received
+};
+
+/*
+ * Record of URB processing, see vhci::read_trace.
+ */
+struct trace_record
+{
+        UINT64 time{}; // 100-nanosecond units since the system start
+        UINT32 seqnum{}; // of USB/IP command
+        UINT32 devid{};
+        UINT32 length{}; // buffer length or actual length
+        LONG status{}; // NTSTATUS; status of the response for trace_event::recv
+        trace_event event{};
+        UINT8 ep{}; // endpoint number
+        UINT8 dir{}; // zero is OUT, one is IN
+        UINT8 port{}; // hub port number
+};
+
+} // namespace usbip
@@ -6,8 +6,14 @@
 
 #include "dllspec.h"
 #include "win_handle.h"
+#include "trace_record.h"
+#include "attach_timings.h"
 #include <usbspec.h>
 
+#include <array>
+#include <functional>
+#include <future>
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -35,6 +41,8 @@ struct imported_device
 
         UINT16 vendor{};
         UINT16 product{};
+
+        attach_timings timings;
 };
 
 enum class state { unplugged, connecting, connected, plugged, disconnected, unplugging };
@@ -43,6 +51,108 @@ struct device_state
 {
         imported_device device;
         state state = state::unplugged;
+        UINT64 seqnum{}; // consecutive numbers, a gap means that events were lost
+};
+
+/*
+ * Buffers of TCP/IP connection of imported device.
+ */
+struct socket_buffers
+{
+        int sndbuf{}; // bytes, SO_SNDBUF, <= 0 does not change
+        int rcvbuf{}; // bytes, SO_RCVBUF, <= 0 does not change
+        int autotune = -1; // boolean, grow SO_SNDBUF automatically, negative does not change
+};
+
+/*
+ * Scheduling of the thread that receives responses of a server for imported device.
+ */
+struct recv_thread_options
+{
+        enum { ANY_PROCESSOR = -1, KEEP_PROCESSOR = -2 };
+
+        int class_aware = -1; // boolean, priority follows classes of selected interfaces, negative does not change
+        int ideal_processor = KEEP_PROCESSOR; // system-wide index of a processor, ANY_PROCESSOR lets the scheduler choose
+        int priority{}; // OUT, KPRIORITY that the thread runs at
+};
+
+/*
+ * Result of attaching one of the devices, see vhci::attach.
+ */
+struct attach_result
+{
+        int port{}; // hub port number, >= 1; zero if the error is set
+        DWORD error{}; // Win32 error code
+};
+
+/*
+ * Counters of an endpoint since it was created.
+ * Latency is the time between sending of a request to a server and receiving of its response.
+ */
+struct endpoint_stats
+{
+        static constexpr auto latency_buckets = 24; // the last one also counts longer latencies
+
+        UINT8 address{}; // bEndpointAddress
+        UINT8 type{}; // USB_ENDPOINT_TYPE_XXX
+
+        UINT64 submitted{}; // requests are sent to a server
+        UINT64 completed{}; // responses are received
+        UINT64 errors{}; // completed with an error
+        UINT64 cancelled{}; // completed without a response
+        UINT64 bytes_out{};
+        UINT64 bytes_in{};
+
+        UINT64 latency_sum{}; // microseconds, the mean is latency_sum/completed
+        std::array<UINT64, latency_buckets> latency{}; // [0] is less than 1 us, [i] is [2^(i-1), 2^i) us
+};
+
+/*
+ * Counters of imported device, see vhci::get_device_stats.
+ */
+struct device_stats
+{
+        UINT64 sent_requests{}; // including unlink commands
+        UINT64 drained{}; // responses for requests that were already completed
+        UINT64 drained_bytes{}; // their payload that was discarded
+
+        UINT64 inflight_bytes{}; // of requests that are waiting for a response
+        ULONG inflight{}; // number of such requests
+
+        ULONG reconnects{};
+        UINT32 srtt{}; // microseconds, smoothed round-trip time of requests
+
+        // bulk payloads that were compressed, the ratio is compressed_out/compressed_out_wire
+        UINT64 compressed_out{}; // sent, original length
+        UINT64 compressed_out_wire{}; // sent, length on the wire
+        UINT64 compressed_in{}; // received, original length
+        UINT64 compressed_in_wire{}; // received, length on the wire
+        UINT64 compress_skipped{}; // payloads that were sent as is, the data is incompressible
+
+        std::vector<endpoint_stats> endpoints; // the first one is the default control pipe
+};
+
+/*
+ * Allocations of memory pool since the driver is loaded, see vhci::get_pool_stats.
+ */
+struct pool_stats
+{
+        std::string name; // of the consumer
+        UINT32 tag{}; // pool tag, zero for a device
+        int port{}; // hub port number of a device, zero for a consumer
+
+        UINT64 allocs{};
+        UINT64 frees{};
+        UINT64 bytes{}; // currently allocated
+        UINT64 peak{}; // high-water mark of bytes
+};
+
+struct pool_usage
+{
+        UINT64 uptime{}; // 100-nanosecond units since the driver is loaded, allocation rate is allocs/uptime
+        ULONG undeleted_devices{}; // were detached, but the driver could not free their memory yet
+        std::vector<pool_stats> consumers; // subsystems of the driver, each one has its own pool tag
+        std::vector<pool_stats> devices; // buffers that are held by imported devices
 };
 
 } // namespace usbip
@@ -65,6 +175,25 @@ USBIP_API Handle open(_In_ bool overlapped = false);
  */
 USBIP_API std::vector<imported_device> get_imported_devices(_In_ HANDLE dev, _Out_ bool &success);
 
+/**
+ * State of the result of update_imported_devices, zero-initialized for the first call.
+ */
+struct imported_devices_cursor
+{
+        UINT64 generation;
+        UINT64 epoch; // instance of the driver, its generations are unrelated to others
+};
+
+/**
+ * Apply changes that were made since the previous call, this is cheaper than get_imported_devices.
+ * @param dev handle of the driver device
+ * @param devices result of the previous call, empty for the first call; is sorted by port
+ * @param cursor of devices, is updated
+ * @return call GetLastError() if false is returned
+ */
+USBIP_API bool update_imported_devices(
+        _In_ HANDLE dev, _Inout_ std::vector<imported_device> &devices, _Inout_ imported_devices_cursor &cursor);
+
 /**
  * @param dev handle of the driver device
  * @param location remote device to attach to
@@ -72,6 +201,17 @@ USBIP_API std::vector<imported_device> get_imported_devices(_In_ HANDLE dev, _Ou
  */
 USBIP_API int attach(_In_ HANDLE dev, _In_ const device_location &location);
 
+/**
+ * Attach several devices with one request, they are attached concurrently.
+ * Addresses of the same host are resolved once.
+ * @param dev handle of the driver device
+ * @param locations remote devices to attach to, up to 64
+ * @param success call GetLastError() if false is returned
+ * @return result for each location in the same order
+ */
+USBIP_API std::vector<attach_result> attach(
+        _In_ HANDLE dev, _In_ const std::vector<device_location> &locations, _Out_ bool &success);
+
 /**
  * @param dev handle of the driver device
  * @param port hub port number, <= 0 means detach all ports
@@ -79,6 +219,164 @@ USBIP_API int attach(_In_ HANDLE dev, _In_ const device_location &location);
  */
 USBIP_API bool detach(_In_ HANDLE dev, _In_ int port);
 
+/*
+ * Asynchronous attach or detach.
+ * The object must not be moved or destroyed until the operation is completed.
+ */
+struct async_op
+{
+        OVERLAPPED overlapped{}; // hEvent is set by a caller, can be NULL if a completion port is used
+        HANDLE dev{};
+        std::vector<char> buf; // of the request
+};
+
+/**
+ * Start attaching, the result can be obtained by get_attach_result or from a completion port.
+ * @param dev handle of the driver device, see open(true)
+ * @param location remote device to attach to
+ * @param op state of the operation
+ * @return call GetLastError() if false is returned
+ */
+USBIP_API bool attach_async(_In_ HANDLE dev, _In_ const device_location &location, _Inout_ async_op &op);
+
+/**
+ * Start detaching, the result can be obtained by get_detach_result or from a completion port.
+ * @param dev handle of the driver device, see open(true)
+ * @param port hub port number, <= 0 means detach all ports
+ * @param op state of the operation
+ * @return call GetLastError() if false is returned
+ */
+USBIP_API bool detach_async(_In_ HANDLE dev, _In_ int port, _Inout_ async_op &op);
+
+/**
+ * @param op started by attach_async
+ * @param wait until the operation is completed
+ * @return hub port number, >= 1. Call GetLastError() if zero is returned, 
+ *         ERROR_IO_INCOMPLETE means that the operation is not completed yet.
+ */
+USBIP_API int get_attach_result(_In_ async_op &op, _In_ bool wait);
+
+/**
+ * @param op started by detach_async
+ * @param wait until the operation is completed
+ * @return call GetLastError() if false is returned, see get_attach_result
+ */
+USBIP_API bool get_detach_result(_In_ async_op &op, _In_ bool wait);
+
+/**
+ * Cancel attaching, detaching is not cancelable.
+ * Completion of the operation must be awaited anyway.
+ * @param op started by attach_async
+ * @return call GetLastError() if false is returned, ERROR_NOT_FOUND means that it is already completed
+ */
+USBIP_API bool cancel(_In_ async_op &op);
+
+using attach_callback = std::function<void(_In_ const attach_result &result)>;
+
+/**
+ * Callback is called from the thread pool when the device is attached or an error occurred.
+ * @param dev handle of the driver device, see open(true)
+ * @param location remote device to attach to
+ * @param callback is not called if an error is returned
+ * @return pass it to cancel() to abort attaching, call GetLastError() if nullptr is returned
+ */
+USBIP_API std::shared_ptr<async_op> attach_async(
+        _In_ HANDLE dev, _In_ const device_location &location, _In_ attach_callback callback);
+
+using detach_callback = std::function<void(_In_ DWORD error)>;
+
+/**
+ * @param dev handle of the driver device, see open(true)
+ * @param port hub port number, <= 0 means detach all ports
+ * @param callback is called from the thread pool, error is zero on success
+ * @return call GetLastError() if nullptr is returned
+ */
+USBIP_API std::shared_ptr<async_op> detach_async(_In_ HANDLE dev, _In_ int port, _In_ detach_callback callback);
+
+/**
+ * @param dev handle of the driver device, see open(true)
+ * @param location remote device to attach to
+ * @param op pass it to cancel() to abort attaching
+ * @return the result of attaching
+ */
+inline auto attach_future(_In_ HANDLE dev, _In_ const device_location &location, _Out_ std::shared_ptr<async_op> &op)
+{
+        auto p = std::make_shared<std::promise<attach_result>>();
+        auto f = p->get_future();
+
+        op = attach_async(dev, location, [p] (auto &result) { p->set_value(result); });
+        if (!op) {
+                p->set_value({ .error = GetLastError() });
+        }
+
+        return f;
+}
+
+/**
+ * @param dev handle of the driver device, see open(true)
+ * @param port hub port number, <= 0 means detach all ports
+ * @return Win32 error code, zero on success
+ */
+inline auto detach_future(_In_ HANDLE dev, _In_ int port)
+{
+        auto p = std::make_shared<std::promise<DWORD>>();
+        auto f = p->get_future();
+
+        if (!detach_async(dev, port, [p] (auto error) { p->set_value(error); })) {
+                p->set_value(GetLastError());
+        }
+
+        return f;
+}
+
+/**
+ * Defaults for new devices are set in the driver's registry Parameters key, 
+ * see SocketSendBuffer, SocketReceiveBuffer, SocketBufferAutotune.
+ * @param dev handle of the driver device
+ * @param port hub port number of imported device
+ * @param bufs new values, actual values of the socket on return
+ * @return call GetLastError() if false is returned
+ */
+USBIP_API bool set_socket_buffers(_In_ HANDLE dev, _In_ int port, _Inout_ socket_buffers &bufs);
+
+/**
+ * Defaults for new devices are set in the driver's registry Parameters key, 
+ * see RecvThreadClassAware, RecvThreadIdealProcessor.
+ * @param dev handle of the driver device
+ * @param port hub port number of imported device
+ * @param opts new values, actual values on return
+ * @return call GetLastError() if false is returned
+ */
+USBIP_API bool set_recv_thread_options(_In_ HANDLE dev, _In_ int port, _Inout_ recv_thread_options &opts);
+
+/**
+ * Counters are read without locking, they can be a bit inconsistent with each other.
+ * @param dev handle of the driver device
+ * @param port hub port number of imported device
+ * @param stats counters of the device and its endpoints
+ * @return call GetLastError() if false is returned
+ */
+USBIP_API bool get_device_stats(_In_ HANDLE dev, _In_ int port, _Out_ device_stats &stats);
+
+/**
+ * Records are removed from the driver's trace, the next call returns new ones.
+ * @param dev handle of the driver device
+ * @param records in the order of time
+ * @param dropped number of records that were lost since the previous call
+ * @return call GetLastError() if false is returned
+ */
+USBIP_API bool read_trace(_In_ HANDLE dev, _Out_ std::vector<trace_record> &records, _Out_ UINT64 &dropped);
+
+USBIP_API const char* get_trace_event_str(_In_ trace_event event) noexcept;
+
+/**
+ * Counters are read without locking, they can be a bit inconsistent with each other.
+ * @param dev handle of the driver device
+ * @param usage allocations of the driver's consumers and imported devices
+ * @return call GetLastError() if false is returned
+ */
+USBIP_API bool get_pool_stats(_In_ HANDLE dev, _Out_ pool_usage &usage);
+
 /**
  * @return textual representation of the given constant
  */
@@ -105,4 +403,18 @@ USBIP_API bool get_device_state(_Inout_ device_state &result, _In_ const void *d
  */
 USBIP_API bool read_device_state(_In_ HANDLE dev, _Inout_ device_state &result);
 
+/**
+ * Read pending states with one call, blocks until at least one is available.
+ * The driver keeps limited number of the latest states, a reader that lags behind loses the oldest ones.
+ * @param dev handle of the driver device that must be opened for serialized I/O
+ * @param result states in the order of seqnum
+ * @param max_count maximum number of states to read
+ * @param seqnum of the last state that was read, zero before the first call; is updated
+ * @param dropped number of lost states since the previous call
+ * @return call GetLastError() if false is returned
+ */
+USBIP_API bool read_device_states(
+        _In_ HANDLE dev, _Out_ std::vector<device_state> &result, _In_ DWORD max_count, 
+        _Inout_ UINT64 &seqnum, _Out_ UINT64 &dropped);
+
 } // namespace usbip::vhci
@@ -0,0 +1,213 @@
+/*
+ * Copyright (C) 2024 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "chrome_trace.h"
+
+#include <format>
+#include <map>
+#include <tuple>
+
+namespace
+{
+
+using namespace usbip;
+
+/*
+ * These events are never recorded after the command is completed.
+ */
+auto is_head(trace_event e)
+{
+	using enum trace_event;
+	return e == dispatch || e == prepare || e == submit || e == locked;
+}
+
+auto is_done(const urb_records &v)
+{
+	return v[int(trace_event::complete)] || v[int(trace_event::unlink)];
+}
+
+/*
+ * Chrome trace event format, nestable async events.
+ * Events of a slice and its children must have the same id, children must not overlap.
+ * @see https://docs.google.com/document/d/1CvAClvFfyA5R-PhYUmn5OOQtYMH4h6I0nSsKchNAySU
+ */
+class chrome_trace
+{
+public:
+	chrome_trace(UINT64 start) : m_start(start) {}
+
+	void urb(size_t id, const urb_records &v);
+	auto& str() const { return m_str; }
+
+private:
+	UINT64 m_start;
+	const trace_record *m_urb{}; // the first record of current URB
+	std::set<int> m_ports; // that have process_name
+	std::string m_str;
+
+	void process_name(int port);
+	void event(const char *name, char phase, const trace_record &r, const std::string &id, const std::string &args = {});
+	void span(const char *name, const trace_record *start, const trace_record *end, const std::string &id);
+	void instant(const char *name, const trace_record &r, const std::string &id);
+};
+
+void chrome_trace::event(
+	const char *name, char phase, const trace_record &r, const std::string &id, const std::string &args)
+{
+	auto &u = *m_urb;
+	auto ts = (r.time - m_start)/10.0; // microseconds
+
+	if (!m_str.empty()) {
+		m_str += ",\n";
+	}
+
+	m_str += std::format(R"({{"name":"{}","cat":"ep{} {}","ph":"{}","id":"{}","ts":{:.1f},"pid":{},"tid":{})",
+			     name, u.ep, u.dir ? "In" : "Out", phase, id, ts, u.port, u.ep);
+
+	if (!args.empty()) {
+		m_str += R"(,"args":{)" + args + '}';
+	}
+
+	m_str += '}';
+}
+
+void chrome_trace::span(const char *name, const trace_record *start, const trace_record *end, const std::string &id)
+{
+	if (start && end && start->time <= end->time) {
+		event(name, 'b', *start, id);
+		event(name, 'e', *end, id);
+	}
+}
+
+void chrome_trace::instant(const char *name, const trace_record &r, const std::string &id)
+{
+	auto args = std::format(R"("status":"{:#x}")", static_cast<ULONG>(r.status));
+	event(name, 'n', r, id, args);
+}
+
+void chrome_trace::process_name(int port)
+{
+	if (!m_str.empty()) {
+		m_str += ",\n";
+	}
+
+	m_str += std::format(R"({{"name":"process_name","ph":"M","pid":{},"args":{{"name":"port {}"}}}})", port, port);
+}
+
+/*
+ * Phases of USB/IP command:
+ * dispatch  - URB is received from UDE, usbip_header is being filled
+ * build MDL - see prepare_wsk_buf
+ * lock wait - waiting for send_lock
+ * WskSend   - until completion of send operation
+ * server    - round trip time until USBIP_RET_* is received
+ * payload   - receiving of transfer buffer
+ * complete  - post processing and completion of URB
+ *
+ * WskSend and server can overlap each other and the phases after them,
+ * so they are shown on their own tracks.
+ */
+void chrome_trace::urb(size_t id, const urb_records &v)
+{
+	using enum trace_event;
+	auto get = [&v] (auto e) { return v[int(e)]; };
+
+	const trace_record *first{};
+	const trace_record *last{};
+
+	for (auto r: v) {
+		if (!r) {
+			continue;
+		}
+		if (!first || r->time < first->time) {
+			first = r;
+		}
+		if (!last || r->time >= last->time) {
+			last = r;
+		}
+	}
+
+	m_urb = first;
+
+	if (m_ports.insert(first->port).second) {
+		process_name(first->port);
+	}
+
+	auto urb_id = std::format("{:#x}", id);
+	auto args = std::format(R"("seqnum":{},"devid":"{:#010x}","length":{},"status":"{:#x}")",
+				first->seqnum, first->devid, last->length, static_cast<ULONG>(last->status));
+
+	event("URB", 'b', *first, urb_id, args);
+
+	span("dispatch", get(dispatch), get(prepare), urb_id);
+	span("build MDL", get(prepare), get(submit), urb_id);
+	span("lock wait", get(submit), get(locked), urb_id);
+
+	span("WskSend", get(locked), get(send), urb_id + " WskSend");
+
+	if (auto snd = get(send), recv_hdr = get(recv); snd && recv_hdr && snd->time <= recv_hdr->time) {
+		span("server", snd, recv_hdr, urb_id + " server");
+	} else { // WskReceive can be completed before WskSend
+		span("server", get(locked), recv_hdr, urb_id + " server");
+	}
+
+	auto done = get(complete);
+	auto payload_rec = get(payload);
+
+	span("payload", get(recv), payload_rec, urb_id);
+	span("complete", payload_rec ? payload_rec : get(recv), done, urb_id);
+
+	if (auto r = get(unlink)) {
+		instant("unlink", *r, urb_id);
+	}
+
+	event("URB", 'e', *last, urb_id);
+}
+
+} // namespace
+
+
+std::vector<urb_records> usbip::group_by_urb(const std::vector<trace_record> &records, const std::set<int> &ports)
+{
+	std::vector<urb_records> urbs;
+	std::map<std::tuple<UINT8, UINT32, UINT32>, size_t> cur; // port, devid, seqnum -> the last command in urbs
+
+	for (auto &r: records) {
+		if (r.event < trace_event::submit || r.event > trace_event::payload ||
+		    !(ports.empty() || ports.contains(r.port))) {
+			continue;
+		}
+
+		auto idx = int(r.event);
+
+		auto [i, inserted] = cur.try_emplace({r.port, r.devid, r.seqnum}, urbs.size());
+
+		if (!inserted) {
+			if (auto &v = urbs[i->second]; v[idx] || (is_head(r.event) && is_done(v))) { // the next command
+				i->second = urbs.size();
+				inserted = true;
+			}
+		}
+
+		if (inserted) {
+			urbs.emplace_back();
+		}
+
+		urbs[i->second][idx] = &r;
+	}
+
+	return urbs;
+}
+
+std::string usbip::to_chrome_trace(const std::vector<trace_record> &records, const std::set<int> &ports)
+{
+	auto urbs = group_by_urb(records, ports);
+	chrome_trace tr(records.empty() ? 0 : records.front().time);
+
+	for (size_t i = 0; i < urbs.size(); ++i) {
+		tr.urb(i + 1, urbs[i]);
+	}
+
+	return std::format("{{\"traceEvents\":[\n{}\n],\n\"displayTimeUnit\":\"ns\"}}\n", tr.str());
+}
@@ -0,0 +1,35 @@
+/*
+ * Copyright (C) 2024 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include <libusbip/trace_record.h>
+
+#include <array>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace usbip
+{
+
+/*
+ * Records of the same USB/IP command, indexed by trace_event.
+ */
+using urb_records = std::array<const trace_record*, int(trace_event::payload) + 1>;
+
+/*
+ * The same port, devid and seqnum can belong to different commands, for example, after a reconnect.
+ * @param records must be sorted by time, see vhci::read_trace
+ * @param ports filter, all ports if empty
+ * @return commands in order of their first record
+ */
+std::vector<urb_records> group_by_urb(const std::vector<trace_record> &records, const std::set<int> &ports);
+
+/*
+ * @return JSON document in Chrome trace event format, one async slice per command
+ */
+std::string to_chrome_trace(const std::vector<trace_record> &records, const std::set<int> &ports);
+
+} // namespace usbip
@@ -0,0 +1,39 @@
+/*
+ * Copyright (C) 2024 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "phases.h"
+
+#include <format>
+#include <utility>
+
+std::string usbip::format_phases(const attach_timings &t)
+{
+        const std::pair<const char*, UINT32> v[] {
+                { "resolve", t.resolved },
+                { "connect", t.connected },
+                { "import", t.imported },
+                { "create", t.created },
+                { "plugin", t.plugged },
+                { "first URB", t.first_urb },
+                { "configure", t.configured },
+        };
+
+        std::string s;
+        UINT32 prev = 0;
+
+        for (auto [name, usec]: v) {
+                if (!s.empty()) {
+                        s += ", ";
+                }
+
+                if (usec) {
+                        s += std::format("{} {:.1f}", name, (usec > prev ? usec - prev : 0)/1000.0);
+                        prev = usec;
+                } else {
+                        s += std::format("{} -", name);
+                }
+        }
+
+        return s;
+}
@@ -0,0 +1,19 @@
+/*
+ * Copyright (C) 2024 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include <libusbip/attach_timings.h>
+#include <string>
+
+namespace usbip
+{
+
+/*
+ * A phase ends at its milestone and starts at the last milestone that was reached before it.
+ * @return durations of attach phases in milliseconds, "-" if a milestone is not reached
+ */
+std::string format_phases(const attach_timings &t);
+
+} // namespace usbip
@@ -4,6 +4,7 @@
 
 #include "usbip.h"
 #include "strings.h"
+#include "phases.h"
 
 #include <libusbip\vhci.h>
 #include <libusbip\persistent.h>
@@ -16,7 +17,7 @@ namespace
 
 using namespace usbip;
 
-void print(const imported_device &d)
+void print(const imported_device &d, bool verbose)
 {
         auto product = get_product(get_ids(), d.vendor, d.product);
 
@@ -35,6 +36,10 @@ void print(const imported_device &d)
                                 bus, dev);
 
         printf(msg.c_str());
+
+        if (verbose) {
+                printf("           -> attach, ms: %s\n", format_phases(d.timings).c_str());
+        }
 }
 
 } // namespace
@@ -76,7 +81,7 @@ bool usbip::cmd_port(void *p)
                                 printf("Imported USB devices\n"
                                        "====================\n");
                         }
-                        print(d);
+                        print(d, args.verbose);
                         if (args.stash) {
                                 dl.push_back(std::move(d.location));
                         }
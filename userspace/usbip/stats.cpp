@@ -0,0 +1,84 @@
+/*
+ * Copyright (C) 2024 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "usbip.h"
+
+#include <libusbip\vhci.h>
+
+#include <format>
+#include <spdlog\spdlog.h>
+
+namespace
+{
+
+using namespace usbip;
+
+/*
+ * Tag is shown as poolmon does, the lowest byte is the first character.
+ */
+auto tag_str(UINT32 tag)
+{
+	std::string s;
+
+	for ( ; tag; tag >>= 8) {
+		auto c = static_cast<char>(tag & 0xFF);
+		s += isprint(static_cast<unsigned char>(c)) ? c : '.';
+	}
+
+	return s;
+}
+
+/*
+ * @param seconds since the driver is loaded
+ */
+void print(const pool_stats &s, double seconds)
+{
+	auto name = s.port ? std::format("port {:02}", s.port) : s.name;
+	auto rate = seconds > 0 ? s.allocs/seconds : 0;
+
+	auto str = std::format("{:<12} {:<4} {:>12} {:>12} {:>12} {:>12} {:>10.1f}\n",
+				name, tag_str(s.tag), s.allocs, s.frees, s.bytes, s.peak, rate);
+
+	printf("%s", str.c_str());
+}
+
+} // namespace
+
+
+bool usbip::cmd_stats(void *p)
+{
+	auto &args = *reinterpret_cast<stats_args*>(p);
+
+	auto dev = vhci::open();
+	if (!dev) {
+		spdlog::error(GetLastErrorMsg());
+		return false;
+	}
+
+	pool_usage usage;
+	if (!vhci::get_pool_stats(dev.get(), usage)) {
+		spdlog::error(GetLastErrorMsg());
+		return false;
+	}
+
+	auto seconds = usage.uptime/1E7; // 100-nanosecond units
+	auto &ports = args.ports;
+
+	printf("Memory pool usage, uptime %.0f s, undeleted devices %lu\n", seconds, usage.undeleted_devices);
+	printf("%-12s %-4s %12s %12s %12s %12s %10s\n", "consumer", "tag", "allocs", "frees", "bytes", "peak", "allocs/s");
+
+	if (ports.empty()) {
+		for (auto &s: usage.consumers) {
+			print(s, seconds);
+		}
+	}
+
+	for (auto &s: usage.devices) {
+		if (ports.empty() || ports.contains(s.port)) {
+			print(s, seconds);
+		}
+	}
+
+	return true;
+}
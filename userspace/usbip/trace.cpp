@@ -0,0 +1,76 @@
+/*
+ * Copyright (C) 2024 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "usbip.h"
+#include "chrome_trace.h"
+
+#include <libusbip\vhci.h>
+
+#include <format>
+
+#include <spdlog\spdlog.h>
+
+namespace
+{
+
+using namespace usbip;
+
+/*
+ * @param start time of the first record
+ */
+void print(const trace_record &r, UINT64 start)
+{
+	auto usec = (r.time - start)/10.0; // 100-nanosecond units
+
+	auto s = std::format("{:12.1f} {:<8} port {:02} devid {:#010x} seqnum {:>8} ep {:>2} {:<3} length {:>7} status {:#x}\n",
+				usec, vhci::get_trace_event_str(r.event), r.port, r.devid, r.seqnum, r.ep, r.dir ? "In" : "Out",
+				r.length, static_cast<ULONG>(r.status));
+
+	printf("%s", s.c_str());
+}
+
+} // namespace
+
+
+bool usbip::cmd_trace(void *p)
+{
+	auto &args = *reinterpret_cast<trace_args*>(p);
+
+	auto dev = vhci::open();
+	if (!dev) {
+		spdlog::error(GetLastErrorMsg());
+		return false;
+	}
+
+	std::vector<trace_record> records;
+	UINT64 dropped{};
+
+	if (!vhci::read_trace(dev.get(), records, dropped)) {
+		spdlog::error(GetLastErrorMsg());
+		return false;
+	}
+
+	spdlog::debug("{} record(s), {} dropped", records.size(), dropped);
+
+	if (dropped) {
+		spdlog::warn("{} record(s) were lost", dropped);
+	}
+
+	auto &ports = args.ports;
+
+	if (args.json) {
+		printf("%s", to_chrome_trace(records, ports).c_str());
+		return true;
+	}
+
+	auto start = records.empty() ? 0 : records.front().time;
+
+	for (auto &r: records) {
+		if (ports.empty() || ports.contains(r.port)) {
+			print(r, start);
+		}
+	}
+
+	return true;
+}
@@ -113,12 +113,40 @@ void add_cmd_port(CLI::App &app)
 
 	cmd->add_flag("-s,--stash", r.stash,
 		      "Devices listed by the command will be attached each time the driver is loaded");
+
+	cmd->add_flag("-v,--verbose", r.verbose, "Show durations of attach phases");
 	
 	cmd->add_option("number", r.ports, "Hub port number")
 		->check(CLI::Range(1, MAX_HUB_PORTS))
 		->expected(1, MAX_HUB_PORTS);
 }
 
+void add_cmd_trace(CLI::App &app)
+{
+	static trace_args r;
+
+	auto cmd = app.add_subcommand("trace", "Show recorded URB events of imported USB devices")
+		->callback(pack(cmd_trace, &r));
+
+	cmd->add_flag("-j,--json", r.json, "Print phases of URBs in Chrome trace event format (Perfetto)");
+
+	cmd->add_option("number", r.ports, "Hub port number")
+		->check(CLI::Range(1, MAX_HUB_PORTS))
+		->expected(1, MAX_HUB_PORTS);
+}
+
+void add_cmd_stats(CLI::App &app)
+{
+	static stats_args r;
+
+	auto cmd = app.add_subcommand("stats", "Show memory pool usage of the driver and imported USB devices")
+		->callback(pack(cmd_stats, &r));
+
+	cmd->add_option("number", r.ports, "Hub port number, only devices are shown")
+		->check(CLI::Range(1, MAX_HUB_PORTS))
+		->expected(1, MAX_HUB_PORTS);
+}
+
 auto &msgtable_dll = L"resources"; // resource-only DLL that contains RT_MESSAGETABLE
 
 auto& get_resource_module() noexcept
@@ -152,6 +180,8 @@ void init(CLI::App &app)
 	add_cmd_detach(app);
 	add_cmd_list(app);
 	add_cmd_port(app);
+	add_cmd_trace(app);
+	add_cmd_stats(app);
 
 	app.require_subcommand(1);
 }
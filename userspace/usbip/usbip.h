@@ -57,7 +57,21 @@ struct port_args
 {
         std::set<int> ports;
         bool stash{};
+        bool verbose{};
 };
 command_t cmd_port;
 
+struct trace_args
+{
+        std::set<int> ports;
+        bool json{};
+};
+command_t cmd_trace;
+
+struct stats_args
+{
+        std::set<int> ports;
+};
+command_t cmd_stats;
+
 } // namespace usbip
@@ -486,13 +486,23 @@ void MainFrame::read_loop()
 
         std::unique_ptr<MainFrame, decltype(on_exit)> ptr(this, on_exit);
 
-        for (device_state st; vhci::read_device_state(m_read.get(), st); ) {
-                auto evt = new DeviceStateEvent(std::move(st));
-                QueueEvent(evt); // see on_device_state()
+        std::vector<device_state> v;
+        UINT64 seqnum = 0;
+        UINT64 dropped;
+
+        while (vhci::read_device_states(m_read.get(), v, 32, seqnum, dropped)) {
+                if (dropped) {
+                        wxLogVerbose(L"%llu device state(s) lost", dropped);
+                }
+
+                for (auto &st: v) {
+                        auto evt = new DeviceStateEvent(std::move(st));
+                        QueueEvent(evt); // see on_device_state()
+                }
         }
 
         if (auto err = GetLastError(); err != ERROR_OPERATION_ABORTED) { // see CancelSynchronousIo
-                wxLogError(_("vhci::read_device_state error %lu\n%s"), err, GetLastErrorMsg(err));
+                wxLogError(_("vhci::read_device_states error %lu\n%s"), err, GetLastErrorMsg(err));
         }
 }
 